@@ -0,0 +1,125 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "block_device.h"
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <utility>
+
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+class SliceImageSource : public ImageSource {
+ public:
+  SliceImageSource(std::unique_ptr<ImageSource> source,
+                   const uint64_t offset,
+                   const int64_t size)
+      : source_(std::move(source)), offset_(offset), size_(size) {}
+
+  int64_t size() const override { return size_; }
+
+  int64_t read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    if (offset >= static_cast<uint64_t>(size_)) {
+      return 0;
+    }
+    length = std::min<uint64_t>(length, size_ - offset);
+    return source_->read(offset_ + offset, buffer, length);
+  }
+
+  int fd() const override { return source_->fd(); }
+  uint64_t fdOffset() const override {
+    return source_->fdOffset() + offset_;
+  }
+
+ private:
+  const std::unique_ptr<ImageSource> source_;
+  const uint64_t offset_;
+  const int64_t size_;
+};
+
+}  // namespace
+
+BlockDevice::~BlockDevice() {}
+
+ImageSource::~ImageSource() {}
+
+AlignedBuffer::AlignedBuffer(size_t size, size_t alignment)
+    : data_(nullptr), size_(size) {
+#ifdef _WIN32
+  data_ = static_cast<uint8_t*>(_aligned_malloc(size, alignment));
+#else
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, alignment, size) == 0) {
+    data_ = static_cast<uint8_t*>(ptr);
+  }
+#endif
+}
+
+AlignedBuffer::~AlignedBuffer() {
+#ifdef _WIN32
+  _aligned_free(data_);
+#else
+  free(data_);
+#endif
+}
+
+bool readFully(ImageSource* source,
+               uint64_t offset,
+               uint8_t* buffer,
+               size_t length) {
+  while (length > 0) {
+    const int64_t rc = source->read(offset, buffer, length);
+    if (rc < 0) {
+      return false;
+    }
+    if (rc == 0) {
+      LOG_ERROR << "image ended unexpectedly at " << offset;
+      return false;
+    }
+    buffer += rc;
+    offset += rc;
+    length -= rc;
+  }
+  return true;
+}
+
+uint64_t roundUp(const uint64_t value, const uint64_t multiple) {
+  return ((value + multiple - 1) / multiple) * multiple;
+}
+
+std::unique_ptr<ImageSource> sliceImageSource(
+    std::unique_ptr<ImageSource> source,
+    const uint64_t offset,
+    const int64_t size) {
+  if (size < 0 || source->size() < 0 ||
+      offset + size > static_cast<uint64_t>(source->size())) {
+    LOG_ERROR << size << " bytes at " << offset << " don't fit in a "
+              << source->size() << "-byte image";
+    return nullptr;
+  }
+  return std::unique_ptr<ImageSource>(
+      new SliceImageSource(std::move(source), offset, size));
+}
+
+}  // namespace gondar
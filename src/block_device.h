@@ -0,0 +1,148 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_BLOCK_DEVICE_H_
+#define SRC_BLOCK_DEVICE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace gondar {
+
+// The destination of an image write: a whole disk, or for testing a
+// loop device or plain image file. Offsets and lengths passed to
+// read() and write() must be multiples of sectorSize(), and buffers
+// must be aligned to it (see AlignedBuffer).
+class BlockDevice {
+ public:
+  virtual ~BlockDevice();
+
+  virtual const std::string& path() const = 0;
+  virtual uint64_t sectorSize() const = 0;
+  virtual uint64_t size() const = 0;
+
+  // Both return false on error; a short transfer counts as an error.
+  virtual bool read(uint64_t offset, uint8_t* buffer, size_t length) = 0;
+  virtual bool write(uint64_t offset, const uint8_t* buffer, size_t length) = 0;
+
+  // Make everything written so far durable.
+  virtual bool flush() = 0;
+
+  // Make |length| bytes at |offset| read back as zeros without sending
+  // them, by discarding or zeroing the range in the device. Returns
+  // false if that isn't supported, in which case the caller has to
+  // write the zeros itself.
+  virtual bool zeroRange(uint64_t /*offset*/, uint64_t /*length*/) {
+    return false;
+  }
+
+  // Tell the device that |length| bytes at |offset| are no longer in
+  // use (TRIM), which lets flash reclaim them ahead of the next write.
+  // What the range reads back as afterwards is up to the device.
+  // Returns false if that isn't supported.
+  virtual bool discard(uint64_t /*offset*/, uint64_t /*length*/) {
+    return false;
+  }
+
+  // Make sure later reads of the range come from the device rather
+  // than a cache. A no-op for unbuffered targets.
+  virtual bool dropCache(uint64_t /*offset*/, uint64_t /*length*/) {
+    return true;
+  }
+
+  // The underlying POSIX file descriptor, or -1 if there is none
+  virtual int fd() const { return -1; }
+};
+
+// A range of the target that kept failing writes
+struct BadRegion {
+  uint64_t offset;
+  uint64_t length;
+};
+
+// The disk image being written. Reads may be unaligned and of any
+// length.
+class ImageSource {
+ public:
+  virtual ~ImageSource();
+
+  virtual int64_t size() const = 0;
+
+  // Read up to |length| bytes starting at |offset|. Returns the number
+  // of bytes read, 0 at the end of the image, or -1 on error.
+  virtual int64_t read(uint64_t offset, uint8_t* buffer, size_t length) = 0;
+
+  // True if going back means producing everything before the offset
+  // again, as with a zip entry inflated as it is read. Reads from such
+  // a source should only go forward.
+  virtual bool forwardOnly() const { return false; }
+
+  // The underlying POSIX file descriptor, or -1 if there is none
+  virtual int fd() const { return -1; }
+  // Where in fd() the image starts
+  virtual uint64_t fdOffset() const { return 0; }
+};
+
+// Heap buffer aligned to a sector boundary, as required for unbuffered
+// (O_DIRECT / FILE_FLAG_NO_BUFFERING) I/O.
+class AlignedBuffer {
+  AlignedBuffer& operator=(AlignedBuffer&) = delete;
+  AlignedBuffer(AlignedBuffer&) = delete;
+
+ public:
+  AlignedBuffer(size_t size, size_t alignment);
+  ~AlignedBuffer();
+
+  // False if the allocation failed
+  bool valid() const { return data_ != nullptr; }
+  uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  uint8_t* data_;
+  size_t size_;
+};
+
+// Fill |length| bytes of |buffer| from |source|, which may return
+// short reads. Fails if the image ends early.
+bool readFully(ImageSource* source,
+               uint64_t offset,
+               uint8_t* buffer,
+               size_t length);
+
+// Round |value| up to the next multiple of |multiple|.
+uint64_t roundUp(uint64_t value, uint64_t multiple);
+
+// The |size| bytes of |source| at |offset| as an image of their own,
+// such as a file stored uncompressed in a zip. Reads go straight to
+// |source|. Returns nullptr if |source| is too small.
+std::unique_ptr<ImageSource> sliceImageSource(
+    std::unique_ptr<ImageSource> source,
+    uint64_t offset,
+    int64_t size);
+
+// Platform-specific. All return nullptr (after logging why) on failure.
+std::unique_ptr<BlockDevice> openBlockDevice(const std::string& path);
+std::unique_ptr<ImageSource> openImageSource(const std::string& path);
+// Read-only and without exclusive access, so that it works while the
+// device is mounted; writes fail
+std::unique_ptr<BlockDevice> openBlockDeviceForReading(
+    const std::string& path);
+
+}  // namespace gondar
+
+#endif  // SRC_BLOCK_DEVICE_H_
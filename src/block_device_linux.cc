@@ -0,0 +1,275 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "block_device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// Sector size assumed for regular files, which have no geometry of
+// their own. 512 satisfies O_DIRECT on every filesystem we care about.
+constexpr uint64_t kFileSectorSize = 512;
+
+class LinuxBlockDevice : public BlockDevice {
+ public:
+  LinuxBlockDevice(const std::string& path,
+                   const int fd,
+                   const bool direct,
+                   const bool is_block_device,
+                   const uint64_t sector_size,
+                   const uint64_t size)
+      : path_(path),
+        fd_(fd),
+        direct_(direct),
+        is_block_device_(is_block_device),
+        sector_size_(sector_size),
+        size_(size) {}
+
+  ~LinuxBlockDevice() override { close(fd_); }
+
+  const std::string& path() const override { return path_; }
+  uint64_t sectorSize() const override { return sector_size_; }
+  uint64_t size() const override { return size_; }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    while (length > 0) {
+      const ssize_t rc = pread(fd_, buffer, length, offset);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc <= 0) {
+        LOG_ERROR << "read of " << path_ << " at " << offset
+                  << " failed: " << (rc == 0 ? "EOF" : strerror(errno));
+        return false;
+      }
+      buffer += rc;
+      offset += rc;
+      length -= rc;
+    }
+    return true;
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    while (length > 0) {
+      const ssize_t rc = pwrite(fd_, buffer, length, offset);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc <= 0) {
+        LOG_ERROR << "write to " << path_ << " at " << offset
+                  << " failed: " << (rc == 0 ? "no progress" : strerror(errno));
+        return false;
+      }
+      buffer += rc;
+      offset += rc;
+      length -= rc;
+    }
+    return true;
+  }
+
+  bool flush() override {
+    if (fsync(fd_) != 0) {
+      LOG_ERROR << "fsync of " << path_ << " failed: " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool zeroRange(const uint64_t offset, const uint64_t length) override {
+    // On a block device, punching a hole is a discard that only
+    // succeeds if the device guarantees discarded blocks read as zero.
+    // Failing that, zeroing the range lets the kernel use WRITE ZEROES
+    // or write its own zero pages. Regular files get sparse holes.
+    if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  length) == 0) {
+      return true;
+    }
+    if (fallocate(fd_, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset,
+                  length) == 0) {
+      return true;
+    }
+    // Kernels before 4.9 can't fallocate() block devices at all
+    uint64_t range[2] = {offset, length};
+    if (is_block_device_ && ioctl(fd_, BLKZEROOUT, range) == 0) {
+      return true;
+    }
+    LOG_DEBUG << "zeroing " << length << " bytes of " << path_ << " at "
+              << offset << " failed: " << strerror(errno);
+    return false;
+  }
+
+  bool discard(const uint64_t offset, const uint64_t length) override {
+    uint64_t range[2] = {offset, length};
+    const int rc =
+        is_block_device_
+            ? ioctl(fd_, BLKDISCARD, range)
+            : fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        offset, length);
+    if (rc != 0) {
+      LOG_DEBUG << "discarding " << length << " bytes of " << path_ << " at "
+                << offset << " failed: " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool dropCache(const uint64_t offset, const uint64_t length) override {
+    if (direct_) {
+      return true;
+    }
+    // Dirty pages can't be dropped, so write them out first
+    if (fdatasync(fd_) != 0 ||
+        posix_fadvise(fd_, offset, length, POSIX_FADV_DONTNEED) != 0) {
+      LOG_ERROR << "could not drop cached pages of " << path_;
+      return false;
+    }
+    return true;
+  }
+
+  int fd() const override { return fd_; }
+
+ private:
+  const std::string path_;
+  const int fd_;
+  const bool direct_;
+  const bool is_block_device_;
+  const uint64_t sector_size_;
+  const uint64_t size_;
+};
+
+class FileImageSource : public ImageSource {
+ public:
+  FileImageSource(const std::string& path, const int fd, const int64_t size)
+      : path_(path), fd_(fd), size_(size) {}
+
+  ~FileImageSource() override { close(fd_); }
+
+  int64_t size() const override { return size_; }
+
+  int64_t read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    while (true) {
+      const ssize_t rc = pread(fd_, buffer, length, offset);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc < 0) {
+        LOG_ERROR << "read of " << path_ << " at " << offset
+                  << " failed: " << strerror(errno);
+      }
+      return rc;
+    }
+  }
+
+  int fd() const override { return fd_; }
+
+ private:
+  const std::string path_;
+  const int fd_;
+  const int64_t size_;
+};
+
+std::unique_ptr<BlockDevice> openDevice(const std::string& path,
+                                        const bool writable) {
+  struct stat st = {};
+  if (stat(path.c_str(), &st) != 0) {
+    LOG_ERROR << "stat " << path << " failed: " << strerror(errno);
+    return nullptr;
+  }
+  const bool is_block_device = S_ISBLK(st.st_mode);
+  if (!is_block_device && !S_ISREG(st.st_mode)) {
+    LOG_ERROR << path << " is neither a block device nor a regular file";
+    return nullptr;
+  }
+
+  // O_EXCL on a block device fails with EBUSY if anything (such as a
+  // mounted filesystem) still holds it open
+  const int flags =
+      O_CLOEXEC | (writable ? O_RDWR | (is_block_device ? O_EXCL : 0)
+                            : O_RDONLY);
+  bool direct = true;
+  int fd = open(path.c_str(), flags | O_DIRECT);
+  if (fd < 0 && errno == EINVAL) {
+    LOG_WARNING << path << " does not support O_DIRECT, using buffered I/O";
+    direct = false;
+    fd = open(path.c_str(), flags);
+  }
+  if (fd < 0) {
+    LOG_ERROR << "open " << path << " failed: " << strerror(errno);
+    return nullptr;
+  }
+
+  uint64_t sector_size = kFileSectorSize;
+  uint64_t size = st.st_size;
+  if (is_block_device) {
+    int logical_sector_size = 0;
+    if (ioctl(fd, BLKSSZGET, &logical_sector_size) != 0 ||
+        ioctl(fd, BLKGETSIZE64, &size) != 0) {
+      LOG_ERROR << "could not query geometry of " << path << ": "
+                << strerror(errno);
+      close(fd);
+      return nullptr;
+    }
+    sector_size = logical_sector_size;
+  }
+
+  LOG_INFO << "opened " << path << ": " << size << " bytes, " << sector_size
+           << "-byte sectors";
+  return std::unique_ptr<BlockDevice>(
+      new LinuxBlockDevice(path, fd, direct, is_block_device,
+                           sector_size, size));
+}
+
+}  // namespace
+
+std::unique_ptr<BlockDevice> openBlockDevice(const std::string& path) {
+  return openDevice(path, true);
+}
+
+std::unique_ptr<BlockDevice> openBlockDeviceForReading(
+    const std::string& path) {
+  return openDevice(path, false);
+}
+
+std::unique_ptr<ImageSource> openImageSource(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR << "open " << path << " failed: " << strerror(errno);
+    return nullptr;
+  }
+  struct stat st = {};
+  if (fstat(fd, &st) != 0) {
+    LOG_ERROR << "fstat " << path << " failed: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+  // Equivalent of FILE_FLAG_SEQUENTIAL_SCAN; purely advisory
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return std::unique_ptr<ImageSource>(
+      new FileImageSource(path, fd, st.st_size));
+}
+
+}  // namespace gondar
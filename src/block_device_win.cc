@@ -0,0 +1,248 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "block_device_win.h"
+
+#include <winioctl.h>
+
+#include <cstddef>
+
+#include "log.h"
+#include "msapi_utf8.h"
+
+namespace gondar {
+
+namespace {
+
+// Positional I/O on a synchronous handle: the OVERLAPPED offset is
+// honored and the call still blocks until the transfer is done
+OVERLAPPED overlappedAt(const uint64_t offset) {
+  OVERLAPPED overlapped = {};
+  overlapped.Offset = static_cast<DWORD>(offset & 0xffffffff);
+  overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+  return overlapped;
+}
+
+class Win32BlockDevice : public BlockDevice {
+ public:
+  Win32BlockDevice(HANDLE handle,
+                   const std::string& path,
+                   const uint64_t sector_size,
+                   const uint64_t size,
+                   const bool owns_handle)
+      : handle_(handle),
+        path_(path),
+        sector_size_(sector_size),
+        size_(size),
+        owns_handle_(owns_handle) {}
+
+  ~Win32BlockDevice() override {
+    if (owns_handle_) {
+      CloseHandle(handle_);
+    }
+  }
+
+  const std::string& path() const override { return path_; }
+  uint64_t sectorSize() const override { return sector_size_; }
+  uint64_t size() const override { return size_; }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    OVERLAPPED overlapped = overlappedAt(offset);
+    DWORD transferred = 0;
+    if (!ReadFile(handle_, buffer, static_cast<DWORD>(length), &transferred,
+                  &overlapped) ||
+        transferred != length) {
+      LOG_ERROR << "read of " << path_ << " at " << offset
+                << " failed: " << GetLastError();
+      return false;
+    }
+    return true;
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    OVERLAPPED overlapped = overlappedAt(offset);
+    DWORD transferred = 0;
+    if (!WriteFile(handle_, buffer, static_cast<DWORD>(length), &transferred,
+                   &overlapped) ||
+        transferred != length) {
+      LOG_ERROR << "write to " << path_ << " at " << offset
+                << " failed: " << GetLastError();
+      return false;
+    }
+    return true;
+  }
+
+  bool flush() override {
+    if (!FlushFileBuffers(handle_)) {
+      LOG_ERROR << "FlushFileBuffers on " << path_
+                << " failed: " << GetLastError();
+      return false;
+    }
+    return true;
+  }
+
+  bool discard(const uint64_t offset, const uint64_t length) override {
+    // One TRIM request covering the whole range
+    struct TrimRequest {
+      DEVICE_MANAGE_DATA_SET_ATTRIBUTES attributes;
+      DEVICE_DATA_SET_RANGE range;
+    };
+    TrimRequest request = {};
+    request.attributes.Size = sizeof(request.attributes);
+    request.attributes.Action = DeviceDsmAction_Trim;
+    request.attributes.DataSetRangesOffset = offsetof(TrimRequest, range);
+    request.attributes.DataSetRangesLength = sizeof(request.range);
+    request.range.StartingOffset = offset;
+    request.range.LengthInBytes = length;
+    DWORD returned = 0;
+    if (!DeviceIoControl(handle_, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+                         &request, sizeof(request), NULL, 0, &returned,
+                         NULL)) {
+      LOG_DEBUG << "discarding " << length << " bytes of " << path_
+                << " at " << offset << " failed: " << GetLastError();
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  HANDLE handle_;
+  const std::string path_;
+  const uint64_t sector_size_;
+  const uint64_t size_;
+  const bool owns_handle_;
+};
+
+class Win32ImageSource : public ImageSource {
+ public:
+  Win32ImageSource(HANDLE handle, const int64_t size, const bool owns_handle)
+      : handle_(handle), size_(size), owns_handle_(owns_handle) {}
+
+  ~Win32ImageSource() override {
+    if (owns_handle_) {
+      CloseHandle(handle_);
+    }
+  }
+
+  int64_t size() const override { return size_; }
+
+  int64_t read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    OVERLAPPED overlapped = overlappedAt(offset);
+    DWORD transferred = 0;
+    if (!ReadFile(handle_, buffer, static_cast<DWORD>(length), &transferred,
+                  &overlapped)) {
+      if (GetLastError() == ERROR_HANDLE_EOF) {
+        return 0;
+      }
+      LOG_ERROR << "image read at " << offset << " failed: " << GetLastError();
+      return -1;
+    }
+    return transferred;
+  }
+
+ private:
+  HANDLE handle_;
+  const int64_t size_;
+  const bool owns_handle_;
+};
+
+}  // namespace
+
+std::unique_ptr<BlockDevice> wrapDeviceHandle(HANDLE handle,
+                                              const std::string& path,
+                                              const uint64_t sector_size,
+                                              const uint64_t size) {
+  return std::unique_ptr<BlockDevice>(
+      new Win32BlockDevice(handle, path, sector_size, size, false));
+}
+
+std::unique_ptr<ImageSource> wrapImageHandle(HANDLE handle,
+                                             const int64_t size) {
+  return std::unique_ptr<ImageSource>(
+      new Win32ImageSource(handle, size, false));
+}
+
+namespace {
+
+std::unique_ptr<BlockDevice> openDevice(const std::string& path,
+                                        const bool writable) {
+  HANDLE handle = CreateFileU(
+      path.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0),
+      FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+      FILE_FLAG_NO_BUFFERING | (writable ? FILE_FLAG_WRITE_THROUGH : 0),
+      NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    LOG_ERROR << "could not open " << path << ": " << GetLastError();
+    return nullptr;
+  }
+
+  DWORD size = 0;
+  uint64_t sector_size = 512;
+  DISK_GEOMETRY_EX geometry = {};
+  if (DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0,
+                      &geometry, sizeof(geometry), &size, NULL)) {
+    sector_size = geometry.Geometry.BytesPerSector;
+  }
+  GET_LENGTH_INFORMATION length_info = {};
+  LARGE_INTEGER file_size = {};
+  uint64_t num_bytes = 0;
+  if (DeviceIoControl(handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0,
+                      &length_info, sizeof(length_info), &size, NULL)) {
+    num_bytes = length_info.Length.QuadPart;
+  } else if (GetFileSizeEx(handle, &file_size)) {
+    // a plain image file
+    num_bytes = file_size.QuadPart;
+  } else {
+    LOG_ERROR << "could not get the size of " << path << ": "
+              << GetLastError();
+    CloseHandle(handle);
+    return nullptr;
+  }
+
+  return std::unique_ptr<BlockDevice>(
+      new Win32BlockDevice(handle, path, sector_size, num_bytes, true));
+}
+
+}  // namespace
+
+std::unique_ptr<BlockDevice> openBlockDevice(const std::string& path) {
+  return openDevice(path, true);
+}
+
+std::unique_ptr<BlockDevice> openBlockDeviceForReading(
+    const std::string& path) {
+  return openDevice(path, false);
+}
+
+std::unique_ptr<ImageSource> openImageSource(const std::string& path) {
+  HANDLE handle =
+      CreateFileU(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    LOG_ERROR << "could not open " << path << ": " << GetLastError();
+    return nullptr;
+  }
+  LARGE_INTEGER file_size = {};
+  if (!GetFileSizeEx(handle, &file_size)) {
+    LOG_ERROR << "could not get the size of " << path << ": "
+              << GetLastError();
+    CloseHandle(handle);
+    return nullptr;
+  }
+  return std::unique_ptr<ImageSource>(
+      new Win32ImageSource(handle, file_size.QuadPart, true));
+}
+
+}  // namespace gondar
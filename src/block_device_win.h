@@ -0,0 +1,38 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_BLOCK_DEVICE_WIN_H_
+#define SRC_BLOCK_DEVICE_WIN_H_
+
+#include <windows.h>
+
+#include <memory>
+#include <string>
+
+#include "block_device.h"
+
+namespace gondar {
+
+// Wrap handles that were opened (and locked) elsewhere, e.g. by
+// GetHandle() in gondar.cc. The wrappers do not close the handles.
+std::unique_ptr<BlockDevice> wrapDeviceHandle(HANDLE handle,
+                                              const std::string& path,
+                                              uint64_t sector_size,
+                                              uint64_t size);
+std::unique_ptr<ImageSource> wrapImageHandle(HANDLE handle, int64_t size);
+
+}  // namespace gondar
+
+#endif  // SRC_BLOCK_DEVICE_WIN_H_
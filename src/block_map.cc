@@ -0,0 +1,372 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "block_map.h"
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QSaveFile>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "block_device.h"
+#include "log.h"
+#include "zero_detect.h"
+
+namespace gondar {
+
+namespace {
+
+// Placeholder the file checksum is computed over, per the bmap spec
+const QByteArray kZeroChecksum(64, '0');
+
+// Blocks read at a time while generating a map
+constexpr uint64_t kGenerateBatchBytes = 1024 * 1024;
+
+bool parseNumber(const QString& text, uint64_t* out) {
+  bool ok = false;
+  *out = text.trimmed().toULongLong(&ok);
+  return ok;
+}
+
+// "first-last", or a single block number
+bool parseRange(const QString& text, BlockMap::Range* range) {
+  const QStringList parts = text.trimmed().split('-');
+  if (parts.size() == 1) {
+    return parseNumber(parts[0], &range->first) &&
+           parseNumber(parts[0], &range->last);
+  }
+  return parts.size() == 2 && parseNumber(parts[0], &range->first) &&
+         parseNumber(parts[1], &range->last);
+}
+
+std::string sha256Hex(const QByteArray& data) {
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha256)
+      .toHex()
+      .toStdString();
+}
+
+bool validate(const BlockMap& map, const uint64_t mapped_blocks_count) {
+  if (map.block_size == 0 || map.image_size == 0) {
+    LOG_ERROR << "bmap is missing the image or block size";
+    return false;
+  }
+  if (map.blocks_count !=
+      roundUp(map.image_size, map.block_size) / map.block_size) {
+    LOG_ERROR << "bmap block count doesn't match the image size";
+    return false;
+  }
+  uint64_t next_block = 0;
+  for (const auto& range : map.ranges) {
+    if (range.first < next_block || range.last < range.first ||
+        range.last >= map.blocks_count) {
+      LOG_ERROR << "bmap range " << range.first << "-" << range.last
+                << " is out of order or out of bounds";
+      return false;
+    }
+    next_block = range.last + 1;
+  }
+  if (mapped_blocks_count != map.mappedBlocks()) {
+    LOG_ERROR << "bmap says " << mapped_blocks_count
+              << " blocks are mapped but its ranges add up to "
+              << map.mappedBlocks();
+    return false;
+  }
+  return true;
+}
+
+struct Extent {
+  uint64_t begin;
+  uint64_t end;
+};
+
+// The parts of a file that hold data, skipping holes if the platform
+// can tell us where they are
+std::vector<Extent> dataExtents(const std::string& path, const uint64_t size) {
+  std::vector<Extent> extents;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    off_t pos = 0;
+    bool ok = true;
+    while (static_cast<uint64_t>(pos) < size) {
+      const off_t data = lseek(fd, pos, SEEK_DATA);
+      if (data < 0) {
+        // ENXIO means there is no more data past |pos|
+        ok = errno == ENXIO;
+        break;
+      }
+      off_t hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0) {
+        hole = size;
+      }
+      extents.push_back({static_cast<uint64_t>(data),
+                         std::min<uint64_t>(hole, size)});
+      pos = hole;
+    }
+    close(fd);
+    if (ok) {
+      return extents;
+    }
+    extents.clear();
+  }
+#else
+  Q_UNUSED(path);
+#endif
+  extents.push_back({0, size});
+  return extents;
+}
+
+}  // namespace
+
+uint64_t BlockMap::mappedBlocks() const {
+  uint64_t count = 0;
+  for (const auto& range : ranges) {
+    count += range.last - range.first + 1;
+  }
+  return count;
+}
+
+uint64_t BlockMap::rangeOffset(const Range& range) const {
+  return range.first * block_size;
+}
+
+uint64_t BlockMap::rangeLength(const Range& range) const {
+  const uint64_t end = std::min((range.last + 1) * block_size, image_size);
+  return end - rangeOffset(range);
+}
+
+std::string blockMapPathFor(const std::string& image_path) {
+  return image_path + ".bmap";
+}
+
+bool parseBlockMap(const QByteArray& xml, BlockMap* map) {
+  *map = BlockMap();
+  QXmlStreamReader reader(xml);
+  if (!reader.readNextStartElement() || reader.name() != "bmap") {
+    LOG_ERROR << "not a bmap file";
+    return false;
+  }
+  const QString version = reader.attributes().value("version").toString();
+  if (version.section('.', 0, 0) != "2") {
+    LOG_ERROR << "unsupported bmap version " << version;
+    return false;
+  }
+
+  uint64_t mapped_blocks_count = 0;
+  QString checksum_type;
+  QByteArray file_checksum;
+  bool numbers_ok = true;
+  while (reader.readNextStartElement()) {
+    const QStringRef name = reader.name();
+    if (name == "ImageSize") {
+      numbers_ok &= parseNumber(reader.readElementText(), &map->image_size);
+    } else if (name == "BlockSize") {
+      numbers_ok &= parseNumber(reader.readElementText(), &map->block_size);
+    } else if (name == "BlocksCount") {
+      numbers_ok &= parseNumber(reader.readElementText(), &map->blocks_count);
+    } else if (name == "MappedBlocksCount") {
+      numbers_ok &=
+          parseNumber(reader.readElementText(), &mapped_blocks_count);
+    } else if (name == "ChecksumType") {
+      checksum_type = reader.readElementText().trimmed();
+    } else if (name == "BmapFileChecksum") {
+      file_checksum = reader.readElementText().trimmed().toLatin1();
+    } else if (name == "BlockMap") {
+      while (reader.readNextStartElement()) {
+        if (reader.name() != "Range") {
+          reader.skipCurrentElement();
+          continue;
+        }
+        BlockMap::Range range;
+        range.sha256 =
+            reader.attributes().value("chksum").toString().toStdString();
+        numbers_ok &= parseRange(reader.readElementText(), &range);
+        map->ranges.push_back(range);
+      }
+    } else {
+      reader.skipCurrentElement();
+    }
+  }
+  if (reader.hasError()) {
+    LOG_ERROR << "malformed bmap: " << reader.errorString();
+    return false;
+  }
+  if (!numbers_ok) {
+    LOG_ERROR << "bmap contains an invalid number";
+    return false;
+  }
+  if (checksum_type != "sha256") {
+    LOG_ERROR << "unsupported bmap checksum type " << checksum_type;
+    return false;
+  }
+
+  // The file checksum is taken with its own value zeroed out
+  if (!file_checksum.isEmpty()) {
+    QByteArray zeroed = xml;
+    const int pos = zeroed.indexOf(file_checksum);
+    zeroed.replace(pos, file_checksum.size(), kZeroChecksum);
+    if (sha256Hex(zeroed) != file_checksum.toStdString()) {
+      LOG_ERROR << "bmap file checksum mismatch";
+      return false;
+    }
+  }
+  return validate(*map, mapped_blocks_count);
+}
+
+bool loadBlockMap(const std::string& path, BlockMap* map) {
+  QFile file(QString::fromStdString(path));
+  if (!file.open(QFile::ReadOnly)) {
+    LOG_ERROR << "could not open " << path << ": " << file.errorString();
+    return false;
+  }
+  if (!parseBlockMap(file.readAll(), map)) {
+    LOG_ERROR << "could not load " << path;
+    return false;
+  }
+  LOG_INFO << "loaded " << path << ": " << map->mappedBlocks() << " of "
+           << map->blocks_count << " blocks mapped";
+  return true;
+}
+
+QByteArray serializeBlockMap(const BlockMap& map) {
+  QByteArray xml;
+  QXmlStreamWriter writer(&xml);
+  writer.setAutoFormatting(true);
+  writer.writeStartDocument();
+  writer.writeStartElement("bmap");
+  writer.writeAttribute("version", "2.0");
+  writer.writeTextElement("ImageSize", QString::number(map.image_size));
+  writer.writeTextElement("BlockSize", QString::number(map.block_size));
+  writer.writeTextElement("BlocksCount", QString::number(map.blocks_count));
+  writer.writeTextElement("MappedBlocksCount",
+                          QString::number(map.mappedBlocks()));
+  writer.writeTextElement("ChecksumType", "sha256");
+  writer.writeTextElement("BmapFileChecksum",
+                          QString::fromLatin1(kZeroChecksum));
+  writer.writeStartElement("BlockMap");
+  for (const auto& range : map.ranges) {
+    writer.writeStartElement("Range");
+    if (!range.sha256.empty()) {
+      writer.writeAttribute("chksum", QString::fromStdString(range.sha256));
+    }
+    QString text = QString::number(range.first);
+    if (range.last != range.first) {
+      text += "-" + QString::number(range.last);
+    }
+    writer.writeCharacters(text);
+    writer.writeEndElement();
+  }
+  writer.writeEndElement();
+  writer.writeEndElement();
+  writer.writeEndDocument();
+
+  const QByteArray checksum = QByteArray::fromStdString(sha256Hex(xml));
+  xml.replace(xml.indexOf(kZeroChecksum), kZeroChecksum.size(), checksum);
+  return xml;
+}
+
+bool saveBlockMap(const std::string& path, const BlockMap& map) {
+  QSaveFile file(QString::fromStdString(path));
+  if (!file.open(QFile::WriteOnly)) {
+    LOG_ERROR << "could not create " << path << ": " << file.errorString();
+    return false;
+  }
+  file.write(serializeBlockMap(map));
+  if (!file.commit()) {
+    LOG_ERROR << "could not write " << path << ": " << file.errorString();
+    return false;
+  }
+  return true;
+}
+
+bool generateBlockMap(const std::string& image_path,
+                      const uint64_t block_size,
+                      const bool zeros_unmapped,
+                      BlockMap* map) {
+  *map = BlockMap();
+  if (block_size == 0 || block_size % 512 != 0) {
+    LOG_ERROR << "block size must be a multiple of 512";
+    return false;
+  }
+  auto source = openImageSource(image_path);
+  if (!source) {
+    return false;
+  }
+  map->image_size = source->size();
+  map->block_size = block_size;
+  map->blocks_count = roundUp(map->image_size, block_size) / block_size;
+
+  const uint64_t batch_blocks = kGenerateBatchBytes / block_size + 1;
+  std::vector<uint8_t> buffer(batch_blocks * block_size);
+  QCryptographicHash hash(QCryptographicHash::Sha256);
+  BlockMap::Range range;
+  bool in_range = false;
+  auto endRange = [&]() {
+    if (in_range) {
+      range.sha256 = hash.result().toHex().toStdString();
+      map->ranges.push_back(range);
+      hash.reset();
+      in_range = false;
+    }
+  };
+
+  uint64_t next_block = 0;
+  for (const auto& extent : dataExtents(image_path, map->image_size)) {
+    uint64_t block = std::max(extent.begin / block_size, next_block);
+    const uint64_t end_block = roundUp(extent.end, block_size) / block_size;
+    if (block != next_block) {
+      // Skipped a hole
+      endRange();
+    }
+    while (block < end_block) {
+      const uint64_t count = std::min(batch_blocks, end_block - block);
+      const uint64_t offset = block * block_size;
+      const uint64_t length =
+          std::min(count * block_size, map->image_size - offset);
+      if (!readFully(source.get(), offset, buffer.data(), length)) {
+        return false;
+      }
+      for (uint64_t i = 0; i < count; i++, block++) {
+        const uint8_t* data = buffer.data() + i * block_size;
+        const uint64_t size = std::min(block_size, length - i * block_size);
+        if (zeros_unmapped && isAllZero(data, size)) {
+          endRange();
+          continue;
+        }
+        if (!in_range) {
+          range.first = block;
+          in_range = true;
+        }
+        range.last = block;
+        hash.addData(reinterpret_cast<const char*>(data), size);
+      }
+    }
+    next_block = end_block;
+  }
+  endRange();
+
+  LOG_INFO << "mapped " << map->mappedBlocks() << " of " << map->blocks_count
+           << " blocks of " << image_path;
+  return true;
+}
+
+}  // namespace gondar
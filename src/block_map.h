@@ -0,0 +1,77 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_BLOCK_MAP_H_
+#define SRC_BLOCK_MAP_H_
+
+#include <QByteArray>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gondar {
+
+// Which blocks of an image hold data, in the format of bmaptool's
+// ".bmap" files (version 2.0, SHA-256 checksums). Blocks outside the
+// mapped ranges don't need to be written, so their old contents on
+// the target are left alone.
+struct BlockMap {
+  struct Range {
+    // Inclusive block numbers
+    uint64_t first = 0;
+    uint64_t last = 0;
+    // Hex SHA-256 of the range's bytes (the last block of the image is
+    // cut off at the image size), or empty if not checksummed
+    std::string sha256;
+  };
+
+  uint64_t image_size = 0;
+  uint64_t block_size = 0;
+  uint64_t blocks_count = 0;
+  std::vector<Range> ranges;
+
+  uint64_t mappedBlocks() const;
+  // Byte range of |range| within the image
+  uint64_t rangeOffset(const Range& range) const;
+  uint64_t rangeLength(const Range& range) const;
+};
+
+// Default block size for generated maps, matching bmaptool
+constexpr uint64_t kDefaultBmapBlockSize = 4096;
+
+// Where the map for an image is expected: "<image_path>.bmap"
+std::string blockMapPathFor(const std::string& image_path);
+
+// Parse and sanity-check a .bmap file. Returns false (after logging
+// why) if it is malformed or its own checksum doesn't match.
+bool parseBlockMap(const QByteArray& xml, BlockMap* map);
+bool loadBlockMap(const std::string& path, BlockMap* map);
+
+QByteArray serializeBlockMap(const BlockMap& map);
+bool saveBlockMap(const std::string& path, const BlockMap& map);
+
+// Build a map of the image at |image_path|. Holes in a sparse file are
+// always left unmapped. If |zeros_unmapped| is set, blocks that are
+// all zeros are too; only do that if the image's consumers don't
+// depend on those blocks reading back as zero.
+bool generateBlockMap(const std::string& image_path,
+                      uint64_t block_size,
+                      bool zeros_unmapped,
+                      BlockMap* map);
+
+}  // namespace gondar
+
+#endif  // SRC_BLOCK_MAP_H_
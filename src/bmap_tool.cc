@@ -0,0 +1,80 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Command-line tool that writes a block map (.bmap) for an image, so
+// that maps can be produced ahead of time on the build server and
+// shipped next to the image.
+
+#include <plog/Appenders/ConsoleAppender.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+
+#include "block_map.h"
+#include "log.h"
+
+int main(int argc, char* argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("gondar-bmap");
+
+  static plog::ConsoleAppender<plog::TxtFormatter> console_log;
+  plog::init(plog::info, &console_log);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Generate a block map for a disk image.");
+  parser.addHelpOption();
+  const QCommandLineOption block_size_option(
+      "block-size", "Block size in bytes, a multiple of 512.", "bytes",
+      QString::number(gondar::kDefaultBmapBlockSize));
+  const QCommandLineOption zeros_option(
+      "zeros-unmapped",
+      "Also leave blocks of zeros unmapped. Only safe if nothing in the "
+      "image relies on those blocks reading back as zero.");
+  const QCommandLineOption output_option(
+      {"o", "output"}, "Where to write the map (default: <image>.bmap).",
+      "path");
+  parser.addOption(block_size_option);
+  parser.addOption(zeros_option);
+  parser.addOption(output_option);
+  parser.addPositionalArgument("image", "The image to map.");
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.size() != 1) {
+    parser.showHelp(1);
+  }
+  bool ok = false;
+  const uint64_t block_size =
+      parser.value(block_size_option).toULongLong(&ok);
+  if (!ok) {
+    LOG_ERROR << "invalid block size";
+    return 1;
+  }
+
+  const std::string image_path = args[0].toStdString();
+  const std::string output_path =
+      parser.isSet(output_option)
+          ? parser.value(output_option).toStdString()
+          : gondar::blockMapPathFor(image_path);
+
+  gondar::BlockMap map;
+  if (!gondar::generateBlockMap(image_path, block_size,
+                                parser.isSet(zeros_option), &map) ||
+      !gondar::saveBlockMap(output_path, map)) {
+    return 1;
+  }
+  LOG_INFO << "wrote " << output_path;
+  return 0;
+}
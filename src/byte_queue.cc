@@ -0,0 +1,106 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "byte_queue.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace gondar {
+
+ByteQueue::ByteQueue(const size_t capacity) : buffer_(capacity) {}
+
+size_t ByteQueue::push(const char* data, const size_t length) {
+  QMutexLocker locker(&mutex_);
+  if (failed_ || finished_) {
+    return 0;
+  }
+  const size_t capacity = buffer_.size();
+  const size_t count = std::min(length, capacity - size_);
+  // At most two pieces, either side of the end of the buffer
+  for (size_t done = 0; done < count;) {
+    const size_t tail = (head_ + size_) % capacity;
+    const size_t piece = std::min(count - done, capacity - tail);
+    memcpy(buffer_.data() + tail, data + done, piece);
+    size_ += piece;
+    done += piece;
+  }
+  if (count < length) {
+    producer_waiting_ = true;
+  }
+  if (count > 0) {
+    data_available_.wakeAll();
+  }
+  return count;
+}
+
+void ByteQueue::finish(const bool success) {
+  QMutexLocker locker(&mutex_);
+  finished_ = true;
+  if (!success) {
+    failed_ = true;
+  }
+  data_available_.wakeAll();
+}
+
+void ByteQueue::setSpaceCallback(const std::function<void()>& callback) {
+  QMutexLocker locker(&mutex_);
+  space_callback_ = callback;
+}
+
+int64_t ByteQueue::pop(uint8_t* buffer, const size_t length) {
+  std::function<void()> callback;
+  size_t count = 0;
+  {
+    QMutexLocker locker(&mutex_);
+    while (size_ == 0 && !finished_ && !failed_) {
+      data_available_.wait(&mutex_);
+    }
+    if (failed_) {
+      return -1;
+    }
+    const size_t capacity = buffer_.size();
+    count = std::min(length, size_);
+    for (size_t done = 0; done < count;) {
+      const size_t piece = std::min(count - done, capacity - head_);
+      memcpy(buffer + done, buffer_.data() + head_, piece);
+      head_ = (head_ + piece) % capacity;
+      size_ -= piece;
+      done += piece;
+    }
+    if (producer_waiting_ && size_ <= capacity / 2) {
+      producer_waiting_ = false;
+      callback = space_callback_;
+    }
+  }
+  // Outside the lock, as the producer may well push from it
+  if (callback) {
+    callback();
+  }
+  return count;
+}
+
+void ByteQueue::abort() {
+  QMutexLocker locker(&mutex_);
+  failed_ = true;
+  data_available_.wakeAll();
+}
+
+bool ByteQueue::failed() const {
+  QMutexLocker locker(&mutex_);
+  return failed_;
+}
+
+}  // namespace gondar
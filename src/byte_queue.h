@@ -0,0 +1,81 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_BYTE_QUEUE_H_
+#define SRC_BYTE_QUEUE_H_
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace gondar {
+
+// Bytes on their way from one thread to another through a buffer of
+// fixed size, such as a download on its way to the inflater. The
+// producer never blocks, so that it can run on the UI thread: push()
+// takes what fits, the producer holds on to the rest, and the space
+// callback tells it when to try again. The consumer blocks in pop()
+// until there is data.
+class ByteQueue {
+  ByteQueue& operator=(ByteQueue&) = delete;
+  ByteQueue(ByteQueue&) = delete;
+
+ public:
+  explicit ByteQueue(size_t capacity);
+
+  // Producer side. push() returns how many of the |length| bytes were
+  // taken. finish() marks the end of the stream; |success| is false
+  // if it was cut short by an error.
+  size_t push(const char* data, size_t length);
+  void finish(bool success);
+
+  // Called on the consumer's thread once half the buffer is free
+  // after a push() that didn't fit. Set before anything is pushed.
+  void setSpaceCallback(const std::function<void()>& callback);
+
+  // Consumer side. Blocks until there is data, then copies up to
+  // |length| bytes of it to |buffer|. Returns the number of bytes
+  // copied, 0 at the end of a successful stream, or -1 if the stream
+  // failed or was aborted.
+  int64_t pop(uint8_t* buffer, size_t length);
+
+  // Either side: give up on the stream. Wakes the consumer, and every
+  // later call fails.
+  void abort();
+
+  // True once the stream has failed or been aborted
+  bool failed() const;
+
+ private:
+  std::vector<char> buffer_;
+  std::function<void()> space_callback_;
+
+  mutable QMutex mutex_;
+  QWaitCondition data_available_;
+  // Ring buffer state: where the oldest byte is and how many there are
+  size_t head_ = 0;
+  size_t size_ = 0;
+  bool producer_waiting_ = false;
+  bool finished_ = false;
+  bool failed_ = false;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_BYTE_QUEUE_H_
@@ -0,0 +1,37 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_CANCEL_TOKEN_H_
+#define SRC_CANCEL_TOKEN_H_
+
+#include <atomic>
+
+namespace gondar {
+
+// Lets one thread ask long-running work on others to stop. The work
+// polls cancelled() between chunks and cleans up after itself.
+// Cancelling can't be undone.
+class CancelToken {
+ public:
+  void cancel() { cancelled_.store(true); }
+  bool cancelled() const { return cancelled_.load(); }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
+}  // namespace gondar
+
+#endif  // SRC_CANCEL_TOKEN_H_
@@ -0,0 +1,151 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "chunk_ring.h"
+
+#include <algorithm>
+
+namespace gondar {
+
+Chunk::Chunk(const size_t capacity, const size_t alignment)
+    : buffer(capacity, alignment) {}
+
+ChunkRing::ChunkRing(const int depth,
+                     const size_t chunk_size,
+                     const size_t alignment,
+                     const int consumers)
+    : chunk_size_(chunk_size),
+      alignment_(alignment),
+      consumers_(consumers),
+      live_consumers_(consumers) {
+  for (int i = 0; i < depth; i++) {
+    chunks_.emplace_back(new Chunk(chunk_size, alignment));
+    empty_.push_back(chunks_.back().get());
+  }
+}
+
+bool ChunkRing::valid() const {
+  if (chunks_.empty()) {
+    return false;
+  }
+  for (const auto& chunk : chunks_) {
+    if (!chunk->buffer.valid()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Chunk* ChunkRing::acquireEmpty() {
+  QMutexLocker locker(&mutex_);
+  while (empty_.empty() && !aborted_) {
+    empty_available_.wait(&mutex_);
+  }
+  if (aborted_) {
+    return nullptr;
+  }
+  Chunk* chunk = empty_.front();
+  empty_.pop_front();
+  return chunk;
+}
+
+void ChunkRing::pushFilled(Chunk* chunk) {
+  QMutexLocker locker(&mutex_);
+  if (live_consumers_ == 0) {
+    recycle(chunk);
+    return;
+  }
+  chunk->refs = live_consumers_;
+  filled_.push_back(chunk);
+  filled_available_.wakeAll();
+}
+
+void ChunkRing::finish(const bool success) {
+  QMutexLocker locker(&mutex_);
+  finished_ = true;
+  producer_failed_ = !success;
+  filled_available_.wakeAll();
+}
+
+Chunk* ChunkRing::takeFilled(const int consumer) {
+  QMutexLocker locker(&mutex_);
+  Consumer& self = consumers_[consumer];
+  while (!self.aborted && self.next == filled_base_ + filled_.size() &&
+         !finished_) {
+    filled_available_.wait(&mutex_);
+  }
+  if (self.aborted || self.next == filled_base_ + filled_.size()) {
+    return nullptr;
+  }
+  Chunk* chunk = filled_[self.next - filled_base_];
+  self.next++;
+  trimFilled();
+  return chunk;
+}
+
+void ChunkRing::release(Chunk* chunk) {
+  QMutexLocker locker(&mutex_);
+  if (--chunk->refs == 0) {
+    recycle(chunk);
+  }
+}
+
+void ChunkRing::abort(const int consumer) {
+  QMutexLocker locker(&mutex_);
+  Consumer& self = consumers_[consumer];
+  if (self.aborted) {
+    return;
+  }
+  // Chunks this consumer never took are no longer waiting on it
+  for (uint64_t seq = self.next; seq < filled_base_ + filled_.size(); seq++) {
+    Chunk* chunk = filled_[seq - filled_base_];
+    if (--chunk->refs == 0) {
+      recycle(chunk);
+    }
+  }
+  self.aborted = true;
+  live_consumers_--;
+  trimFilled();
+  if (live_consumers_ == 0) {
+    aborted_ = true;
+    empty_available_.wakeAll();
+  }
+  filled_available_.wakeAll();
+}
+
+bool ChunkRing::producerFailed() const {
+  QMutexLocker locker(&mutex_);
+  return producer_failed_;
+}
+
+void ChunkRing::recycle(Chunk* chunk) {
+  empty_.push_back(chunk);
+  empty_available_.wakeOne();
+}
+
+void ChunkRing::trimFilled() {
+  uint64_t oldest = filled_base_ + filled_.size();
+  for (const auto& consumer : consumers_) {
+    if (!consumer.aborted) {
+      oldest = std::min(oldest, consumer.next);
+    }
+  }
+  while (filled_base_ < oldest) {
+    filled_.pop_front();
+    filled_base_++;
+  }
+}
+
+}  // namespace gondar
@@ -0,0 +1,122 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_CHUNK_RING_H_
+#define SRC_CHUNK_RING_H_
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "block_device.h"
+
+namespace gondar {
+
+// One buffer's worth of the image on its way from source to target
+struct Chunk {
+  Chunk(size_t capacity, size_t alignment);
+
+  AlignedBuffer buffer;
+  // Position of the data in both the image and the target
+  uint64_t offset = 0;
+  // Bytes of image data in |buffer|. The producer zero-fills the rest
+  // of the buffer up to the next multiple of the ring's alignment.
+  size_t length = 0;
+  // Set by the producer if the data is known to be all zeros
+  bool zero = false;
+  // CRC-32 of the data, if the producer was asked for one
+  uint32_t crc = 0;
+  // Consumers that have yet to release the chunk; managed by the ring
+  int refs = 0;
+};
+
+// A fixed pool of sector-aligned chunks that cycle between a producer
+// thread, which fills them from the source, and one or more consumers,
+// which drain them to targets. Every consumer sees every chunk in
+// order, and a chunk is only reused once all of them have released it.
+// The ring depth therefore bounds both how far the producer can run
+// ahead and how far the fastest consumer can get ahead of the slowest.
+class ChunkRing {
+  ChunkRing& operator=(ChunkRing&) = delete;
+  ChunkRing(ChunkRing&) = delete;
+
+ public:
+  ChunkRing(int depth,
+            size_t chunk_size,
+            size_t alignment,
+            int consumers = 1);
+
+  // False if a buffer allocation failed
+  bool valid() const;
+  size_t chunkSize() const { return chunk_size_; }
+  size_t alignment() const { return alignment_; }
+
+  // Producer side. acquireEmpty() blocks until a chunk is free, and
+  // returns null once every consumer has aborted. finish() marks the end of
+  // the stream; |success| is false if the producer hit an error.
+  Chunk* acquireEmpty();
+  void pushFilled(Chunk* chunk);
+  void finish(bool success);
+
+  // Consumer side, for consumer number |consumer|. takeFilled() blocks
+  // until a chunk is ready, and returns null once the producer has
+  // finished and everything has been taken, or once this consumer has
+  // aborted. Every chunk taken must be released, even if writing it
+  // failed. abort() drops the consumer, so that chunks it hasn't taken
+  // no longer wait for it; when the last one goes the producer stops.
+  Chunk* takeFilled(int consumer = 0);
+  void release(Chunk* chunk);
+  void abort(int consumer = 0);
+
+  // Only meaningful once takeFilled() has returned null
+  bool producerFailed() const;
+
+ private:
+  struct Consumer {
+    // Sequence number of the next chunk to take
+    uint64_t next = 0;
+    bool aborted = false;
+  };
+
+  // Put |chunk| back in the pool. Called with |mutex_| held.
+  void recycle(Chunk* chunk);
+  // Drop chunks from the front of |filled_| that every live consumer
+  // has taken. Called with |mutex_| held.
+  void trimFilled();
+
+  const size_t chunk_size_;
+  const size_t alignment_;
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+
+  mutable QMutex mutex_;
+  QWaitCondition empty_available_;
+  QWaitCondition filled_available_;
+  std::deque<Chunk*> empty_;
+  std::deque<Chunk*> filled_;
+  // Sequence number of filled_.front()
+  uint64_t filled_base_ = 0;
+  std::vector<Consumer> consumers_;
+  int live_consumers_;
+  bool finished_ = false;
+  bool producer_failed_ = false;
+  bool aborted_ = false;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_CHUNK_RING_H_
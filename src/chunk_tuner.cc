@@ -0,0 +1,132 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "chunk_tuner.h"
+
+#include <algorithm>
+
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// From what suits a cheap USB 2 stick up to what keeps a USB 3 SSD
+// busy
+constexpr size_t kCandidateSizes[] = {128 * 1024,      256 * 1024,
+                                      512 * 1024,      1024 * 1024,
+                                      2 * 1024 * 1024, 4 * 1024 * 1024};
+
+// A write this many times slower than usual counts as a spike, and
+// this many spikes in a row make the size step down
+constexpr int64_t kSpikeFactor = 4;
+constexpr int kSpikesBeforeBackoff = 3;
+
+double megabytesPerSecond(const uint64_t bytes, const int64_t ns) {
+  return ns > 0 ? (bytes / (1024.0 * 1024.0)) / (ns / 1e9) : 0;
+}
+
+}  // namespace
+
+ChunkSizeTuner::ChunkSizeTuner(const uint64_t sector_size,
+                               const uint64_t trial_bytes)
+    : trial_bytes_(trial_bytes), current_(0) {
+  for (const size_t size : kCandidateSizes) {
+    const size_t rounded = roundUp(size, sector_size);
+    if (candidates_.empty() || candidates_.back() != rounded) {
+      candidates_.push_back(rounded);
+    }
+  }
+  trials_.resize(candidates_.size());
+}
+
+void ChunkSizeTuner::onComplete(const Chunk& chunk,
+                                const int64_t latency_ns,
+                                const int64_t now_ns) {
+  // Ignore chunks queued before the last size change, and short ones
+  // at the end of a range
+  if (chunk.length != chunkSize()) {
+    return;
+  }
+  if (locked_) {
+    checkLatency(latency_ns);
+    return;
+  }
+
+  // Throughput is measured from the first completion, so the bytes
+  // of that first write don't count
+  Trial& trial = trials_[current_];
+  if (trial.writes == 0) {
+    trial.first_ns = now_ns;
+  } else {
+    trial.bytes += chunk.length;
+  }
+  trial.writes++;
+  trial.last_ns = now_ns;
+  trial.latency_ns += latency_ns;
+  if (trial.bytes >= trial_bytes_) {
+    finishTrial();
+  }
+}
+
+void ChunkSizeTuner::finishTrial() {
+  const Trial& trial = trials_[current_];
+  LOG_INFO << "chunk size " << chunkSize() << ": "
+           << megabytesPerSecond(trial.bytes, trial.last_ns - trial.first_ns)
+           << " MB/s, mean write latency "
+           << trial.latency_ns / trial.writes / 1000 << " us";
+  if (current_ + 1 < candidates_.size()) {
+    current_++;
+    return;
+  }
+
+  size_t best = 0;
+  double best_rate = -1;
+  for (size_t i = 0; i < trials_.size(); i++) {
+    const double rate = megabytesPerSecond(
+        trials_[i].bytes, trials_[i].last_ns - trials_[i].first_ns);
+    if (rate > best_rate) {
+      best = i;
+      best_rate = rate;
+    }
+  }
+  current_ = best;
+  locked_ = true;
+  baseline_latency_ns_ = trials_[best].latency_ns / trials_[best].writes;
+  LOG_INFO << "locked in chunk size " << chunkSize() << " at " << best_rate
+           << " MB/s";
+}
+
+void ChunkSizeTuner::checkLatency(const int64_t latency_ns) {
+  if (latency_ns <= kSpikeFactor * baseline_latency_ns_) {
+    // Track slow drift, but not the spikes themselves
+    baseline_latency_ns_ = (7 * baseline_latency_ns_ + latency_ns) / 8;
+    spikes_ = 0;
+    return;
+  }
+  if (++spikes_ < kSpikesBeforeBackoff || current_ == 0) {
+    return;
+  }
+  const size_t old_size = chunkSize();
+  current_--;
+  // Latency should scale with the write size
+  baseline_latency_ns_ = baseline_latency_ns_ * chunkSize() / old_size;
+  spikes_ = 0;
+  LOG_WARNING << "write latency spiked to " << latency_ns / 1000
+              << " us, dropping chunk size from " << old_size << " to "
+              << chunkSize();
+}
+
+}  // namespace gondar
@@ -0,0 +1,73 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_CHUNK_TUNER_H_
+#define SRC_CHUNK_TUNER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chunk_ring.h"
+
+namespace gondar {
+
+// Picks the write size for a device at run time. The first
+// |trial_bytes| of writes are done at each candidate size in turn, the
+// size with the best sustained throughput is locked in, and from then
+// on the size steps down whenever write latency keeps spiking.
+//
+// The reader thread calls chunkSize(); everything else happens on the
+// writing thread. Times are passed in so that tests can fake them.
+class ChunkSizeTuner {
+ public:
+  ChunkSizeTuner(uint64_t sector_size, uint64_t trial_bytes);
+
+  // Largest size that may be asked for; ring buffers must hold this
+  size_t maxChunkSize() const { return candidates_.back(); }
+  // Size new chunks should have
+  size_t chunkSize() const { return candidates_[current_]; }
+  bool locked() const { return locked_; }
+
+  // |chunk| was written in |latency_ns|, finishing at |now_ns|
+  void onComplete(const Chunk& chunk, int64_t latency_ns, int64_t now_ns);
+
+ private:
+  struct Trial {
+    uint64_t bytes = 0;
+    int writes = 0;
+    int64_t first_ns = 0;
+    int64_t last_ns = 0;
+    int64_t latency_ns = 0;
+  };
+
+  void finishTrial();
+  void checkLatency(int64_t latency_ns);
+
+  std::vector<size_t> candidates_;
+  std::vector<Trial> trials_;
+  const uint64_t trial_bytes_;
+  std::atomic<size_t> current_;
+  bool locked_ = false;
+  // Typical latency at the current size once locked, and how many
+  // writes in a row have been far slower than that
+  int64_t baseline_latency_ns_ = 0;
+  int spikes_ = 0;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_CHUNK_TUNER_H_
@@ -0,0 +1,212 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "chunk_writer.h"
+
+#include <QThread>
+
+#include <algorithm>
+
+#include "log.h"
+#include "stall_watchdog.h"
+
+namespace gondar {
+
+namespace {
+
+// A failed write is tried this many times in all, first waiting
+// kRetryInitialDelayMs and then twice as long before each new attempt,
+// so a device that needs a moment (e.g. a stick doing wear levelling)
+// gets one without a fixed wait on every error
+constexpr int kWriteAttempts = 5;
+constexpr unsigned long kRetryInitialDelayMs = 100;  // NOLINT(runtime/int)
+
+// Once this many sectors in a row have failed while looking for the bad
+// ones in a chunk, the rest of it is marked bad without being tried. A
+// dead stick would otherwise take a write for every sector of every
+// chunk before the write gives up.
+constexpr int kMaxFailedSectorsInARow = 64;
+
+class SyncChunkWriter : public ChunkWriter {
+ public:
+  SyncChunkWriter(BlockDevice* target,
+                  ChunkRing* ring,
+                  const uint64_t sector_size)
+      : target_(target), ring_(ring), sector_size_(sector_size) {}
+
+  bool submit(Chunk* chunk) override {
+    const bool success = writeChunkSync(target_, *chunk, sector_size_);
+    if (success) {
+      notifyComplete(*chunk);
+    }
+    ring_->release(chunk);
+    return success;
+  }
+
+  bool drain() override { return true; }
+
+  const char* name() const override { return "sync"; }
+  int queueDepth() const override { return 1; }
+
+ private:
+  BlockDevice* target_;
+  ChunkRing* ring_;
+  const uint64_t sector_size_;
+};
+
+bool writeWithBackoff(BlockDevice* target,
+                      const uint64_t offset,
+                      const uint8_t* data,
+                      const size_t length,
+                      const uint64_t sector_size,
+                      StallWatchdog* watchdog) {
+  unsigned long delay_ms = kRetryInitialDelayMs;  // NOLINT(runtime/int)
+  for (int attempt = 1; !target->write(offset, data, length); attempt++) {
+    // A failed write is still an answer, and the wait isn't the
+    // target's
+    if (watchdog) {
+      watchdog->touch();
+    }
+    if (attempt >= kWriteAttempts) {
+      LOG_ERROR << "giving up on write at sector " << offset / sector_size;
+      return false;
+    }
+    LOG_WARNING << "write error at sector " << offset / sector_size
+                << ", retrying in " << delay_ms << " ms";
+    QThread::msleep(delay_ms);
+    delay_ms *= 2;
+  }
+  return true;
+}
+
+void addBadRegion(std::vector<BadRegion>* bad_regions,
+                  const uint64_t offset,
+                  const uint64_t length) {
+  if (!bad_regions->empty() &&
+      bad_regions->back().offset + bad_regions->back().length == offset) {
+    bad_regions->back().length += length;
+  } else {
+    bad_regions->push_back({offset, length});
+  }
+}
+
+// State of the search for the bad sectors in one chunk
+struct Isolation {
+  BlockDevice* target;
+  uint64_t sector_size;
+  std::vector<BadRegion>* bad_regions;
+  StallWatchdog* watchdog;
+  // Sectors that failed since the last write that went through
+  int failed_in_a_row;
+};
+
+// Find the bad sectors in a range whose write failed by writing each
+// half separately, and recursing into the halves that fail too. The
+// target has already had its retries, so these writes get none.
+// Returns true if every piece went through after all, i.e. the
+// failure didn't last.
+bool isolateBadRegions(Isolation* isolation,
+                       const uint64_t offset,
+                       const uint8_t* data,
+                       const size_t length) {
+  const uint64_t sector_size = isolation->sector_size;
+  if (length <= sector_size) {
+    addBadRegion(isolation->bad_regions, offset, length);
+    if (++isolation->failed_in_a_row == kMaxFailedSectorsInARow) {
+      LOG_ERROR << kMaxFailedSectorsInARow << " sectors in a row failed at "
+                << "sector " << offset / sector_size
+                << ", not trying the rest of the chunk";
+    }
+    return false;
+  }
+  const size_t half =
+      std::max<size_t>(length / sector_size / 2, 1) * sector_size;
+  const size_t pieces[][2] = {{0, half}, {half, length - half}};
+  bool written = true;
+  for (const auto& piece : pieces) {
+    const uint64_t piece_offset = offset + piece[0];
+    const uint8_t* piece_data = data + piece[0];
+    if (isolation->failed_in_a_row >= kMaxFailedSectorsInARow) {
+      addBadRegion(isolation->bad_regions, piece_offset, piece[1]);
+      written = false;
+      continue;
+    }
+    const bool success =
+        isolation->target->write(piece_offset, piece_data, piece[1]);
+    // However it went, the target answered
+    if (isolation->watchdog) {
+      isolation->watchdog->touch();
+    }
+    if (success) {
+      isolation->failed_in_a_row = 0;
+    } else if (!isolateBadRegions(isolation, piece_offset, piece_data,
+                                  piece[1])) {
+      written = false;
+    }
+  }
+  return written;
+}
+
+}  // namespace
+
+ChunkWriter::~ChunkWriter() {}
+
+bool ChunkWriter::writeChunkSync(BlockDevice* target,
+                                 const Chunk& chunk,
+                                 const uint64_t sector_size) {
+  return writeChunk(target, chunk, sector_size, &bad_regions_, watchdog_);
+}
+
+size_t chunkWriteLength(const Chunk& chunk, const uint64_t sector_size) {
+  return roundUp(chunk.length, sector_size);
+}
+
+bool writeChunk(BlockDevice* target,
+                const Chunk& chunk,
+                const uint64_t sector_size,
+                std::vector<BadRegion>* bad_regions,
+                StallWatchdog* watchdog) {
+  const size_t write_length = chunkWriteLength(chunk, sector_size);
+  if (writeWithBackoff(target, chunk.offset, chunk.buffer.data(),
+                       write_length, sector_size, watchdog)) {
+    return true;
+  }
+  // Splitting the chunk up writes all of it if the failure was only
+  // transient, in which case there is nothing bad to record
+  if (!bad_regions) {
+    return false;
+  }
+  Isolation isolation = {target, sector_size, bad_regions, watchdog, 0};
+  return isolateBadRegions(&isolation, chunk.offset, chunk.buffer.data(),
+                           write_length);
+}
+
+std::unique_ptr<ChunkWriter> createSyncWriter(BlockDevice* target,
+                                              ChunkRing* ring,
+                                              const uint64_t sector_size) {
+  return std::unique_ptr<ChunkWriter>(
+      new SyncChunkWriter(target, ring, sector_size));
+}
+
+#if !defined(__linux__)
+std::unique_ptr<ChunkWriter> createUringWriter(BlockDevice*,
+                                               ChunkRing*,
+                                               uint64_t,
+                                               int) {
+  return nullptr;
+}
+#endif
+
+}  // namespace gondar
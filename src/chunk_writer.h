@@ -0,0 +1,118 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_CHUNK_WRITER_H_
+#define SRC_CHUNK_WRITER_H_
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "block_device.h"
+#include "chunk_ring.h"
+
+namespace gondar {
+
+class StallWatchdog;
+
+// Drains filled chunks to the target. Each chunk is handed back to the
+// ring once its write has completed, which may be after submit()
+// returns, and whether or not it succeeded.
+class ChunkWriter {
+ public:
+  // Called on the writing thread as each write finishes successfully,
+  // just before the chunk goes back to the ring
+  using CompletionCallback = std::function<void(const Chunk& chunk)>;
+
+  virtual ~ChunkWriter();
+
+  void setCompletionCallback(const CompletionCallback& callback) {
+    on_complete_ = callback;
+  }
+
+  // Touched as each retry of a failed write returns, and as each piece
+  // of it is tried while looking for its bad sectors, which can take
+  // many writes. May be null.
+  void setStallWatchdog(StallWatchdog* watchdog) { watchdog_ = watchdog; }
+
+  // Start writing |chunk|, which the writer now owns. Returns false if
+  // this or an earlier write failed for good.
+  virtual bool submit(Chunk* chunk) = 0;
+
+  // Wait for every submitted write. Returns false if any failed.
+  virtual bool drain() = 0;
+
+  virtual const char* name() const = 0;
+  // Number of writes kept in flight
+  virtual int queueDepth() const = 0;
+
+  // Where writes that failed for good were found to fail, in the order
+  // found
+  const std::vector<BadRegion>& badRegions() const { return bad_regions_; }
+
+ protected:
+  void notifyComplete(const Chunk& chunk) const {
+    if (on_complete_) {
+      on_complete_(chunk);
+    }
+  }
+
+  // writeChunk(), recording any bad region it finds
+  bool writeChunkSync(BlockDevice* target,
+                      const Chunk& chunk,
+                      uint64_t sector_size);
+
+ private:
+  CompletionCallback on_complete_;
+  StallWatchdog* watchdog_ = nullptr;
+  std::vector<BadRegion> bad_regions_;
+};
+
+// Length of the write for |chunk|: its data rounded up to the next
+// sector boundary, since unbuffered writes fail unless the size is a
+// multiple of the sector size. The producer has zeroed the padding.
+size_t chunkWriteLength(const Chunk& chunk, uint64_t sector_size);
+
+// Write |chunk| synchronously, retrying failures with exponential
+// backoff. If it still fails, the chunk is split down to single
+// sectors to find which part of the target is bad, and the result is
+// added to |bad_regions| if that is non-null. The write fails if any
+// sector turns out bad, but the rest of the chunk has then been
+// written; if none does, the failure was transient and it succeeds.
+// Once a long enough run of sectors has failed, the rest of the chunk
+// is taken to be bad without trying it. |watchdog|, if non-null, is
+// touched as each retry and each of those writes returns.
+bool writeChunk(BlockDevice* target,
+                const Chunk& chunk,
+                uint64_t sector_size,
+                std::vector<BadRegion>* bad_regions = nullptr,
+                StallWatchdog* watchdog = nullptr);
+
+// One write at a time
+std::unique_ptr<ChunkWriter> createSyncWriter(BlockDevice* target,
+                                              ChunkRing* ring,
+                                              uint64_t sector_size);
+
+// Keeps up to |queue_depth| writes in flight with io_uring. Returns
+// null if that isn't available (not Linux, old kernel, or the target
+// has no file descriptor).
+std::unique_ptr<ChunkWriter> createUringWriter(BlockDevice* target,
+                                               ChunkRing* ring,
+                                               uint64_t sector_size,
+                                               int queue_depth);
+
+}  // namespace gondar
+
+#endif  // SRC_CHUNK_WRITER_H_
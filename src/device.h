@@ -35,6 +35,8 @@ class DeviceGuy {
   uint32_t device_num = 0;
   std::string name;
   uint64_t num_bytes = 0;
+  // Hardware serial number, if the platform code could find one
+  std::string serial;
 };
 
 typedef std::vector<DeviceGuy> DeviceGuyList;
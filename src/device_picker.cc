@@ -17,14 +17,25 @@
 
 #include <QRadioButton>
 
+#include <algorithm>
+#include <limits>
+
 #include "util.h"
 
 namespace gondar {
 
+namespace {
+
+uint64_t minimumDeviceSize() {
+  return 6 * getGigabyte();
+}
+
+}  // namespace
+
 DevicePicker::Button::Button(const DeviceGuy& device, QWidget* parent)
     : QRadioButton(QString::fromStdString(device.name), parent),
       device_(device) {
-  if (device.num_bytes < 6 * gondar::getGigabyte()) {
+  if (device.num_bytes < minimumDeviceSize()) {
     setEnabled(false);
     setText(QString::fromStdString(device.name) + " (too small)");
   }
@@ -34,7 +45,25 @@ const DeviceGuy& DevicePicker::Button::device() const {
   return device_;
 }
 
-DevicePicker::DevicePicker() {
+void DevicePicker::Button::setProbeResult(const SpeedProbeResult& result,
+                                          const uint64_t image_size) {
+  result_ = result;
+  estimate_ = estimateFlashSeconds(result, image_size);
+  if (estimate_ < 0) {
+    return;
+  }
+  const int minutes = std::max(1, static_cast<int>(estimate_ / 60 + 0.5));
+  setText(QString("%1 (about %2 min)")
+              .arg(QString::fromStdString(device_.name))
+              .arg(minutes));
+  setToolTip(QString("Reads %1 MB/s, %2 random reads/s")
+                 .arg(result.sequential_rate / 1e6, 0, 'f', 1)
+                 .arg(result.random_iops, 0, 'f', 0));
+}
+
+// Until the image is known, assume it nearly fills the smallest device
+// it fits on, so that estimates err on the long side
+DevicePicker::DevicePicker() : image_size_(minimumDeviceSize()) {
   setLayout(&layout_);
 
   using OnButtonClicked = void (QButtonGroup::*)(QAbstractButton*);
@@ -43,6 +72,8 @@ DevicePicker::DevicePicker() {
           &DevicePicker::onButtonClicked);
 }
 
+DevicePicker::~DevicePicker() = default;
+
 Option<DeviceGuy> DevicePicker::selectedDevice() const {
   const auto* selected = selectedButton();
 
@@ -54,21 +85,61 @@ Option<DeviceGuy> DevicePicker::selectedDevice() const {
 }
 
 void DevicePicker::refresh(const DeviceGuyList& devices) {
+  probe_thread_.reset();
+  probe_generation_++;
+
   while (auto* item = layout_.takeAt(0)) {
     auto* button = dynamic_cast<Button*>(item->widget());
     button_group_.removeButton(button);
+    delete button;
     delete item;
   }
+  buttons_.clear();
 
+  SpeedProbeThread::DeviceList to_probe;
   for (const auto& device : devices) {
     auto* button = new Button(device, this);
     button_group_.addButton(button);
     layout_.addWidget(button);
+    if (button->isEnabled()) {
+      to_probe.emplace_back(static_cast<int>(buttons_.size()), device);
+    }
+    buttons_.push_back(button);
+  }
+
+  if (!to_probe.empty()) {
+    probe_thread_.reset(new SpeedProbeThread(to_probe));
+    const int generation = probe_generation_;
+    connect(probe_thread_.get(), &SpeedProbeThread::probed, this,
+            [this, generation](const int index, const double sequential_rate,
+                               const double random_iops) {
+              // A probe can finish just as refresh() replaces the
+              // buttons, in which case |index| no longer means anything
+              if (generation == probe_generation_) {
+                onProbed(index, sequential_rate, random_iops);
+              }
+            });
+    probe_thread_->start();
   }
 
   emit selectionChanged();
 }
 
+void DevicePicker::setImageSize(const uint64_t image_size) {
+  image_size_ = image_size;
+  for (auto* button : buttons_) {
+    if (button->estimate() >= 0) {
+      button->setProbeResult(button->probeResult(), image_size_);
+    }
+  }
+  updateOrder();
+}
+
+void DevicePicker::setSortByEstimate(const bool sort) {
+  sort_by_estimate_ = sort;
+  updateOrder();
+}
+
 const DevicePicker::Button* DevicePicker::selectedButton() const {
   const QAbstractButton* selected = button_group_.checkedButton();
   return dynamic_cast<const Button*>(selected);
@@ -78,4 +149,39 @@ void DevicePicker::onButtonClicked(QAbstractButton*) {
   emit selectionChanged();
 }
 
+void DevicePicker::onProbed(const int index,
+                            const double sequential_rate,
+                            const double random_iops) {
+  if (index < 0 || index >= static_cast<int>(buttons_.size())) {
+    return;
+  }
+  SpeedProbeResult result;
+  result.sequential_rate = sequential_rate;
+  result.random_iops = random_iops;
+  buttons_[index]->setProbeResult(result, image_size_);
+  updateOrder();
+}
+
+void DevicePicker::updateOrder() {
+  std::vector<Button*> order = buttons_;
+  if (sort_by_estimate_) {
+    // Unprobed and unusable devices go last, in their original order
+    const auto rank = [](const Button* button) {
+      return button->isEnabled() && button->estimate() >= 0
+                 ? button->estimate()
+                 : std::numeric_limits<double>::infinity();
+    };
+    std::stable_sort(order.begin(), order.end(),
+                     [&rank](const Button* a, const Button* b) {
+                       return rank(a) < rank(b);
+                     });
+  }
+  for (size_t i = 0; i < order.size(); i++) {
+    if (layout_.indexOf(order[i]) != static_cast<int>(i)) {
+      layout_.removeWidget(order[i]);
+      layout_.insertWidget(static_cast<int>(i), order[i]);
+    }
+  }
+}
+
 }  // namespace gondar
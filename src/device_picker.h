@@ -21,8 +21,13 @@
 #include <QVBoxLayout>
 #include <QWidget>
 
+#include <cstdint>
+#include <memory>
+#include <vector>
+
 #include "device.h"
 #include "option.h"
+#include "speed_probe.h"
 #include "util.h"
 
 namespace gondar {
@@ -32,11 +37,21 @@ class DevicePicker : public QWidget {
 
  public:
   DevicePicker();
+  ~DevicePicker() override;
 
   Option<DeviceGuy> selectedDevice() const;
 
+  // Replace the devices on offer. Each usable device is then probed for
+  // speed in the background, and its button shows how long writing the
+  // image would take once that is known.
   void refresh(const DeviceGuyList& devices);
 
+  // Size of the image the estimates are for
+  void setImageSize(uint64_t image_size);
+  // List the fastest devices first, instead of in the order refresh()
+  // was given them
+  void setSortByEstimate(bool sort);
+
  signals:
   void selectionChanged();
 
@@ -46,9 +61,19 @@ class DevicePicker : public QWidget {
   virtual const Button* selectedButton() const;
 
   void onButtonClicked(QAbstractButton* button);
+  void onProbed(int index, double sequential_rate, double random_iops);
+  void updateOrder();
 
   QButtonGroup button_group_;
   QVBoxLayout layout_;
+  // In the order refresh() was given the devices
+  std::vector<Button*> buttons_;
+  std::unique_ptr<SpeedProbeThread> probe_thread_;
+  // Bumped by refresh(), so that results from an earlier probe are
+  // ignored
+  int probe_generation_ = 0;
+  uint64_t image_size_;
+  bool sort_by_estimate_ = false;
 };
 
 class DevicePicker::Button : public QRadioButton {
@@ -56,8 +81,15 @@ class DevicePicker::Button : public QRadioButton {
   Button(const DeviceGuy& device, QWidget* parent);
   const DeviceGuy& device() const;
 
+  void setProbeResult(const SpeedProbeResult& result, uint64_t image_size);
+  const SpeedProbeResult& probeResult() const { return result_; }
+  // Estimated seconds to write the image, or -1 if not probed yet
+  double estimate() const { return estimate_; }
+
  private:
   DeviceGuy device_;
+  SpeedProbeResult result_;
+  double estimate_ = -1;
 };
 
 }  // namespace gondar
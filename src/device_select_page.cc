@@ -17,6 +17,7 @@
 
 #include "gondarwizard.h"
 #include "log.h"
+#include "write_engine.h"
 
 DeviceSelectPage::DeviceSelectPage(
     std::unique_ptr<gondar::DevicePicker> picker_in,
@@ -34,18 +35,90 @@ void DeviceSelectPage::init() {
   drivesLabel.setText("Select Drive:");
   layout.addWidget(&drivesLabel);
   layout.addWidget(picker.get());
+  sortCheckBox.setText("List the fastest drives first");
+  layout.addWidget(&sortCheckBox);
+  streamCheckBox.setText("Write to the drive while the image downloads");
+  streamCheckBox.setToolTip(
+      "Saves time and disk space, but a dropped connection means starting "
+      "over");
+  layout.addWidget(&streamCheckBox);
+  extractCheckBox.setText("Extract the image before writing it");
+  extractCheckBox.setToolTip(
+      "Needs as much free disk space as the image, but the write itself "
+      "takes less CPU");
+  layout.addWidget(&extractCheckBox);
+  verifyCheckBox.setText("Read the drive back to check it once written");
+  verifyCheckBox.setToolTip(
+      "Catches drives that silently lose data, but takes longer");
+  layout.addWidget(&verifyCheckBox);
+  differentialCheckBox.setText(
+      "Only rewrite what changed since this drive was last flashed");
+  differentialCheckBox.setToolTip(
+      "Faster when updating a CloudReady drive, slower on any other");
+  layout.addWidget(&differentialCheckBox);
+  autotuneCheckBox.setText("Find the fastest write size for this drive");
+  autotuneCheckBox.setToolTip(
+      "Tries a few sizes at the start of the write and keeps the best");
+  layout.addWidget(&autotuneCheckBox);
+  partitionsCheckBox.setText("Only write the image's partitions");
+  partitionsCheckBox.setToolTip(
+      "Faster, but whatever was on the drive between them stays there");
+  layout.addWidget(&partitionsCheckBox);
+  skipZerosCheckBox.setText("Have the drive zero the image's empty blocks");
+  skipZerosCheckBox.setToolTip(
+      "Faster, but some drives don't zero them properly");
+  layout.addWidget(&skipZerosCheckBox);
+  resumableCheckBox.setText(
+      "Let an interrupted write pick up where it left off");
+  resumableCheckBox.setToolTip(
+      "Saves starting over if the drive is pulled out, but the write "
+      "pauses now and then to make sure of its progress");
+  layout.addWidget(&resumableCheckBox);
   setLayout(&layout);
   connect(picker.get(), &gondar::DevicePicker::selectionChanged, this,
           &DeviceSelectPage::completeChanged);
+  connect(&sortCheckBox, &QCheckBox::toggled, picker.get(),
+          &gondar::DevicePicker::setSortByEstimate);
 }
 
 void DeviceSelectPage::initializePage() {
+  // Time estimates are for a typical image until the real one is here
+  if (!wizard()->isFormatOnly() &&
+      wizard()->downloadProgressPage.isComplete()) {
+    const int64_t image_size = wizard()->downloadProgressPage.getImageSize();
+    if (image_size > 0) {
+      picker->setImageSize(image_size);
+    }
+  }
   picker->refresh(wizard()->usbInsertPage.devices());
+  // Only a download still to come can be streamed or extracted
+  const bool downloading = !wizard()->isFormatOnly() &&
+                           !wizard()->downloadProgressPage.isComplete();
+  streamCheckBox.setVisible(downloading);
+  extractCheckBox.setVisible(downloading);
+  verifyCheckBox.setVisible(!wizard()->isFormatOnly());
+  differentialCheckBox.setVisible(!wizard()->isFormatOnly());
+  autotuneCheckBox.setVisible(!wizard()->isFormatOnly());
+  partitionsCheckBox.setVisible(!wizard()->isFormatOnly());
+  skipZerosCheckBox.setVisible(!wizard()->isFormatOnly());
+  resumableCheckBox.setVisible(!wizard()->isFormatOnly());
 }
 
 bool DeviceSelectPage::validatePage() {
   if (const auto device = picker->selectedDevice()) {
     wizard()->writeOperationPage.setDevice(*device);
+    gondar::WriteOptions options;
+    options.verify = verifyCheckBox.isChecked();
+    options.differential = differentialCheckBox.isChecked();
+    options.autotune = autotuneCheckBox.isChecked();
+    options.partitions_only = partitionsCheckBox.isChecked();
+    options.skip_zero_blocks = skipZerosCheckBox.isChecked();
+    wizard()->writeOperationPage.setWriteOptions(options);
+    wizard()->writeOperationPage.setResumable(resumableCheckBox.isChecked());
+    wizard()->downloadProgressPage.setStreaming(
+        !streamCheckBox.isHidden() && streamCheckBox.isChecked());
+    wizard()->downloadProgressPage.setExtracting(
+        !extractCheckBox.isHidden() && extractCheckBox.isChecked());
     return true;
   }
   return false;
@@ -16,6 +16,7 @@
 #ifndef SRC_DEVICE_SELECT_PAGE_H_
 #define SRC_DEVICE_SELECT_PAGE_H_
 
+#include <QCheckBox>
 #include <QLabel>
 #include <QVBoxLayout>
 #include <memory>
@@ -40,6 +41,15 @@ class DeviceSelectPage : public gondar::WizardPage {
  private:
   QVBoxLayout layout;
   QLabel drivesLabel;
+  QCheckBox sortCheckBox;
+  QCheckBox streamCheckBox;
+  QCheckBox extractCheckBox;
+  QCheckBox verifyCheckBox;
+  QCheckBox differentialCheckBox;
+  QCheckBox autotuneCheckBox;
+  QCheckBox partitionsCheckBox;
+  QCheckBox skipZerosCheckBox;
+  QCheckBox resumableCheckBox;
   std::unique_ptr<gondar::DevicePicker> picker;
 };
 
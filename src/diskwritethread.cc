@@ -17,10 +17,20 @@
 
 #include <QFile>
 
+#include <memory>
+#include <string>
+
+#include "block_map.h"
+#include "cancel_token.h"
 #include "device.h"
 #include "gondar.h"
 #include "log.h"
 #include "metric.h"
+#include "write_journal.h"
+#include "zip_stream.h"
+
+// How often progressChanged() is emitted
+static const int kProgressIntervalMs = 500;
 
 static int64_t getFileSize(const QString& path) {
   QFile file(path);
@@ -31,24 +41,70 @@ static int64_t getFileSize(const QString& path) {
 }
 
 DiskWriteThread::DiskWriteThread(DeviceGuy* drive_in, QObject* parent)
-    : QThread(parent), selected_drive(*drive_in) {}
+    : QThread(parent),
+      selected_drive(*drive_in),
+      progress_meter_(&progress_) {}
 
 DiskWriteThread::DiskWriteThread(DeviceGuy* drive_in,
                                  const QString& image_path_in,
                                  QObject* parent)
-    : QThread(parent), selected_drive(*drive_in) {
+    : QThread(parent),
+      selected_drive(*drive_in),
+      progress_meter_(&progress_) {
   image_path = image_path_in;
+  startProgress();
+}
+
+DiskWriteThread::DiskWriteThread(DeviceGuy* drive_in,
+                                 const QString& zip_path_in,
+                                 const QString& entry_name_in,
+                                 QObject* parent)
+    : QThread(parent),
+      selected_drive(*drive_in),
+      image_path(zip_path_in),
+      entry_name(entry_name_in),
+      progress_meter_(&progress_) {
+  startProgress();
+}
+
+DiskWriteThread::DiskWriteThread(DeviceGuy* drive_in,
+                                 gondar::ZipStreamSource* stream,
+                                 QObject* parent)
+    : QThread(parent),
+      selected_drive(*drive_in),
+      stream_(stream),
+      progress_meter_(&progress_) {
+  startProgress();
 }
 
 DiskWriteThread::~DiskWriteThread() {}
 
+void DiskWriteThread::setCancelToken(const gondar::CancelToken* cancel) {
+  cancel_ = cancel;
+}
+
+void DiskWriteThread::setWriteOptions(const gondar::WriteOptions& options) {
+  options_ = options;
+}
+
+void DiskWriteThread::setResumable(const bool resumable) {
+  resumable_ = resumable;
+}
+
 DiskWriteThread::State DiskWriteThread::state() const {
   QMutexLocker locker(&state_mutex_);
   return state_;
 }
 
+std::vector<gondar::BadRegion> DiskWriteThread::badRegions() const {
+  QMutexLocker locker(&state_mutex_);
+  return bad_regions_;
+}
+
 void DiskWriteThread::writeImage() {
-  LOG_INFO << "writing " << image_path << " to disk";
+  LOG_INFO << "writing " << image_path
+           << (entry_name.isEmpty() ? QString() : ":" + entry_name)
+           << " to disk";
   setState(State::Running);
 
   const int64_t image_size = getFileSize(image_path);
@@ -58,9 +114,53 @@ void DiskWriteThread::writeImage() {
     return;
   }
 
-  if (!Install(&selected_drive, image_path.toStdString().c_str(), image_size)) {
-    LOG_ERROR << "Install failed";
-    setState(State::InstallFailed);
+  // A block map shipped next to the image lets us skip unused blocks.
+  // A broken one is only a missed optimization, so write everything.
+  const std::string path = image_path.toStdString();
+  const std::string bmap_path = gondar::blockMapPathFor(path);
+  gondar::BlockMap block_map;
+  gondar::WriteOptions options = options_;
+  options.progress = &progress_;
+  options.cancel = cancel_;
+  // A plain image file can be handed to the kernel to copy; the engine
+  // goes through the ring instead whenever another option needs to see
+  // the data
+  options.zero_copy = entry_name.isEmpty();
+  if (QFile::exists(QString::fromStdString(bmap_path))) {
+    if (gondar::loadBlockMap(bmap_path, &block_map)) {
+      options.block_map = &block_map;
+    } else {
+      LOG_WARNING << "ignoring block map, writing the whole image";
+    }
+  }
+
+  // Keep a journal so that if this write is interrupted, writing the
+  // same image to the same stick again picks up where it left off
+  std::unique_ptr<gondar::WriteJournal> journal;
+  if (resumable_) {
+    const std::string device_id =
+        (selected_drive.serial.empty() ? selected_drive.name
+                                       : selected_drive.serial) +
+        " " + std::to_string(selected_drive.num_bytes);
+    const std::string journal_path = gondar::journalPathFor(device_id);
+    const std::string image_id = gondar::imageFingerprint(path);
+    if (!journal_path.empty() && !image_id.empty()) {
+      journal.reset(
+          new gondar::WriteJournal(journal_path, device_id, image_id));
+      options.journal = journal.get();
+    }
+  }
+
+  gondar::WriteStats stats;
+  const bool success =
+      entry_name.isEmpty()
+          ? Install(&selected_drive, path.c_str(), image_size, options,
+                    &stats)
+          : InstallZipEntry(&selected_drive, path.c_str(),
+                            entry_name.toStdString().c_str(), options,
+                            &stats);
+  if (!success) {
+    setFailedState(stats);
     return;
   }
 
@@ -68,6 +168,75 @@ void DiskWriteThread::writeImage() {
   setState(State::Success);
 }
 
+void DiskWriteThread::writeStream() {
+  LOG_INFO << "writing download to disk";
+  setState(State::Running);
+
+  if (!stream_->start()) {
+    setState(cancel_ && cancel_->cancelled() ? State::Cancelled
+                                               : State::StreamFailed);
+    return;
+  }
+  // The image is read once, as it arrives, so nothing that would read
+  // it out of order (the partition scan) or fingerprint it beforehand
+  // (the journal) applies
+  gondar::WriteOptions options = options_;
+  options.partitions_only = false;
+  options.progress = &progress_;
+  options.cancel = cancel_;
+  int64_t image_size = stream_->size();
+  if (image_size < 0) {
+    // A zip written as a stream only says for sure how big the image
+    // is at the end, so write until the entry ends and check it then.
+    // The size given up front, if any, keeps progress honest; failing
+    // that, allow for as much as the drive takes.
+    options.open_ended = true;
+    image_size = stream_->expectedSize();
+    if (image_size < 0) {
+      image_size = selected_drive.num_bytes;
+    }
+  }
+
+  gondar::WriteStats stats;
+  if (!Install(&selected_drive, stream_, image_size, options, &stats)) {
+    // Cancelling aborts the download too, which the stream sees first
+    if (stream_->failed() && !(cancel_ && cancel_->cancelled())) {
+      LOG_ERROR << "Install failed reading the download";
+      setState(State::StreamFailed);
+    } else {
+      setFailedState(stats);
+    }
+    return;
+  }
+
+  LOG_INFO << "Install succeeded";
+  setState(State::Success);
+}
+
+void DiskWriteThread::setFailedState(const gondar::WriteStats& stats) {
+  if (cancel_ && cancel_->cancelled()) {
+    LOG_INFO << "Install cancelled";
+    setState(State::Cancelled);
+  } else if (stats.stalled) {
+    LOG_ERROR << "Install stalled";
+    setState(State::Stalled);
+  } else if (!stats.bad_regions.empty()) {
+    LOG_ERROR << "Install found " << stats.bad_regions.size()
+              << " bad regions";
+    {
+      QMutexLocker locker(&state_mutex_);
+      bad_regions_ = stats.bad_regions;
+    }
+    setState(State::BadRegions);
+  } else if (stats.verify_failed) {
+    LOG_ERROR << "Install failed verification";
+    setState(State::VerifyFailed);
+  } else {
+    LOG_ERROR << "Install failed";
+    setState(State::InstallFailed);
+  }
+}
+
 void DiskWriteThread::formatDrive() {
   LOG_INFO << "formatting disk";
   setState(State::Running);
@@ -82,13 +251,42 @@ void DiskWriteThread::formatDrive() {
   setState(State::Success);
 }
 void DiskWriteThread::run() {
-  if (image_path.isEmpty()) {
+  if (stream_) {
+    writeStream();
+  } else if (image_path.isEmpty()) {
     formatDrive();
   } else {
     writeImage();
   }
 }
 
+void DiskWriteThread::startProgress() {
+  // The timer lives on our owner's thread, not the one run() is on, so
+  // the write itself never waits for the UI
+  progress_timer_.setInterval(kProgressIntervalMs);
+  connect(&progress_timer_, &QTimer::timeout, this,
+          &DiskWriteThread::pollProgress);
+  connect(this, &QThread::started, &progress_timer_, [this]() {
+    progress_clock_.start();
+    progress_timer_.start();
+  });
+  connect(this, &QThread::finished, &progress_timer_, [this]() {
+    progress_timer_.stop();
+    pollProgress();
+  });
+}
+
+void DiskWriteThread::pollProgress() {
+  if (!progress_clock_.isValid()) {
+    return;
+  }
+  const gondar::ProgressSample sample =
+      progress_meter_.sample(progress_clock_.elapsed());
+  if (sample.total > 0) {
+    emit progressChanged(sample);
+  }
+}
+
 void DiskWriteThread::setState(const State state) {
   QMutexLocker locker(&state_mutex_);
   state_ = state;
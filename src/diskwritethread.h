@@ -16,11 +16,23 @@
 #ifndef SRC_DISKWRITETHREAD_H_
 #define SRC_DISKWRITETHREAD_H_
 
+#include <QElapsedTimer>
 #include <QMutex>
 #include <QString>
 #include <QThread>
+#include <QTimer>
 
+#include <vector>
+
+#include "block_device.h"
 #include "device.h"
+#include "write_engine.h"
+#include "write_progress.h"
+
+namespace gondar {
+class CancelToken;
+class ZipStreamSource;
+}
 
 class DiskWriteThread : public QThread {
   Q_OBJECT
@@ -32,17 +44,60 @@ class DiskWriteThread : public QThread {
   DiskWriteThread(DeviceGuy* drive_in,
                   const QString& image_path_in,
                   QObject* parent = 0);
+  // a constructor used to write the file |entry_name_in| of the zip at
+  // |zip_path_in| to disk, inflating it on the way instead of
+  // extracting it first
+  DiskWriteThread(DeviceGuy* drive_in,
+                  const QString& zip_path_in,
+                  const QString& entry_name_in,
+                  QObject* parent = 0);
+  // a constructor used to write an image while it is still downloading.
+  // |stream| must outlive the thread, and is started by it.
+  DiskWriteThread(DeviceGuy* drive_in,
+                  gondar::ZipStreamSource* stream,
+                  QObject* parent = 0);
   ~DiskWriteThread();
 
+  // Once |cancel| is cancelled, an image write stops at the next chunk
+  // and leaves the drive without a partition table. Call before
+  // start().
+  void setCancelToken(const gondar::CancelToken* cancel);
+  // Write with |options| as the user chose them; progress, cancelling
+  // and anything that depends on the image are filled in on top. Call
+  // before start().
+  void setWriteOptions(const gondar::WriteOptions& options);
+  // Keep a journal of an image write, so that if it is interrupted,
+  // writing the same image to the same drive again picks up where it
+  // left off. Costs a flush every WriteOptions::journal_interval, and
+  // rules out having the kernel copy the image. Call before start().
+  void setResumable(bool resumable);
+
   enum class State {
     Initial,
     Running,
     GetFileSizeFailed,
     InstallFailed,
+    // The write completed but reading it back didn't match the image
+    VerifyFailed,
+    // Parts of the drive wouldn't take writes; see badRegions()
+    BadRegions,
+    // The drive stopped responding
+    Stalled,
+    // Stopped through the cancel token
+    Cancelled,
+    // The download being written failed, or wasn't a usable zip
+    StreamFailed,
     Success,
   };
 
   State state() const;
+  // Where the drive failed writes, once the state is BadRegions
+  std::vector<gondar::BadRegion> badRegions() const;
+
+ signals:
+  // Emitted on the thread that owns this object, about twice a second
+  // while an image is being written
+  void progressChanged(const gondar::ProgressSample& sample);
 
  protected:
   void run() override;
@@ -50,12 +105,30 @@ class DiskWriteThread : public QThread {
  private:
   void setState(State state);
   void writeImage();
+  void writeStream();
+  // Work out why Install() failed
+  void setFailedState(const gondar::WriteStats& stats);
   void formatDrive();
+  void startProgress();
+  void pollProgress();
 
   mutable QMutex state_mutex_;
   State state_ = State::Initial;
+  std::vector<gondar::BadRegion> bad_regions_;
   DeviceGuy selected_drive;
   QString image_path;
+  // Set if |image_path| is a zip, to the file in it to write
+  QString entry_name;
+  gondar::ZipStreamSource* stream_ = nullptr;
+  const gondar::CancelToken* cancel_ = nullptr;
+  gondar::WriteOptions options_;
+  bool resumable_ = false;
+
+  // Updated by the write engine, polled by |progress_timer_|
+  gondar::WriteProgress progress_;
+  gondar::ProgressMeter progress_meter_;
+  QTimer progress_timer_;
+  QElapsedTimer progress_clock_;
 };
 
 #endif  // SRC_DISKWRITETHREAD_H_
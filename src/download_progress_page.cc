@@ -15,10 +15,19 @@
 
 #include "download_progress_page.h"
 
+#include <exception>
+
 #include "gondarwizard.h"
+#include "log.h"
+
+// How much of a streamed download can be waiting for the drive
+static const size_t kStreamBufferSize = 16 * 1024 * 1024;
 
 DownloadProgressPage::DownloadProgressPage(QWidget* parent)
-    : WizardPage(parent) {
+    : WizardPage(parent),
+      streaming(false),
+      extracting(false),
+      unzipThread(nullptr) {
   setTitle("CloudReady Download");
   setSubTitle("Your installer image is currently downloading.");
   download_finished = false;
@@ -31,6 +40,15 @@ void DownloadProgressPage::initializePage() {
   setLayout(&layout);
   const QUrl url = wizard()->imageSelectPage.getUrl();
   qDebug() << "using url= " << url;
+  if (streaming) {
+    // A fresh stream for every download
+    stream_source.reset();
+    stream_queue.reset(new gondar::ByteQueue(kStreamBufferSize));
+    stream_source.reset(new gondar::ZipStreamSource(stream_queue.get()));
+    manager.setStreamQueue(stream_queue.get());
+  } else {
+    manager.setStreamQueue(nullptr);
+  }
   connect(&manager, &DownloadManager::finished, this,
           &DownloadProgressPage::markComplete);
   manager.append(url.toString());
@@ -38,12 +56,17 @@ void DownloadProgressPage::initializePage() {
           &DownloadProgressPage::onDownloadStarted);
   // allow the download manager to access session state in the wizard
   manager.setWizard(wizard());
+  manager.setCancelToken(&wizard()->cancelToken);
 }
 
 void DownloadProgressPage::onDownloadStarted() {
   QNetworkReply* cur_download = manager.getCurrentDownload();
   connect(cur_download, &QNetworkReply::downloadProgress, this,
           &DownloadProgressPage::downloadProgress);
+  if (streaming) {
+    // the write page takes it from here
+    wizard()->next();
+  }
 }
 
 void DownloadProgressPage::downloadProgress(qint64 sofar, qint64 total) {
@@ -55,23 +78,61 @@ void DownloadProgressPage::downloadProgress(qint64 sofar, qint64 total) {
 }
 
 void DownloadProgressPage::markComplete() {
+  if (streaming) {
+    // the write page has been reading the download all along, and
+    // reports how it went; nothing was saved
+    return;
+  }
   download_finished = true;
-  // now that the download is finished, let's unzip the build.
   if (manager.hasError()) {
     wizard()->postError(
         "An error has occurred downloading the latest image.  Please ensure "
         "you have a network connection.");
     return;
   }
-  notifyUnzip();
-  unzipThread = new UnzipThread(manager.outputFileInfo(), this);
-  connect(unzipThread, &UnzipThread::finished, this,
-          &DownloadProgressPage::onUnzipFinished);
-  unzipThread->start();
+  if (extracting) {
+    notifyUnzip();
+    unzipThread = new UnzipThread(manager.outputFileInfo(),
+                                  &wizard()->cancelToken, this);
+    connect(unzipThread, &UnzipThread::finished, this,
+            &DownloadProgressPage::onUnzipFinished);
+    unzipThread->start();
+    return;
+  }
+  // The image is inflated as it is written, so all that's needed from
+  // the zip for now is which file in it that is
+  const QFileInfo zip = manager.outputFileInfo();
+  try {
+    image_entry = neverware_first_entry(zip);
+  } catch (const std::exception& exc) {
+    LOG_ERROR << "could not read " << zip.filePath() << ": " << exc.what();
+    wizard()->postError(
+        "The downloaded image could not be read.  Please try again.");
+    return;
+  }
+  image_path = zip.absoluteFilePath();
+  qDebug() << "main thread has accepted complete";
+  progress.setRange(0, 100);
+  progress.setValue(100);
+  setSubTitle("Download complete!");
+  emit completeChanged();
+  // immediately progress to writeOperationPage
+  wizard()->next();
 }
 
 void DownloadProgressPage::onUnzipFinished() {
-  // unzip has now completed
+  if (wizard()->cancelToken.cancelled()) {
+    return;
+  }
+  const QFileInfo image(unzipThread->getFileName());
+  if (image.fileName().isEmpty()) {
+    wizard()->postError(
+        "The downloaded image could not be extracted.  Please try again.");
+    return;
+  }
+  image_path = image.absoluteFilePath();
+  image_entry = NeverwareZipEntry();
+  image_entry.size = image.size();
   qDebug() << "main thread has accepted complete";
   progress.setRange(0, 100);
   progress.setValue(100);
@@ -80,6 +141,7 @@ void DownloadProgressPage::onUnzipFinished() {
   // immediately progress to writeOperationPage
   wizard()->next();
 }
+
 void DownloadProgressPage::notifyUnzip() {
   setSubTitle("Extracting compressed image...");
   // setting range and value to zero results in an 'infinite' progress bar
@@ -92,5 +154,32 @@ bool DownloadProgressPage::isComplete() const {
 }
 
 const QString& DownloadProgressPage::getImageFileName() {
-  return unzipThread->getFileName();
+  return image_path;
+}
+
+const QString& DownloadProgressPage::getImageEntryName() {
+  return image_entry.name;
+}
+
+int64_t DownloadProgressPage::getImageSize() {
+  return image_entry.size;
+}
+
+void DownloadProgressPage::cancel() {
+  manager.cancel();
+  if (unzipThread) {
+    unzipThread->wait();
+  }
+}
+
+void DownloadProgressPage::setStreaming(const bool streaming_in) {
+  streaming = streaming_in;
+}
+
+void DownloadProgressPage::setExtracting(const bool extracting_in) {
+  extracting = extracting_in;
+}
+
+gondar::ZipStreamSource* DownloadProgressPage::streamSource() {
+  return streaming ? stream_source.get() : nullptr;
 }
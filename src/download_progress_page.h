@@ -19,9 +19,14 @@
 #include <QProgressBar>
 #include <QVBoxLayout>
 
+#include <memory>
+
+#include "byte_queue.h"
 #include "downloader.h"
+#include "neverware_unzipper.h"
 #include "unzipthread.h"
 #include "wizard_page.h"
+#include "zip_stream.h"
 
 class DownloadProgressPage : public gondar::WizardPage {
   Q_OBJECT
@@ -29,7 +34,26 @@ class DownloadProgressPage : public gondar::WizardPage {
  public:
   explicit DownloadProgressPage(QWidget* parent = 0);
   bool isComplete() const override;
+  // The downloaded zip, and the image in it, which is written straight
+  // out of the zip. If the image was extracted instead, the file name
+  // is the image's and the entry name is empty.
   const QString& getImageFileName();
+  const QString& getImageEntryName();
+  int64_t getImageSize();
+  // Instead of saving the download, move on to the write page as soon
+  // as the download starts and let it write the image as it arrives.
+  // Set before the page is shown.
+  void setStreaming(bool streaming_in);
+  // What the write page reads the image from when streaming, else null
+  gondar::ZipStreamSource* streamSource();
+  // Extract the image next to the zip once the download is done, and
+  // write that, rather than writing straight out of the zip. Takes
+  // disk space and time up front, but leaves a plain image the kernel
+  // can copy to the drive itself. Ignored when streaming. Set before
+  // the page is shown.
+  void setExtracting(bool extracting_in);
+  // Stop downloading or extracting, and wait until that has cleaned up
+  void cancel();
 
  protected:
   void initializePage() override;
@@ -47,7 +71,13 @@ class DownloadProgressPage : public gondar::WizardPage {
   QProgressBar progress;
   bool download_finished;
   QVBoxLayout layout;
+  QString image_path;
+  NeverwareZipEntry image_entry;
+  bool streaming;
+  bool extracting;
   UnzipThread* unzipThread;
+  std::unique_ptr<gondar::ByteQueue> stream_queue;
+  std::unique_ptr<gondar::ZipStreamSource> stream_source;
 };
 
 #endif  // SRC_DOWNLOAD_PROGRESS_PAGE_H_
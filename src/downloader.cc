@@ -24,12 +24,34 @@
 #include <QStringList>
 #include <QTimer>
 
+#include "byte_queue.h"
+#include "cancel_token.h"
 #include "gondarwizard.h"
 #include "log.h"
 #include "metric.h"
 
+// When streaming, the network layer buffers no more than this before
+// it stops reading from the socket, so a slow drive slows the download
+// down rather than filling memory
+static const qint64 kStreamReadBufferSize = 4 * 1024 * 1024;
+// and the stream is handed this much at a time
+static const qint64 kStreamPushSize = 1024 * 1024;
+
 DownloadManager::DownloadManager(QObject* parent)
-    : QObject(parent), error(false), downloadedCount(0), totalCount(0) {}
+    : QObject(parent),
+      currentDownload(nullptr),
+      wizard(nullptr),
+      cancelToken(nullptr),
+      streamQueue(nullptr),
+      finishPending(false),
+      error(false),
+      cancelled(false),
+      downloadedCount(0),
+      totalCount(0) {
+  // The stream's reader runs on a thread of its own
+  connect(this, &DownloadManager::streamSpaceAvailable, this,
+          &DownloadManager::downloadReadyRead, Qt::QueuedConnection);
+}
 
 void DownloadManager::append(const QStringList& urlList) {
   for (const auto& url : urlList)
@@ -52,6 +74,9 @@ QString DownloadManager::saveFileName(const QUrl& url) {
 }
 
 void DownloadManager::startNextDownload() {
+  if (cancelled) {
+    return;
+  }
   if (downloadQueue.isEmpty()) {
     LOG_INFO << downloadedCount << "/" << totalCount
              << " files downloaded successfully";
@@ -61,31 +86,37 @@ void DownloadManager::startNextDownload() {
 
   QUrl url = downloadQueue.dequeue();
 
-  const QDir dir =
-      QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
-  if (!dir.exists()) {
-    // equivalent of mkdir -p
-    bool success = dir.mkpath(".");
-    if (!success) {
-      LOG_ERROR << "Could not create download directory: "
-                << dir.absolutePath();
+  if (!streamQueue) {
+    const QDir dir =
+        QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
+    if (!dir.exists()) {
+      // equivalent of mkdir -p
+      bool success = dir.mkpath(".");
+      if (!success) {
+        LOG_ERROR << "Could not create download directory: "
+                  << dir.absolutePath();
+      }
     }
-  }
-  QString filename = saveFileName(url);
+    QString filename = saveFileName(url);
 
-  output.setFileName(dir.filePath(filename));
-  qInfo() << "Download destination:" << output.fileName();
+    output.setFileName(dir.filePath(filename));
+    qInfo() << "Download destination:" << output.fileName();
 
-  if (!output.open(QIODevice::WriteOnly)) {
-    LOG_ERROR << "failed to open " << filename << ": " << output.errorString();
-    LOG_ERROR << "skipping download of " << url;
-    startNextDownload();
-    return;  // skip this download
+    if (!output.open(QIODevice::WriteOnly)) {
+      LOG_ERROR << "failed to open " << filename << ": "
+                << output.errorString();
+      LOG_ERROR << "skipping download of " << url;
+      startNextDownload();
+      return;  // skip this download
+    }
   }
 
   QNetworkRequest request(url);
   gondar::SendMetric(wizard, gondar::Metric::DownloadAttempt);
   currentDownload = manager.get(request);
+  if (streamQueue) {
+    currentDownload->setReadBufferSize(kStreamReadBufferSize);
+  }
   connect(currentDownload, &QNetworkReply::finished, this,
           &DownloadManager::downloadFinished);
   connect(currentDownload, &QNetworkReply::readyRead, this,
@@ -98,7 +129,16 @@ void DownloadManager::startNextDownload() {
 }
 
 void DownloadManager::downloadFinished() {
+  // What the stream couldn't take yet goes first
+  if (streamQueue && !currentDownload->error() && !pushToStream()) {
+    finishPending = true;
+    return;
+  }
+  finishPending = false;
   output.close();
+  if (streamQueue) {
+    streamQueue->finish(!currentDownload->error());
+  }
 
   if (currentDownload->error()) {
     // download failed
@@ -112,11 +152,71 @@ void DownloadManager::downloadFinished() {
   }
 
   currentDownload->deleteLater();
+  currentDownload = nullptr;
   startNextDownload();
 }
 
 void DownloadManager::downloadReadyRead() {
-  output.write(currentDownload->readAll());
+  // Also reached through streamSpaceAvailable(), which may come late
+  if (!currentDownload) {
+    return;
+  }
+  if (cancelToken && cancelToken->cancelled()) {
+    cancel();
+    return;
+  }
+  if (!streamQueue) {
+    output.write(currentDownload->readAll());
+    return;
+  }
+  if (streamQueue->failed()) {
+    // Whoever was reading the stream has given up on it
+    cancel();
+    return;
+  }
+  if (pushToStream() && finishPending) {
+    downloadFinished();
+  }
+}
+
+// Hand the stream as much of what has arrived as it takes. Returns
+// false if some is left over, in which case streamSpaceAvailable()
+// says when to try again.
+bool DownloadManager::pushToStream() {
+  while (currentDownload->bytesAvailable() > 0 && !streamQueue->failed()) {
+    const QByteArray data = currentDownload->peek(kStreamPushSize);
+    const size_t taken = streamQueue->push(data.constData(), data.size());
+    if (taken == 0) {
+      return false;
+    }
+    currentDownload->read(taken);
+  }
+  return true;
+}
+
+void DownloadManager::cancel() {
+  if (cancelled) {
+    return;
+  }
+  LOG_INFO << "cancelling download";
+  cancelled = true;
+  error = true;
+  downloadQueue.clear();
+  if (currentDownload) {
+    // Nothing more should reach us from the reply, not even finished()
+    disconnect(currentDownload, nullptr, this, nullptr);
+    currentDownload->abort();
+    currentDownload->deleteLater();
+    currentDownload = nullptr;
+    if (!streamQueue) {
+      // Don't leave a partial download behind
+      output.close();
+      output.remove();
+    }
+  }
+  if (streamQueue) {
+    streamQueue->abort();
+  }
 }
 
 QNetworkReply* DownloadManager::getCurrentDownload() {
@@ -134,3 +234,14 @@ bool DownloadManager::hasError() {
 void DownloadManager::setWizard(GondarWizard* wizard_in) {
   wizard = wizard_in;
 }
+
+void DownloadManager::setCancelToken(const gondar::CancelToken* token) {
+  cancelToken = token;
+}
+
+void DownloadManager::setStreamQueue(gondar::ByteQueue* queue) {
+  streamQueue = queue;
+  if (queue) {
+    queue->setSpaceCallback([this]() { emit streamSpaceAvailable(); });
+  }
+}
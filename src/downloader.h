@@ -62,6 +62,11 @@
 
 class GondarWizard;
 
+namespace gondar {
+class ByteQueue;
+class CancelToken;
+}
+
 class DownloadManager : public QObject {
   Q_OBJECT
 
@@ -77,10 +82,21 @@ class DownloadManager : public QObject {
   bool hasError();
   // allow downloader to access wizard state
   void setWizard(GondarWizard* wizard_in);
+  // Downloads stop, at the next chunk received, once |token| is cancelled
+  void setCancelToken(const gondar::CancelToken* token);
+  // Hand downloads to |queue| as they arrive instead of saving them.
+  // The download slows down to the pace the queue is read at, and
+  // cancel() aborts the queue. Null goes back to saving to a file.
+  void setStreamQueue(gondar::ByteQueue* queue);
+  // Stop now, dropping queued downloads and the partial output. Neither
+  // signal is emitted afterwards.
+  void cancel();
 
  signals:
   void started();
   void finished();
+  // The stream queue has room again; emitted on the reader's thread
+  void streamSpaceAvailable();
 
  private slots:
   void startNextDownload();
@@ -88,14 +104,21 @@ class DownloadManager : public QObject {
   void downloadReadyRead();
 
  private:
+  bool pushToStream();
+
   QNetworkAccessManager manager;
   QQueue<QUrl> downloadQueue;
   QNetworkReply* currentDownload;
   QFile output;
   QTime downloadTime;
   GondarWizard* wizard;
+  const gondar::CancelToken* cancelToken;
+  gondar::ByteQueue* streamQueue;
+  // The download has finished but the stream hasn't taken all of it
+  bool finishPending;
 
   bool error;
+  bool cancelled;
   int downloadedCount;
   int totalCount;
 };
@@ -0,0 +1,148 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "erase.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "cancel_token.h"
+#include "log.h"
+#include "stall_watchdog.h"
+#include "write_progress.h"
+
+namespace gondar {
+
+namespace {
+
+// Most a single zeroing call covers. Without a native zeroing command
+// the kernel writes the zeros itself, at the device's write speed, so
+// slicing keeps progress, cancellation and the stall watchdog working.
+constexpr uint64_t kZeroSliceSize = 64 * 1024 * 1024;
+
+}  // namespace
+
+bool eraseRange(BlockDevice* target,
+                const uint64_t offset,
+                uint64_t length,
+                const WriteOptions& options,
+                EraseStats* stats) {
+  EraseStats local_stats;
+  if (!stats) {
+    stats = &local_stats;
+  }
+  *stats = EraseStats();
+
+  const uint64_t sector_size = std::max<uint64_t>(target->sectorSize(), 512);
+  length = roundUp(length, sector_size);
+  if (offset % sector_size != 0 || offset > target->size() ||
+      length > target->size() - offset) {
+    LOG_ERROR << "can't erase " << length << " bytes at " << offset << " of "
+              << target->path();
+    return false;
+  }
+  LOG_INFO << "erasing " << length << " bytes of " << target->path()
+           << " at " << offset;
+
+  WriteProgress* progress = options.progress;
+  if (progress) {
+    progress->start(length);
+  }
+  std::unique_ptr<StallWatchdog> watchdog;
+  if (options.stall_timeout_ms > 0) {
+    watchdog.reset(new StallWatchdog(target->path(), options.stall_timeout_ms,
+                                     progress));
+    watchdog->start();
+  }
+
+  {
+    StallWatchdog::Busy busy(watchdog.get());
+    stats->discarded = target->discard(offset, length);
+  }
+  if (stats->discarded) {
+    LOG_INFO << "discarded " << length << " bytes of " << target->path();
+  }
+
+  bool device_zeroes = true;
+  std::unique_ptr<AlignedBuffer> zeros;
+  for (uint64_t done = 0; done < length;) {
+    if (options.cancel && options.cancel->cancelled()) {
+      LOG_INFO << "erase of " << target->path() << " cancelled";
+      stats->cancelled = true;
+      return false;
+    }
+    if (watchdog && watchdog->stalled()) {
+      stats->stalled = true;
+      return false;
+    }
+    StallWatchdog::Busy busy(watchdog.get());
+    uint64_t count = std::min(kZeroSliceSize, length - done);
+    if (device_zeroes && target->zeroRange(offset + done, count)) {
+      stats->zeroed_bytes += count;
+    } else {
+      if (device_zeroes) {
+        LOG_INFO << target->path()
+                 << " can't zero ranges itself, writing zeros instead";
+        device_zeroes = false;
+        zeros.reset(new AlignedBuffer(
+            roundUp(options.buffer_size, sector_size), sector_size));
+        if (!zeros->valid()) {
+          LOG_ERROR << "could not allocate zero buffer";
+          return false;
+        }
+        memset(zeros->data(), 0, zeros->size());
+      }
+      count = std::min<uint64_t>(zeros->size(), length - done);
+      if (!target->write(offset + done, zeros->data(), count)) {
+        return false;
+      }
+      stats->written_bytes += count;
+    }
+    if (watchdog) {
+      watchdog->touch();
+    }
+    if (progress) {
+      progress->add(count);
+    }
+    done += count;
+  }
+
+  {
+    StallWatchdog::Busy busy(watchdog.get());
+    if (!target->flush()) {
+      return false;
+    }
+  }
+  if (watchdog && watchdog->stalled()) {
+    stats->stalled = true;
+    return false;
+  }
+  LOG_INFO << "erased " << target->path() << ": " << stats->zeroed_bytes
+           << " bytes zeroed by the device, " << stats->written_bytes
+           << " written";
+  return true;
+}
+
+bool discardAll(BlockDevice* target) {
+  if (!target->discard(0, target->size())) {
+    LOG_INFO << target->path() << " doesn't support discarding";
+    return false;
+  }
+  LOG_INFO << "discarded all of " << target->path();
+  return true;
+}
+
+}  // namespace gondar
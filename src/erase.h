@@ -0,0 +1,61 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_ERASE_H_
+#define SRC_ERASE_H_
+
+#include <cstdint>
+
+#include "block_device.h"
+#include "write_engine.h"
+
+namespace gondar {
+
+// What eraseRange() actually did
+struct EraseStats {
+  // Set if the device accepted a discard of the whole range
+  bool discarded = false;
+  // Bytes the device zeroed itself, and bytes that had to be written
+  uint64_t zeroed_bytes = 0;
+  uint64_t written_bytes = 0;
+  // Set if the erase stopped because it was cancelled, or because the
+  // target stopped responding
+  bool cancelled = false;
+  bool stalled = false;
+};
+
+// Make |length| bytes of |target| from |offset| read back as zeros, as
+// fast as the device allows. The range is discarded first, which also
+// lets flash reclaim it before the next write, and then zeroed by the
+// device itself (see BlockDevice::zeroRange). Only if the device can't
+// do that are zeros written, WriteOptions::buffer_size at a time.
+// |offset| must be a multiple of the sector size; |length| is rounded
+// up to one. The progress, cancel and stall_timeout_ms options apply
+// as they do to writeImage(). Returns true once the zeros are durable.
+bool eraseRange(BlockDevice* target,
+                uint64_t offset,
+                uint64_t length,
+                const WriteOptions& options = WriteOptions(),
+                EraseStats* stats = nullptr);
+
+// Best-effort discard of all of |target|, so that a stick that has
+// been written over and over is back to full speed. Doesn't wait for
+// anything to be zeroed. Returns false if the device doesn't support
+// discarding, which is common for USB sticks and harmless.
+bool discardAll(BlockDevice* target);
+
+}  // namespace gondar
+
+#endif  // SRC_ERASE_H_
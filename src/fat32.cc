@@ -0,0 +1,275 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "fat32.h"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+
+#include "block_device.h"
+#include "erase.h"
+#include "log.h"
+#include "rand_util.h"
+
+namespace gondar {
+
+namespace {
+
+// Layout of the reserved region, in sectors from the start of the
+// volume
+constexpr uint32_t kFsInfoSector = 1;
+constexpr uint32_t kBackupBootSector = 6;
+constexpr uint32_t kMinReservedSectors = 32;
+
+// FAT32 volumes need at least this many clusters, or they would be
+// taken for FAT16, and can't address more than this many
+constexpr uint64_t kMinClusters = 65525;
+constexpr uint64_t kMaxClusters = 0x0ffffff5;
+
+// Where the data region starts, on the disk, for the sake of flash
+// erase blocks
+constexpr uint64_t kDataAlignment = 1024 * 1024;
+
+constexpr uint8_t kMediaFixed = 0xf8;
+constexpr uint32_t kRootCluster = 2;
+
+// Default cluster size for a volume of up to |max_bytes|, after the
+// table Windows formats FAT32 by
+struct ClusterSize {
+  uint64_t max_bytes;
+  uint64_t cluster_bytes;
+};
+
+const ClusterSize kClusterSizes[] = {
+    {260ULL * 1024 * 1024, 512},
+    {8ULL * 1024 * 1024 * 1024, 4096},
+    {16ULL * 1024 * 1024 * 1024, 8192},
+    {32ULL * 1024 * 1024 * 1024, 16384},
+    {UINT64_MAX, 32768},
+};
+
+void putLe16(uint8_t* dst, const uint32_t value) {
+  dst[0] = static_cast<uint8_t>(value);
+  dst[1] = static_cast<uint8_t>(value >> 8);
+}
+
+void putLe32(uint8_t* dst, const uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    dst[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+// Upper case and padded with spaces, as labels are stored
+std::string paddedLabel(const std::string& label) {
+  std::string padded = label.substr(0, 11);
+  for (auto& c : padded) {
+    c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+  }
+  padded.resize(11, ' ');
+  return padded;
+}
+
+void fillBootSector(uint8_t* sector,
+                    const uint64_t sector_size,
+                    const uint64_t num_sectors,
+                    const Fat32Layout& layout,
+                    const Fat32Options& options,
+                    const uint32_t volume_id) {
+  // Jump over the parameter block to boot code that hands over to the
+  // next boot device (INT 18h)
+  const uint8_t jump[] = {0xeb, 0x58, 0x90};
+  memcpy(sector, jump, sizeof(jump));
+  memcpy(sector + 3, "MSWIN4.1", 8);
+  putLe16(sector + 11, sector_size);
+  sector[13] = static_cast<uint8_t>(layout.sectors_per_cluster);
+  putLe16(sector + 14, layout.reserved_sectors);
+  sector[16] = 2;  // number of FATs
+  sector[21] = kMediaFixed;
+  putLe16(sector + 24, 63);   // sectors per track
+  putLe16(sector + 26, 255);  // heads
+  putLe32(sector + 28, static_cast<uint32_t>(options.hidden_sectors));
+  putLe32(sector + 32, static_cast<uint32_t>(num_sectors));
+  putLe32(sector + 36, layout.fat_sectors);
+  putLe32(sector + 44, kRootCluster);
+  putLe16(sector + 48, kFsInfoSector);
+  putLe16(sector + 50, kBackupBootSector);
+  sector[64] = 0x80;  // drive number
+  sector[66] = 0x29;  // extended boot signature
+  putLe32(sector + 67, volume_id);
+  const std::string label =
+      options.label.empty() ? "NO NAME    " : paddedLabel(options.label);
+  memcpy(sector + 71, label.data(), 11);
+  memcpy(sector + 82, "FAT32   ", 8);
+  sector[90] = 0xcd;
+  sector[91] = 0x18;
+  sector[510] = 0x55;
+  sector[511] = 0xaa;
+}
+
+void fillFsInfoSector(uint8_t* sector, const Fat32Layout& layout) {
+  putLe32(sector, 0x41615252);
+  putLe32(sector + 484, 0x61417272);
+  // Everything is free but the root directory's cluster, which is the
+  // first one
+  putLe32(sector + 488, layout.clusters - 1);
+  putLe32(sector + 492, kRootCluster + 1);
+  putLe32(sector + 508, 0xaa550000);
+}
+
+}  // namespace
+
+bool layoutFat32(const uint64_t num_sectors,
+                 const uint64_t sector_size,
+                 const uint64_t hidden_sectors,
+                 Fat32Layout* layout) {
+  if (sector_size < 512 || sector_size > 4096 ||
+      (sector_size & (sector_size - 1)) != 0) {
+    LOG_ERROR << "can't make FAT32 with " << sector_size << "-byte sectors";
+    return false;
+  }
+  if (num_sectors > UINT32_MAX || hidden_sectors > UINT32_MAX) {
+    LOG_ERROR << "volume is too large for FAT32";
+    return false;
+  }
+  const uint64_t volume_bytes = num_sectors * sector_size;
+  const auto size = std::find_if(
+      std::begin(kClusterSizes), std::end(kClusterSizes),
+      [volume_bytes](const ClusterSize& s) {
+        return volume_bytes <= s.max_bytes;
+      });
+  const uint64_t sectors_per_cluster =
+      std::max<uint64_t>(size->cluster_bytes / sector_size, 1);
+
+  // Size the FATs for every cluster the volume could hold without them,
+  // which wastes a few sectors of FAT but never comes up short
+  uint64_t reserved = kMinReservedSectors;
+  if (num_sectors <= reserved) {
+    LOG_ERROR << "volume is too small for FAT32";
+    return false;
+  }
+  const uint64_t max_clusters = (num_sectors - reserved) / sectors_per_cluster;
+  const uint64_t fat_sectors =
+      ((max_clusters + 2) * 4 + sector_size - 1) / sector_size;
+
+  // Grow the reserved region until the data region is aligned
+  const uint64_t alignment =
+      std::max<uint64_t>(kDataAlignment / sector_size, 1);
+  const uint64_t data_start = hidden_sectors + reserved + 2 * fat_sectors;
+  reserved += (alignment - data_start % alignment) % alignment;
+
+  if (reserved + 2 * fat_sectors >= num_sectors) {
+    LOG_ERROR << "volume is too small for FAT32";
+    return false;
+  }
+  const uint64_t clusters =
+      (num_sectors - reserved - 2 * fat_sectors) / sectors_per_cluster;
+  if (clusters < kMinClusters || clusters > kMaxClusters) {
+    LOG_ERROR << "a FAT32 volume of " << num_sectors << " sectors would have "
+              << clusters << " clusters";
+    return false;
+  }
+  layout->sectors_per_cluster = static_cast<uint32_t>(sectors_per_cluster);
+  layout->reserved_sectors = static_cast<uint32_t>(reserved);
+  layout->fat_sectors = static_cast<uint32_t>(fat_sectors);
+  layout->clusters = static_cast<uint32_t>(clusters);
+  return true;
+}
+
+bool formatFat32(BlockDevice* device,
+                 const uint64_t first_sector,
+                 const uint64_t num_sectors,
+                 const Fat32Options& options) {
+  const uint64_t sector_size = device->sectorSize();
+  if (first_sector > device->size() / sector_size ||
+      num_sectors > device->size() / sector_size - first_sector) {
+    LOG_ERROR << "FAT32 volume doesn't fit on " << device->path();
+    return false;
+  }
+  Fat32Layout layout;
+  if (!layoutFat32(num_sectors, sector_size, options.hidden_sectors,
+                   &layout)) {
+    return false;
+  }
+  const uint32_t volume_id = options.volume_id
+                                 ? options.volume_id
+                                 : static_cast<uint32_t>(
+                                       getRandomNum(1, INT_MAX));
+  LOG_INFO << "formatting " << num_sectors << " sectors of "
+           << device->path() << " at " << first_sector << " as FAT32: "
+           << layout.clusters << " clusters of "
+           << layout.sectors_per_cluster * sector_size << " bytes";
+
+  // Reserved region, both FATs and the root directory's cluster
+  const uint64_t volume_offset = first_sector * sector_size;
+  const uint64_t fat_offset =
+      volume_offset + uint64_t(layout.reserved_sectors) * sector_size;
+  const uint64_t fat_bytes = uint64_t(layout.fat_sectors) * sector_size;
+  const uint64_t root_offset = fat_offset + 2 * fat_bytes;
+  const uint64_t metadata_bytes =
+      root_offset + layout.sectors_per_cluster * sector_size - volume_offset;
+  if (!eraseRange(device, volume_offset, metadata_bytes)) {
+    LOG_ERROR << "could not clear FAT32 metadata on " << device->path();
+    return false;
+  }
+
+  // Boot sector, FSInfo and their backups, in one write
+  const uint64_t boot_sectors = kBackupBootSector + 2;
+  AlignedBuffer boot(boot_sectors * sector_size, sector_size);
+  AlignedBuffer sector(sector_size, sector_size);
+  if (!boot.valid() || !sector.valid()) {
+    LOG_ERROR << "could not allocate FAT32 buffers";
+    return false;
+  }
+  memset(boot.data(), 0, boot.size());
+  uint8_t* primary = boot.data();
+  fillBootSector(primary, sector_size, num_sectors, layout, options,
+                 volume_id);
+  fillFsInfoSector(primary + kFsInfoSector * sector_size, layout);
+  memcpy(primary + kBackupBootSector * sector_size, primary,
+         2 * sector_size);
+  if (!device->write(volume_offset, boot.data(), boot.size())) {
+    return false;
+  }
+
+  // The first FAT entries hold the media type, the clean shutdown
+  // flags and the end of the root directory's chain
+  memset(sector.data(), 0, sector.size());
+  putLe32(sector.data(), 0x0fffff00 | kMediaFixed);
+  putLe32(sector.data() + 4, 0x0fffffff);
+  putLe32(sector.data() + 8, 0x0fffffff);
+  if (!device->write(fat_offset, sector.data(), sector.size()) ||
+      !device->write(fat_offset + fat_bytes, sector.data(), sector.size())) {
+    return false;
+  }
+
+  if (!options.label.empty()) {
+    memset(sector.data(), 0, sector.size());
+    memcpy(sector.data(), paddedLabel(options.label).data(), 11);
+    sector.data()[11] = 0x08;  // volume label attribute
+    if (!device->write(root_offset, sector.data(), sector.size())) {
+      return false;
+    }
+  }
+
+  if (!device->flush()) {
+    return false;
+  }
+  LOG_INFO << "FAT32 volume on " << device->path() << " is ready";
+  return true;
+}
+
+}  // namespace gondar
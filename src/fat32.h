@@ -0,0 +1,68 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_FAT32_H_
+#define SRC_FAT32_H_
+
+#include <cstdint>
+#include <string>
+
+namespace gondar {
+
+class BlockDevice;
+
+struct Fat32Options {
+  // Sectors before the volume on the disk, recorded in the boot sector
+  // for the BIOS. When formatting a partition through a handle to the
+  // whole disk this is normally the partition's first sector; through a
+  // handle to the partition itself it is where the partition starts.
+  uint64_t hidden_sectors = 0;
+  // Up to 11 characters; empty for none
+  std::string label;
+  // 0 picks one at random
+  uint32_t volume_id = 0;
+};
+
+// How a FAT32 volume of a given size is laid out, in sectors
+struct Fat32Layout {
+  uint32_t sectors_per_cluster = 0;
+  uint32_t reserved_sectors = 0;
+  uint32_t fat_sectors = 0;
+  uint32_t clusters = 0;
+};
+
+// Work out the layout of a FAT32 volume of |num_sectors| sectors of
+// |sector_size| bytes, with clusters sized by the same table Windows
+// uses and the data region aligned to 1 MiB on the disk. Returns false
+// if the volume is too small or too large for FAT32.
+bool layoutFat32(uint64_t num_sectors,
+                 uint64_t sector_size,
+                 uint64_t hidden_sectors,
+                 Fat32Layout* layout);
+
+// Write an empty FAT32 filesystem to the |num_sectors| sectors of
+// |device| starting at |first_sector|. Only the metadata is touched:
+// it is zeroed in one pass (by the device itself where it can), after
+// which the boot sectors and FSInfo go out in one write and each FAT
+// and the root directory need a sector each. Returns once everything
+// is flushed to the device; false on error.
+bool formatFat32(BlockDevice* device,
+                 uint64_t first_sector,
+                 uint64_t num_sectors,
+                 const Fat32Options& options = Fat32Options());
+
+}  // namespace gondar
+
+#endif  // SRC_FAT32_H_
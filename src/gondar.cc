@@ -41,11 +41,18 @@
 #include "msapi_utf8.h"
 
 // gondar-level includes
+#include "block_device_win.h"
+#include "cancel_token.h"
 #include "device.h"
+#include "erase.h"
 #include "gpt_pal.h"
+#include "inflate_index.h"
 #include "log.h"
 #include "mkfs.h"
+#include "neverware_unzipper.h"
 #include "shared.h"
+#include "write_engine.h"
+#include "write_journal.h"
 
 static ssize_t size_t_to_signed(const size_t value) {
   if (value <= SSIZE_MAX) {
@@ -100,19 +107,6 @@ static int dword_to_int(const DWORD value) {
     free((void*)p);  \
     p = NULL;        \
   } while (0)
-#define safe_mm_free(p) \
-  do {                  \
-    _mm_free((void*)p); \
-    p = NULL;           \
-  } while (0)
-
-#define DD_BUFFER_SIZE \
-  65536  // Minimum size of the buffer we use for DD operations
-
-#define WRITE_RETRIES 3
-
-#define FAC(f) (f << 16)
-
 #define safe_strnicmp(str1, str2, count)        \
   _strnicmp(((str1 == NULL) ? "<NULL>" : str1), \
             ((str2 == NULL) ? "<NULL>" : str2), count)
@@ -2163,115 +2157,20 @@ static uint64_t GetSectorSize(DWORD DriveIndex) {
 }
 
 // from format.c
+// The copy itself is done by the write engine, which overlaps reads of
+// the source with writes to the drive
 static bool WriteDrive(HANDLE hPhysicalDrive,
-                       HANDLE hSourceImage,
+                       gondar::ImageSource* source,
                        uint64_t sector_size,
                        uint64_t drive_size,
-                       int64_t image_size) {
-  bool s, ret = false;
-  LARGE_INTEGER li;
-  DWORD rSize, wSize, BufSize;
-  // ok; i found the logic for this in vhd.c.  we have the handles
-
-  // previous logic (rufus) also casted a signed int into an unsigned int here,
-  // just using LARGE_INTEGER union as a middleman
-  uint64_t projected_size = (uint64_t)image_size;
-
-  uint64_t wb, target_size = projected_size;
-  uint8_t* buffer = NULL;
-  int i;
-
-  // We poked the MBR and other stuff, so we need to rewind
-  li.QuadPart = 0;
-  // works when i return here
-  // return true;
-  if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-    printf(
-        "Warning: Unable to rewind image position - wrong data might be "
-        "copied!");
-
-  // the image won't be compressed
-  printf(hSourceImage ? "Writing Image..." : "Zeroing drive...");
-  // Our buffer size must be a multiple of the sector size and *ALIGNED* to the
-  // sector size
-  printf("sector size: %llu\n", sector_size);
-  if (sector_size < 512) {
-    sector_size = 512;
-  }
-  // return true;
-  BufSize = ((DD_BUFFER_SIZE + sector_size - 1) / sector_size) * sector_size;
-  buffer = (uint8_t*)_mm_malloc(BufSize, sector_size);
-  if (buffer == NULL) {
-    FormatStatus =
-        ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-    printf("Could not allocate disk write buffer");
-    goto out;
-  }
-  // Sanity check
-  if ((uintptr_t)buffer % sector_size != 0) {
-    FormatStatus =
-        ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
-    printf("Write buffer is not aligned");
-    goto out;
-  }
-  // Don't bother trying for something clever, using double buffering overlapped
-  // and whatnot:
-  // With Windows' default optimizations, sync read + sync write for sequential
-  // operations
-  // will be as fast, if not faster, than whatever async scheme you can come up
-  // with.
-  rSize = BufSize;
-  // i made this
-  for (wb = 0, wSize = 0; wb < drive_size; wb += wSize) {
-    if (hSourceImage != NULL) {
-      s = ReadFile(hSourceImage, buffer, BufSize, &rSize, NULL);
-      if (!s) {
-        FormatStatus =
-            ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
-        printf("read error:\n");
-        goto out;
-      }
-      if (rSize == 0)
-        break;
-    }
-    // Don't overflow our projected size (mostly for VHDs)
-    if (wb + rSize > target_size) {
-      rSize = (DWORD)(target_size - wb);
-    }
-
-    // WriteFile fails unless the size is a multiple of sector size
-    if (rSize % sector_size != 0)
-      rSize = ((rSize + sector_size - 1) / sector_size) * sector_size;
-    for (i = 0; i < WRITE_RETRIES; i++) {
-      s = WriteFile(hPhysicalDrive, buffer, rSize, &wSize, NULL);
-      if ((s) && (wSize == rSize))
-        break;
-      if (s)
-        printf("write error: Wrote %lu bytes, expected %lu bytes", wSize,
-               rSize);
-      else
-        printf("write error at sector %llu:\n", wb / sector_size);
-      if (i < WRITE_RETRIES - 1) {
-        li.QuadPart = wb;
-        printf("  RETRYING...\n");
-        if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-          printf("write error: could not reset position -");
-          goto out;
-        }
-      } else {
-        FormatStatus =
-            ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
-        goto out;
-      }
-      Sleep(200);
-    }
-    if (i >= WRITE_RETRIES)
-      goto out;
-  }
+                       int64_t image_size,
+                       const gondar::WriteOptions& options,
+                       gondar::WriteStats* stats) {
+  auto target = gondar::wrapDeviceHandle(hPhysicalDrive, "physical drive",
+                                         sector_size, drive_size);
+  bool ret =
+      gondar::writeImage(source, target.get(), image_size, options, stats);
   RefreshDriveLayout(hPhysicalDrive);
-  ret = true;
-out:
-  safe_mm_free(buffer);
   return ret;
 }
 
@@ -2293,29 +2192,79 @@ static bool formatShared(char* physical_path) {
   return true;
 }
 
+// After a cancelled write, make sure the half-written image isn't
+// mistaken for a bootable one. Call once the drive's handles are closed.
+static void clearCancelledWrite(uint64_t device_num,
+                                const gondar::WriteOptions& options) {
+  if (!options.cancel || !options.cancel->cancelled()) {
+    return;
+  }
+  LOG_INFO << "clearing partition tables after cancelled write";
+  char* physical_path = GetPhysicalName(device_num);
+  if (physical_path != NULL) {
+    formatShared(physical_path);
+  }
+  safe_free(physical_path);
+  // Nothing is left to resume
+  if (options.journal) {
+    options.journal->clear();
+  }
+}
+
 bool Install(DeviceGuy* target_device,
              const char* image_path,
-             int64_t image_size) {
+             int64_t image_size,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
+  HANDLE source_img =
+      CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (source_img == INVALID_HANDLE_VALUE) {
+    LOG_ERROR << "could not open " << image_path;
+    return false;
+  }
+  auto source = gondar::wrapImageHandle(source_img, image_size);
+  const bool ret =
+      Install(target_device, source.get(), image_size, options, stats);
+  source.reset();
+  safe_closehandle(source_img);
+  return ret;
+}
+
+bool Install(DeviceGuy* target_device,
+             gondar::ImageSource* source,
+             int64_t image_size,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
   uint64_t device_num = target_device->device_num;
   uint64_t sector_size = GetSectorSize(device_num);
   uint64_t drive_size = GetDriveSize(device_num);
   // FIXME: this is a leak
   char* physical_path = GetPhysicalName(device_num);
-  if (!formatShared(physical_path)) {
+  // Clearing the partition tables would undo what an interrupted write
+  // already did, so only skip it if the write is going to resume. That
+  // takes the same spot check the write does, done up front.
+  bool resuming = false;
+  if (options.journal) {
+    auto reader = gondar::openBlockDeviceForReading(physical_path);
+    resuming =
+        reader && gondar::canResume(source, reader.get(), image_size, options);
+    if (!resuming) {
+      // Starting over, so the write mustn't resume after all
+      options.journal->clear();
+    }
+  }
+  if (!resuming && !formatShared(physical_path)) {
     // pass up the failure
     return false;
   }
   HANDLE phys_handle = GetHandle(physical_path, true, true, false);
   // HANDLE phys_handle = GetHandle(physical_path, true, true, true);
   // ^ i have not noticed any difference in behavior whether we share or not
-  HANDLE source_img =
-      CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
-                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
   bool ret = false;
   // TODO(kendall): make sure the handlers don't equal INVALID_HANDLE_VALUE
   safe_free(physical_path);
-  if (phys_handle != INVALID_HANDLE_VALUE &&
-      source_img != INVALID_HANDLE_VALUE) {
+  if (phys_handle != INVALID_HANDLE_VALUE) {
     printf("Handles are valid\n");
   }
   HANDLE hLogicalVolume = GetLogicalHandle(device_num, true, false, false);
@@ -2328,21 +2277,134 @@ bool Install(DeviceGuy* target_device,
     printf("Physical handle invalid\n");
   }
 
-  ret =
-      WriteDrive(phys_handle, source_img, sector_size, drive_size, image_size);
+  ret = WriteDrive(phys_handle, source, sector_size, drive_size, image_size,
+                   options, stats);
 
   // close the handles we created so that Install() may be called again
   // within this same run
   safe_closehandle(phys_handle);
   safe_closehandle(hLogicalVolume);
-  safe_closehandle(source_img);
 
+  if (!ret) {
+    clearCancelledWrite(device_num, options);
+  }
+  return ret;
+}
+
+bool InstallZipEntry(DeviceGuy* target_device,
+                     const char* zip_path,
+                     const char* entry_name,
+                     const gondar::WriteOptions& options,
+                     gondar::WriteStats* stats) {
+  NeverwareUnzipOptions unzip_options;
+  unzip_options.index_path = gondar::inflateIndexPathFor(zip_path);
+  auto source = neverware_open_entry(QFileInfo(QString::fromUtf8(zip_path)),
+                                     QString::fromUtf8(entry_name),
+                                     unzip_options);
+  if (!source) {
+    return false;
+  }
+  return Install(target_device, source.get(), source->size(), options, stats);
+}
+
+bool InstallMany(DeviceGuyList* target_devices,
+                 const char* image_path,
+                 int64_t image_size,
+                 const gondar::WriteOptions& options,
+                 std::vector<gondar::TargetResult>* results) {
+  std::vector<gondar::TargetResult> local_results;
+  if (results == NULL) {
+    results = &local_results;
+  }
+  results->assign(target_devices->size(), gondar::TargetResult());
+
+  // Prepare every drive the way Install() does. A drive that can't be
+  // opened fails on its own; the rest are still written.
+  std::vector<HANDLE> phys_handles;
+  std::vector<HANDLE> logical_handles;
+  std::vector<std::unique_ptr<gondar::BlockDevice>> devices;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < target_devices->size(); i++) {
+    uint64_t device_num = (*target_devices)[i].device_num;
+    char* physical_path = GetPhysicalName(device_num);
+    if (physical_path == NULL || !formatShared(physical_path)) {
+      LOG_ERROR << "could not prepare " << (*target_devices)[i];
+      safe_free(physical_path);
+      continue;
+    }
+    HANDLE phys_handle = GetHandle(physical_path, true, true, false);
+    if (phys_handle == INVALID_HANDLE_VALUE) {
+      LOG_ERROR << "could not open " << physical_path;
+      safe_free(physical_path);
+      continue;
+    }
+    HANDLE hLogicalVolume = GetLogicalHandle(device_num, true, false, false);
+    UnmountVolume(hLogicalVolume);
+    devices.push_back(gondar::wrapDeviceHandle(
+        phys_handle, physical_path, GetSectorSize(device_num),
+        GetDriveSize(device_num)));
+    safe_free(physical_path);
+    phys_handles.push_back(phys_handle);
+    logical_handles.push_back(hLogicalVolume);
+    indices.push_back(i);
+  }
+
+  HANDLE source_img =
+      CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  bool ret = false;
+  if (source_img == INVALID_HANDLE_VALUE) {
+    LOG_ERROR << "could not open " << image_path;
+  } else if (!devices.empty()) {
+    auto source = gondar::wrapImageHandle(source_img, image_size);
+    std::vector<gondar::BlockDevice*> targets;
+    for (const auto& device : devices) {
+      targets.push_back(device.get());
+    }
+    std::vector<gondar::TargetResult> target_results;
+    ret = gondar::writeImageToMany(source.get(), targets, image_size, options,
+                                   &target_results);
+    for (size_t i = 0; i < indices.size(); i++) {
+      (*results)[indices[i]] = target_results[i];
+    }
+  }
+  ret = ret && indices.size() == target_devices->size();
+
+  devices.clear();
+  for (size_t i = 0; i < phys_handles.size(); i++) {
+    RefreshDriveLayout(phys_handles[i]);
+    safe_closehandle(phys_handles[i]);
+    safe_closehandle(logical_handles[i]);
+  }
+  safe_closehandle(source_img);
+  if (!ret) {
+    for (size_t index : indices) {
+      clearCancelledWrite((*target_devices)[index].device_num, options);
+    }
+  }
   return ret;
 }
 
+// Discard everything on the drive, so that flash that has been written
+// over and over is back to full speed. Best effort; most USB sticks
+// don't support it.
+static void discardDrive(uint64_t device_num, char* physical_path) {
+  HANDLE handle = GetHandle(physical_path, true, true, false);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  auto device = gondar::wrapDeviceHandle(handle, physical_path,
+                                         GetSectorSize(device_num),
+                                         GetDriveSize(device_num));
+  gondar::discardAll(device.get());
+  device.reset();
+  safe_closehandle(handle);
+}
+
 bool Format(DeviceGuy* target_device) {
   uint64_t device_num = target_device->device_num;
   char* physical_path = GetPhysicalName(device_num);
+  discardDrive(device_num, physical_path);
   bool ret = formatShared(physical_path);
   if (!ret) {
     // logging handled by formatShared already
@@ -2355,11 +2417,23 @@ bool Format(DeviceGuy* target_device) {
   }
   safe_free(physical_path);
   char* logical_path = GetLogicalName(device_num, false);
-  makeFilesystem(logical_path);
+  if (ret && !makeFilesystem(logical_path)) {
+    LOG_WARNING << "Error making fat32 filesystem";
+    ret = false;
+  }
+  safe_free(logical_path);
   return ret;
 }
 
-void CleanUp() {
-  deleteLibrary();
-  LOG_INFO << "Deleted formatting library";
+std::unique_ptr<gondar::BlockDevice> OpenDeviceForReading(
+    const DeviceGuy& device) {
+  char* physical_path = GetPhysicalName(device.device_num);
+  if (!physical_path) {
+    return nullptr;
+  }
+  auto block_device = gondar::openBlockDeviceForReading(physical_path);
+  safe_free(physical_path);
+  return block_device;
 }
+
+void CleanUp() {}
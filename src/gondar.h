@@ -16,16 +16,53 @@
 #ifndef SRC_GONDAR_H_
 #define SRC_GONDAR_H_
 
+#include <memory>
+#include <vector>
+
 #include "device.h"
 #include "shared.h"
+#include "write_engine.h"
 
 DeviceGuyList GetDeviceList();
 
-// Returns true on success
+// Returns true on success. |stats|, if given, says more about what
+// happened, including whether read-back verification failed.
 bool Install(DeviceGuy* target_device,
              const char* image_path,
-             int64_t image_size);
+             int64_t image_size,
+             const gondar::WriteOptions& options = gondar::WriteOptions(),
+             gondar::WriteStats* stats = nullptr);
+// The same, for an image that doesn't come from a file, such as one
+// still being downloaded. |image_size| may be larger than the image if
+// |options| says it is open-ended.
+bool Install(DeviceGuy* target_device,
+             gondar::ImageSource* source,
+             int64_t image_size,
+             const gondar::WriteOptions& options = gondar::WriteOptions(),
+             gondar::WriteStats* stats = nullptr);
+// The same, for the file |entry_name| of the zip |zip_path|, which is
+// inflated as it is written rather than extracted first
+bool InstallZipEntry(
+    DeviceGuy* target_device,
+    const char* zip_path,
+    const char* entry_name,
+    const gondar::WriteOptions& options = gondar::WriteOptions(),
+    gondar::WriteStats* stats = nullptr);
+// Write the image to every device in |target_devices| at once, reading
+// it only once (see gondar::writeImageToMany). Returns true if every
+// device succeeded. |results|, if given, gets one entry per device, in
+// the same order.
+bool InstallMany(DeviceGuyList* target_devices,
+                 const char* image_path,
+                 int64_t image_size,
+                 const gondar::WriteOptions& options = gondar::WriteOptions(),
+                 std::vector<gondar::TargetResult>* results = nullptr);
 bool Format(DeviceGuy* target_device);
+// Open |device| read-only, without locking it or taking it from anyone
+// else who has it open (see gondar::openBlockDeviceForReading). Returns
+// null on error.
+std::unique_ptr<gondar::BlockDevice> OpenDeviceForReading(
+    const DeviceGuy& device);
 bool IsCurrentProcessElevated();
 void CleanUp();
 
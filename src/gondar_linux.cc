@@ -0,0 +1,482 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Linux implementation of the gondar.h API. Devices are found through
+// sysfs and written with the portable write engine.
+
+#include "gondar.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSet>
+
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "block_device.h"
+#include "cancel_token.h"
+#include "erase.h"
+#include "fat32.h"
+#include "inflate_index.h"
+#include "log.h"
+#include "neverware_unzipper.h"
+#include "rand_util.h"
+#include "write_engine.h"
+#include "write_journal.h"
+
+namespace {
+
+// Block devices that can never be a USB stick
+const char* const kIgnoredDevicePrefixes[] = {"dm-", "loop", "md",  "nbd",
+                                              "ram", "sr",   "zram"};
+
+// Colon-separated list of extra targets (image files or loop devices)
+// to offer alongside real USB devices. Used for testing.
+const char kTestDevicesVariable[] = "GONDAR_TEST_DEVICES";
+
+// The FAT32 partition created by Format() starts 1MiB in, like the
+// one makeEmptyPartition() creates on Windows
+constexpr uint64_t kPartitionAlignment = 1024 * 1024;
+
+// Regions zeroed at both ends of the disk by Format(); big enough to
+// cover the MBR, the primary GPT and the backup GPT
+constexpr uint64_t kPartitionTableRegion = 1024 * 1024;
+
+// GetDeviceList() hands out device numbers, which are resolved back to
+// paths here. Numbers are never reused within a run, so a DeviceGuy
+// stays valid even if the device list changes underneath it.
+QMutex device_paths_mutex;
+std::vector<std::string> device_paths;
+
+uint32_t registerDevicePath(const std::string& path) {
+  QMutexLocker locker(&device_paths_mutex);
+  const auto iter = std::find(device_paths.begin(), device_paths.end(), path);
+  if (iter != device_paths.end()) {
+    return iter - device_paths.begin();
+  }
+  device_paths.push_back(path);
+  return device_paths.size() - 1;
+}
+
+std::string lookupDevicePath(const uint32_t device_num) {
+  QMutexLocker locker(&device_paths_mutex);
+  if (device_num >= device_paths.size()) {
+    return std::string();
+  }
+  return device_paths[device_num];
+}
+
+QString readSysfs(const QString& path) {
+  QFile file(path);
+  if (!file.open(QFile::ReadOnly)) {
+    return QString();
+  }
+  return QString::fromUtf8(file.readAll()).trimmed();
+}
+
+bool isIgnoredDevice(const QString& name) {
+  for (const char* prefix : kIgnoredDevicePrefixes) {
+    if (name.startsWith(prefix)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool isUsbOrRemovable(const QString& sysfs_dir) {
+  if (readSysfs(sysfs_dir + "/removable") == "1") {
+    return true;
+  }
+  // USB SSD enclosures and some card readers claim not to be removable,
+  // so also accept anything that hangs off a USB bus
+  return QFileInfo(sysfs_dir).canonicalFilePath().contains("/usb");
+}
+
+// The serial number lives on the USB device (or SCSI device, for other
+// buses) somewhere above the block device in sysfs
+QString findSerial(const QString& sysfs_dir) {
+  QDir dir(QFileInfo(sysfs_dir).canonicalFilePath());
+  while (dir.cdUp() && dir.path() != "/sys/devices") {
+    const QString serial = readSysfs(dir.filePath("serial"));
+    if (!serial.isEmpty()) {
+      return serial;
+    }
+  }
+  return QString();
+}
+
+void addTestDevices(DeviceGuyList* device_list) {
+  const QString paths = qgetenv(kTestDevicesVariable);
+  for (const auto& path : paths.split(':', QString::SkipEmptyParts)) {
+    auto device = gondar::openBlockDevice(path.toStdString());
+    if (!device) {
+      LOG_WARNING << "ignoring test device " << path;
+      continue;
+    }
+    device_list->emplace_back(registerDevicePath(device->path()),
+                              "test device (" + device->path() + ")",
+                              device->size());
+  }
+}
+
+// Mount sources in /proc/self/mounts escape whitespace as octal
+std::string unescapeMountField(const QByteArray& field) {
+  std::string result;
+  for (int i = 0; i < field.size(); i++) {
+    if (field[i] == '\\' && i + 3 < field.size()) {
+      result += static_cast<char>(field.mid(i + 1, 3).toInt(nullptr, 8));
+      i += 3;
+    } else {
+      result += field[i];
+    }
+  }
+  return result;
+}
+
+// Unmount every filesystem on |device_path| or one of its partitions.
+// Returns false if something is still mounted afterwards.
+bool unmountDevice(const std::string& device_path) {
+  const QString name =
+      QFileInfo(QString::fromStdString(device_path)).fileName();
+  const QString sysfs_dir = "/sys/block/" + name;
+  if (!QFileInfo(sysfs_dir).exists()) {
+    // Not a whole disk (e.g. an image file), nothing to unmount
+    return true;
+  }
+
+  QSet<QString> nodes{QString::fromStdString(device_path)};
+  for (const auto& entry : QDir(sysfs_dir).entryList(QDir::Dirs)) {
+    if (QFileInfo(sysfs_dir + "/" + entry + "/partition").exists()) {
+      nodes.insert("/dev/" + entry);
+    }
+  }
+
+  QFile mounts("/proc/self/mounts");
+  if (!mounts.open(QFile::ReadOnly)) {
+    LOG_ERROR << "could not read /proc/self/mounts";
+    return false;
+  }
+  bool success = true;
+  for (const auto& line : mounts.readAll().split('\n')) {
+    const auto fields = line.split(' ');
+    if (fields.size() < 2 || !nodes.contains(QString::fromUtf8(fields[0]))) {
+      continue;
+    }
+    const std::string target = unescapeMountField(fields[1]);
+    LOG_INFO << "unmounting " << fields[0].constData() << " from " << target;
+    if (umount2(target.c_str(), 0) != 0) {
+      LOG_ERROR << "umount " << target << " failed: " << strerror(errno);
+      success = false;
+    }
+  }
+  return success;
+}
+
+// Equivalent of RefreshDriveLayout on Windows: ask the kernel to pick
+// up the partition table we just wrote
+void rereadPartitionTable(const std::string& device_path) {
+  const int fd = open(device_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  if (ioctl(fd, BLKRRPART) != 0 && errno != ENOTTY) {
+    LOG_WARNING << "could not refresh partitions of " << device_path << ": "
+                << strerror(errno);
+  }
+  close(fd);
+}
+
+// Zero the partition tables at both ends of the device
+bool clearPartitionTables(gondar::BlockDevice* device) {
+  const uint64_t length = std::min(kPartitionTableRegion, device->size());
+  gondar::AlignedBuffer zeros(length, device->sectorSize());
+  if (!zeros.valid()) {
+    return false;
+  }
+  memset(zeros.data(), 0, length);
+  const uint64_t tail = (device->size() - length) / device->sectorSize() *
+                        device->sectorSize();
+  return device->write(0, zeros.data(), length) &&
+         device->write(tail, zeros.data(), length);
+}
+
+// After a cancelled write, make sure the half-written image isn't
+// mistaken for a bootable one
+void clearCancelledWrite(gondar::BlockDevice* device,
+                         const gondar::WriteOptions& options) {
+  if (!options.cancel || !options.cancel->cancelled()) {
+    return;
+  }
+  LOG_INFO << "clearing partition tables after cancelled write to "
+           << device->path();
+  if (!clearPartitionTables(device) || !device->flush()) {
+    LOG_WARNING << "could not clear partition tables of " << device->path();
+  }
+  // Nothing is left to resume
+  if (options.journal) {
+    options.journal->clear();
+  }
+}
+
+void putLe32(uint8_t* dst, const uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    dst[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+// Write an MBR holding a single FAT32 (LBA) partition that spans the
+// device from |first_lba| onwards
+bool writeFat32Mbr(gondar::BlockDevice* device,
+                   const uint64_t first_lba,
+                   const uint64_t num_sectors) {
+  gondar::AlignedBuffer mbr(device->sectorSize(), device->sectorSize());
+  if (!mbr.valid()) {
+    return false;
+  }
+  uint8_t* sector = mbr.data();
+  memset(sector, 0, mbr.size());
+  putLe32(sector + 440, gondar::getRandomNum(1, INT_MAX));  // disk signature
+
+  uint8_t* entry = sector + 446;
+  // CHS addresses are meaningless at this size; use the LBA marker
+  const uint8_t chs_max[] = {0xfe, 0xff, 0xff};
+  memcpy(entry + 1, chs_max, sizeof(chs_max));
+  entry[4] = 0x0c;  // FAT32 with LBA addressing
+  memcpy(entry + 5, chs_max, sizeof(chs_max));
+  putLe32(entry + 8, first_lba);
+  putLe32(entry + 12, std::min<uint64_t>(num_sectors, UINT32_MAX));
+
+  sector[510] = 0x55;
+  sector[511] = 0xaa;
+  return device->write(0, sector, mbr.size());
+}
+
+}  // namespace
+
+DeviceGuyList GetDeviceList() {
+  DeviceGuyList device_list;
+  const QDir sys_block("/sys/block");
+  const auto names = sys_block.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+  for (const auto& name : names) {
+    const QString sysfs_dir = sys_block.filePath(name);
+    if (isIgnoredDevice(name) || !isUsbOrRemovable(sysfs_dir)) {
+      continue;
+    }
+    // sysfs always counts in 512-byte units, whatever the sector size
+    const uint64_t num_bytes =
+        readSysfs(sysfs_dir + "/size").toULongLong() * 512;
+    if (num_bytes == 0) {
+      // e.g. a card reader with no card in it
+      continue;
+    }
+    QString label = (readSysfs(sysfs_dir + "/device/vendor") + " " +
+                     readSysfs(sysfs_dir + "/device/model"))
+                        .simplified();
+    if (label.isEmpty()) {
+      label = name;
+    }
+    const std::string path = "/dev/" + name.toStdString();
+    device_list.emplace_back(registerDevicePath(path),
+                             label.toStdString() + " (" + path + ")",
+                             num_bytes);
+    device_list.back().serial = findSerial(sysfs_dir).toStdString();
+  }
+  addTestDevices(&device_list);
+  return device_list;
+}
+
+bool Install(DeviceGuy* target_device,
+             const char* image_path,
+             int64_t image_size,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
+  auto source = gondar::openImageSource(image_path);
+  if (!source) {
+    return false;
+  }
+  return Install(target_device, source.get(), image_size, options, stats);
+}
+
+bool Install(DeviceGuy* target_device,
+             gondar::ImageSource* source,
+             int64_t image_size,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
+  const std::string device_path = lookupDevicePath(target_device->device_num);
+  if (device_path.empty()) {
+    LOG_ERROR << "unknown device " << *target_device;
+    return false;
+  }
+  if (!unmountDevice(device_path)) {
+    return false;
+  }
+
+  auto target = gondar::openBlockDevice(device_path);
+  if (!target) {
+    return false;
+  }
+
+  const bool ret =
+      gondar::writeImage(source, target.get(), image_size, options, stats);
+  if (!ret) {
+    clearCancelledWrite(target.get(), options);
+  }
+  // close before rereading, the kernel refuses while we hold O_EXCL
+  target.reset();
+  rereadPartitionTable(device_path);
+  return ret;
+}
+
+bool InstallZipEntry(DeviceGuy* target_device,
+                     const char* zip_path,
+                     const char* entry_name,
+                     const gondar::WriteOptions& options,
+                     gondar::WriteStats* stats) {
+  NeverwareUnzipOptions unzip_options;
+  unzip_options.index_path = gondar::inflateIndexPathFor(zip_path);
+  auto source = neverware_open_entry(QFileInfo(QString::fromUtf8(zip_path)),
+                                     QString::fromUtf8(entry_name),
+                                     unzip_options);
+  if (!source) {
+    return false;
+  }
+  return Install(target_device, source.get(), source->size(), options, stats);
+}
+
+bool InstallMany(DeviceGuyList* target_devices,
+                 const char* image_path,
+                 int64_t image_size,
+                 const gondar::WriteOptions& options,
+                 std::vector<gondar::TargetResult>* results) {
+  std::vector<gondar::TargetResult> local_results;
+  if (!results) {
+    results = &local_results;
+  }
+  results->assign(target_devices->size(), gondar::TargetResult());
+
+  // A device that can't be opened fails on its own; the rest are still
+  // written
+  std::vector<std::unique_ptr<gondar::BlockDevice>> devices;
+  std::vector<gondar::BlockDevice*> targets;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < target_devices->size(); i++) {
+    const DeviceGuy& device = (*target_devices)[i];
+    const std::string device_path = lookupDevicePath(device.device_num);
+    if (device_path.empty()) {
+      LOG_ERROR << "unknown device " << device;
+      continue;
+    }
+    if (!unmountDevice(device_path)) {
+      continue;
+    }
+    auto target = gondar::openBlockDevice(device_path);
+    if (!target) {
+      continue;
+    }
+    targets.push_back(target.get());
+    devices.push_back(std::move(target));
+    indices.push_back(i);
+  }
+  auto source = gondar::openImageSource(image_path);
+  if (!source || targets.empty()) {
+    return false;
+  }
+
+  std::vector<gondar::TargetResult> target_results;
+  const bool ret = gondar::writeImageToMany(source.get(), targets, image_size,
+                                            options, &target_results);
+  for (size_t i = 0; i < indices.size(); i++) {
+    (*results)[indices[i]] = target_results[i];
+  }
+  for (auto& device : devices) {
+    if (!ret) {
+      clearCancelledWrite(device.get(), options);
+    }
+    // close before rereading, the kernel refuses while we hold O_EXCL
+    const std::string device_path = device->path();
+    device.reset();
+    rereadPartitionTable(device_path);
+  }
+  return ret && indices.size() == target_devices->size();
+}
+
+bool Format(DeviceGuy* target_device) {
+  const std::string device_path = lookupDevicePath(target_device->device_num);
+  if (device_path.empty()) {
+    LOG_ERROR << "unknown device " << *target_device;
+    return false;
+  }
+  if (!unmountDevice(device_path)) {
+    return false;
+  }
+
+  auto device = gondar::openBlockDevice(device_path);
+  if (!device) {
+    return false;
+  }
+  // Whatever was on the stick is about to go anyway
+  gondar::discardAll(device.get());
+  const uint64_t sector_size = device->sectorSize();
+  const uint64_t first_lba = kPartitionAlignment / sector_size;
+  const uint64_t num_sectors = device->size() / sector_size - first_lba;
+  if (!clearPartitionTables(device.get()) ||
+      !writeFat32Mbr(device.get(), first_lba, num_sectors)) {
+    LOG_ERROR << "error writing partition table";
+    return false;
+  }
+  // Written through the whole device, which also works for image files
+  // that have no partition device nodes
+  gondar::Fat32Options fat32_options;
+  fat32_options.hidden_sectors = first_lba;
+  if (!gondar::formatFat32(device.get(), first_lba, num_sectors,
+                           fat32_options)) {
+    LOG_ERROR << "error making filesystem";
+    return false;
+  }
+  device.reset();
+  rereadPartitionTable(device_path);
+  return true;
+}
+
+std::unique_ptr<gondar::BlockDevice> OpenDeviceForReading(
+    const DeviceGuy& device) {
+  const std::string device_path = lookupDevicePath(device.device_num);
+  if (device_path.empty()) {
+    LOG_ERROR << "unknown device " << device;
+    return nullptr;
+  }
+  return gondar::openBlockDeviceForReading(device_path);
+}
+
+bool IsCurrentProcessElevated() {
+  // Raw block devices are only writable by root
+  return geteuid() == 0;
+}
+
+void CleanUp() {}
@@ -99,6 +99,8 @@ void GondarWizard::init() {
           &ChromeoverLoginPage::handleMeepoFinished);
   connect(&meepo_, &gondar::Meepo::failed, &p_->chromeoverLoginPage,
           &ChromeoverLoginPage::handleMeepoFailed);
+  connect(&writeOperationPage, &WriteOperationPage::writeStopped, this,
+          &GondarWizard::onWriteStopped);
 
   p_->feedbackDialog.setWizard(this);
 
@@ -114,8 +116,8 @@ GondarWizard::~GondarWizard() {}
 void GondarWizard::setNormalLayout() {
   QList<QWizard::WizardButton> button_layout;
   button_layout << QWizard::CustomButton2 << QWizard::CustomButton3
-                << QWizard::Stretch << QWizard::NextButton
-                << QWizard::FinishButton;
+                << QWizard::Stretch << QWizard::CancelButton
+                << QWizard::NextButton << QWizard::FinishButton;
   setButtonLayout(button_layout);
 }
 
@@ -151,6 +153,25 @@ void GondarWizard::handleCustomButton(int buttonIndex) {
   }
 }
 
+void GondarWizard::reject() {
+  LOG_INFO << "wizard closed, cancelling";
+  cancelToken.cancel();
+  downloadProgressPage.cancel();
+  if (writeOperationPage.cancel()) {
+    // closed by onWriteStopped() once the write has cleaned up
+    closing_ = true;
+    return;
+  }
+  QWizard::reject();
+}
+
+void GondarWizard::onWriteStopped() {
+  if (closing_) {
+    closing_ = false;
+    QWizard::reject();
+  }
+}
+
 int GondarWizard::nextId() const {
   if (p_->errorPage.errorEmpty()) {
     return QWizard::nextId();
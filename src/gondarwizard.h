@@ -22,6 +22,7 @@
 #include <memory>
 #include <vector>
 
+#include "cancel_token.h"
 #include "device_picker.h"
 #include "download_progress_page.h"
 #include "image_select_page.h"
@@ -48,6 +49,10 @@ class GondarWizard : public QWizard {
   void init();
 
   int nextId() const override;
+  // Cancel whatever download, extraction or write is running before
+  // closing. A write may take a moment to stop; the wizard closes once
+  // it has, without blocking in the meantime.
+  void reject() override;
   void postError(const QString& error);
   qint64 getRunTime();
   void setMakeAnotherLayout();
@@ -61,6 +66,8 @@ class GondarWizard : public QWizard {
   UsbInsertPage usbInsertPage;
   WriteOperationPage writeOperationPage;
   NewestImageUrl newestImageUrl;
+  // Cancelled when the wizard is closed early or the write is stopped
+  gondar::CancelToken cancelToken;
 
   gondar::Meepo meepo_;
 
@@ -91,6 +98,7 @@ class GondarWizard : public QWizard {
 
  private slots:
   void handleCustomButton(int buttonIndex);
+  void onWriteStopped();
 
  private:
   class Private;
@@ -105,6 +113,8 @@ class GondarWizard : public QWizard {
 
   QShortcut about_shortcut_;
   bool formatOnly;
+  // Set while waiting for a cancelled write to stop before closing
+  bool closing_ = false;
 };
 
 #endif  // SRC_GONDARWIZARD_H_
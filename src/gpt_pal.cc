@@ -15,77 +15,58 @@
 
 #include "gpt_pal.h"
 
-#include <inttypes.h>
 #include <windows.h>
+#include <winioctl.h>
 
-// We use gdisk to clean up the GPT such that Windows is happy writing to
-// the disk
-#include "../gdisk/gpt.h"
-#include "../gdisk/parttypes.h"
+#include "block_device.h"
+#include "log.h"
+#include "msapi_utf8.h"
+#include "partition_table.h"
 
-class PalData : public GPTData {
- public:
-  PalData();
-  WhichToUse UseWhichPartitions(void) override;
-  void ClearDisk();
-};
+namespace {
 
-PalData::PalData() : GPTData() {}
+// Replace the partition tables of the disk at |physical_path| (see
+// gondar::wipePartitionTables) and have Windows pick up the change
+bool rewritePartitionTables(const char* physical_path,
+                            const bool data_partition) {
+  auto device = gondar::openBlockDevice(physical_path);
+  if (!device) {
+    return false;
+  }
+  gondar::GptLayout::Partition partition;
+  if (!gondar::wipePartitionTables(device.get(),
+                                   data_partition ? &partition : nullptr)) {
+    LOG_ERROR << "could not write partition tables to " << physical_path;
+    return false;
+  }
+  device.reset();
 
-WhichToUse PalData::UseWhichPartitions(void) {
-  // The disk may be in a weird state, but we are about to reformat it.
-  // Just always use a new partition table.
-  return use_new;
+  HANDLE handle = CreateFileU(physical_path, GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, 0, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    LOG_WARNING << "could not reopen " << physical_path << ": "
+                << GetLastError();
+    return true;
+  }
+  DWORD size = 0;
+  if (!DeviceIoControl(handle, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0,
+                       &size, NULL)) {
+    LOG_WARNING << "could not refresh drive layout of " << physical_path
+                << ": " << GetLastError();
+  }
+  CloseHandle(handle);
+  return true;
 }
 
-void PalData::ClearDisk() {
-  int newPartNum = 0;
-  uint64_t low = FindFirstInLargest();
-  Align(&low);
-  uint64_t high = FindLastInFree(low);
-  uint64_t startSector = low;
-  uint64_t endSector = high;
-  CreatePartition(newPartNum, startSector, endSector);
-  partitions[0].SetFirstLBA(startSector);
-  partitions[0].SetLastLBA(endSector);
-  partitions[0].SetType(0x0b00);  // make it fat32
-  partitions[0].RandomizeUniqueGUID();
-  DisplayGPTData();
-  // arg is 'quiet'
-  SaveGPTData(true);
-}
+}  // namespace
 
 // shared logic between writing cloudready usb and formatting disk
 bool clearMbrGpt(const char* physical_path) {
-  std::string physical_path_str(physical_path);
-  PalData gptdata;
-  // set the physical path for this GPT object to act on
-  gptdata.LoadPartitions(std::string(physical_path));
-  gptdata.WriteProtectiveMBR();
-  gptdata.ClearGPTData();
-
-  int quiet = true;
-  // attempt to fix any gpt/mbr problems by setting to a sane, empty state
-  gptdata.SaveGPTData(quiet);
-  int problems = gptdata.Verify();
-  if (problems > 0) {
-    return false;
-  } else {
-    return true;
-  }
+  return rewritePartitionTables(physical_path, false);
 }
 
 // make a new partition using the whole disk, but do not format yet
 bool makeEmptyPartition(const char* physical_path) {
-  PalData gptdata;
-  gptdata.LoadPartitions(std::string(physical_path));
-  // make an unformatted partition with label for fat32
-  gptdata.ClearDisk();
-  int problems = gptdata.Verify();
-  // logging handled by caller
-  if (problems > 0) {
-    return false;
-  } else {
-    return true;
-  }
+  return rewritePartitionTables(physical_path, true);
 }
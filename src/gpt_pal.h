@@ -16,11 +16,10 @@
 #ifndef SRC_GPT_PAL_H_
 #define SRC_GPT_PAL_H_
 
-// We use gdisk to clean up the GPT such that Windows is happy writing to
-// the disk
-
-// This function is kept in a separate file to avoid an issue with pragmas
-// within gdisk affecting rufus-based functionality (getting disk extents)
+// Reset the disk to a protective MBR and a GPT such that Windows is
+// happy writing to it, either empty or with a single unformatted data
+// partition. Each is one pass over the partition tables; see
+// gondar::wipePartitionTables.
 bool clearMbrGpt(const char* physical_path);
 bool makeEmptyPartition(const char* physical_path);
 
@@ -0,0 +1,279 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "inflate_index.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// Start of every index file, so that a format change can't be misread
+const char kIndexMagic[] = "gondar-inflate-index 1\n";
+
+// As far back as deflate can refer
+constexpr size_t kWindowSize = 32 * 1024;
+
+void putLe(QByteArray* data, const uint64_t value, const int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    data->append(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+void putString(QByteArray* data, const std::string& value) {
+  putLe(data, value.size(), 4);
+  data->append(value.data(), static_cast<int>(value.size()));
+}
+
+// Reads the fields putLe() and putString() write, failing (for good)
+// rather than running off the end
+class Reader {
+ public:
+  Reader(const QByteArray& data, const int position)
+      : data_(data), position_(position) {}
+
+  bool ok() const { return ok_; }
+
+  uint64_t le(const int bytes) {
+    if (!have(bytes)) {
+      return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+      value |= uint64_t(static_cast<uint8_t>(data_[position_ + i]))
+               << (8 * i);
+    }
+    position_ += bytes;
+    return value;
+  }
+
+  std::string string() {
+    const uint64_t length = le(4);
+    if (!have(length)) {
+      return std::string();
+    }
+    std::string value(data_.constData() + position_, length);
+    position_ += length;
+    return value;
+  }
+
+  std::vector<uint8_t> bytes() {
+    const uint64_t length = le(4);
+    if (!have(length)) {
+      return std::vector<uint8_t>();
+    }
+    const auto begin =
+        reinterpret_cast<const uint8_t*>(data_.constData()) + position_;
+    position_ += length;
+    return std::vector<uint8_t>(begin, begin + length);
+  }
+
+ private:
+  bool have(const uint64_t length) {
+    ok_ = ok_ && length <= uint64_t(data_.size() - position_);
+    return ok_;
+  }
+
+  const QByteArray& data_;
+  int position_;
+  bool ok_ = true;
+};
+
+}  // namespace
+
+uint64_t InflateIndex::spanEnd(const size_t span) const {
+  return span + 1 < checkpoints.size() ? checkpoints[span + 1].output_offset
+                                       : size;
+}
+
+size_t InflateIndex::spanAt(const uint64_t offset) const {
+  const auto after = std::upper_bound(
+      checkpoints.begin(), checkpoints.end(), offset,
+      [](const uint64_t value, const InflateCheckpoint& checkpoint) {
+        return value < checkpoint.output_offset;
+      });
+  return after == checkpoints.begin() ? 0 : after - checkpoints.begin() - 1;
+}
+
+InflateIndexBuilder::InflateIndexBuilder(const uint64_t spacing)
+    : spacing_(spacing), checkpoints_(1) {
+  window_.reserve(kWindowSize);
+}
+
+void InflateIndexBuilder::addOutput(const uint8_t* data, size_t length) {
+  output_offset_ += length;
+  span_crc_ = static_cast<uint32_t>(
+      crc32(span_crc_, data, static_cast<uInt>(length)));
+  if (length >= kWindowSize) {
+    window_.assign(data + length - kWindowSize, data + length);
+    window_start_ = 0;
+    return;
+  }
+  while (length > 0 && window_.size() < kWindowSize) {
+    const size_t step = std::min(length, kWindowSize - window_.size());
+    window_.insert(window_.end(), data, data + step);
+    data += step;
+    length -= step;
+  }
+  while (length > 0) {
+    const size_t step = std::min(length, kWindowSize - window_start_);
+    std::copy(data, data + step, window_.begin() + window_start_);
+    window_start_ = (window_start_ + step) % kWindowSize;
+    data += step;
+    length -= step;
+  }
+}
+
+void InflateIndexBuilder::addBoundary(const uint64_t input_offset,
+                                      const int bits) {
+  if (output_offset_ - checkpoints_.back().output_offset < spacing_) {
+    return;
+  }
+  checkpoints_.back().crc = span_crc_;
+  span_crc_ = 0;
+  InflateCheckpoint checkpoint;
+  checkpoint.output_offset = output_offset_;
+  checkpoint.input_offset = input_offset;
+  checkpoint.bits = bits;
+  checkpoint.window.reserve(window_.size());
+  checkpoint.window.insert(checkpoint.window.end(),
+                           window_.begin() + window_start_, window_.end());
+  checkpoint.window.insert(checkpoint.window.end(), window_.begin(),
+                           window_.begin() + window_start_);
+  checkpoints_.push_back(std::move(checkpoint));
+}
+
+std::vector<InflateCheckpoint> InflateIndexBuilder::finish() {
+  checkpoints_.back().crc = span_crc_;
+  return std::move(checkpoints_);
+}
+
+bool saveInflateIndex(const InflateIndex& index, const std::string& path) {
+  QByteArray contents(kIndexMagic);
+  putString(&contents, index.zip_id);
+  putString(&contents, index.entry_name);
+  putLe(&contents, index.data_offset, 8);
+  putLe(&contents, index.compressed_size, 8);
+  putLe(&contents, index.size, 8);
+  putLe(&contents, index.crc, 4);
+  putLe(&contents, index.checkpoints.size(), 4);
+  for (const auto& checkpoint : index.checkpoints) {
+    putLe(&contents, checkpoint.output_offset, 8);
+    putLe(&contents, checkpoint.input_offset, 8);
+    putLe(&contents, checkpoint.bits, 1);
+    putLe(&contents, checkpoint.crc, 4);
+    putLe(&contents, checkpoint.window.size(), 4);
+    contents.append(reinterpret_cast<const char*>(checkpoint.window.data()),
+                    static_cast<int>(checkpoint.window.size()));
+  }
+  QSaveFile file(QString::fromStdString(path));
+  if (!file.open(QFile::WriteOnly)) {
+    LOG_WARNING << "could not create " << path << ": " << file.errorString();
+    return false;
+  }
+  file.write(contents);
+  if (!file.commit()) {
+    LOG_WARNING << "could not write " << path << ": " << file.errorString();
+    return false;
+  }
+  LOG_INFO << "saved inflate index " << path << ": "
+           << index.checkpoints.size() << " checkpoints";
+  return true;
+}
+
+bool loadInflateIndex(const std::string& path, InflateIndex* index) {
+  QFile file(QString::fromStdString(path));
+  if (!file.open(QFile::ReadOnly)) {
+    return false;
+  }
+  const QByteArray contents = file.readAll();
+  if (!contents.startsWith(kIndexMagic)) {
+    LOG_WARNING << "ignoring unreadable inflate index " << path;
+    return false;
+  }
+  Reader reader(contents, sizeof(kIndexMagic) - 1);
+  InflateIndex loaded;
+  loaded.zip_id = reader.string();
+  loaded.entry_name = reader.string();
+  loaded.data_offset = reader.le(8);
+  loaded.compressed_size = reader.le(8);
+  loaded.size = reader.le(8);
+  loaded.crc = static_cast<uint32_t>(reader.le(4));
+  const uint64_t count = reader.le(4);
+  for (uint64_t i = 0; i < count && reader.ok(); i++) {
+    InflateCheckpoint checkpoint;
+    checkpoint.output_offset = reader.le(8);
+    checkpoint.input_offset = reader.le(8);
+    checkpoint.bits = static_cast<int>(reader.le(1));
+    checkpoint.crc = static_cast<uint32_t>(reader.le(4));
+    checkpoint.window = reader.bytes();
+    loaded.checkpoints.push_back(std::move(checkpoint));
+  }
+  // Checkpoints have to start the stream and go forward through it
+  bool ordered = reader.ok() && !loaded.checkpoints.empty() &&
+                 loaded.checkpoints[0].output_offset == 0 &&
+                 loaded.checkpoints[0].input_offset == 0;
+  for (size_t i = 0; ordered && i < loaded.checkpoints.size(); i++) {
+    const auto& checkpoint = loaded.checkpoints[i];
+    ordered = checkpoint.bits < 8 &&
+              (checkpoint.bits == 0 || checkpoint.input_offset > 0) &&
+              checkpoint.window.size() <= kWindowSize &&
+              checkpoint.output_offset <= loaded.size &&
+              checkpoint.input_offset <= loaded.compressed_size &&
+              (i == 0 || checkpoint.output_offset >
+                             loaded.checkpoints[i - 1].output_offset);
+  }
+  if (!ordered) {
+    LOG_WARNING << "ignoring damaged inflate index " << path;
+    return false;
+  }
+  *index = std::move(loaded);
+  return true;
+}
+
+std::string inflateIndexPathFor(const std::string& zip_path) {
+  const QDir dir =
+      QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+  const QString subdir = dir.filePath(QStringLiteral("neverware"));
+  if (!QDir().mkpath(subdir)) {
+    LOG_WARNING << "could not create " << subdir;
+    return std::string();
+  }
+  const QString absolute =
+      QFileInfo(QString::fromStdString(zip_path)).absoluteFilePath();
+  const std::string name =
+      QCryptographicHash::hash(absolute.toUtf8(), QCryptographicHash::Sha256)
+          .toHex()
+          .toStdString()
+          .substr(0, 16);
+  return QDir(subdir)
+      .filePath(QString::fromStdString(name + ".index"))
+      .toStdString();
+}
+
+}  // namespace gondar
@@ -0,0 +1,106 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_INFLATE_INDEX_H_
+#define SRC_INFLATE_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gondar {
+
+// A place a deflate stream can be picked up from without inflating
+// everything before it: a block boundary, and the 32 KiB of output
+// before it that later blocks may refer back to
+struct InflateCheckpoint {
+  // Uncompressed bytes before the boundary
+  uint64_t output_offset = 0;
+  // Compressed bytes before the first byte that is wholly in the next
+  // block, from the start of the stream
+  uint64_t input_offset = 0;
+  // Bits of the byte before |input_offset| that belong to the next
+  // block (the top ones)
+  int bits = 0;
+  // CRC-32 of the output from here to the next checkpoint (or the end)
+  uint32_t crc = 0;
+  std::vector<uint8_t> window;
+};
+
+// Checkpoints spread through one zip entry's deflate stream, so that
+// the spans between them can be inflated independently, and on
+// different threads. An index is built by inflating the whole entry
+// once and only fits that entry of that zip.
+struct InflateIndex {
+  // Fingerprint of the zip (see imageFingerprint) and the entry's name
+  std::string zip_id;
+  std::string entry_name;
+  // Where the stream starts in the zip, and its size
+  uint64_t data_offset = 0;
+  uint64_t compressed_size = 0;
+  // Uncompressed size, and CRC-32 as the zip gives it
+  uint64_t size = 0;
+  uint32_t crc = 0;
+  // In order; the first is at the start of the stream
+  std::vector<InflateCheckpoint> checkpoints;
+
+  // Uncompressed offset the span starting at checkpoint |span| ends at
+  uint64_t spanEnd(size_t span) const;
+  // Span holding the uncompressed offset |offset|
+  size_t spanAt(uint64_t offset) const;
+};
+
+// Collects checkpoints while a stream is inflated from the start with
+// Inflater::inflateToBlock(): tell it about everything inflated and
+// every block boundary found, in order.
+class InflateIndexBuilder {
+ public:
+  // Checkpoints are taken at the first boundary after each |spacing|
+  // bytes of output
+  explicit InflateIndexBuilder(uint64_t spacing);
+
+  void addOutput(const uint8_t* data, size_t length);
+  void addBoundary(uint64_t input_offset, int bits);
+
+  // The checkpoints, once the whole stream has been inflated
+  std::vector<InflateCheckpoint> finish();
+
+ private:
+  const uint64_t spacing_;
+  std::vector<InflateCheckpoint> checkpoints_;
+  uint64_t output_offset_ = 0;
+  uint32_t span_crc_ = 0;
+  // The last 32 KiB of output, as a ring starting at |window_start_|
+  std::vector<uint8_t> window_;
+  size_t window_start_ = 0;
+};
+
+// Save |index| to |path|, replacing whatever was there. Returns false
+// on error.
+bool saveInflateIndex(const InflateIndex& index, const std::string& path);
+
+// Load the index at |path| into |index|. Returns false if there is
+// none or it can't be read; it is up to the caller to check that it is
+// for the right entry.
+bool loadInflateIndex(const std::string& path, InflateIndex* index);
+
+// Where to keep the index for the zip at |zip_path|, in the app's
+// data directory. Returns an empty string if that isn't available.
+std::string inflateIndexPathFor(const std::string& zip_path);
+
+}  // namespace gondar
+
+#endif  // SRC_INFLATE_INDEX_H_
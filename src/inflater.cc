@@ -0,0 +1,92 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "inflater.h"
+
+#include <zlib.h>
+
+#include <utility>
+
+#include "log.h"
+#include "zlib_style_inflater.h"
+
+namespace gondar {
+
+namespace {
+
+struct ZlibApi {
+  static int init(z_stream* stream, const int window_bits) {
+    return inflateInit2(stream, window_bits);
+  }
+  static int reset(z_stream* stream) { return inflateReset(stream); }
+  static int inflate(z_stream* stream, const int flush) {
+    return ::inflate(stream, flush);
+  }
+  static int end(z_stream* stream) { return inflateEnd(stream); }
+  static int prime(z_stream* stream, const int bits, const int value) {
+    return inflatePrime(stream, bits, value);
+  }
+  static int setDictionary(z_stream* stream,
+                           const uint8_t* window,
+                           const uint32_t length) {
+    return inflateSetDictionary(stream, window, length);
+  }
+  static uint32_t crc32(const uint32_t crc,
+                        const uint8_t* data,
+                        const uint32_t length) {
+    return static_cast<uint32_t>(::crc32(crc, data, length));
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<Inflater> createZlibInflater() {
+  return createZlibStyleInflater<z_stream, ZlibApi>("zlib");
+}
+
+#ifndef GONDAR_HAVE_ZLIB_NG
+
+// See inflater_zlib_ng.cc, which is only built if zlib-ng was found
+std::unique_ptr<Inflater> createZlibNgInflater() {
+  return nullptr;
+}
+
+#endif  // GONDAR_HAVE_ZLIB_NG
+
+std::unique_ptr<Inflater> createInflater(const std::string& name) {
+  if (name.empty()) {
+    auto inflater = createZlibNgInflater();
+    return inflater ? std::move(inflater) : createZlibInflater();
+  }
+  if (name == "zlib-ng") {
+    return createZlibNgInflater();
+  }
+  if (name == "zlib") {
+    return createZlibInflater();
+  }
+  LOG_ERROR << "no inflate backend called " << name;
+  return nullptr;
+}
+
+std::vector<std::string> inflaterBackends() {
+  std::vector<std::string> names;
+#ifdef GONDAR_HAVE_ZLIB_NG
+  names.push_back("zlib-ng");
+#endif
+  names.push_back("zlib");
+  return names;
+}
+
+}  // namespace gondar
@@ -0,0 +1,94 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_INFLATER_H_
+#define SRC_INFLATER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace gondar {
+
+// Inflates a raw deflate stream (as zip entries hold them, with no
+// zlib or gzip wrapper) a piece at a time, so that entries far larger
+// than memory can be extracted. Backends differ only in speed.
+class Inflater {
+ public:
+  enum class Status { kOk, kEnd, kError };
+
+  virtual ~Inflater() = default;
+
+  virtual const char* name() const = 0;
+
+  // Forget the current stream and get ready for a new one
+  virtual bool reset() = 0;
+
+  // Inflate as much of |*input_left| bytes at |*input| as fits in
+  // |*output_left| bytes at |*output|, advancing all four past what
+  // was used. Returns kEnd once the end of the stream has been
+  // inflated and kError if the stream is corrupt.
+  virtual Status inflate(const uint8_t** input,
+                         size_t* input_left,
+                         uint8_t** output,
+                         size_t* output_left) = 0;
+
+  // Like inflate(), but also stops at the end of every deflate block
+  // (still returning kOk), for recording where a stream can later be
+  // picked up from. |*boundary_bits| is set to the number of bits of
+  // the last byte used that belong to the next block if it stopped at
+  // a block boundary other than the end of the stream, else -1.
+  virtual Status inflateToBlock(const uint8_t** input,
+                                size_t* input_left,
+                                uint8_t** output,
+                                size_t* output_left,
+                                int* boundary_bits) = 0;
+
+  // Start over at a block boundary part way through a stream. The
+  // first |bits| bits of the block are the top bits of |byte|, and the
+  // rest follow in the input. |window| holds the last |window_size|
+  // bytes inflated before the boundary (up to 32 KiB, which is as far
+  // back as deflate looks).
+  virtual bool resume(int bits,
+                      uint8_t byte,
+                      const uint8_t* window,
+                      size_t window_size) = 0;
+
+  // CRC-32 of |length| bytes at |data| following on from |crc|, for
+  // checking what was inflated against the zip's directory
+  virtual uint32_t crc32(uint32_t crc,
+                         const uint8_t* data,
+                         size_t length) const = 0;
+};
+
+// Stock zlib, which is always available
+std::unique_ptr<Inflater> createZlibInflater();
+
+// zlib-ng, whose inflate and CRC-32 are vectorized on x86 and ARM.
+// Returns null if the build didn't find it.
+std::unique_ptr<Inflater> createZlibNgInflater();
+
+// The backend called |name|, or the fastest available one if |name| is
+// empty. Returns null if there is no such backend in this build.
+std::unique_ptr<Inflater> createInflater(const std::string& name = "");
+
+// Names of the backends in this build, fastest first
+std::vector<std::string> inflaterBackends();
+
+}  // namespace gondar
+
+#endif  // SRC_INFLATER_H_
@@ -0,0 +1,59 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// zlib-ng through its native API (zng_ prefixes), so that it can be
+// linked next to the stock zlib minizip uses. Only built when CMake
+// finds it, which also defines GONDAR_HAVE_ZLIB_NG.
+
+#include <zlib-ng.h>
+
+#include "inflater.h"
+#include "zlib_style_inflater.h"
+
+namespace gondar {
+
+namespace {
+
+struct ZlibNgApi {
+  static int init(zng_stream* stream, const int window_bits) {
+    return zng_inflateInit2(stream, window_bits);
+  }
+  static int reset(zng_stream* stream) { return zng_inflateReset(stream); }
+  static int inflate(zng_stream* stream, const int flush) {
+    return zng_inflate(stream, flush);
+  }
+  static int end(zng_stream* stream) { return zng_inflateEnd(stream); }
+  static int prime(zng_stream* stream, const int bits, const int value) {
+    return zng_inflatePrime(stream, bits, value);
+  }
+  static int setDictionary(zng_stream* stream,
+                           const uint8_t* window,
+                           const uint32_t length) {
+    return zng_inflateSetDictionary(stream, window, length);
+  }
+  static uint32_t crc32(const uint32_t crc,
+                        const uint8_t* data,
+                        const uint32_t length) {
+    return zng_crc32(crc, data, length);
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<Inflater> createZlibNgInflater() {
+  return createZlibStyleInflater<zng_stream, ZlibNgApi>("zlib-ng");
+}
+
+}  // namespace gondar
@@ -16,7 +16,8 @@
 #ifndef SRC_MKFS_H_
 #define SRC_MKFS_H_
 
-void makeFilesystem(char* logical_path);
-void deleteLibrary();
+// Make an empty FAT32 filesystem on the volume at |logical_path| (see
+// gondar::formatFat32). Returns true once it is on the device.
+bool makeFilesystem(const char* logical_path);
 
 #endif  // SRC_MKFS_H_
@@ -16,7 +16,14 @@
 #include "neverware_unzipper.h"
 
 #include <QDir>
+#include <QFile>
+#include <QThread>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include "unzip.h"
 
@@ -25,40 +32,40 @@
 #include "iowin32.h"
 #endif
 
+#include "block_device.h"
+#include "cancel_token.h"
+#include "inflate_index.h"
+#include "inflater.h"
 #include "log.h"
-
-// Defined in minizip/miniunz.c
-extern "C" {
-int miniunz_extract_currentfile(unzFile uf,
-                                int opt_extract_without_path,
-                                int* popt_overwrite,
-                                const char* password);
-}
+#include "parallel_inflater.h"
+#include "write_journal.h"
 
 namespace {
 
-// RAII class for changing the current working directory. When it goes
-// out of scope the working directory is reset.
-class ScopedWorkingDirectory {
- public:
-  ScopedWorkingDirectory() : orig_dir_(QDir::current()) {}
+// How much is inflated between checks for cancellation
+constexpr int kExtractChunkSize = 1024 * 1024;
 
-  ~ScopedWorkingDirectory() { setCwd(orig_dir_); }
+// How much compressed data is read from the zip at a time
+constexpr unsigned kCompressedChunkSize = 256 * 1024;
 
-  static void setCwd(const QDir& dir) {
-    const QString path = dir.absolutePath();
-    if (QDir::setCurrent(path)) {
-      LOG_INFO << "set current working directory to " << path;
-    } else {
-      LOG_ERROR << "failed to set current working directory to " << path;
-    }
-  }
+// Output between checkpoints in an inflate index. Each thread inflates
+// a span of this size at a time, and each checkpoint costs 32 KiB of
+// index, so this comes to 4 MiB of index per GiB of image.
+constexpr uint64_t kIndexSpacing = 8 * 1024 * 1024;
 
- private:
-  const QDir orig_dir_;
-};
+// Threads to inflate with by default. Beyond this the drive is always
+// slower, and every thread holds a couple of spans.
+constexpr int kMaxDefaultThreads = 8;
+
+int inflateThreads(const NeverwareUnzipOptions& options) {
+  if (options.threads > 0) {
+    return options.threads;
+  }
+  return std::max(1, std::min(QThread::idealThreadCount(),
+                              kMaxDefaultThreads));
+}
 
-class ZipError : std::runtime_error {
+class ZipError : public std::runtime_error {
  public:
   explicit ZipError(const std::string& what) : std::runtime_error(what) {}
 };
@@ -70,8 +77,12 @@ class ZipFile {
  public:
   // Open a file for unzipping. Throw a ZipError if the open fails, so
   // the object is never partially constructed.
-  explicit ZipFile(const QFileInfo& zipfile_info)
-      : zipfile_info_(zipfile_info), file_(open(zipfile_info)) {}
+  explicit ZipFile(
+      const QFileInfo& zipfile_info,
+      const NeverwareUnzipOptions& options = NeverwareUnzipOptions())
+      : zipfile_info_(zipfile_info),
+        options_(options),
+        file_(open(zipfile_info)) {}
 
   ~ZipFile() {
     const auto rc = unzClose(file_);
@@ -80,28 +91,144 @@ class ZipFile {
     }
   }
 
-  // Extract the first file in the zip in the same directory as the
-  // zipfile. Throw a ZipError if anything goes wrong.
-  QFileInfo extractFirstFile() {
-    const QString firstFileName = goToFirstFile();
+  // Move to the file named |name| and describe it. Throw a ZipError if
+  // there is no such file.
+  NeverwareZipEntry goToFile(const QString& name) {
+    const std::string wanted = name.toStdString();
+    for (auto rc = unzGoToFirstFile(file_); rc == UNZ_OK;
+         rc = unzGoToNextFile(file_)) {
+      unz_file_info64 file_info = {};
+      if (currentFileName(&file_info) == wanted) {
+        return currentEntry(name, file_info);
+      }
+    }
+    LOG_ERROR << "no " << wanted << " in " << zipfile_info_.filePath();
+    throw ZipError("missing " + wanted);
+  }
 
-    const int opt_extract_without_path = 1;
-    int opt_overwrite = 1;
-    const char* password = nullptr;
+  // Move to the first file in the zip and describe it. Throw a ZipError
+  // if anything goes wrong.
+  NeverwareZipEntry firstEntry() {
+    unz_file_info64 file_info = {};
+    const QString name = goToFirstFile(&file_info);
+    return currentEntry(name, file_info);
+  }
 
-    {
-      ScopedWorkingDirectory scoped_wd;
-      scoped_wd.setCwd(zipfile_info_.absolutePath());
+  // Start reading the current file; the entry's own CRC is checked by
+  // closeCurrentFile() once all of it has been read. Deflated files
+  // are read raw from minizip and inflated by our own backend, which
+  // builds an inflate index on the way if there is somewhere to keep
+  // it; anything else is left to minizip.
+  bool openCurrentFile() {
+    unz_file_info64 file_info = {};
+    const std::string name = currentFileName(&file_info);
+    if (name.empty()) {
+      return false;
+    }
+    raw_ = isDeflated(file_info);
+    if (raw_ && !startInflate(file_info)) {
+      return false;
+    }
+    const auto rc = unzOpenCurrentFile2(file_, nullptr, nullptr, raw_);
+    if (rc != UNZ_OK) {
+      LOG_ERROR << "unzOpenCurrentFile2 failed: " << rc;
+      return false;
+    }
+    index_builder_.reset();
+    if (raw_ && !options_.index_path.empty()) {
+      index_builder_.reset(new gondar::InflateIndexBuilder(kIndexSpacing));
+      index_.entry_name = name;
+      index_.data_offset = unzGetCurrentFileZStreamPos64(file_);
+      index_.compressed_size = file_info.compressed_size;
+      index_.size = expected_size_;
+      index_.crc = expected_crc_;
+    }
+    return true;
+  }
 
-      const auto rc = miniunz_extract_currentfile(
-          file_, opt_extract_without_path, &opt_overwrite, password);
-      if (rc != UNZ_OK) {
-        LOG_ERROR << "miniunz_extract_currentfile failed: " << rc;
-        throw ZipError("miniunz_extract_currentfile failed");
-      }
+  // Returns the number of bytes inflated, 0 at the end of the file or
+  // -1 on error
+  int readCurrentFile(void* buffer, const unsigned length) {
+    if (raw_) {
+      return inflateCurrentFile(static_cast<uint8_t*>(buffer), length);
     }
+    const int count = unzReadCurrentFile(file_, buffer, length);
+    if (count < 0) {
+      LOG_ERROR << "unzReadCurrentFile failed: " << count;
+    }
+    return count;
+  }
 
-    return zipfile_info_.absoluteDir().absoluteFilePath(firstFileName);
+  bool closeCurrentFile() {
+    const auto rc = unzCloseCurrentFile(file_);
+    if (rc != UNZ_OK) {
+      LOG_ERROR << "unzCloseCurrentFile failed: " << rc;
+      return false;
+    }
+    if (!raw_) {
+      return true;
+    }
+    if (!checkInflated()) {
+      return false;
+    }
+    if (index_builder_ && inflated_ == expected_size_) {
+      saveIndex();
+    }
+    index_builder_.reset();
+    return true;
+  }
+
+  // Load the inflate index for the current file, if there is one, it
+  // is still good and there are threads to use it with
+  bool loadIndex(gondar::InflateIndex* index) {
+    if (options_.index_path.empty() || inflateThreads(options_) < 2) {
+      return false;
+    }
+    unz_file_info64 file_info = {};
+    const std::string name = currentFileName(&file_info);
+    if (!isDeflated(file_info) ||
+        !gondar::loadInflateIndex(options_.index_path, index)) {
+      return false;
+    }
+    if (index->entry_name != name ||
+        index->compressed_size != file_info.compressed_size ||
+        index->size != file_info.uncompressed_size ||
+        index->crc != file_info.crc ||
+        index->data_offset != uint64_t(currentDataOffset()) ||
+        index->zip_id != gondar::imageFingerprint(zipPath())) {
+      LOG_INFO << "inflate index " << options_.index_path
+               << " is for another zip";
+      return false;
+    }
+    return true;
+  }
+
+  std::string zipPath() const {
+    return zipfile_info_.absoluteFilePath().toStdString();
+  }
+
+  // Extract the first file in the zip in the same directory as the
+  // zipfile. Throw a ZipError if anything goes wrong, or if |cancel| is
+  // cancelled; either way no partial output is left behind.
+  QFileInfo extractFirstFile(const gondar::CancelToken* cancel) {
+    // Entries may carry a path; only the name is used
+    const QString firstFileName = QFileInfo(goToFirstFile()).fileName();
+    const QString output_path =
+        zipfile_info_.absoluteDir().absoluteFilePath(firstFileName);
+
+    QFile output(output_path);
+    if (!output.open(QFile::WriteOnly | QFile::Truncate)) {
+      LOG_ERROR << "failed to create " << output_path << ": "
+                << output.errorString();
+      throw ZipError("error creating " + output_path.toStdString());
+    }
+    try {
+      extractCurrentFile(&output, cancel);
+    } catch (const ZipError&) {
+      output.remove();
+      throw;
+    }
+    return output_path;
   }
 
  private:
@@ -125,20 +252,22 @@ class ZipFile {
     return file;
   }
 
-  // Move to the first file in the zip and get its name. Throw a
-  // ZipError if anything goes wrong.
-  QString goToFirstFile() {
+  // Move to the first file in the zip and get its name, and its
+  // details if |file_info| isn't null. Throw a ZipError if anything
+  // goes wrong.
+  QString goToFirstFile(unz_file_info64* file_info = nullptr) {
     constexpr int FILENAME_BUFFER_SIZE = 256;
     char filename[FILENAME_BUFFER_SIZE] = {};
-    unz_file_info64 file_info = {};
+    unz_file_info64 unused_info = {};
 
     void* extrafield = nullptr;
     const uint16_t extrafield_size = 0;
     char* comment = nullptr;
     const uint16_t comment_size = 0;
-    const auto rc =
-        unzGoToFirstFile2(file_, &file_info, filename, FILENAME_BUFFER_SIZE,
-                          extrafield, extrafield_size, comment, comment_size);
+    const auto rc = unzGoToFirstFile2(
+        file_, file_info ? file_info : &unused_info, filename,
+        FILENAME_BUFFER_SIZE, extrafield, extrafield_size, comment,
+        comment_size);
 
     if (rc != UNZ_OK) {
       LOG_ERROR << "unzGoToFirstFile2 failed: " << rc;
@@ -148,12 +277,522 @@ class ZipFile {
     return filename;
   }
 
+  NeverwareZipEntry currentEntry(const QString& name,
+                                 const unz_file_info64& file_info) {
+    NeverwareZipEntry entry;
+    entry.name = name;
+    entry.size = file_info.uncompressed_size;
+    entry.crc = static_cast<uint32_t>(file_info.crc);
+    if (file_info.compression_method == 0 && !(file_info.flag & 1)) {
+      entry.data_offset = currentDataOffset();
+    }
+    return entry;
+  }
+
+  static bool isDeflated(const unz_file_info64& file_info) {
+    return file_info.compression_method == Z_DEFLATED &&
+           !(file_info.flag & 1);
+  }
+
+  // Where the current file's data starts, which only the local header
+  // says, or -1 if that can't be read
+  int64_t currentDataOffset() {
+    if (unzOpenCurrentFile2(file_, nullptr, nullptr, 1) != UNZ_OK) {
+      return -1;
+    }
+    const int64_t offset = unzGetCurrentFileZStreamPos64(file_);
+    unzCloseCurrentFile(file_);
+    return offset > 0 ? offset : -1;
+  }
+
+  // The name and details of the current file, or an empty name if they
+  // can't be read
+  std::string currentFileName(unz_file_info64* file_info) {
+    constexpr int FILENAME_BUFFER_SIZE = 256;
+    char filename[FILENAME_BUFFER_SIZE] = {};
+    const auto rc = unzGetCurrentFileInfo64(
+        file_, file_info, filename, FILENAME_BUFFER_SIZE, nullptr, 0, nullptr,
+        0);
+    if (rc != UNZ_OK) {
+      LOG_ERROR << "unzGetCurrentFileInfo64 failed: " << rc;
+      return std::string();
+    }
+    return filename;
+  }
+
+  // Set up the backend for a raw read of the file |file_info|
+  // describes
+  bool startInflate(const unz_file_info64& file_info) {
+    if (!inflater_) {
+      inflater_ = gondar::createInflater(options_.inflate_backend);
+      if (!inflater_) {
+        return false;
+      }
+      compressed_.reset(new uint8_t[kCompressedChunkSize]);
+      LOG_INFO << "inflating with " << inflater_->name();
+    } else if (!inflater_->reset()) {
+      return false;
+    }
+    compressed_next_ = compressed_.get();
+    compressed_left_ = 0;
+    compressed_read_ = 0;
+    inflate_ended_ = false;
+    inflated_ = 0;
+    crc_ = 0;
+    expected_size_ = file_info.uncompressed_size;
+    expected_crc_ = static_cast<uint32_t>(file_info.crc);
+    return true;
+  }
+
+  // readCurrentFile() for a raw read: fill |buffer| from the backend,
+  // feeding it compressed data as it runs out. Like minizip, never
+  // returns more than the directory says the file holds.
+  int inflateCurrentFile(uint8_t* buffer, const unsigned length) {
+    uint8_t* next = buffer;
+    size_t left = std::min<uint64_t>(length, expected_size_ - inflated_);
+    while (left > 0 && !inflate_ended_) {
+      if (compressed_left_ == 0) {
+        const int count =
+            unzReadCurrentFile(file_, compressed_.get(), kCompressedChunkSize);
+        if (count < 0) {
+          LOG_ERROR << "unzReadCurrentFile failed: " << count;
+          return -1;
+        }
+        if (count == 0) {
+          LOG_ERROR << "deflate stream in " << zipfile_info_.filePath()
+                    << " is truncated";
+          return -1;
+        }
+        compressed_next_ = compressed_.get();
+        compressed_left_ = count;
+        compressed_read_ += count;
+      }
+      const auto status =
+          index_builder_ ? inflateToBlock(&next, &left)
+                         : inflater_->inflate(&compressed_next_,
+                                              &compressed_left_, &next, &left);
+      if (status == gondar::Inflater::Status::kError) {
+        return -1;
+      }
+      inflate_ended_ = status == gondar::Inflater::Status::kEnd;
+    }
+    const size_t count = next - buffer;
+    crc_ = inflater_->crc32(crc_, buffer, count);
+    inflated_ += count;
+    return static_cast<int>(count);
+  }
+
+  // Inflate as inflateCurrentFile() does, noting block boundaries and
+  // output in the index being built
+  gondar::Inflater::Status inflateToBlock(uint8_t** next, size_t* left) {
+    uint8_t* const start = *next;
+    int boundary_bits = -1;
+    const auto status = inflater_->inflateToBlock(
+        &compressed_next_, &compressed_left_, next, left, &boundary_bits);
+    index_builder_->addOutput(start, *next - start);
+    if (boundary_bits >= 0) {
+      index_builder_->addBoundary(compressed_read_ - compressed_left_,
+                                  boundary_bits);
+    }
+    return status;
+  }
+
+  void saveIndex() {
+    index_.zip_id = gondar::imageFingerprint(zipPath());
+    index_.checkpoints = index_builder_->finish();
+    if (!index_.zip_id.empty()) {
+      gondar::saveInflateIndex(index_, options_.index_path);
+    }
+    index_.checkpoints.clear();
+  }
+
+  // minizip doesn't check raw reads, so check as it would have once the
+  // whole file has been read, and also that the deflate stream didn't
+  // end short of it. A file closed part way isn't checked.
+  bool checkInflated() const {
+    if (inflated_ != expected_size_) {
+      if (inflate_ended_) {
+        LOG_ERROR << "deflate stream in " << zipfile_info_.filePath()
+                  << " ends at " << inflated_ << ", expected "
+                  << expected_size_;
+        return false;
+      }
+      return true;
+    }
+    if (crc_ != expected_crc_) {
+      LOG_ERROR << "CRC mismatch in " << zipfile_info_.filePath() << ": "
+                << crc_ << ", expected " << expected_crc_;
+      return false;
+    }
+    return true;
+  }
+
+  // Inflate the current entry into |output|, on several threads if it
+  // has an index
+  void extractCurrentFile(QFile* output, const gondar::CancelToken* cancel) {
+    gondar::InflateIndex index;
+    if (loadIndex(&index)) {
+      extractSpans(index, output, cancel);
+    } else {
+      extractSequentially(output, cancel);
+    }
+    if (!output->flush()) {
+      LOG_ERROR << "failed to write " << output->fileName();
+      throw ZipError("error writing output");
+    }
+  }
+
+  // Inflate the current entry into |output| a span of |index| at a time
+  void extractSpans(const gondar::InflateIndex& index,
+                    QFile* output,
+                    const gondar::CancelToken* cancel) {
+    const int threads = inflateThreads(options_);
+    LOG_INFO << "inflating " << index.checkpoints.size() << " spans on "
+             << threads << " threads";
+    gondar::ParallelInflater inflater(zipPath(), index,
+                                      options_.inflate_backend, threads);
+    if (!inflater.start(0)) {
+      throw ZipError("could not start inflating");
+    }
+    std::vector<uint8_t> span;
+    for (size_t i = 0; i < index.checkpoints.size(); i++) {
+      if (cancel && cancel->cancelled()) {
+        LOG_INFO << "unzip cancelled";
+        throw ZipError("cancelled");
+      }
+      if (!inflater.next(&span)) {
+        throw ZipError("error inflating entry");
+      }
+      const qint64 length = span.size();
+      if (output->write(reinterpret_cast<const char*>(span.data()),
+                        length) != length) {
+        LOG_ERROR << "failed to write " << output->fileName() << ": "
+                  << output->errorString();
+        throw ZipError("error writing output");
+      }
+    }
+  }
+
+  // Inflate the current entry into |output| a chunk at a time
+  void extractSequentially(QFile* output,
+                           const gondar::CancelToken* cancel) {
+    if (!openCurrentFile()) {
+      throw ZipError("could not open entry");
+    }
+    std::unique_ptr<char[]> buffer(new char[kExtractChunkSize]);
+    while (true) {
+      if (cancel && cancel->cancelled()) {
+        LOG_INFO << "unzip cancelled";
+        closeCurrentFile();
+        throw ZipError("cancelled");
+      }
+      const int length = readCurrentFile(buffer.get(), kExtractChunkSize);
+      if (length == 0) {
+        break;
+      }
+      if (length < 0) {
+        closeCurrentFile();
+        throw ZipError("error reading entry");
+      }
+      if (output->write(buffer.get(), length) != length) {
+        LOG_ERROR << "failed to write " << output->fileName() << ": "
+                  << output->errorString();
+        closeCurrentFile();
+        throw ZipError("error writing output");
+      }
+    }
+    // Also checks the entry's CRC
+    if (!closeCurrentFile()) {
+      throw ZipError("error closing entry");
+    }
+  }
+
   const QFileInfo zipfile_info_;
+  const NeverwareUnzipOptions options_;
   unzFile file_;
+
+  // State of a raw read, see openCurrentFile()
+  bool raw_ = false;
+  std::unique_ptr<gondar::Inflater> inflater_;
+  std::unique_ptr<uint8_t[]> compressed_;
+  const uint8_t* compressed_next_ = nullptr;
+  size_t compressed_left_ = 0;
+  uint64_t compressed_read_ = 0;
+  bool inflate_ended_ = false;
+  uint64_t inflated_ = 0;
+  uint32_t crc_ = 0;
+  uint64_t expected_size_ = 0;
+  uint32_t expected_crc_ = 0;
+  // While inflating from the start, the index being built and what it
+  // is for
+  std::unique_ptr<gondar::InflateIndexBuilder> index_builder_;
+  gondar::InflateIndex index_;
+};
+
+// One file of a zip, inflated as it is read. Reads are expected to go
+// forward: skipping ahead means inflating what is skipped, and going
+// back means starting the file over.
+class ZipEntrySource : public gondar::ImageSource {
+ public:
+  ZipEntrySource(std::unique_ptr<ZipFile> zip, const int64_t size)
+      : zip_(std::move(zip)), size_(size) {}
+
+  ~ZipEntrySource() override {
+    if (open_) {
+      zip_->closeCurrentFile();
+    }
+  }
+
+  bool open() {
+    open_ = zip_->openCurrentFile();
+    return open_;
+  }
+
+  int64_t size() const override { return size_; }
+  bool forwardOnly() const override { return true; }
+
+  // The entry's CRC is checked once the end is reached; if it doesn't
+  // match, the read that got there fails
+  int64_t read(const uint64_t offset,
+               uint8_t* buffer,
+               const size_t length) override {
+    if (offset < position_ && !rewind()) {
+      return -1;
+    }
+    while (position_ < offset) {
+      if (!skip_buffer_) {
+        skip_buffer_.reset(new uint8_t[kExtractChunkSize]);
+      }
+      const int64_t count = readAtPosition(
+          skip_buffer_.get(),
+          std::min<uint64_t>(kExtractChunkSize, offset - position_));
+      if (count <= 0) {
+        return count;
+      }
+    }
+    return readAtPosition(buffer, length);
+  }
+
+ private:
+  int64_t readAtPosition(uint8_t* buffer, const size_t length) {
+    if (!open_ || length == 0) {
+      // Closed once the end was reached, and checked then
+      return 0;
+    }
+    const int count = zip_->readCurrentFile(
+        buffer, static_cast<unsigned>(
+                    std::min<size_t>(length, kExtractChunkSize)));
+    if (count < 0) {
+      return -1;
+    }
+    position_ += count;
+    if (count == 0 || position_ >= static_cast<uint64_t>(size_)) {
+      open_ = false;
+      // Also checks the entry's CRC
+      if (!zip_->closeCurrentFile() ||
+          position_ != static_cast<uint64_t>(size_)) {
+        LOG_ERROR << "zip entry ends at " << position_ << ", expected "
+                  << size_;
+        return -1;
+      }
+    }
+    return count;
+  }
+
+  bool rewind() {
+    LOG_INFO << "starting zip entry over from " << position_;
+    if (open_) {
+      zip_->closeCurrentFile();
+    }
+    position_ = 0;
+    return open();
+  }
+
+  std::unique_ptr<ZipFile> zip_;
+  const int64_t size_;
+  bool open_ = false;
+  uint64_t position_ = 0;
+  std::unique_ptr<uint8_t[]> skip_buffer_;
+};
+
+// A file stored in a zip, read in place. minizip isn't involved, so
+// the entry's CRC is checked here once it has all been read in order;
+// if it doesn't match, the read that got there fails, and so does
+// every read after it. Reads that skip part of the entry leave it
+// unchecked, as reads of a partial file do in minizip.
+class StoredEntrySource : public gondar::ImageSource {
+ public:
+  StoredEntrySource(std::unique_ptr<gondar::ImageSource> data,
+                    const uint32_t expected_crc)
+      : data_(std::move(data)), expected_crc_(expected_crc) {}
+
+  int64_t size() const override { return data_->size(); }
+
+  int64_t read(const uint64_t offset,
+               uint8_t* buffer,
+               const size_t length) override {
+    if (failed_) {
+      return -1;
+    }
+    const int64_t count = data_->read(offset, buffer, length);
+    if (count <= 0 || offset > checked_ || offset + count <= checked_) {
+      return count;
+    }
+    // Only what hasn't been read before counts
+    const uint64_t seen = checked_ - offset;
+    crc_ = static_cast<uint32_t>(
+        crc32(crc_, buffer + seen, static_cast<uInt>(count - seen)));
+    checked_ = offset + count;
+    if (checked_ == static_cast<uint64_t>(size()) && crc_ != expected_crc_) {
+      LOG_ERROR << "CRC mismatch in stored zip entry: " << crc_
+                << ", expected " << expected_crc_;
+      failed_ = true;
+      return -1;
+    }
+    return count;
+  }
+
+ private:
+  std::unique_ptr<gondar::ImageSource> data_;
+  const uint32_t expected_crc_;
+  // The entry's first |checked_| bytes have gone into |crc_|
+  uint64_t checked_ = 0;
+  uint32_t crc_ = 0;
+  bool failed_ = false;
+};
+
+// One file of a zip that has an inflate index, inflated a span at a
+// time on several threads as it is read. Reads are expected to go
+// forward, like ZipEntrySource's, but jumping around only costs the
+// spans in between.
+class IndexedEntrySource : public gondar::ImageSource {
+ public:
+  IndexedEntrySource(const std::string& zip_path,
+                     gondar::InflateIndex index,
+                     const NeverwareUnzipOptions& options)
+      : zip_path_(zip_path),
+        index_(std::move(index)),
+        options_(options),
+        threads_(inflateThreads(options)) {}
+
+  int64_t size() const override { return index_.size; }
+
+  // Each span is checked against its own CRC as it is inflated
+  int64_t read(const uint64_t offset,
+               uint8_t* buffer,
+               const size_t length) override {
+    if (offset >= index_.size || length == 0) {
+      return 0;
+    }
+    const size_t span = index_.spanAt(offset);
+    if (span != span_ && !inflateSpan(span)) {
+      return -1;
+    }
+    const uint64_t start = offset - index_.checkpoints[span].output_offset;
+    const size_t count = std::min<uint64_t>(length, data_.size() - start);
+    std::copy(data_.begin() + start, data_.begin() + start + count, buffer);
+    return count;
+  }
+
+ private:
+  // Make |span| the one in |data_|, going on from the one that is if
+  // it isn't far behind, or starting the threads over at |span|
+  bool inflateSpan(const size_t span) {
+    if (!inflater_ || span < next_span_ || span > next_span_ + threads_) {
+      inflater_.reset();
+      inflater_.reset(new gondar::ParallelInflater(
+          zip_path_, index_, options_.inflate_backend, threads_));
+      if (!inflater_->start(span)) {
+        inflater_.reset();
+        return false;
+      }
+      next_span_ = span;
+    }
+    while (next_span_ <= span) {
+      if (!inflater_->next(&data_)) {
+        inflater_.reset();
+        span_ = kNoSpan;
+        return false;
+      }
+      span_ = next_span_++;
+    }
+    return true;
+  }
+
+  static constexpr size_t kNoSpan = SIZE_MAX;
+
+  const std::string zip_path_;
+  const gondar::InflateIndex index_;
+  const NeverwareUnzipOptions options_;
+  const int threads_;
+  // Refers to |index_|
+  std::unique_ptr<gondar::ParallelInflater> inflater_;
+  // The span after the last one |inflater_| handed back
+  size_t next_span_ = 0;
+  // The span in |data_|
+  size_t span_ = kNoSpan;
+  std::vector<uint8_t> data_;
 };
 
+constexpr size_t IndexedEntrySource::kNoSpan;
+
 }  // namespace
 
-QFileInfo neverware_unzip(const QFileInfo& input_file) {
-  return ZipFile(input_file).extractFirstFile();
+QFileInfo neverware_unzip(const QFileInfo& input_file,
+                          const gondar::CancelToken* cancel,
+                          const NeverwareUnzipOptions& options) {
+  return ZipFile(input_file, options).extractFirstFile(cancel);
+}
+
+NeverwareZipEntry neverware_first_entry(const QFileInfo& input_file) {
+  return ZipFile(input_file).firstEntry();
+}
+
+std::unique_ptr<gondar::ImageSource> neverware_open_entry(
+    const QFileInfo& input_file,
+    const QString& entry_name,
+    const NeverwareUnzipOptions& options) {
+  try {
+    std::unique_ptr<ZipFile> zip(new ZipFile(input_file, options));
+    const NeverwareZipEntry entry = zip->goToFile(entry_name);
+    if (entry.data_offset >= 0) {
+      // Nothing to inflate, so no need for minizip either
+      LOG_INFO << entry_name << " is stored at " << entry.data_offset
+               << " in " << input_file.filePath() << ", " << entry.size
+               << " bytes";
+      auto file = gondar::openImageSource(
+          input_file.absoluteFilePath().toStdString());
+      if (!file) {
+        return nullptr;
+      }
+      auto data = gondar::sliceImageSource(std::move(file),
+                                           entry.data_offset, entry.size);
+      if (!data) {
+        return nullptr;
+      }
+      return std::unique_ptr<gondar::ImageSource>(
+          new StoredEntrySource(std::move(data), entry.crc));
+    }
+    gondar::InflateIndex index;
+    if (zip->loadIndex(&index)) {
+      LOG_INFO << "inflating " << entry_name << " from "
+               << input_file.filePath() << " with an index of "
+               << index.checkpoints.size() << " spans, " << entry.size
+               << " bytes";
+      return std::unique_ptr<gondar::ImageSource>(new IndexedEntrySource(
+          zip->zipPath(), std::move(index), options));
+    }
+    std::unique_ptr<ZipEntrySource> source(
+        new ZipEntrySource(std::move(zip), entry.size));
+    if (!source->open()) {
+      return nullptr;
+    }
+    LOG_INFO << "inflating " << entry_name << " straight from "
+             << input_file.filePath() << ", " << entry.size << " bytes";
+    return std::unique_ptr<gondar::ImageSource>(std::move(source));
+  } catch (const std::exception& exc) {
+    LOG_ERROR << "could not open " << entry_name << " in "
+              << input_file.filePath() << ": " << exc.what();
+    return nullptr;
+  }
 }
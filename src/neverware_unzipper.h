@@ -17,7 +17,61 @@
 #define SRC_NEVERWARE_UNZIPPER_H_
 
 #include <QFileInfo>
+#include <QString>
 
-QFileInfo neverware_unzip(const QFileInfo& input_file);
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace gondar {
+class CancelToken;
+class ImageSource;
+}
+
+struct NeverwareZipEntry {
+  QString name;
+  // Uncompressed
+  int64_t size = 0;
+  // CRC-32 of the uncompressed data
+  uint32_t crc = 0;
+  // Where the file's data starts in the zip if it is stored as is
+  // (uncompressed and unencrypted), else -1
+  int64_t data_offset = -1;
+};
+
+struct NeverwareUnzipOptions {
+  // Inflates deflated files (see gondar::createInflater); empty for
+  // the fastest in the build
+  std::string inflate_backend;
+  // Where to keep an index of the file's deflate stream (see
+  // gondar::InflateIndex), or empty for none. Whatever inflates the
+  // whole file from the start builds it, and anything after that uses
+  // it to inflate on several threads at once.
+  std::string index_path;
+  // Threads to inflate with once there is an index; 0 for one per
+  // core, up to 8
+  int threads = 0;
+};
+
+// Extract the first file of the zip |input_file| next to it and return
+// the result. Throws a std::exception on failure or if |cancel| is
+// cancelled part way.
+QFileInfo neverware_unzip(
+    const QFileInfo& input_file,
+    const gondar::CancelToken* cancel = nullptr,
+    const NeverwareUnzipOptions& options = NeverwareUnzipOptions());
+
+// Find the first file of the zip |input_file| without extracting it.
+// Throws a std::exception on failure.
+NeverwareZipEntry neverware_first_entry(const QFileInfo& input_file);
+
+// Open the file |entry_name| of the zip |input_file| as an image source
+// that inflates it as it is read, so that it can be written to a device
+// without being extracted first. A stored file is read straight out of
+// the zip instead. Returns null on failure.
+std::unique_ptr<gondar::ImageSource> neverware_open_entry(
+    const QFileInfo& input_file,
+    const QString& entry_name,
+    const NeverwareUnzipOptions& options = NeverwareUnzipOptions());
 
 #endif  // SRC_NEVERWARE_UNZIPPER_H_
@@ -0,0 +1,227 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "parallel_inflater.h"
+
+#include <QThread>
+
+#include <algorithm>
+#include <utility>
+
+#include "block_device.h"
+#include "inflater.h"
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// How much compressed data a worker reads at a time
+constexpr size_t kInputChunkSize = 256 * 1024;
+
+}  // namespace
+
+// Inflates spans until there are none left, with an inflater and a
+// handle to the zip of its own
+class SpanWorker : public QThread {
+ public:
+  SpanWorker(ParallelInflater* owner,
+             std::unique_ptr<Inflater> inflater,
+             std::unique_ptr<ImageSource> input)
+      : owner_(owner),
+        inflater_(std::move(inflater)),
+        input_(std::move(input)),
+        buffer_(new uint8_t[kInputChunkSize]) {}
+
+  Inflater* inflater() const { return inflater_.get(); }
+  ImageSource* input() const { return input_.get(); }
+  uint8_t* buffer() const { return buffer_.get(); }
+
+ protected:
+  void run() override {
+    size_t span = 0;
+    std::vector<uint8_t> data;
+    while (owner_->claim(&span, &data)) {
+      const bool success = owner_->inflateSpan(this, span, &data);
+      owner_->complete(span, success, &data);
+    }
+  }
+
+ private:
+  ParallelInflater* const owner_;
+  const std::unique_ptr<Inflater> inflater_;
+  const std::unique_ptr<ImageSource> input_;
+  const std::unique_ptr<uint8_t[]> buffer_;
+};
+
+ParallelInflater::ParallelInflater(const std::string& zip_path,
+                                   const InflateIndex& index,
+                                   const std::string& backend,
+                                   const int threads)
+    : zip_path_(zip_path),
+      index_(index),
+      backend_(backend),
+      threads_(std::max(threads, 1)) {}
+
+ParallelInflater::~ParallelInflater() {
+  {
+    QMutexLocker locker(&mutex_);
+    stopping_ = true;
+    changed_.wakeAll();
+  }
+  for (auto& worker : workers_) {
+    worker->wait();
+  }
+}
+
+bool ParallelInflater::start(const size_t first_span) {
+  next_claim_ = first_span;
+  next_delivery_ = first_span;
+  const size_t spans = index_.checkpoints.size() - first_span;
+  const int threads =
+      static_cast<int>(std::min<size_t>(threads_, std::max<size_t>(spans, 1)));
+  for (int i = 0; i < threads; i++) {
+    auto inflater = createInflater(backend_);
+    auto input = openImageSource(zip_path_);
+    if (!inflater || !input) {
+      return false;
+    }
+    workers_.emplace_back(
+        new SpanWorker(this, std::move(inflater), std::move(input)));
+  }
+  for (auto& worker : workers_) {
+    worker->start();
+  }
+  return true;
+}
+
+bool ParallelInflater::next(std::vector<uint8_t>* data) {
+  QMutexLocker locker(&mutex_);
+  if (next_delivery_ >= index_.checkpoints.size()) {
+    return false;
+  }
+  auto span = done_.find(next_delivery_);
+  while (!failed_ && span == done_.end()) {
+    changed_.wait(&mutex_);
+    span = done_.find(next_delivery_);
+  }
+  if (failed_) {
+    return false;
+  }
+  data->swap(span->second);
+  if (span->second.capacity() > 0) {
+    spare_.push_back(std::move(span->second));
+  }
+  done_.erase(span);
+  next_delivery_++;
+  changed_.wakeAll();
+  return true;
+}
+
+bool ParallelInflater::claim(size_t* span, std::vector<uint8_t>* data) {
+  QMutexLocker locker(&mutex_);
+  const size_t spans = index_.checkpoints.size();
+  // The span being handed back, plus one ahead for each thread
+  const size_t max_ahead = threads_ + 1;
+  while (!stopping_ && !failed_ && next_claim_ < spans &&
+         next_claim_ - next_delivery_ >= max_ahead) {
+    changed_.wait(&mutex_);
+  }
+  if (stopping_ || failed_ || next_claim_ >= spans) {
+    return false;
+  }
+  *span = next_claim_++;
+  if (!spare_.empty()) {
+    data->swap(spare_.back());
+    spare_.pop_back();
+  }
+  return true;
+}
+
+void ParallelInflater::complete(const size_t span,
+                                const bool success,
+                                std::vector<uint8_t>* data) {
+  QMutexLocker locker(&mutex_);
+  if (success) {
+    done_[span].swap(*data);
+  } else {
+    failed_ = true;
+  }
+  changed_.wakeAll();
+}
+
+bool ParallelInflater::inflateSpan(SpanWorker* worker,
+                                   const size_t span,
+                                   std::vector<uint8_t>* data) const {
+  const InflateCheckpoint& checkpoint = index_.checkpoints[span];
+  const uint64_t length = index_.spanEnd(span) - checkpoint.output_offset;
+  data->resize(length);
+
+  // Part of the block's first byte may already have gone to the one
+  // before it
+  uint64_t position = index_.data_offset + checkpoint.input_offset;
+  const uint64_t end = index_.data_offset + index_.compressed_size;
+  uint8_t byte = 0;
+  if (checkpoint.bits > 0 &&
+      worker->input()->read(position - 1, &byte, 1) != 1) {
+    LOG_ERROR << "could not read " << zip_path_ << " at " << position - 1;
+    return false;
+  }
+  Inflater* inflater = worker->inflater();
+  if (!inflater->resume(checkpoint.bits, byte, checkpoint.window.data(),
+                        checkpoint.window.size())) {
+    return false;
+  }
+
+  uint8_t* output = data->data();
+  size_t output_left = length;
+  const uint8_t* input = nullptr;
+  size_t input_left = 0;
+  while (output_left > 0) {
+    if (input_left == 0) {
+      const size_t wanted =
+          std::min<uint64_t>(kInputChunkSize, end - position);
+      const int64_t count =
+          wanted ? worker->input()->read(position, worker->buffer(), wanted)
+                 : 0;
+      if (count <= 0) {
+        LOG_ERROR << "could not read " << zip_path_ << " at " << position;
+        return false;
+      }
+      position += count;
+      input = worker->buffer();
+      input_left = count;
+    }
+    const auto status =
+        inflater->inflate(&input, &input_left, &output, &output_left);
+    if (status == Inflater::Status::kError) {
+      return false;
+    }
+    if (status == Inflater::Status::kEnd && output_left > 0) {
+      LOG_ERROR << "deflate stream in " << zip_path_ << " ends "
+                << output_left << " bytes into span " << span;
+      return false;
+    }
+  }
+  const uint32_t crc = inflater->crc32(0, data->data(), length);
+  if (crc != checkpoint.crc) {
+    LOG_ERROR << "CRC mismatch in span " << span << " of " << zip_path_
+              << ": " << crc << ", expected " << checkpoint.crc;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace gondar
@@ -0,0 +1,96 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_PARALLEL_INFLATER_H_
+#define SRC_PARALLEL_INFLATER_H_
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "inflate_index.h"
+
+namespace gondar {
+
+class SpanWorker;
+
+// Inflates a zip entry that has an index on several threads, one span
+// between checkpoints per thread at a time, and hands the spans back
+// in order. Each span is checked against the CRC the index has for it.
+// Only a few spans past the one last handed back are inflated ahead,
+// which bounds the memory used to about |threads| + 2 spans.
+class ParallelInflater {
+  ParallelInflater& operator=(ParallelInflater&) = delete;
+  ParallelInflater(ParallelInflater&) = delete;
+
+ public:
+  // Spans are read from the zip at |zip_path|, which |index| must be
+  // for, and inflated by |backend| (see createInflater)
+  ParallelInflater(const std::string& zip_path,
+                   const InflateIndex& index,
+                   const std::string& backend,
+                   int threads);
+  // Stops the threads and waits for them
+  ~ParallelInflater();
+
+  // Start the threads, inflating from span |first_span| to the end.
+  // Returns false if they can't be started.
+  bool start(size_t first_span);
+
+  // Wait for the next span and swap its output into |data|, whose old
+  // contents are recycled. Returns false if the span (or any before it)
+  // could not be inflated or there are no more.
+  bool next(std::vector<uint8_t>* data);
+
+ private:
+  friend class SpanWorker;
+
+  // Inflate |span| into |data|. Called on the workers.
+  bool inflateSpan(SpanWorker* worker,
+                   size_t span,
+                   std::vector<uint8_t>* data) const;
+
+  // Claim the next span for a worker, and a buffer to inflate it into.
+  // Returns false once there is nothing more to do.
+  bool claim(size_t* span, std::vector<uint8_t>* data);
+  // Hand back a span a worker has inflated, or a failure
+  void complete(size_t span, bool success, std::vector<uint8_t>* data);
+
+  const std::string zip_path_;
+  const InflateIndex& index_;
+  const std::string backend_;
+  const int threads_;
+  std::vector<std::unique_ptr<SpanWorker>> workers_;
+
+  QMutex mutex_;
+  QWaitCondition changed_;
+  // Guarded by |mutex_|
+  size_t next_claim_ = 0;
+  size_t next_delivery_ = 0;
+  std::map<size_t, std::vector<uint8_t>> done_;
+  std::vector<std::vector<uint8_t>> spare_;
+  bool failed_ = false;
+  bool stopping_ = false;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_PARALLEL_INFLATER_H_
@@ -0,0 +1,398 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "partition_table.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "log.h"
+#include "rand_util.h"
+
+namespace gondar {
+
+namespace {
+
+const char kGptSignature[] = "EFI PART";
+constexpr uint32_t kMinHeaderSize = 92;
+constexpr uint32_t kMinEntrySize = 128;
+// Far more than any real table, just to bound the allocation
+constexpr uint64_t kMaxEntriesBytes = 1024 * 1024;
+
+// Header field offsets, from the UEFI spec
+constexpr size_t kHeaderSizeOffset = 12;
+constexpr size_t kHeaderCrcOffset = 16;
+constexpr size_t kMyLbaOffset = 24;
+constexpr size_t kAlternateLbaOffset = 32;
+constexpr size_t kEntriesLbaOffset = 72;
+constexpr size_t kNumEntriesOffset = 80;
+constexpr size_t kEntrySizeOffset = 84;
+constexpr size_t kEntriesCrcOffset = 88;
+
+// Entry field offsets
+constexpr size_t kTypeGuidSize = 16;
+constexpr size_t kUniqueGuidOffset = 16;
+constexpr size_t kFirstLbaOffset = 32;
+constexpr size_t kLastLbaOffset = 40;
+constexpr size_t kNameOffset = 56;
+
+// Shape of the tables wipePartitionTables() writes
+constexpr uint32_t kRevision = 0x00010000;
+constexpr uint32_t kNumEntries = 128;
+constexpr uint64_t kEntriesBytes = kNumEntries * kMinEntrySize;
+constexpr size_t kDiskGuidOffset = 56;
+constexpr size_t kFirstUsableLbaOffset = 40;
+constexpr size_t kLastUsableLbaOffset = 48;
+
+// Where the data partition of a fresh GPT starts
+constexpr uint64_t kPartitionAlignment = 1024 * 1024;
+
+// EBD0A0A2-B9E5-4433-87C0-68B6B72699C7, with the first three fields
+// little-endian as GPT stores them
+const uint8_t kBasicDataType[kTypeGuidSize] = {
+    0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44,
+    0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7};
+
+uint32_t readLe32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t readLe64(const uint8_t* p) {
+  return readLe32(p) | (static_cast<uint64_t>(readLe32(p + 4)) << 32);
+}
+
+void putLe32(uint8_t* p, const uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+void putLe64(uint8_t* p, const uint64_t value) {
+  putLe32(p, static_cast<uint32_t>(value));
+  putLe32(p + 4, static_cast<uint32_t>(value >> 32));
+}
+
+uint32_t crc(const uint8_t* data, const size_t length) {
+  return crc32(crc32(0, Z_NULL, 0), data, length);
+}
+
+struct Header {
+  uint64_t my_lba;
+  uint64_t alternate_lba;
+  uint64_t entries_lba;
+  uint32_t num_entries;
+  uint32_t entry_size;
+  uint32_t entries_crc;
+};
+
+// Read and check the header at |lba|
+bool readHeader(ImageSource* source,
+                const uint64_t image_size,
+                const uint64_t sector_size,
+                const uint64_t lba,
+                Header* header) {
+  if ((lba + 1) * sector_size > image_size) {
+    return false;
+  }
+  std::vector<uint8_t> sector(sector_size);
+  if (!readFully(source, lba * sector_size, sector.data(), sector.size())) {
+    return false;
+  }
+  if (memcmp(sector.data(), kGptSignature, strlen(kGptSignature)) != 0) {
+    return false;
+  }
+  const uint32_t header_size = readLe32(&sector[kHeaderSizeOffset]);
+  if (header_size < kMinHeaderSize || header_size > sector_size) {
+    return false;
+  }
+  // The CRC is computed with its own field zeroed
+  const uint32_t header_crc = readLe32(&sector[kHeaderCrcOffset]);
+  memset(&sector[kHeaderCrcOffset], 0, sizeof(uint32_t));
+  if (crc(sector.data(), header_size) != header_crc) {
+    LOG_WARNING << "GPT header at LBA " << lba << " has a bad CRC";
+    return false;
+  }
+  header->my_lba = readLe64(&sector[kMyLbaOffset]);
+  header->alternate_lba = readLe64(&sector[kAlternateLbaOffset]);
+  header->entries_lba = readLe64(&sector[kEntriesLbaOffset]);
+  header->num_entries = readLe32(&sector[kNumEntriesOffset]);
+  header->entry_size = readLe32(&sector[kEntrySizeOffset]);
+  header->entries_crc = readLe32(&sector[kEntriesCrcOffset]);
+  const uint64_t entries_bytes =
+      static_cast<uint64_t>(header->num_entries) * header->entry_size;
+  return header->my_lba == lba && header->entry_size >= kMinEntrySize &&
+         header->entry_size % 8 == 0 && entries_bytes <= kMaxEntriesBytes;
+}
+
+// Read the entry array described by |header| and check its CRC
+bool readEntries(ImageSource* source,
+                 const uint64_t image_size,
+                 const uint64_t sector_size,
+                 const Header& header,
+                 std::vector<uint8_t>* entries) {
+  entries->resize(header.num_entries * header.entry_size);
+  const uint64_t offset = header.entries_lba * sector_size;
+  if (offset + entries->size() > image_size ||
+      !readFully(source, offset, entries->data(), entries->size())) {
+    return false;
+  }
+  if (crc(entries->data(), entries->size()) != header.entries_crc) {
+    LOG_WARNING << "GPT entries at LBA " << header.entries_lba
+                << " have a bad CRC";
+    return false;
+  }
+  return true;
+}
+
+bool isUnused(const uint8_t* entry) {
+  static const uint8_t kUnusedType[kTypeGuidSize] = {};
+  return memcmp(entry, kUnusedType, kTypeGuidSize) == 0;
+}
+
+bool readGptLayoutWithSectorSize(ImageSource* source,
+                                 const uint64_t image_size,
+                                 const uint64_t sector_size,
+                                 GptLayout* gpt) {
+  Header header;
+  std::vector<uint8_t> entries;
+  if (!readHeader(source, image_size, sector_size, 1, &header) ||
+      !readEntries(source, image_size, sector_size, header, &entries)) {
+    return false;
+  }
+
+  *gpt = GptLayout();
+  gpt->sector_size = sector_size;
+  gpt->entries_lba = header.entries_lba;
+  gpt->entries_sectors =
+      roundUp(entries.size(), sector_size) / sector_size;
+
+  const uint64_t image_sectors = image_size / sector_size;
+  for (uint32_t i = 0; i < header.num_entries; i++) {
+    const uint8_t* entry = &entries[i * header.entry_size];
+    if (isUnused(entry)) {
+      continue;
+    }
+    GptLayout::Partition partition;
+    partition.first_lba = readLe64(entry + kFirstLbaOffset);
+    partition.last_lba = readLe64(entry + kLastLbaOffset);
+    if (partition.last_lba < partition.first_lba ||
+        partition.first_lba >= image_sectors) {
+      LOG_WARNING << "ignoring GPT entry " << i << " with bad extent";
+      continue;
+    }
+    // Images may be truncated after the last partition's data
+    partition.last_lba = std::min(partition.last_lba, image_sectors - 1);
+    gpt->partitions.push_back(partition);
+  }
+  std::sort(gpt->partitions.begin(), gpt->partitions.end(),
+            [](const GptLayout::Partition& a, const GptLayout::Partition& b) {
+              return a.first_lba < b.first_lba;
+            });
+
+  // The backup is optional: an image built for a bigger disk may point
+  // past its own end. Reading it from a source that only goes forward
+  // would mean producing the whole image just for that, so there it is
+  // taken to be where it usually is, with its entries just before it.
+  if (source->forwardOnly()) {
+    if (header.alternate_lba < image_sectors &&
+        header.alternate_lba > gpt->entries_lba + gpt->entries_sectors) {
+      gpt->has_backup = true;
+      gpt->backup_header_lba = header.alternate_lba;
+      gpt->backup_entries_lba = header.alternate_lba - gpt->entries_sectors;
+    }
+    return true;
+  }
+  Header backup;
+  if (readHeader(source, image_size, sector_size, header.alternate_lba,
+                 &backup) &&
+      backup.num_entries == header.num_entries &&
+      backup.entry_size == header.entry_size) {
+    if (backup.entries_lba + gpt->entries_sectors <= image_sectors) {
+      gpt->has_backup = true;
+      gpt->backup_header_lba = header.alternate_lba;
+      gpt->backup_entries_lba = backup.entries_lba;
+    }
+  }
+  return true;
+}
+
+// A random (version 4) GUID
+void randomGuid(uint8_t* guid) {
+  for (size_t i = 0; i < kTypeGuidSize; i++) {
+    guid[i] = static_cast<uint8_t>(getRandomNum(0, 255));
+  }
+  guid[7] = (guid[7] & 0x0f) | 0x40;
+  guid[8] = (guid[8] & 0x3f) | 0x80;
+}
+
+void fillProtectiveMbr(uint8_t* sector, const uint64_t num_sectors) {
+  uint8_t* entry = sector + 446;
+  const uint8_t chs_first[] = {0x00, 0x02, 0x00};
+  const uint8_t chs_last[] = {0xff, 0xff, 0xff};
+  memcpy(entry + 1, chs_first, sizeof(chs_first));
+  entry[4] = 0xee;
+  memcpy(entry + 5, chs_last, sizeof(chs_last));
+  putLe32(entry + 8, 1);
+  putLe32(entry + 12, static_cast<uint32_t>(
+                          std::min<uint64_t>(num_sectors - 1, UINT32_MAX)));
+  sector[510] = 0x55;
+  sector[511] = 0xaa;
+}
+
+void fillHeader(uint8_t* sector,
+                const uint64_t my_lba,
+                const uint64_t alternate_lba,
+                const uint64_t entries_lba,
+                const uint64_t first_usable_lba,
+                const uint64_t last_usable_lba,
+                const uint8_t* disk_guid,
+                const uint32_t entries_crc) {
+  memcpy(sector, kGptSignature, strlen(kGptSignature));
+  putLe32(sector + 8, kRevision);
+  putLe32(sector + kHeaderSizeOffset, kMinHeaderSize);
+  putLe64(sector + kMyLbaOffset, my_lba);
+  putLe64(sector + kAlternateLbaOffset, alternate_lba);
+  putLe64(sector + kFirstUsableLbaOffset, first_usable_lba);
+  putLe64(sector + kLastUsableLbaOffset, last_usable_lba);
+  memcpy(sector + kDiskGuidOffset, disk_guid, kTypeGuidSize);
+  putLe64(sector + kEntriesLbaOffset, entries_lba);
+  putLe32(sector + kNumEntriesOffset, kNumEntries);
+  putLe32(sector + kEntrySizeOffset, kMinEntrySize);
+  putLe32(sector + kEntriesCrcOffset, entries_crc);
+  putLe32(sector + kHeaderCrcOffset, crc(sector, kMinHeaderSize));
+}
+
+}  // namespace
+
+bool readGptLayout(ImageSource* source,
+                   const uint64_t image_size,
+                   GptLayout* gpt) {
+  for (const uint64_t sector_size : {512, 4096}) {
+    if (readGptLayoutWithSectorSize(source, image_size, sector_size, gpt)) {
+      LOG_INFO << "image has a GPT with " << gpt->partitions.size()
+               << " partitions, " << sector_size << "-byte sectors"
+               << (gpt->has_backup ? "" : ", no backup");
+      return true;
+    }
+  }
+  return false;
+}
+
+BlockMap gptBlockMap(const GptLayout& gpt, const uint64_t image_size) {
+  std::vector<BlockMap::Range> ranges;
+  auto add = [&ranges](const uint64_t first, const uint64_t count) {
+    BlockMap::Range range;
+    range.first = first;
+    range.last = first + count - 1;
+    ranges.push_back(range);
+  };
+  // Protective MBR and primary header
+  add(0, 2);
+  add(gpt.entries_lba, gpt.entries_sectors);
+  for (const auto& partition : gpt.partitions) {
+    add(partition.first_lba, partition.last_lba - partition.first_lba + 1);
+  }
+  if (gpt.has_backup) {
+    add(gpt.backup_entries_lba, gpt.entries_sectors);
+    add(gpt.backup_header_lba, 1);
+  }
+
+  std::sort(ranges.begin(), ranges.end(),
+            [](const BlockMap::Range& a, const BlockMap::Range& b) {
+              return a.first < b.first;
+            });
+  BlockMap map;
+  map.image_size = image_size;
+  map.block_size = gpt.sector_size;
+  map.blocks_count = roundUp(image_size, gpt.sector_size) / gpt.sector_size;
+  // Merge overlapping and adjacent ranges so each is one sequential run
+  for (const auto& range : ranges) {
+    if (!map.ranges.empty() && range.first <= map.ranges.back().last + 1) {
+      map.ranges.back().last = std::max(map.ranges.back().last, range.last);
+    } else {
+      map.ranges.push_back(range);
+    }
+  }
+  return map;
+}
+
+bool wipePartitionTables(BlockDevice* device,
+                         GptLayout::Partition* data_partition) {
+  const uint64_t sector_size = device->sectorSize();
+  const uint64_t num_sectors = device->size() / sector_size;
+  const uint64_t entries_sectors =
+      roundUp(kEntriesBytes, sector_size) / sector_size;
+  const uint64_t alignment_sectors =
+      std::max<uint64_t>(kPartitionAlignment / sector_size, 1);
+  const uint64_t first_usable_lba = 2 + entries_sectors;
+  if (num_sectors < alignment_sectors + 2 * first_usable_lba) {
+    LOG_ERROR << device->path() << " is too small for a GPT";
+    return false;
+  }
+  const uint64_t last_lba = num_sectors - 1;
+  const uint64_t last_usable_lba = last_lba - 1 - entries_sectors;
+  const uint64_t backup_entries_lba = last_lba - entries_sectors;
+
+  // Each end is built in full, so that a single write replaces the
+  // MBR or GPT there, zeroing anything the old tables had and the new
+  // ones don't
+  AlignedBuffer head(first_usable_lba * sector_size, sector_size);
+  AlignedBuffer tail((1 + entries_sectors) * sector_size, sector_size);
+  if (!head.valid() || !tail.valid()) {
+    LOG_ERROR << "could not allocate partition table buffers";
+    return false;
+  }
+  memset(head.data(), 0, head.size());
+  memset(tail.data(), 0, tail.size());
+
+  uint8_t* entries = head.data() + 2 * sector_size;
+  if (data_partition) {
+    data_partition->first_lba =
+        roundUp(first_usable_lba, alignment_sectors);
+    data_partition->last_lba = last_usable_lba;
+    memcpy(entries, kBasicDataType, kTypeGuidSize);
+    randomGuid(entries + kUniqueGuidOffset);
+    putLe64(entries + kFirstLbaOffset, data_partition->first_lba);
+    putLe64(entries + kLastLbaOffset, data_partition->last_lba);
+    const char kName[] = "Basic data partition";
+    for (size_t i = 0; i < strlen(kName); i++) {
+      entries[kNameOffset + 2 * i] = static_cast<uint8_t>(kName[i]);
+    }
+  }
+  const uint32_t entries_crc = crc(entries, kEntriesBytes);
+  uint8_t disk_guid[kTypeGuidSize];
+  randomGuid(disk_guid);
+
+  fillProtectiveMbr(head.data(), num_sectors);
+  fillHeader(head.data() + sector_size, 1, last_lba, 2, first_usable_lba,
+             last_usable_lba, disk_guid, entries_crc);
+  memcpy(tail.data(), entries, kEntriesBytes);
+  fillHeader(tail.data() + entries_sectors * sector_size, last_lba, 1,
+             backup_entries_lba, first_usable_lba, last_usable_lba,
+             disk_guid, entries_crc);
+
+  LOG_INFO << "writing a fresh GPT to " << device->path()
+           << (data_partition ? " with a data partition" : "");
+  // Backup first, so that an interrupted wipe can't leave the new
+  // primary pointing at a stale backup
+  return device->write(backup_entries_lba * sector_size, tail.data(),
+                       tail.size()) &&
+         device->write(0, head.data(), head.size()) && device->flush();
+}
+
+}  // namespace gondar
@@ -0,0 +1,68 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_PARTITION_TABLE_H_
+#define SRC_PARTITION_TABLE_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "block_device.h"
+#include "block_map.h"
+
+namespace gondar {
+
+// The parts of a GPT disk image that matter when copying it to a
+// device. All positions are in sectors of |sector_size| bytes.
+struct GptLayout {
+  struct Partition {
+    // Inclusive
+    uint64_t first_lba = 0;
+    uint64_t last_lba = 0;
+  };
+
+  uint64_t sector_size = 0;
+  // Primary header is LBA 1; its entry array follows at this LBA
+  uint64_t entries_lba = 0;
+  uint64_t entries_sectors = 0;
+  // Backup header and entry array (the same size as the primary one),
+  // if the image holds them
+  bool has_backup = false;
+  uint64_t backup_header_lba = 0;
+  uint64_t backup_entries_lba = 0;
+  // Partitions in use, sorted by first LBA
+  std::vector<Partition> partitions;
+};
+
+// Parse the GPT of a disk image, trying 512- and then 4096-byte
+// sectors. Returns false if there is no valid primary GPT.
+bool readGptLayout(ImageSource* source, uint64_t image_size, GptLayout* gpt);
+
+// A block map (without checksums) covering the protective MBR, both
+// GPTs and the allocated partitions, in LBA order
+BlockMap gptBlockMap(const GptLayout& gpt, uint64_t image_size);
+
+// Give |device| a fresh GPT in a single pass: one write for the
+// protective MBR and primary table at the start, one for the backup
+// table at the end, and a flush. Nothing else on the device is
+// touched. If |data_partition| is non-null the GPT gets one basic data
+// partition from the first MiB to the end of the device, whose extent
+// is returned there; otherwise it is empty.
+bool wipePartitionTables(BlockDevice* device,
+                         GptLayout::Partition* data_partition = nullptr);
+
+}  // namespace gondar
+
+#endif  // SRC_PARTITION_TABLE_H_
@@ -0,0 +1,131 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "read_back_verifier.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "zero_detect.h"
+
+namespace gondar {
+
+ReadBackVerifier::ReadBackVerifier(BlockDevice* target,
+                                   const uint64_t sector_size,
+                                   const size_t buffer_size,
+                                   const uint64_t distance)
+    : target_(target),
+      sector_size_(sector_size),
+      distance_(distance),
+      buffer_(roundUp(buffer_size, sector_size), sector_size),
+      failed_(false),
+      verified_bytes_(0) {}
+
+void ReadBackVerifier::addWritten(const uint64_t offset,
+                                  const uint64_t length,
+                                  const uint32_t crc) {
+  add({offset, length, false, crc});
+}
+
+void ReadBackVerifier::addZeroed(const uint64_t offset,
+                                 const uint64_t length) {
+  add({offset, length, true, 0});
+}
+
+void ReadBackVerifier::add(const Region& region) {
+  QMutexLocker locker(&mutex_);
+  pending_.push_back(region);
+  written_end_ = std::max(written_end_, region.offset + region.length);
+  changed_.wakeAll();
+}
+
+void ReadBackVerifier::finish() {
+  QMutexLocker locker(&mutex_);
+  finished_ = true;
+  changed_.wakeAll();
+}
+
+void ReadBackVerifier::abort() {
+  QMutexLocker locker(&mutex_);
+  aborted_ = true;
+  changed_.wakeAll();
+}
+
+void ReadBackVerifier::run() {
+  while (true) {
+    Region region;
+    {
+      QMutexLocker locker(&mutex_);
+      while (true) {
+        if (aborted_ || (finished_ && pending_.empty())) {
+          return;
+        }
+        if (!pending_.empty()) {
+          const Region& front = pending_.front();
+          if (finished_ ||
+              written_end_ >= front.offset + front.length + distance_) {
+            break;
+          }
+        }
+        changed_.wait(&mutex_);
+      }
+      region = pending_.front();
+      pending_.pop_front();
+    }
+    if (!verify(region)) {
+      failed_ = true;
+      return;
+    }
+    verified_bytes_ += region.length;
+  }
+}
+
+bool ReadBackVerifier::verify(const Region& region) {
+  if (!target_->dropCache(region.offset, region.length)) {
+    return false;
+  }
+  uint32_t crc = crc32(0, Z_NULL, 0);
+  for (uint64_t done = 0; done < region.length;) {
+    const uint64_t offset = region.offset + done;
+    const size_t length =
+        std::min<uint64_t>(buffer_.size(), region.length - done);
+    if (!target_->read(offset, buffer_.data(),
+                       roundUp(length, sector_size_))) {
+      LOG_ERROR << "read-back of " << target_->path() << " at " << offset
+                << " failed";
+      return false;
+    }
+    if (region.zero) {
+      if (!isAllZero(buffer_.data(), length)) {
+        LOG_ERROR << "read-back mismatch at " << offset
+                  << ": expected zeros";
+        return false;
+      }
+    } else {
+      crc = crc32(crc, buffer_.data(), length);
+    }
+    done += length;
+  }
+  if (!region.zero && crc != region.crc) {
+    LOG_ERROR << "read-back mismatch in the " << region.length
+              << " bytes at " << region.offset;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace gondar
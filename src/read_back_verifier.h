@@ -0,0 +1,90 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_READ_BACK_VERIFIER_H_
+#define SRC_READ_BACK_VERIFIER_H_
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <deque>
+
+#include "block_device.h"
+
+namespace gondar {
+
+// Reads back regions of the target after they have been written and
+// checks them against a CRC-32 of what was sent. It trails the writer
+// by |distance| bytes so that reads overlap with writing without
+// chasing writes that may still be in flight.
+class ReadBackVerifier : public QThread {
+ public:
+  ReadBackVerifier(BlockDevice* target,
+                   uint64_t sector_size,
+                   size_t buffer_size,
+                   uint64_t distance);
+
+  // False if the read buffer couldn't be allocated
+  bool valid() const { return buffer_.valid(); }
+
+  // Writer side. |crc| covers the first |length| bytes at |offset|;
+  // zeroed regions must read back as all zeros.
+  void addWritten(uint64_t offset, uint64_t length, uint32_t crc);
+  void addZeroed(uint64_t offset, uint64_t length);
+  // Everything has been written: verify what's left, then stop
+  void finish();
+  // Stop without verifying the rest
+  void abort();
+
+  // True once any region failed to verify
+  bool failed() const { return failed_; }
+  uint64_t verifiedBytes() const { return verified_bytes_; }
+
+ protected:
+  void run() override;
+
+ private:
+  struct Region {
+    uint64_t offset;
+    uint64_t length;
+    bool zero;
+    uint32_t crc;
+  };
+
+  void add(const Region& region);
+  bool verify(const Region& region);
+
+  BlockDevice* target_;
+  const uint64_t sector_size_;
+  const uint64_t distance_;
+  AlignedBuffer buffer_;
+
+  QMutex mutex_;
+  QWaitCondition changed_;
+  std::deque<Region> pending_;
+  // End of the furthest write so far
+  uint64_t written_end_ = 0;
+  bool finished_ = false;
+  bool aborted_ = false;
+
+  std::atomic<bool> failed_;
+  std::atomic<uint64_t> verified_bytes_;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_READ_BACK_VERIFIER_H_
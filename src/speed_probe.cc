@@ -0,0 +1,158 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "speed_probe.h"
+
+#include <QElapsedTimer>
+
+#include <algorithm>
+
+#include "block_device.h"
+#include "gondar.h"
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// Sequential sample: this much, in reads of kSequentialReadSize
+constexpr uint64_t kSequentialBytes = 16 * 1024 * 1024;
+constexpr uint64_t kSequentialReadSize = 1024 * 1024;
+
+// Random sample: this many reads of kRandomReadSize (or a sector, if
+// that is larger)
+constexpr int kRandomReads = 64;
+constexpr uint64_t kRandomReadSize = 4096;
+
+// Sticks commonly write at a third of their read speed or less; better
+// to promise too long than too short
+constexpr double kWriteToReadRatio = 0.35;
+
+// The write engine pays about one random access per chunk of this size
+constexpr uint64_t kWriteChunkSize = 4 * 1024 * 1024;
+
+// xorshift64, for offsets that are scattered but the same every run
+uint64_t nextOffset(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+bool isCancelled(const CancelToken* cancel) {
+  return cancel && cancel->cancelled();
+}
+
+}  // namespace
+
+bool probeSpeed(BlockDevice* device,
+                SpeedProbeResult* result,
+                const CancelToken* cancel) {
+  const uint64_t sector_size = device->sectorSize();
+  const uint64_t sectors = device->size() / sector_size;
+  const uint64_t sequential_read_size =
+      std::max(kSequentialReadSize / sector_size, uint64_t(1)) * sector_size;
+  const uint64_t random_read_size =
+      std::max(kRandomReadSize / sector_size, uint64_t(1)) * sector_size;
+  if (sectors * sector_size < sequential_read_size) {
+    LOG_WARNING << device->path() << " is too small to probe";
+    return false;
+  }
+  AlignedBuffer buffer(sequential_read_size, sector_size);
+  if (!buffer.valid()) {
+    LOG_ERROR << "could not allocate probe buffer";
+    return false;
+  }
+
+  // The start of a stick is often cached by its controller and the end
+  // is often slower, so sample from the middle
+  const uint64_t sequential_bytes =
+      std::min(kSequentialBytes, sectors * sector_size) / sequential_read_size *
+      sequential_read_size;
+  const uint64_t start =
+      (sectors * sector_size - sequential_bytes) / 2 / sector_size *
+      sector_size;
+  // Whatever the OS has cached would make the device look faster than
+  // it is; a failure here only makes the probe less accurate
+  device->dropCache(0, device->size());
+
+  QElapsedTimer clock;
+  clock.start();
+  for (uint64_t done = 0; done < sequential_bytes;
+       done += sequential_read_size) {
+    if (isCancelled(cancel) ||
+        !device->read(start + done, buffer.data(), sequential_read_size)) {
+      return false;
+    }
+  }
+  const int64_t sequential_ns = std::max<int64_t>(clock.nsecsElapsed(), 1);
+
+  const uint64_t random_slots = sectors * sector_size / random_read_size;
+  uint64_t state = 0x2545f4914f6cdd1dULL;
+  clock.restart();
+  for (int i = 0; i < kRandomReads; i++) {
+    const uint64_t offset =
+        nextOffset(&state) % random_slots * random_read_size;
+    if (isCancelled(cancel) ||
+        !device->read(offset, buffer.data(), random_read_size)) {
+      return false;
+    }
+  }
+  const int64_t random_ns = std::max<int64_t>(clock.nsecsElapsed(), 1);
+
+  result->sequential_rate = sequential_bytes * 1e9 / sequential_ns;
+  result->random_iops = kRandomReads * 1e9 / random_ns;
+  LOG_INFO << "probed " << device->path() << ": "
+           << result->sequential_rate / 1e6 << " MB/s sequential, "
+           << result->random_iops << " random reads/s";
+  return true;
+}
+
+double estimateFlashSeconds(const SpeedProbeResult& result,
+                            const uint64_t image_size) {
+  if (result.sequential_rate <= 0 || result.random_iops <= 0) {
+    return -1;
+  }
+  const double chunks =
+      static_cast<double>(image_size + kWriteChunkSize - 1) / kWriteChunkSize;
+  return image_size / (result.sequential_rate * kWriteToReadRatio) +
+         chunks / result.random_iops;
+}
+
+SpeedProbeThread::SpeedProbeThread(const DeviceList& devices,
+                                   QObject* parent)
+    : QThread(parent), devices_(devices) {}
+
+SpeedProbeThread::~SpeedProbeThread() {
+  cancel();
+  wait();
+}
+
+void SpeedProbeThread::run() {
+  for (const auto& entry : devices_) {
+    if (cancel_.cancelled()) {
+      return;
+    }
+    auto device = OpenDeviceForReading(entry.second);
+    SpeedProbeResult result;
+    if (!device || !probeSpeed(device.get(), &result, &cancel_)) {
+      LOG_WARNING << "could not probe " << entry.second;
+      continue;
+    }
+    emit probed(entry.first, result.sequential_rate, result.random_iops);
+  }
+}
+
+}  // namespace gondar
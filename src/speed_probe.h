@@ -0,0 +1,86 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_SPEED_PROBE_H_
+#define SRC_SPEED_PROBE_H_
+
+#include <QThread>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "cancel_token.h"
+#include "device.h"
+
+namespace gondar {
+
+class BlockDevice;
+
+struct SpeedProbeResult {
+  // Bytes per second of large sequential reads
+  double sequential_rate = 0;
+  // Small reads per second at scattered offsets
+  double random_iops = 0;
+};
+
+// Measure how fast |device| reads, with a few megabytes of sequential
+// reads from the middle of the device and a few dozen small reads
+// scattered over it. Never writes. Takes a second or two on a typical
+// USB stick. Returns false if a read fails or |cancel| (which may be
+// null) is set.
+bool probeSpeed(BlockDevice* device,
+                SpeedProbeResult* result,
+                const CancelToken* cancel = nullptr);
+
+// Rough number of seconds it would take to write |image_size| bytes to
+// a device that probed as |result|. Flash sticks write several times
+// slower than they read, and the ones with slow random reads tend to
+// have slow controllers that pay for every chunk, so both count.
+// Returns -1 if the probe measured nothing.
+double estimateFlashSeconds(const SpeedProbeResult& result,
+                            uint64_t image_size);
+
+// Probes a list of devices one after another, reporting each with
+// probed(). Probing only reads, but it is still done in the background
+// so that the UI doesn't wait on slow sticks.
+class SpeedProbeThread : public QThread {
+  Q_OBJECT
+
+ public:
+  // Each of |devices| is the index to report it under, and the device
+  using DeviceList = std::vector<std::pair<int, DeviceGuy>>;
+
+  explicit SpeedProbeThread(const DeviceList& devices,
+                            QObject* parent = nullptr);
+  // Cancels the probe and waits for the thread
+  ~SpeedProbeThread() override;
+
+  void cancel() { cancel_.cancel(); }
+
+ signals:
+  void probed(int index, double sequential_rate, double random_iops);
+
+ protected:
+  void run() override;
+
+ private:
+  const DeviceList devices_;
+  CancelToken cancel_;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_SPEED_PROBE_H_
@@ -0,0 +1,83 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stall_watchdog.h"
+
+#include <algorithm>
+
+#include "log.h"
+#include "write_progress.h"
+
+namespace gondar {
+
+namespace {
+
+// Longest the watchdog sleeps between checks
+constexpr int64_t kMaxPollMs = 1000;
+
+}  // namespace
+
+StallWatchdog::StallWatchdog(const std::string& name,
+                             const int64_t threshold_ms,
+                             WriteProgress* progress)
+    : name_(name), threshold_ms_(threshold_ms), progress_(progress) {
+  clock_.start();
+}
+
+StallWatchdog::~StallWatchdog() {
+  stop();
+}
+
+void StallWatchdog::enter() {
+  touch();
+  busy_++;
+}
+
+void StallWatchdog::leave() {
+  busy_--;
+  touch();
+}
+
+void StallWatchdog::stop() {
+  {
+    QMutexLocker locker(&mutex_);
+    stopped_ = true;
+    stopping_.wakeAll();
+  }
+  wait();
+}
+
+void StallWatchdog::run() {
+  const int64_t poll_ms = std::max<int64_t>(
+      std::min<int64_t>(threshold_ms_ / 4, kMaxPollMs), 1);
+  QMutexLocker locker(&mutex_);
+  while (!stopped_ && !stalled_) {
+    stopping_.wait(&mutex_, poll_ms);
+    if (stopped_) {
+      break;
+    }
+    const int64_t idle_ms = clock_.elapsed() - last_activity_ms_.load();
+    if (busy_ > 0 && idle_ms > threshold_ms_) {
+      LOG_ERROR << name_ << " has not completed a write in " << idle_ms
+                << " ms, giving up on it";
+      stalled_ = true;
+      if (progress_) {
+        progress_->setStalled();
+      }
+    }
+  }
+}
+
+}  // namespace gondar
@@ -0,0 +1,98 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_STALL_WATCHDOG_H_
+#define SRC_STALL_WATCHDOG_H_
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace gondar {
+
+class WriteProgress;
+
+// Notices when a target stops responding. The writer marks the time it
+// spends in calls that may block on the device with Busy, and reports
+// each write that completes with touch(). Once it has been busy for
+// |threshold_ms| without anything completing, the target counts as
+// stalled. A blocked system call can't be interrupted, so it is up to
+// the writer to give up once the call returns; until then the stall
+// shows through stalled() and WriteProgress::stalled().
+class StallWatchdog : public QThread {
+ public:
+  // Marks the writer busy for its lifetime. |watchdog| may be null.
+  class Busy {
+    Busy& operator=(Busy&) = delete;
+    Busy(Busy&) = delete;
+
+   public:
+    explicit Busy(StallWatchdog* watchdog) : watchdog_(watchdog) {
+      if (watchdog_) {
+        watchdog_->enter();
+      }
+    }
+    ~Busy() {
+      if (watchdog_) {
+        watchdog_->leave();
+      }
+    }
+
+   private:
+    StallWatchdog* watchdog_;
+  };
+
+  // |progress| may be null
+  StallWatchdog(const std::string& name,
+                int64_t threshold_ms,
+                WriteProgress* progress);
+  ~StallWatchdog() override;
+
+  void touch() { last_activity_ms_.store(clock_.elapsed()); }
+
+  // Stop watching; waits for the thread
+  void stop();
+
+  bool stalled() const { return stalled_; }
+
+ protected:
+  void run() override;
+
+ private:
+  void enter();
+  void leave();
+
+  const std::string name_;
+  const int64_t threshold_ms_;
+  WriteProgress* progress_;
+  QElapsedTimer clock_;
+
+  std::atomic<int> busy_{0};
+  std::atomic<int64_t> last_activity_ms_{0};
+  std::atomic<bool> stalled_{false};
+
+  QMutex mutex_;
+  QWaitCondition stopping_;
+  bool stopped_ = false;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_STALL_WATCHDOG_H_
@@ -27,10 +27,57 @@ DeviceGuyList GetDeviceList() {
 
 bool Install(DeviceGuy* target_device,
              const char* image_path,
-             int64_t image_size) {
+             int64_t image_size,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
   Q_UNUSED(target_device);
   Q_UNUSED(image_path);
   Q_UNUSED(image_size);
+  Q_UNUSED(options);
+  Q_UNUSED(stats);
+  return true;
+}
+
+bool Install(DeviceGuy* target_device,
+             gondar::ImageSource* source,
+             int64_t image_size,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
+  Q_UNUSED(target_device);
+  Q_UNUSED(source);
+  Q_UNUSED(image_size);
+  Q_UNUSED(options);
+  Q_UNUSED(stats);
+  return true;
+}
+
+bool Install(DeviceGuy* target_device,
+             const char* zip_path,
+             const char* entry_name,
+             const gondar::WriteOptions& options,
+             gondar::WriteStats* stats) {
+  Q_UNUSED(target_device);
+  Q_UNUSED(zip_path);
+  Q_UNUSED(entry_name);
+  Q_UNUSED(options);
+  Q_UNUSED(stats);
+  return true;
+}
+
+bool InstallMany(DeviceGuyList* target_devices,
+                 const char* image_path,
+                 int64_t image_size,
+                 const gondar::WriteOptions& options,
+                 std::vector<gondar::TargetResult>* results) {
+  Q_UNUSED(image_path);
+  Q_UNUSED(image_size);
+  Q_UNUSED(options);
+  if (results) {
+    results->assign(target_devices->size(), gondar::TargetResult());
+    for (auto& result : *results) {
+      result.success = true;
+    }
+  }
   return true;
 }
 
@@ -39,6 +86,12 @@ bool Format(DeviceGuy* target_device) {
   return true;
 }
 
+std::unique_ptr<gondar::BlockDevice> OpenDeviceForReading(
+    const DeviceGuy& device) {
+  Q_UNUSED(device);
+  return nullptr;
+}
+
 bool IsCurrentProcessElevated() {
   return true;
 }
@@ -20,8 +20,10 @@
 #include "log.h"
 #include "neverware_unzipper.h"
 
-UnzipThread::UnzipThread(const QFileInfo& input, QObject* parent)
-    : QThread(parent), inputFile(input) {}
+UnzipThread::UnzipThread(const QFileInfo& input,
+                         const gondar::CancelToken* cancel_token,
+                         QObject* parent)
+    : QThread(parent), inputFile(input), cancel(cancel_token) {}
 
 UnzipThread::~UnzipThread() {}
 
@@ -30,7 +32,7 @@ const QString& UnzipThread::getFileName() const {
 }
 void UnzipThread::run() {
   try {
-    const QFileInfo binfile = neverware_unzip(inputFile);
+    const QFileInfo binfile = neverware_unzip(inputFile, cancel);
     filename = binfile.absoluteFilePath();
     LOG_INFO << "unzip succeeded";
   } catch (const std::exception& exc) {
@@ -19,10 +19,17 @@
 #include <QFileInfo>
 #include <QThread>
 
+namespace gondar {
+class CancelToken;
+}
+
 class UnzipThread : public QThread {
   Q_OBJECT
  public:
-  explicit UnzipThread(const QFileInfo& inputFile, QObject* parent = 0);
+  // Unzipping stops early, leaving no output, if |cancel| is cancelled
+  UnzipThread(const QFileInfo& inputFile,
+              const gondar::CancelToken* cancel,
+              QObject* parent = 0);
   ~UnzipThread();
   const QString& getFileName() const;
 
@@ -31,6 +38,7 @@ class UnzipThread : public QThread {
 
  private:
   QFileInfo inputFile;
+  const gondar::CancelToken* cancel;
   QString filename;
 };
 
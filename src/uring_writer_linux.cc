@@ -0,0 +1,366 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// io_uring support is done with raw syscalls so that we don't pick up
+// a dependency on liburing. The kernel headers must be new enough to
+// describe io_uring; otherwise createUringWriter() always returns null
+// and the engine falls back to synchronous writes.
+
+#include "chunk_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "log.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define GONDAR_HAVE_IO_URING
+#endif
+#endif
+
+namespace gondar {
+
+#ifdef GONDAR_HAVE_IO_URING
+
+namespace {
+
+// How often a writer whose ring broke checks for the writes still in
+// the kernel
+const useconds_t kAbandonPollUs = 1000;
+
+// Minimal io_uring wrapper: one submission and one completion queue,
+// mapped into our address space
+class IoUring {
+  IoUring& operator=(IoUring&) = delete;
+  IoUring(IoUring&) = delete;
+
+ public:
+  IoUring() {}
+
+  ~IoUring() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+      munmap(cq_ptr_, cq_size_);
+    }
+    if (sq_ptr_ != MAP_FAILED) {
+      munmap(sq_ptr_, sq_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool init(const unsigned entries) {
+    io_uring_params params = {};
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      LOG_INFO << "io_uring_setup failed: " << strerror(errno);
+      return false;
+    }
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      LOG_ERROR << "mmap of io_uring submission queue failed";
+      return false;
+    }
+    if (single_mmap) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ptr_ == MAP_FAILED) {
+        LOG_ERROR << "mmap of io_uring completion queue failed";
+        return false;
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      LOG_ERROR << "mmap of io_uring submission entries failed";
+      return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(sq_ptr_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    uint8_t* cq = static_cast<uint8_t*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  // Queue a vectored write. The caller guarantees there is room, by
+  // never having more writes in flight than the ring has entries.
+  void queueWritev(const int fd,
+                   const iovec* iov,
+                   const uint64_t offset,
+                   const uint64_t user_data) {
+    const unsigned tail = *sq_tail_;
+    const unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(iov);
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    pending_++;
+  }
+
+  // Submit everything queued and wait for at least |min_complete|
+  // completions
+  bool enter(const unsigned min_complete) {
+    while (true) {
+      const int rc = syscall(__NR_io_uring_enter, fd_, pending_, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0,
+                             nullptr, 0);
+      if (rc >= 0) {
+        pending_ -= rc;
+        return true;
+      }
+      if (errno != EINTR) {
+        LOG_ERROR << "io_uring_enter failed: " << strerror(errno);
+        return false;
+      }
+    }
+  }
+
+  // Queued writes the kernel hasn't taken yet
+  unsigned pending() const { return pending_; }
+
+  // Pop one completion if available
+  bool popCompletion(io_uring_cqe* out) {
+    const unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    *out = cqes_[head & *cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  int fd_ = -1;
+  unsigned pending_ = 0;
+  void* sq_ptr_ = MAP_FAILED;
+  void* cq_ptr_ = MAP_FAILED;
+  void* sqes_ = MAP_FAILED;
+  size_t sq_size_ = 0;
+  size_t cq_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+};
+
+class UringChunkWriter : public ChunkWriter {
+ public:
+  UringChunkWriter(BlockDevice* target,
+                   ChunkRing* ring,
+                   const uint64_t sector_size,
+                   const int queue_depth)
+      : target_(target),
+        ring_(ring),
+        sector_size_(sector_size),
+        slots_(queue_depth) {
+    for (auto& slot : slots_) {
+      free_slots_.push_back(&slot);
+    }
+  }
+
+  ~UringChunkWriter() override {
+    // The kernel may still be reading from our buffers
+    drain();
+  }
+
+  bool init() { return uring_.init(slots_.size()); }
+
+  bool submit(Chunk* chunk) override {
+    if (failed_ || (free_slots_.empty() && !reap(1))) {
+      ring_->release(chunk);
+      return false;
+    }
+    Slot* slot = free_slots_.back();
+    free_slots_.pop_back();
+    slot->chunk = chunk;
+    slot->iov.iov_base = chunk->buffer.data();
+    slot->iov.iov_len = chunkWriteLength(*chunk, sector_size_);
+    uring_.queueWritev(target_->fd(), &slot->iov, chunk->offset,
+                       reinterpret_cast<uintptr_t>(slot));
+    in_flight_++;
+    // Submit right away, and pick up whatever has already completed
+    if (!uring_.enter(0)) {
+      failed_ = true;
+      abandon();
+      return false;
+    }
+    reap(0);
+    return !failed_;
+  }
+
+  bool drain() override {
+    while (in_flight_ > 0) {
+      if (!reap(1)) {
+        return false;
+      }
+    }
+    return !failed_;
+  }
+
+  const char* name() const override { return "io_uring"; }
+  int queueDepth() const override { return slots_.size(); }
+
+ private:
+  struct Slot {
+    Chunk* chunk = nullptr;
+    iovec iov = {};
+  };
+
+  // Wait for at least |min_complete| writes, then handle every
+  // completion that is ready. Returns false only if the ring itself
+  // broke; failed writes are tracked in |failed_|.
+  bool reap(const unsigned min_complete) {
+    if (min_complete > 0 && !uring_.enter(min_complete)) {
+      failed_ = true;
+      abandon();
+      return false;
+    }
+    popCompletions();
+    return true;
+  }
+
+  // Handle every completion that is ready. Returns false if there were
+  // none.
+  bool popCompletions() {
+    bool popped = false;
+    io_uring_cqe cqe = {};
+    while (uring_.popCompletion(&cqe)) {
+      Slot* slot =
+          reinterpret_cast<Slot*>(static_cast<uintptr_t>(cqe.user_data));
+      in_flight_--;
+      complete(slot, cqe.res);
+      free_slots_.push_back(slot);
+      popped = true;
+    }
+    return popped;
+  }
+
+  // Give up on the ring once io_uring_enter fails. We can no longer
+  // wait in the kernel, but it still posts a completion for every
+  // write it took, and reads from that chunk's buffer until it does,
+  // so poll for those. The writes it never took are only in our queue
+  // and their chunks can go straight back.
+  void abandon() {
+    while (in_flight_ > static_cast<int>(uring_.pending())) {
+      if (!popCompletions()) {
+        usleep(kAbandonPollUs);
+      }
+    }
+    for (auto& slot : slots_) {
+      if (slot.chunk) {
+        ring_->release(slot.chunk);
+        slot.chunk = nullptr;
+        free_slots_.push_back(&slot);
+        in_flight_--;
+      }
+    }
+  }
+
+  void complete(Slot* slot, const int res) {
+    Chunk* chunk = slot->chunk;
+    slot->chunk = nullptr;
+    bool success = true;
+    if (res != static_cast<int>(slot->iov.iov_len)) {
+      LOG_WARNING << "queued write at " << chunk->offset << " failed: "
+                  << (res < 0 ? strerror(-res) : "short write")
+                  << ", retrying synchronously";
+      success = !failed_ && writeChunkSync(target_, *chunk, sector_size_);
+    }
+    if (success) {
+      notifyComplete(*chunk);
+    } else {
+      failed_ = true;
+    }
+    ring_->release(chunk);
+  }
+
+  BlockDevice* target_;
+  ChunkRing* ring_;
+  const uint64_t sector_size_;
+  IoUring uring_;
+  std::vector<Slot> slots_;
+  std::vector<Slot*> free_slots_;
+  int in_flight_ = 0;
+  bool failed_ = false;
+};
+
+}  // namespace
+
+std::unique_ptr<ChunkWriter> createUringWriter(BlockDevice* target,
+                                               ChunkRing* ring,
+                                               const uint64_t sector_size,
+                                               const int queue_depth) {
+  if (target->fd() < 0) {
+    return nullptr;
+  }
+  std::unique_ptr<UringChunkWriter> writer(
+      new UringChunkWriter(target, ring, sector_size, queue_depth));
+  if (!writer->init()) {
+    return nullptr;
+  }
+  return std::unique_ptr<ChunkWriter>(writer.release());
+}
+
+#else
+
+std::unique_ptr<ChunkWriter> createUringWriter(BlockDevice*,
+                                               ChunkRing*,
+                                               uint64_t,
+                                               int) {
+  return nullptr;
+}
+
+#endif  // GONDAR_HAVE_IO_URING
+
+}  // namespace gondar
@@ -0,0 +1,1112 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "write_engine.h"
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "block_map.h"
+#include "cancel_token.h"
+#include "chunk_ring.h"
+#include "chunk_tuner.h"
+#include "chunk_writer.h"
+#include "erase.h"
+#include "log.h"
+#include "partition_table.h"
+#include "read_back_verifier.h"
+#include "stall_watchdog.h"
+#include "write_journal.h"
+#include "write_progress.h"
+#include "zero_copy.h"
+#include "zero_detect.h"
+
+namespace gondar {
+
+namespace {
+
+// A differential write stops comparing if less than 1/kDiffMinRatio
+// of the first kDiffProbeBytes compared turn out to be unchanged
+constexpr uint64_t kDiffProbeBytes = 256 * 1024 * 1024;
+constexpr uint64_t kDiffMinRatio = 4;
+
+// Samples read back by spotCheck(), and the size of each
+constexpr int kSpotCheckSamples = 8;
+constexpr uint64_t kSpotCheckBytes = 64 * 1024;
+
+// Fills the ring with consecutive chunks of the image, or with a
+// block map only the mapped ranges. If |detect_zeros| is set, chunks
+// that are all zeros are flagged, and if |checksum| is set each chunk
+// gets a CRC-32 for read-back verification. Both run here so that they
+// overlap with device writes too. With a |tuner|, chunks are sized as
+// it currently asks rather than filling the whole buffer. Everything
+// before |start_offset| is left out, for resuming a write. Reading
+// stops early if |cancel| is cancelled. If |open_ended| is set the
+// image may end before |image_size| (see WriteOptions::open_ended).
+class ReaderThread : public QThread {
+ public:
+  ReaderThread(ImageSource* source,
+               ChunkRing* ring,
+               const uint64_t image_size,
+               const bool detect_zeros,
+               const bool checksum,
+               const BlockMap* block_map,
+               const ChunkSizeTuner* tuner,
+               const CancelToken* cancel,
+               const uint64_t start_offset = 0,
+               const bool open_ended = false)
+      : source_(source),
+        ring_(ring),
+        image_size_(image_size),
+        detect_zeros_(detect_zeros),
+        checksum_(checksum),
+        block_map_(block_map),
+        tuner_(tuner),
+        cancel_(cancel),
+        start_offset_(start_offset),
+        open_ended_(open_ended) {}
+
+ protected:
+  void run() override {
+    if (block_map_) {
+      for (const auto& range : block_map_->ranges) {
+        uint64_t offset = block_map_->rangeOffset(range);
+        uint64_t length = block_map_->rangeLength(range);
+        if (offset + length <= start_offset_) {
+          continue;
+        }
+        // Only whole ranges can be checked against their checksums
+        std::string sha256 = range.sha256;
+        if (offset < start_offset_) {
+          length -= start_offset_ - offset;
+          offset = start_offset_;
+          sha256.clear();
+        }
+        if (!readRange(offset, length, sha256)) {
+          return;
+        }
+      }
+    } else if (!readRange(start_offset_, image_size_ - start_offset_,
+                          std::string())) {
+      return;
+    }
+    if (open_ended_ && source_ && !ended_) {
+      // Anything past the limit would be left out
+      uint8_t byte = 0;
+      if (source_->read(image_size_, &byte, 1) != 0) {
+        LOG_ERROR << "image doesn't end within " << image_size_ << " bytes";
+        ring_->finish(false);
+        return;
+      }
+    }
+    ring_->finish(true);
+  }
+
+ private:
+  // Queue |length| bytes starting at |begin|, checking them against
+  // |sha256| unless it is empty. Returns false if the reader should
+  // stop.
+  bool readRange(const uint64_t begin,
+                 const uint64_t length,
+                 const std::string& sha256) {
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    uint64_t end = begin + length;
+    for (uint64_t offset = begin; offset < end;) {
+      if (cancel_ && cancel_->cancelled()) {
+        ring_->finish(false);
+        return false;
+      }
+      Chunk* chunk = ring_->acquireEmpty();
+      if (!chunk) {
+        // the writer gave up
+        return false;
+      }
+      const size_t chunk_size =
+          tuner_ ? tuner_->chunkSize() : ring_->chunkSize();
+      chunk->offset = offset;
+      chunk->length = std::min<uint64_t>(chunk_size, end - offset);
+      if (source_ && !readChunk(chunk, &end)) {
+        ring_->finish(false);
+        return false;
+      }
+      if (chunk->length == 0) {
+        // The image ended with the last chunk. This one never goes
+        // back to the ring, which is finished with anyway.
+        break;
+      }
+      const size_t padded_length = roundUp(chunk->length, ring_->alignment());
+      if (!source_) {
+        memset(chunk->buffer.data(), 0, padded_length);
+      } else {
+        // Pad with zeros rather than whatever an earlier chunk left
+        memset(chunk->buffer.data() + chunk->length, 0,
+               padded_length - chunk->length);
+      }
+      if (!sha256.empty()) {
+        hash.addData(reinterpret_cast<const char*>(chunk->buffer.data()),
+                     chunk->length);
+      }
+      chunk->zero =
+          detect_zeros_ &&
+          (!source_ || isAllZero(chunk->buffer.data(), chunk->length));
+      if (checksum_ && !chunk->zero) {
+        chunk->crc = crc32(crc32(0, Z_NULL, 0), chunk->buffer.data(),
+                           chunk->length);
+      }
+      offset += chunk->length;
+      ring_->pushFilled(chunk);
+    }
+    if (!sha256.empty() && hash.result().toHex().toStdString() != sha256) {
+      LOG_ERROR << "image range at " << begin
+                << " doesn't match its block map checksum";
+      ring_->finish(false);
+      return false;
+    }
+    return true;
+  }
+
+  // Fill |chunk| from the source. If the image is open ended and ends
+  // within the chunk, the chunk is cut short there and so is |*end|.
+  // Returns false on a read error.
+  bool readChunk(Chunk* chunk, uint64_t* end) {
+    if (!open_ended_) {
+      if (!readFully(source_, chunk->offset, chunk->buffer.data(),
+                     chunk->length)) {
+        LOG_ERROR << "read error at " << chunk->offset;
+        return false;
+      }
+      return true;
+    }
+    for (size_t done = 0; done < chunk->length;) {
+      const int64_t count =
+          source_->read(chunk->offset + done, chunk->buffer.data() + done,
+                        chunk->length - done);
+      if (count < 0) {
+        LOG_ERROR << "read error at " << chunk->offset + done;
+        return false;
+      }
+      if (count == 0) {
+        LOG_INFO << "image ends at " << chunk->offset + done;
+        chunk->length = done;
+        *end = chunk->offset + done;
+        ended_ = true;
+        break;
+      }
+      done += count;
+    }
+    return true;
+  }
+
+  ImageSource* source_;
+  ChunkRing* ring_;
+  const uint64_t image_size_;
+  const bool detect_zeros_;
+  const bool checksum_;
+  const BlockMap* block_map_;
+  const ChunkSizeTuner* tuner_;
+  const CancelToken* cancel_;
+  const uint64_t start_offset_;
+  const bool open_ended_;
+  bool ended_ = false;
+};
+
+// Merges consecutive all-zero chunks into runs and has the target zero
+// each run in a single request. Targets that can't do that get the
+// zeros written the ordinary way. Finished runs are passed on to
+// |verifier| if there is one.
+class ZeroRunWriter {
+ public:
+  ZeroRunWriter(BlockDevice* target,
+                const uint64_t sector_size,
+                const size_t buffer_size,
+                ReadBackVerifier* verifier)
+      : target_(target),
+        sector_size_(sector_size),
+        buffer_size_(buffer_size),
+        verifier_(verifier) {}
+
+  bool add(const uint64_t offset, const uint64_t length) {
+    if (run_length_ > 0 && run_offset_ + run_length_ == offset) {
+      run_length_ += length;
+      return true;
+    }
+    if (!flush()) {
+      return false;
+    }
+    run_offset_ = offset;
+    run_length_ = length;
+    return true;
+  }
+
+  // Zero the pending run, if any
+  bool flush() {
+    if (run_length_ == 0) {
+      return true;
+    }
+    const uint64_t offset = run_offset_;
+    const uint64_t length = run_length_;
+    run_length_ = 0;
+    if (supported_ && target_->zeroRange(offset, length)) {
+      LOG_DEBUG << "zeroed " << length << " bytes at " << offset;
+      bytes_skipped_ += length;
+      runs_++;
+    } else {
+      if (supported_) {
+        LOG_INFO << target_->path()
+                 << " can't zero ranges itself, writing zeros instead";
+        supported_ = false;
+      }
+      if (!writeZeros(offset, length)) {
+        return false;
+      }
+    }
+    if (verifier_) {
+      verifier_->addZeroed(offset, length);
+    }
+    return true;
+  }
+
+  uint64_t bytesSkipped() const { return bytes_skipped_; }
+  int runs() const { return runs_; }
+
+ private:
+  bool writeZeros(uint64_t offset, uint64_t length) {
+    if (!zeros_) {
+      zeros_.reset(new AlignedBuffer(buffer_size_, sector_size_));
+      if (!zeros_->valid()) {
+        LOG_ERROR << "could not allocate zero buffer";
+        return false;
+      }
+      memset(zeros_->data(), 0, zeros_->size());
+    }
+    while (length > 0) {
+      const size_t count = std::min<uint64_t>(length, buffer_size_);
+      if (!target_->write(offset, zeros_->data(), count)) {
+        return false;
+      }
+      offset += count;
+      length -= count;
+    }
+    return true;
+  }
+
+  BlockDevice* target_;
+  const uint64_t sector_size_;
+  const size_t buffer_size_;
+  ReadBackVerifier* verifier_;
+  std::unique_ptr<AlignedBuffer> zeros_;
+  uint64_t run_offset_ = 0;
+  uint64_t run_length_ = 0;
+  bool supported_ = true;
+  uint64_t bytes_skipped_ = 0;
+  int runs_ = 0;
+};
+
+// Compares chunks with what the target already holds, for
+// differential writes. Reads happen on the writing thread, so they
+// overlap with source reads but not with writes.
+class ChangeDetector {
+ public:
+  ChangeDetector(BlockDevice* target,
+                 const uint64_t sector_size,
+                 const size_t buffer_size)
+      : target_(target),
+        sector_size_(sector_size),
+        buffer_(buffer_size, sector_size) {}
+
+  bool valid() const { return buffer_.valid(); }
+
+  // True if the target already holds |chunk|'s data
+  bool unchanged(const Chunk& chunk) {
+    if (gave_up_) {
+      return false;
+    }
+    if (bytes_compared_ >= kDiffProbeBytes &&
+        bytes_unchanged_ * kDiffMinRatio < bytes_compared_) {
+      LOG_INFO << target_->path() << " is mostly different from the image, "
+               << "no longer comparing";
+      gave_up_ = true;
+      return false;
+    }
+    bytes_compared_ += chunk.length;
+    if (!target_->read(chunk.offset, buffer_.data(),
+                       roundUp(chunk.length, sector_size_))) {
+      // Writing it is the safe choice
+      return false;
+    }
+    const bool same =
+        chunk.zero ? isAllZero(buffer_.data(), chunk.length)
+                   : memcmp(buffer_.data(), chunk.buffer.data(),
+                            chunk.length) == 0;
+    if (same) {
+      bytes_unchanged_ += chunk.length;
+    }
+    return same;
+  }
+
+  uint64_t bytesUnchanged() const { return bytes_unchanged_; }
+
+ private:
+  BlockDevice* target_;
+  const uint64_t sector_size_;
+  AlignedBuffer buffer_;
+  uint64_t bytes_compared_ = 0;
+  uint64_t bytes_unchanged_ = 0;
+  bool gave_up_ = false;
+};
+
+// Record where |target| wouldn't take writes, so that a stick that
+// fails can be told apart from one that is merely slow
+void logBadRegions(const std::string& target,
+                   const uint64_t sector_size,
+                   const std::vector<BadRegion>& bad_regions) {
+  for (const auto& region : bad_regions) {
+    LOG_ERROR << target << ": bad region of " << region.length
+              << " bytes at " << region.offset << " (sectors "
+              << region.offset / sector_size << "-"
+              << (region.offset + region.length - 1) / sector_size << ")";
+  }
+}
+
+// Drains one consumer's share of |ring| to a target in the calling
+// thread
+class TargetWriter {
+ public:
+  // |start_offset| is where the reader starts, i.e. where an
+  // interrupted write is resumed from
+  TargetWriter(ChunkRing* ring,
+               const int consumer,
+               BlockDevice* target,
+               const uint64_t sector_size,
+               const uint64_t start_offset,
+               const WriteOptions& options,
+               ChunkSizeTuner* tuner,
+               WriteStats* stats)
+      : ring_(ring),
+        consumer_(consumer),
+        target_(target),
+        sector_size_(sector_size),
+        start_offset_(start_offset),
+        options_(options),
+        tuner_(tuner),
+        stats_(stats) {}
+
+  // Write everything the ring hands us: all-zero chunks as zero runs,
+  // the rest through a ChunkWriter, verifying it behind the writer if
+  // asked to. Returns true if the target got the whole image.
+  bool run() {
+    const size_t buffer_size = ring_->chunkSize();
+    const int queue_depth = std::max(options_.queue_depth, 1);
+    std::unique_ptr<ChunkWriter> writer;
+    if (queue_depth > 1) {
+      writer = createUringWriter(target_, ring_, sector_size_, queue_depth);
+      if (!writer) {
+        LOG_INFO << "io_uring unavailable, falling back to synchronous writes";
+      }
+    }
+    if (!writer) {
+      writer = createSyncWriter(target_, ring_, sector_size_);
+    }
+    if (stats_) {
+      stats_->engine = writer->name();
+      stats_->queue_depth = writer->queueDepth();
+    }
+    LOG_INFO << target_->path() << ": " << writer->name()
+             << " writes, queue depth " << writer->queueDepth();
+
+    std::unique_ptr<ReadBackVerifier> verifier;
+    if (options_.verify) {
+      // Stay at least a full queue behind, or the distance means nothing
+      const uint64_t distance = std::max<uint64_t>(
+          options_.verify_distance, (queue_depth + 1) * buffer_size);
+      verifier.reset(
+          new ReadBackVerifier(target_, sector_size_, buffer_size, distance));
+      if (!verifier->valid()) {
+        LOG_ERROR << "could not allocate read-back buffer";
+        ring_->abort(consumer_);
+        return false;
+      }
+      LOG_INFO << "verifying " << distance << " bytes behind the writer";
+      verifier->start();
+    }
+
+    WriteProgress* progress = options_.progress;
+    std::unique_ptr<StallWatchdog> watchdog;
+    if (options_.stall_timeout_ms > 0) {
+      watchdog.reset(new StallWatchdog(target_->path(),
+                                       options_.stall_timeout_ms, progress));
+      watchdog->start();
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+    ReadBackVerifier* raw_verifier = verifier.get();
+    ChunkSizeTuner* raw_tuner = tuner_;
+    StallWatchdog* raw_watchdog = watchdog.get();
+    writer->setStallWatchdog(raw_watchdog);
+    std::vector<int64_t> latencies;
+    std::vector<int64_t>* raw_latencies =
+        options_.record_latency ? &latencies : nullptr;
+    // When each write in flight was submitted, by offset. Chunks are
+    // shared with the other targets' writers, so this can't live in
+    // them.
+    std::unordered_map<uint64_t, int64_t> submit_ns;
+    const bool timed = raw_tuner || raw_latencies;
+    if (raw_verifier || raw_tuner || progress || raw_watchdog ||
+        raw_latencies) {
+      writer->setCompletionCallback(
+          [raw_verifier, raw_tuner, progress, raw_watchdog, raw_latencies,
+           &clock, &submit_ns](const Chunk& chunk) {
+            if (raw_watchdog) {
+              raw_watchdog->touch();
+            }
+            const auto submitted = submit_ns.find(chunk.offset);
+            if (submitted != submit_ns.end()) {
+              const int64_t now_ns = clock.nsecsElapsed();
+              const int64_t latency_ns = now_ns - submitted->second;
+              submit_ns.erase(submitted);
+              if (raw_latencies) {
+                raw_latencies->push_back(latency_ns);
+              }
+              if (raw_tuner) {
+                raw_tuner->onComplete(chunk, latency_ns, now_ns);
+              }
+            }
+            if (raw_verifier) {
+              raw_verifier->addWritten(chunk.offset, chunk.length, chunk.crc);
+            }
+            if (progress) {
+              progress->add(chunk.length);
+            }
+          });
+    }
+
+    std::unique_ptr<ChangeDetector> changes;
+    if (options_.differential) {
+      changes.reset(new ChangeDetector(target_, sector_size_, buffer_size));
+      if (!changes->valid()) {
+        LOG_WARNING << "no comparison buffer, writing everything";
+        changes.reset();
+      }
+    }
+
+    ZeroRunWriter zero_runs(target_, sector_size_, buffer_size,
+                            verifier.get());
+    WriteJournal* journal = options_.journal;
+    // End of the last chunk handed to the writer, and where the last
+    // journal checkpoint (or the start of the write) was
+    uint64_t submitted_end = start_offset_;
+    uint64_t checkpoint = start_offset_;
+    bool success = true;
+    bool cancelled = false;
+    while (Chunk* chunk = ring_->takeFilled(consumer_)) {
+      if (options_.cancel && options_.cancel->cancelled()) {
+        LOG_INFO << "write to " << target_->path() << " cancelled";
+        ring_->release(chunk);
+        cancelled = true;
+        success = false;
+        break;
+      }
+      if (verifier && verifier->failed()) {
+        // No point writing the rest
+        ring_->release(chunk);
+        success = false;
+        break;
+      }
+      if (watchdog && watchdog->stalled()) {
+        ring_->release(chunk);
+        success = false;
+        break;
+      }
+      StallWatchdog::Busy busy(watchdog.get());
+      submitted_end = chunk->offset + chunk->length;
+      if (changes && changes->unchanged(*chunk)) {
+        if (progress) {
+          progress->add(chunk->length);
+        }
+        ring_->release(chunk);
+      } else if (chunk->zero) {
+        const uint64_t offset = chunk->offset;
+        const uint64_t length = roundUp(chunk->length, sector_size_);
+        if (progress) {
+          progress->add(chunk->length);
+        }
+        ring_->release(chunk);
+        if (!zero_runs.add(offset, length)) {
+          success = false;
+          break;
+        }
+      } else {
+        if (timed) {
+          submit_ns[chunk->offset] = clock.nsecsElapsed();
+        }
+        if (!writer->submit(chunk)) {
+          success = false;
+          break;
+        }
+      }
+      if (journal &&
+          submitted_end - checkpoint >= options_.journal_interval) {
+        // Everything submitted so far has to be on the device before
+        // the journal can say so
+        if (!zero_runs.flush() || !writer->drain() || !target_->flush()) {
+          success = false;
+          break;
+        }
+        journal->commit(submitted_end);
+        checkpoint = submitted_end;
+      }
+    }
+    if (!success) {
+      ring_->abort(consumer_);
+    }
+    {
+      StallWatchdog::Busy busy(watchdog.get());
+      if (success && !zero_runs.flush()) {
+        success = false;
+      }
+      if (!writer->drain()) {
+        success = false;
+        ring_->abort(consumer_);
+      }
+    }
+    const std::vector<BadRegion> bad_regions = writer->badRegions();
+    // Buffers must not be reused while the kernel may still use them
+    writer.reset();
+    logBadRegions(target_->path(), sector_size_, bad_regions);
+
+    if (success && ring_->producerFailed()) {
+      // The reader stops the same way when cancelled
+      cancelled = options_.cancel && options_.cancel->cancelled();
+      success = false;
+    }
+    if (verifier) {
+      if (success) {
+        verifier->finish();
+      } else {
+        verifier->abort();
+      }
+      verifier->wait();
+      if (verifier->failed()) {
+        LOG_ERROR << "read-back verification of " << target_->path()
+                  << " failed";
+        success = false;
+      } else if (success) {
+        LOG_INFO << "verified " << verifier->verifiedBytes() << " bytes";
+      }
+      if (stats_) {
+        stats_->verify_failed = verifier->failed();
+        stats_->verified_bytes = verifier->verifiedBytes();
+      }
+    }
+    if (zero_runs.runs() > 0) {
+      LOG_INFO << "skipped writing " << zero_runs.bytesSkipped()
+               << " bytes in " << zero_runs.runs() << " zero runs";
+    }
+    if (changes) {
+      LOG_INFO << "left " << changes->bytesUnchanged()
+               << " unchanged bytes alone";
+    }
+    if (tuner_) {
+      LOG_INFO << "finished with chunk size " << tuner_->chunkSize()
+               << (tuner_->locked() ? "" : " (tuning didn't finish)");
+    }
+    if (stats_) {
+      stats_->chunk_size = tuner_ ? tuner_->chunkSize() : buffer_size;
+      stats_->zero_bytes_skipped = zero_runs.bytesSkipped();
+      stats_->zero_runs = zero_runs.runs();
+      stats_->unchanged_bytes_skipped =
+          changes ? changes->bytesUnchanged() : 0;
+      stats_->cancelled = cancelled;
+      stats_->bad_regions = bad_regions;
+      stats_->chunk_latency_ns = std::move(latencies);
+    }
+    if (success) {
+      StallWatchdog::Busy busy(watchdog.get());
+      success = target_->flush();
+    }
+    if (watchdog) {
+      watchdog->stop();
+      if (watchdog->stalled()) {
+        success = false;
+      }
+      if (stats_) {
+        stats_->stalled = watchdog->stalled();
+      }
+    }
+    if (success && journal) {
+      journal->clear();
+    }
+    return success;
+  }
+
+ private:
+  ChunkRing* ring_;
+  const int consumer_;
+  BlockDevice* target_;
+  const uint64_t sector_size_;
+  const uint64_t start_offset_;
+  const WriteOptions& options_;
+  ChunkSizeTuner* tuner_;
+  WriteStats* stats_;
+};
+
+// Runs a TargetWriter on its own thread, for fan-out
+class TargetThread : public QThread {
+ public:
+  explicit TargetThread(const TargetWriter& writer) : writer_(writer) {}
+
+  bool success() const { return success_; }
+
+ protected:
+  void run() override { success_ = writer_.run(); }
+
+ private:
+  TargetWriter writer_;
+  bool success_ = false;
+};
+
+// Work out which parts of the image to write: those in the caller's
+// block map, those the GPT covers (with the map stored in |gpt_map|),
+// or everything (a null |block_map|). Returns false if the caller's map
+// doesn't fit the image or target.
+bool resolveBlockMap(ImageSource* source,
+                     const uint64_t image_size,
+                     const uint64_t sector_size,
+                     const WriteOptions& options,
+                     BlockMap* gpt_map,
+                     const BlockMap** block_map) {
+  *block_map = options.block_map;
+  if (!*block_map && options.partitions_only && source) {
+    GptLayout gpt;
+    if (readGptLayout(source, image_size, &gpt) &&
+        gpt.sector_size % sector_size == 0) {
+      *gpt_map = gptBlockMap(gpt, image_size);
+      *block_map = gpt_map;
+    } else {
+      LOG_INFO << "no usable GPT in the image, writing all of it";
+    }
+  }
+  if (!*block_map) {
+    return true;
+  }
+  if ((*block_map)->image_size != image_size) {
+    LOG_ERROR << "block map is for a " << (*block_map)->image_size
+              << "-byte image, not " << image_size;
+    return false;
+  }
+  if ((*block_map)->block_size % sector_size != 0) {
+    LOG_ERROR << "block map's " << (*block_map)->block_size
+              << "-byte blocks don't fit " << sector_size << "-byte sectors";
+    return false;
+  }
+  return true;
+}
+
+// Bytes of the image before |end| that are read and written
+uint64_t mappedBytesBefore(const BlockMap* block_map, const uint64_t end) {
+  if (!block_map) {
+    return end;
+  }
+  uint64_t mapped_bytes = 0;
+  for (const auto& range : block_map->ranges) {
+    const uint64_t offset = block_map->rangeOffset(range);
+    if (offset >= end) {
+      break;
+    }
+    mapped_bytes +=
+        std::min(end, offset + block_map->rangeLength(range)) - offset;
+  }
+  return mapped_bytes;
+}
+
+// Bytes of the image that will actually be read and written
+uint64_t mappedBytes(const BlockMap* block_map, const uint64_t image_size) {
+  const uint64_t mapped_bytes = mappedBytesBefore(block_map, image_size);
+  if (block_map) {
+    LOG_INFO << "using block map, " << mapped_bytes << " of " << image_size
+             << " bytes mapped";
+  }
+  return mapped_bytes;
+}
+
+// Fewer than two buffers would serialize reads and writes again, and
+// every queued write holds on to a buffer of its own
+int baseRingDepth(const WriteOptions& options) {
+  const int queue_depth = std::max(options.queue_depth, 1);
+  return std::max(options.ring_depth, queue_depth > 1 ? queue_depth + 2 : 2);
+}
+
+void logZeroSkipping(const WriteOptions& options) {
+  if (options.skip_zero_blocks) {
+    LOG_INFO << "skipping zero blocks, " << zeroDetectImplementation()
+             << " detection";
+  }
+}
+
+// An in-kernel copy never sees the data, which everything but a plain
+// copy needs to
+bool canCopyInKernel(const WriteOptions& options) {
+  return options.zero_copy && !options.verify && !options.block_map &&
+         !options.partitions_only && !options.differential &&
+         !options.autotune && !options.journal;
+}
+
+// Before resuming, read back a few samples of what the interrupted
+// write left on |target| below |end| and compare them with the image:
+// the start, where the partition table lives, the last bytes
+// committed, and some in between. Only mapped parts are compared, as
+// nothing else was written. A forward-only source would have to
+// produce everything up to |end| again for the later samples, so there
+// only the start is compared.
+bool spotCheck(ImageSource* source,
+               BlockDevice* target,
+               const uint64_t sector_size,
+               const BlockMap* block_map,
+               const uint64_t end) {
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  if (block_map) {
+    for (const auto& range : block_map->ranges) {
+      const uint64_t offset = block_map->rangeOffset(range);
+      if (offset >= end) {
+        break;
+      }
+      extents.emplace_back(
+          offset, std::min(end, offset + block_map->rangeLength(range)));
+    }
+  } else {
+    extents.emplace_back(0, end);
+  }
+  uint64_t total = 0;
+  for (const auto& extent : extents) {
+    total += extent.second - extent.first;
+  }
+
+  AlignedBuffer expected(kSpotCheckBytes, sector_size);
+  AlignedBuffer actual(kSpotCheckBytes, sector_size);
+  if (!expected.valid() || !actual.valid()) {
+    LOG_ERROR << "could not allocate spot check buffers";
+    return false;
+  }
+  const int samples = source->forwardOnly() ? 1 : kSpotCheckSamples;
+  for (int sample = 0; sample < samples; sample++) {
+    // Position of the sample within the mapped bytes, the last one
+    // ending exactly at |end|
+    uint64_t position =
+        sample == kSpotCheckSamples - 1
+            ? (total > kSpotCheckBytes ? total - kSpotCheckBytes : 0)
+            : total * sample / (kSpotCheckSamples - 1);
+    position -= position % sector_size;
+    for (const auto& extent : extents) {
+      const uint64_t extent_length = extent.second - extent.first;
+      if (position >= extent_length) {
+        position -= extent_length;
+        continue;
+      }
+      const uint64_t offset = extent.first + position;
+      const size_t length =
+          std::min<uint64_t>(kSpotCheckBytes, extent.second - offset);
+      if (!readFully(source, offset, expected.data(), length) ||
+          !target->read(offset, actual.data(), roundUp(length, sector_size)) ||
+          memcmp(expected.data(), actual.data(), length) != 0) {
+        LOG_WARNING << "spot check at " << offset << " failed";
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+// Where to resume the interrupted write |journal| describes: its last
+// checkpoint if that is usable and the spot check of |target| passes,
+// else 0
+uint64_t resumeOffset(ImageSource* source,
+                      BlockDevice* target,
+                      const uint64_t image_size,
+                      const uint64_t sector_size,
+                      const BlockMap* block_map,
+                      WriteJournal* journal) {
+  const uint64_t committed = journal->load();
+  // Checkpoints fall on chunk boundaries, which are sector aligned
+  // everywhere but at the end of the image
+  if (committed == 0 || committed > image_size ||
+      (committed % sector_size != 0 && committed != image_size)) {
+    return 0;
+  }
+  if (!spotCheck(source, target, sector_size, block_map, committed)) {
+    LOG_WARNING << "target doesn't match the journal, starting over";
+    return 0;
+  }
+  return committed;
+}
+
+}  // namespace
+
+bool canResume(ImageSource* source,
+               BlockDevice* target,
+               const uint64_t image_size,
+               const WriteOptions& options) {
+  // Streamed writes don't keep a journal
+  if (!options.journal || !source || options.open_ended) {
+    return false;
+  }
+  const uint64_t sector_size = std::max<uint64_t>(target->sectorSize(), 512);
+  BlockMap gpt_map;
+  const BlockMap* block_map = nullptr;
+  if (!resolveBlockMap(source, image_size, sector_size, options, &gpt_map,
+                       &block_map)) {
+    return false;
+  }
+  return resumeOffset(source, target, image_size, sector_size, block_map,
+                      options.journal) > 0;
+}
+
+bool writeImage(ImageSource* source,
+                BlockDevice* target,
+                const uint64_t image_size,
+                const WriteOptions& options,
+                WriteStats* stats) {
+  // Streaming only works for a plain copy, and no image can be longer
+  // than its target
+  if (options.open_ended &&
+      (image_size > target->size() || options.block_map ||
+       options.partitions_only || options.journal || options.zero_copy)) {
+    WriteOptions plain = options;
+    plain.block_map = nullptr;
+    plain.partitions_only = false;
+    plain.journal = nullptr;
+    plain.zero_copy = false;
+    return writeImage(source, target, std::min(image_size, target->size()),
+                      plain, stats);
+  }
+  if (image_size > target->size()) {
+    LOG_ERROR << "image is " << image_size << " bytes but " << target->path()
+              << " only holds " << target->size();
+    return false;
+  }
+  // Zeroing with nothing to verify is an erase, which the device can
+  // usually do itself in a fraction of the time
+  if (!source && options.skip_zero_blocks && !options.verify &&
+      !options.block_map) {
+    EraseStats erase_stats;
+    const bool success =
+        eraseRange(target, 0, image_size, options, &erase_stats);
+    if (stats) {
+      stats->engine = "erase";
+      stats->zero_bytes_skipped = erase_stats.zeroed_bytes;
+      stats->zero_runs = erase_stats.zeroed_bytes > 0 ? 1 : 0;
+      stats->cancelled = erase_stats.cancelled;
+      stats->stalled = erase_stats.stalled;
+    }
+    return success;
+  }
+
+  uint64_t copied = 0;
+  if (source && canCopyInKernel(options)) {
+    WriteStats copy_stats;
+    const bool success = copyInKernel(source, target, image_size, options,
+                                      &copied, &copy_stats);
+    if (!success || copied == image_size) {
+      if (stats) {
+        *stats = copy_stats;
+      }
+      return success;
+    }
+    if (copied > 0) {
+      LOG_INFO << "writing the rest of the image from " << copied;
+    }
+  }
+
+  // Unbuffered writes fail unless both the buffer address and the
+  // transfer size are multiples of the sector size
+  const uint64_t sector_size = std::max<uint64_t>(target->sectorSize(), 512);
+  BlockMap gpt_map;
+  const BlockMap* block_map = nullptr;
+  if (!resolveBlockMap(source, image_size, sector_size, options, &gpt_map,
+                       &block_map)) {
+    return false;
+  }
+  std::unique_ptr<ChunkSizeTuner> tuner;
+  if (options.autotune) {
+    tuner.reset(new ChunkSizeTuner(sector_size, options.autotune_trial_bytes));
+  }
+  const size_t buffer_size = tuner
+                                 ? tuner->maxChunkSize()
+                                 : roundUp(options.buffer_size, sector_size);
+  const int ring_depth = baseRingDepth(options);
+  ChunkRing ring(ring_depth, buffer_size, sector_size);
+  if (!ring.valid()) {
+    LOG_ERROR << "could not allocate disk write buffers";
+    return false;
+  }
+
+  LOG_INFO << (source ? "writing image" : "zeroing drive") << ", "
+           << image_size << " bytes, sector size " << sector_size
+           << ", buffer size " << buffer_size << ", ring depth "
+           << ring_depth;
+  const uint64_t mapped_bytes = mappedBytes(block_map, image_size);
+  if (stats) {
+    stats->unmapped_bytes_skipped = image_size - mapped_bytes;
+  }
+  logZeroSkipping(options);
+
+  uint64_t start_offset = 0;
+  if (options.journal && source) {
+    start_offset = resumeOffset(source, target, image_size, sector_size,
+                                block_map, options.journal);
+    if (start_offset > 0) {
+      LOG_INFO << "resuming interrupted write at " << start_offset;
+    }
+  }
+  if (stats) {
+    stats->resumed_from = start_offset;
+  }
+  // What an in-kernel copy got through is done too
+  start_offset = std::max(start_offset, copied);
+  if (options.progress) {
+    options.progress->start(mapped_bytes,
+                            mappedBytesBefore(block_map, start_offset));
+  }
+
+  ReaderThread reader(source, &ring, image_size, options.skip_zero_blocks,
+                      options.verify, block_map, tuner.get(), options.cancel,
+                      start_offset, options.open_ended);
+  reader.start();
+  const bool success = TargetWriter(&ring, 0, target, sector_size,
+                                    start_offset, options, tuner.get(), stats)
+                           .run();
+  reader.wait();
+  return success;
+}
+
+bool writeImageToMany(ImageSource* source,
+                      const std::vector<BlockDevice*>& targets,
+                      const uint64_t image_size,
+                      const WriteOptions& options,
+                      std::vector<TargetResult>* results) {
+  std::vector<TargetResult> local_results;
+  if (!results) {
+    results = &local_results;
+  }
+  results->assign(targets.size(), TargetResult());
+
+  // Targets too small for the image fail up front; the rest go ahead
+  std::vector<size_t> active;
+  uint64_t sector_size = 512;
+  for (size_t i = 0; i < targets.size(); i++) {
+    if (image_size > targets[i]->size()) {
+      LOG_ERROR << "image is " << image_size << " bytes but "
+                << targets[i]->path() << " only holds "
+                << targets[i]->size();
+      continue;
+    }
+    active.push_back(i);
+    // Sector sizes are powers of two, so the largest suits them all
+    sector_size = std::max(sector_size, targets[i]->sectorSize());
+  }
+  if (active.empty()) {
+    return false;
+  }
+
+  BlockMap gpt_map;
+  const BlockMap* block_map = nullptr;
+  if (!resolveBlockMap(source, image_size, sector_size, options, &gpt_map,
+                       &block_map)) {
+    return false;
+  }
+  if (options.autotune) {
+    // Every target sees the same chunks, so they can't each pick a size
+    LOG_INFO << "not autotuning the chunk size when writing to "
+             << active.size() << " targets";
+  }
+  const size_t buffer_size = roundUp(options.buffer_size, sector_size);
+  const int ring_depth =
+      baseRingDepth(options) + options.fan_out_lag / buffer_size;
+  ChunkRing ring(ring_depth, buffer_size, sector_size, active.size());
+  if (!ring.valid()) {
+    LOG_ERROR << "could not allocate disk write buffers";
+    return false;
+  }
+
+  LOG_INFO << (source ? "writing image" : "zeroing drives") << " to "
+           << active.size() << " targets, " << image_size
+           << " bytes, sector size " << sector_size << ", buffer size "
+           << buffer_size << ", ring depth " << ring_depth;
+  const uint64_t mapped_bytes = mappedBytes(block_map, image_size);
+  const uint64_t unmapped_bytes = image_size - mapped_bytes;
+  logZeroSkipping(options);
+  if (options.progress) {
+    options.progress->start(mapped_bytes * active.size());
+  }
+
+  ReaderThread reader(source, &ring, image_size, options.skip_zero_blocks,
+                      options.verify, block_map, nullptr, options.cancel);
+  // Targets resuming from different places can't share one reader
+  WriteOptions target_options = options;
+  target_options.journal = nullptr;
+  std::vector<std::unique_ptr<TargetThread>> threads;
+  for (size_t consumer = 0; consumer < active.size(); consumer++) {
+    const size_t index = active[consumer];
+    WriteStats* stats = &(*results)[index].stats;
+    stats->unmapped_bytes_skipped = unmapped_bytes;
+    threads.emplace_back(new TargetThread(
+        TargetWriter(&ring, consumer, targets[index], sector_size, 0,
+                     target_options, nullptr, stats)));
+  }
+  reader.start();
+  for (auto& thread : threads) {
+    thread->start();
+  }
+
+  bool all_succeeded = active.size() == targets.size();
+  for (size_t consumer = 0; consumer < active.size(); consumer++) {
+    threads[consumer]->wait();
+    const size_t index = active[consumer];
+    (*results)[index].success = threads[consumer]->success();
+    if ((*results)[index].success) {
+      LOG_INFO << targets[index]->path() << ": written";
+    } else {
+      LOG_ERROR << targets[index]->path() << ": failed";
+      all_succeeded = false;
+    }
+  }
+  reader.wait();
+  return all_succeeded;
+}
+
+#if !defined(__linux__)
+bool copyInKernel(ImageSource*,
+                  BlockDevice*,
+                  uint64_t,
+                  const WriteOptions&,
+                  uint64_t* copied,
+                  WriteStats*) {
+  *copied = 0;
+  return true;
+}
+#endif
+
+}  // namespace gondar
@@ -0,0 +1,198 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_WRITE_ENGINE_H_
+#define SRC_WRITE_ENGINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "block_device.h"
+
+namespace gondar {
+
+struct BlockMap;
+class CancelToken;
+class WriteJournal;
+class WriteProgress;
+
+struct WriteOptions {
+  // Bytes per read and per write, rounded up to a multiple of the
+  // target's sector size
+  size_t buffer_size = 1024 * 1024;
+  // Pick the write size by measuring the target instead (buffer_size
+  // is then ignored): each candidate size gets |autotune_trial_bytes|
+  // of writes and the fastest wins. See ChunkSizeTuner.
+  bool autotune = false;
+  uint64_t autotune_trial_bytes = 32 * 1024 * 1024;
+  // Number of buffers in the ring between the reader thread and the
+  // writer, i.e. how far reads may run ahead of writes
+  int ring_depth = 4;
+  // Number of device writes kept in flight. Values above one use
+  // io_uring where available and fall back to one write at a time
+  // otherwise. The ring is grown if needed so the reader can keep up.
+  int queue_depth = 4;
+  // Skip buffers that are entirely zero and ask the target to zero
+  // the range instead (see BlockDevice::zeroRange), which avoids
+  // pushing large empty regions of the image over the bus. With no
+  // source the whole write becomes one such request (see eraseRange).
+  // Off by default, as it relies on the target zeroing ranges
+  // correctly.
+  bool skip_zero_blocks = false;
+  // If set, only the ranges it maps are written, and each is checked
+  // against its checksum as it is read. Must outlive the write.
+  const BlockMap* block_map = nullptr;
+  // If the image has a GPT, write only the protective MBR, the primary
+  // and backup tables and the allocated partitions, leaving the rest
+  // of the target alone. Ignored if |block_map| is set.
+  bool partitions_only = false;
+  // Read back everything written or zeroed and compare it against a
+  // CRC-32 of the data sent. Reads trail the writer by at least
+  // |verify_distance| bytes and bypass the page cache.
+  bool verify = false;
+  uint64_t verify_distance = 64 * 1024 * 1024;
+  // With writeImageToMany(), how far the fastest target may get ahead
+  // of the slowest before it has to wait. This many bytes of buffers
+  // are allocated on top of the usual ring.
+  uint64_t fan_out_lag = 64 * 1024 * 1024;
+  // If set, progress is committed to the journal every
+  // |journal_interval| bytes, and a write that the journal says was
+  // interrupted resumes where it left off once a spot check of what is
+  // already on the target passes. Must outlive the write. Ignored by
+  // writeImageToMany().
+  WriteJournal* journal = nullptr;
+  uint64_t journal_interval = 64 * 1024 * 1024;
+  // Read each chunk's range from the target first and skip the write
+  // if it already holds the same data, which makes re-flashing a stick
+  // with a slightly newer image mostly reads. Comparing stops if the
+  // target turns out to be largely different.
+  bool differential = false;
+  // If set, updated as the write goes, for progress reporting from
+  // another thread. Counts image bytes, whether they were written,
+  // zeroed or found unchanged; with writeImageToMany(), summed over
+  // all targets. Must outlive the write.
+  WriteProgress* progress = nullptr;
+  // If set, checked between chunks; once it is cancelled the write
+  // stops, waits for queued writes and fails with
+  // WriteStats::cancelled set
+  const CancelToken* cancel = nullptr;
+  // Give up on a target once it has spent this long in a write, flush
+  // or zeroing call without finishing any write (see StallWatchdog).
+  // 0 disables the watchdog.
+  int64_t stall_timeout_ms = 60 * 1000;
+  // Have the kernel move the data from the source file to the target
+  // itself (copy_file_range, or splice through a pipe), without it
+  // passing through the ring buffers, which saves most of the CPU time
+  // of a write. Linux only. Zero blocks are copied like any other. Only
+  // applies to a plain copy, so it is ignored along with verify,
+  // block_map, partitions_only, differential, autotune or a journal.
+  // If the kernel or filesystem refuses, the write carries on through
+  // the ring from wherever the copy got to.
+  bool zero_copy = false;
+  // Take |image_size| as no more than a limit: the image ends wherever
+  // the source's reads do, and may not be longer than the target. For
+  // images that are streamed in before their size is known, such as
+  // zips with data descriptors (see ZipStreamSource). Only a plain
+  // copy can be streamed, so block_map, partitions_only, journal and
+  // zero_copy are ignored. Progress is counted against |image_size|,
+  // so pass the image's expected size where there is one rather than
+  // the target's. Not supported by writeImageToMany().
+  bool open_ended = false;
+  // Fill in WriteStats::chunk_latency_ns, for benchmarking
+  bool record_latency = false;
+};
+
+// What writeImage() actually did, for logging and tests
+struct WriteStats {
+  // Name of the write backend used, "io_uring" or "sync", "erase" if
+  // zeroing was handed to eraseRange(), or "copy_file_range" or
+  // "splice" if the kernel copied the whole image itself
+  std::string engine;
+  // Number of writes that were kept in flight
+  int queue_depth = 0;
+  // Write size in use at the end
+  size_t chunk_size = 0;
+  // Bytes the target zeroed itself rather than having them written,
+  // and the number of contiguous runs they made up
+  uint64_t zero_bytes_skipped = 0;
+  int zero_runs = 0;
+  // Bytes left out because the block map or partition table doesn't
+  // cover them
+  uint64_t unmapped_bytes_skipped = 0;
+  // Set if read-back verification found a mismatch or read error
+  bool verify_failed = false;
+  uint64_t verified_bytes = 0;
+  // Where in the image the write picked up from a journal, or 0
+  uint64_t resumed_from = 0;
+  // Bytes not written because the target already held them
+  uint64_t unchanged_bytes_skipped = 0;
+  // Set if the write stopped because it was cancelled
+  bool cancelled = false;
+  // Set if the target stopped responding
+  bool stalled = false;
+  // Parts of the target that wouldn't take a write, down to the sector
+  std::vector<BadRegion> bad_regions;
+  // Time from submission to completion of each chunk written, in
+  // completion order, if WriteOptions::record_latency was set
+  std::vector<int64_t> chunk_latency_ns;
+};
+
+// Outcome for one target of writeImageToMany()
+struct TargetResult {
+  bool success = false;
+  WriteStats stats;
+};
+
+// Copy the first |image_size| bytes of |source| to the start of
+// |target|. If |source| is null the same range of |target| is zeroed
+// instead, by eraseRange() unless verifying or told not to skip zero
+// blocks. Source reads happen on a separate thread so that they
+// overlap with device writes. Returns true on success. If |stats| is
+// non-null it is filled in even on failure.
+bool writeImage(ImageSource* source,
+                BlockDevice* target,
+                uint64_t image_size,
+                const WriteOptions& options = WriteOptions(),
+                WriteStats* stats = nullptr);
+
+// Whether writeImage() with the same arguments would resume the
+// interrupted write in |options.journal| rather than start over: the
+// journal has a usable checkpoint, and a spot check of what is on
+// |target| up to it matches the image. Only reads |target|, so it may
+// be one opened just for reading, before the real target is prepared.
+bool canResume(ImageSource* source,
+               BlockDevice* target,
+               uint64_t image_size,
+               const WriteOptions& options);
+
+// Copy the first |image_size| bytes of |source| to every target in
+// |targets| at once, reading the source only once. Each target has a
+// writer thread of its own; they share the read buffers, so the
+// slowest one paces the rest once they are
+// WriteOptions::fan_out_lag ahead. A target that fails drops out
+// without holding up the others. Chunk size autotuning is not
+// supported. Returns true if every target succeeded. If |results| is
+// non-null it gets one entry per target, in the same order.
+bool writeImageToMany(ImageSource* source,
+                      const std::vector<BlockDevice*>& targets,
+                      uint64_t image_size,
+                      const WriteOptions& options = WriteOptions(),
+                      std::vector<TargetResult>* results = nullptr);
+
+}  // namespace gondar
+
+#endif  // SRC_WRITE_ENGINE_H_
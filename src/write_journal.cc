@@ -0,0 +1,142 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "write_journal.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// First line of every journal, so that a format change can't be
+// misread
+const char kJournalMagic[] = "gondar-write-journal 1";
+
+// Bytes at each end of the image that go into its fingerprint
+constexpr qint64 kFingerprintBytes = 1024 * 1024;
+
+std::string sha256Hex(const QByteArray& data) {
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha256)
+      .toHex()
+      .toStdString();
+}
+
+}  // namespace
+
+WriteJournal::WriteJournal(const std::string& path,
+                           const std::string& device_id,
+                           const std::string& image_id)
+    : path_(path), device_id_(device_id), image_id_(image_id) {}
+
+uint64_t WriteJournal::load() const {
+  QFile file(QString::fromStdString(path_));
+  if (!file.open(QFile::ReadOnly)) {
+    return 0;
+  }
+  const QList<QByteArray> lines = file.readAll().split('\n');
+  if (lines.isEmpty() || lines[0] != kJournalMagic) {
+    LOG_WARNING << "ignoring unreadable write journal " << path_;
+    return 0;
+  }
+  std::string device_id;
+  std::string image_id;
+  uint64_t committed = 0;
+  for (const auto& line : lines.mid(1)) {
+    const int space = line.indexOf(' ');
+    if (space < 0) {
+      continue;
+    }
+    const QByteArray key = line.left(space);
+    const QByteArray value = line.mid(space + 1);
+    if (key == "device") {
+      device_id = value.toStdString();
+    } else if (key == "image") {
+      image_id = value.toStdString();
+    } else if (key == "committed") {
+      committed = value.toULongLong();
+    }
+  }
+  if (device_id != device_id_ || image_id != image_id_) {
+    LOG_INFO << "write journal is for a different device or image";
+    return 0;
+  }
+  return committed;
+}
+
+bool WriteJournal::commit(const uint64_t offset) {
+  QByteArray contents(kJournalMagic);
+  contents += "\ndevice " + QByteArray::fromStdString(device_id_);
+  contents += "\nimage " + QByteArray::fromStdString(image_id_);
+  contents += "\ncommitted " + QByteArray::number(qulonglong(offset)) + "\n";
+  QSaveFile file(QString::fromStdString(path_));
+  if (!file.open(QFile::WriteOnly)) {
+    LOG_WARNING << "could not create " << path_ << ": " << file.errorString();
+    return false;
+  }
+  file.write(contents);
+  if (!file.commit()) {
+    LOG_WARNING << "could not write " << path_ << ": " << file.errorString();
+    return false;
+  }
+  return true;
+}
+
+void WriteJournal::clear() {
+  QFile::remove(QString::fromStdString(path_));
+}
+
+std::string journalPathFor(const std::string& device_id) {
+  const QDir dir =
+      QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+  const QString subdir = dir.filePath(QStringLiteral("neverware"));
+  if (!QDir().mkpath(subdir)) {
+    LOG_WARNING << "could not create " << subdir;
+    return std::string();
+  }
+  // Device ids can hold anything, so name the file after a hash
+  const std::string name =
+      sha256Hex(QByteArray::fromStdString(device_id)).substr(0, 16);
+  return QDir(subdir)
+      .filePath(QString::fromStdString(name + ".journal"))
+      .toStdString();
+}
+
+std::string imageFingerprint(const std::string& path) {
+  QFile file(QString::fromStdString(path));
+  if (!file.open(QFile::ReadOnly)) {
+    LOG_WARNING << "could not open " << path << ": " << file.errorString();
+    return std::string();
+  }
+  const qint64 size = file.size();
+  const QDateTime modified = QFileInfo(file).lastModified();
+  QByteArray data = QByteArray::number(size) + " " +
+                    QByteArray::number(modified.toMSecsSinceEpoch()) + "\n";
+  data += file.read(kFingerprintBytes);
+  if (size > kFingerprintBytes && file.seek(size - kFingerprintBytes)) {
+    data += file.read(kFingerprintBytes);
+  }
+  return sha256Hex(data);
+}
+
+}  // namespace gondar
@@ -0,0 +1,67 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_WRITE_JOURNAL_H_
+#define SRC_WRITE_JOURNAL_H_
+
+#include <cstdint>
+#include <string>
+
+namespace gondar {
+
+// Records how much of an image has durably reached a device, so that a
+// write that was interrupted (stick pulled, app crashed) can resume
+// instead of starting over. The journal is a small text file that is
+// replaced atomically at each checkpoint and removed once the write
+// completes. Everything before the committed offset in image order
+// has been written, or deliberately skipped, and flushed.
+class WriteJournal {
+ public:
+  // |device_id| and |image_id| say what is being written where; a
+  // journal left behind by any other write is ignored
+  WriteJournal(const std::string& path,
+               const std::string& device_id,
+               const std::string& image_id);
+
+  const std::string& path() const { return path_; }
+
+  // Offset a previous attempt got to, or 0 if there is nothing to
+  // resume
+  uint64_t load() const;
+
+  // Record that everything before |offset| is on the device
+  bool commit(uint64_t offset);
+
+  // Forget the journal, once the write has completed
+  void clear();
+
+ private:
+  const std::string path_;
+  const std::string device_id_;
+  const std::string image_id_;
+};
+
+// Where to keep the journal for writes to |device_id|, in the app's
+// data directory. Returns an empty string if that isn't available.
+std::string journalPathFor(const std::string& device_id);
+
+// Cheap identity for the image at |path|: a SHA-256 of its size,
+// modification time and first and last megabyte. Returns an empty
+// string if the file can't be read.
+std::string imageFingerprint(const std::string& path);
+
+}  // namespace gondar
+
+#endif  // SRC_WRITE_JOURNAL_H_
@@ -21,8 +21,14 @@
 #include "metric.h"
 
 WriteOperationPage::WriteOperationPage(QWidget* parent)
-    : WizardPage(parent), device(0, std::string(), 0) {
+    : WizardPage(parent),
+      diskWriteThread(nullptr),
+      device(0, std::string(), 0) {
   layout.addWidget(&progress);
+  cancelButton.setText("Stop writing");
+  connect(&cancelButton, &QPushButton::clicked, this,
+          &WriteOperationPage::onCancelClicked);
+  layout.addWidget(&cancelButton, 0, Qt::AlignLeft);
   bolded.setObjectName("bolded");
   bolded.setText("<br>What's next?<br>");
   layout.addWidget(&bolded);
@@ -48,6 +54,14 @@ void WriteOperationPage::setDevice(const DeviceGuy& device_in) {
   device = device_in;
 }
 
+void WriteOperationPage::setWriteOptions(const gondar::WriteOptions& options) {
+  writeOptions = options;
+}
+
+void WriteOperationPage::setResumable(const bool resumable_in) {
+  resumable = resumable_in;
+}
+
 void WriteOperationPage::initializePage() {
   // set the titles in initializePage for 'make another' flow
   if (wizard()->isFormatOnly()) {
@@ -60,6 +74,11 @@ void WriteOperationPage::initializePage() {
   bolded.hide();
   whatsNext.hide();
   writeFinished = false;
+  cancelling = false;
+  cancelledByUser = false;
+  // formatting takes a moment and doesn't watch the cancel token
+  cancelButton.setEnabled(true);
+  cancelButton.setVisible(!wizard()->isFormatOnly());
   writeToDrive();
 }
 
@@ -79,23 +98,90 @@ void WriteOperationPage::writeToDrive() {
     diskWriteThread = new DiskWriteThread(&device, this);
     gondar::SendMetric(wizard(), gondar::Metric::FormatAttempt);
   } else {
-    image_path.clear();
-    image_path.append(wizard()->downloadProgressPage.getImageFileName());
-    diskWriteThread = new DiskWriteThread(&device, image_path, this);
+    gondar::ZipStreamSource* stream =
+        wizard()->downloadProgressPage.streamSource();
+    if (stream) {
+      // the image is still downloading
+      diskWriteThread = new DiskWriteThread(&device, stream, this);
+    } else {
+      image_path.clear();
+      image_path.append(wizard()->downloadProgressPage.getImageFileName());
+      const QString& entry_name =
+          wizard()->downloadProgressPage.getImageEntryName();
+      if (entry_name.isEmpty()) {
+        // the image was extracted from the zip
+        diskWriteThread = new DiskWriteThread(&device, image_path, this);
+      } else {
+        diskWriteThread =
+            new DiskWriteThread(&device, image_path, entry_name, this);
+      }
+    }
+    diskWriteThread->setCancelToken(&wizard()->cancelToken);
+    diskWriteThread->setWriteOptions(writeOptions);
+    diskWriteThread->setResumable(resumable);
     gondar::SendMetric(wizard(), gondar::Metric::UsbAttempt);
   }
   connect(diskWriteThread, &DiskWriteThread::finished, this,
           &WriteOperationPage::onDoneWriting);
+  connect(diskWriteThread, &DiskWriteThread::progressChanged, this,
+          &WriteOperationPage::onProgress);
   showProgress();
   LOG_INFO << "launching thread...";
   diskWriteThread->start();
 }
 
+bool WriteOperationPage::cancel() {
+  if (!diskWriteThread || !diskWriteThread->isRunning()) {
+    return false;
+  }
+  wizard()->cancelToken.cancel();
+  cancelling = true;
+  cancelButton.setEnabled(false);
+  setSubTitle("Stopping...");
+  return true;
+}
+
+void WriteOperationPage::onCancelClicked() {
+  LOG_INFO << "write cancelled by the user";
+  cancelledByUser = cancel();
+}
+
 void WriteOperationPage::showProgress() {
   progress.setRange(0, 0);
   progress.setValue(0);
 }
 
+void WriteOperationPage::onProgress(const gondar::ProgressSample& sample) {
+  if (writeFinished || cancelling || sample.total == 0) {
+    return;
+  }
+  if (sample.stalled) {
+    setSubTitle("The USB device has stopped responding...");
+    return;
+  }
+  const int kSteps = 1000;
+  progress.setRange(0, kSteps);
+  progress.setValue(static_cast<int>(
+      static_cast<double>(sample.done) / sample.total * kSteps));
+
+  const double megabyte = 1000 * 1000;
+  QString text = QString("%1 of %2 MB written")
+                     .arg(static_cast<qulonglong>(sample.done / megabyte))
+                     .arg(static_cast<qulonglong>(sample.total / megabyte));
+  if (sample.current_rate > 0) {
+    text += QString(", %1 MB/s (%2 MB/s average)")
+                .arg(sample.current_rate / megabyte, 0, 'f', 1)
+                .arg(sample.average_rate / megabyte, 0, 'f', 1);
+  }
+  if (sample.eta_ms > 0) {
+    const qint64 seconds = sample.eta_ms / 1000;
+    text += QString(", about %1:%2 left")
+                .arg(seconds / 60)
+                .arg(seconds % 60, 2, 10, QChar('0'));
+  }
+  setSubTitle(text);
+}
+
 void WriteOperationPage::showWhatsNext() {
   bolded.setObjectName("bolded");
   bolded.setText("<br>What's next?<br>");
@@ -135,6 +221,8 @@ void WriteOperationPage::showWhatsNext() {
 }
 
 void WriteOperationPage::onDoneWriting() {
+  cancelButton.hide();
+  emit writeStopped();
   switch (diskWriteThread->state()) {
     case DiskWriteThread::State::Initial:
     case DiskWriteThread::State::Running:
@@ -151,6 +239,43 @@ void WriteOperationPage::onDoneWriting() {
       writeFailed("Error writing to the USB device");
       return;
 
+    case DiskWriteThread::State::VerifyFailed:
+      writeFailed(
+          "The USB device did not read back correctly after writing; it "
+          "may be faulty");
+      return;
+
+    case DiskWriteThread::State::BadRegions: {
+      // there is always at least one in this state
+      const qulonglong offset_mb =
+          diskWriteThread->badRegions().front().offset / (1000 * 1000);
+      writeFailed(QString("Part of the USB device, %1 MB in, could not be "
+                          "written; it is likely faulty")
+                      .arg(offset_mb));
+      return;
+    }
+
+    case DiskWriteThread::State::Stalled:
+      writeFailed(
+          "The USB device stopped responding while it was being written; "
+          "it may be faulty");
+      return;
+
+    case DiskWriteThread::State::StreamFailed:
+      writeFailed(
+          "An error has occurred downloading the latest image.  Please "
+          "ensure you have a network connection.");
+      return;
+
+    case DiskWriteThread::State::Cancelled:
+      if (cancelledByUser) {
+        writeFailed(
+            "Writing was stopped before it finished; the USB device will "
+            "need to be written again before it can be used");
+      }
+      // otherwise the wizard is closing, there's nobody to tell
+      return;
+
     case DiskWriteThread::State::Success:
       // on success, break out to normal onDoneWriting logic
       break;
@@ -18,10 +18,13 @@
 
 #include <QLabel>
 #include <QProgressBar>
+#include <QPushButton>
 #include <QVBoxLayout>
 
 #include "device.h"
 #include "wizard_page.h"
+#include "write_engine.h"
+#include "write_progress.h"
 
 class DiskWriteThread;
 
@@ -32,6 +35,15 @@ class WriteOperationPage : public gondar::WizardPage {
   explicit WriteOperationPage(QWidget* parent = 0);
 
   void setDevice(const DeviceGuy& device);
+  // How the image is to be written, as chosen on the device page
+  void setWriteOptions(const gondar::WriteOptions& options);
+  // Keep a journal of the write so that an interrupted one can be
+  // resumed (see DiskWriteThread::setResumable)
+  void setResumable(bool resumable_in);
+  // Ask a running write to stop through the wizard's cancel token,
+  // without waiting for it. Returns true if one was running, in which
+  // case writeStopped() follows once it has cleaned up.
+  bool cancel();
 
  protected:
   void initializePage() override;
@@ -40,18 +52,31 @@ class WriteOperationPage : public gondar::WizardPage {
   void showProgress();
   int nextId() const override;
   void showWhatsNext();
+ signals:
+  // The write's thread has finished, however it went
+  void writeStopped();
+
  public slots:
   void onDoneWriting();
+  void onProgress(const gondar::ProgressSample& sample);
+  void onCancelClicked();
 
  private:
   void writeToDrive();
   void writeFailed(const QString& errorMessage);
   QVBoxLayout layout;
   QProgressBar progress;
+  QPushButton cancelButton;
   bool writeFinished;
+  // Set once a cancel has been asked for, and by the user rather than
+  // by closing the wizard
+  bool cancelling = false;
+  bool cancelledByUser = false;
   DiskWriteThread* diskWriteThread;
   QString image_path;
   DeviceGuy device;
+  gondar::WriteOptions writeOptions;
+  bool resumable = false;
   QLabel bolded;
   QLabel whatsNext;
 };
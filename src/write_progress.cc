@@ -0,0 +1,76 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "write_progress.h"
+
+namespace gondar {
+
+namespace {
+
+// Weight of the newest interval in the current rate. Device writes
+// come in bursts, so a single interval says little on its own.
+constexpr double kRateSmoothing = 0.3;
+
+}  // namespace
+
+void WriteProgress::start(const uint64_t total, const uint64_t done) {
+  done_.store(done);
+  total_.store(total);
+}
+
+ProgressMeter::ProgressMeter(const WriteProgress* progress)
+    : progress_(progress) {}
+
+ProgressSample ProgressMeter::sample(const int64_t now_ms) {
+  ProgressSample sample;
+  sample.done = progress_->done();
+  sample.total = progress_->total();
+  sample.stalled = progress_->stalled();
+  if (sample.total == 0) {
+    return sample;
+  }
+  if (!started_) {
+    // Rates count from here, so that bytes done by an earlier attempt
+    // don't inflate them
+    started_ = true;
+    start_ms_ = last_ms_ = now_ms;
+    start_done_ = last_done_ = sample.done;
+    return sample;
+  }
+
+  if (now_ms > last_ms_) {
+    const double rate =
+        (sample.done - last_done_) * 1000.0 / (now_ms - last_ms_);
+    current_rate_ = last_ms_ == start_ms_
+                        ? rate
+                        : kRateSmoothing * rate +
+                              (1 - kRateSmoothing) * current_rate_;
+    last_ms_ = now_ms;
+    last_done_ = sample.done;
+  }
+  sample.current_rate = current_rate_;
+  if (now_ms > start_ms_) {
+    sample.average_rate =
+        (sample.done - start_done_) * 1000.0 / (now_ms - start_ms_);
+  }
+  if (sample.done >= sample.total) {
+    sample.eta_ms = 0;
+  } else if (current_rate_ > 0) {
+    sample.eta_ms = (sample.total - sample.done) * 1000.0 / current_rate_;
+  }
+  return sample;
+}
+
+}  // namespace gondar
@@ -0,0 +1,82 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_WRITE_PROGRESS_H_
+#define SRC_WRITE_PROGRESS_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace gondar {
+
+// How much of a write is done. The write engine updates it from its
+// own threads and anyone may poll it; it is lock-free so that the
+// writers never wait on the UI.
+class WriteProgress {
+ public:
+  // Begin a write of |total| bytes, of which |done| are already done
+  // (e.g. by an earlier, interrupted attempt)
+  void start(uint64_t total, uint64_t done = 0);
+  void add(uint64_t bytes) { done_.fetch_add(bytes); }
+
+  uint64_t done() const { return done_.load(); }
+  // 0 until the write has started
+  uint64_t total() const { return total_.load(); }
+
+  // Set once a target has stopped responding (see StallWatchdog)
+  void setStalled() { stalled_.store(true); }
+  bool stalled() const { return stalled_.load(); }
+
+ private:
+  std::atomic<uint64_t> done_{0};
+  std::atomic<uint64_t> total_{0};
+  std::atomic<bool> stalled_{false};
+};
+
+// One reading of a ProgressMeter
+struct ProgressSample {
+  uint64_t done = 0;
+  uint64_t total = 0;
+  // Bytes per second, recently and since the first sample
+  double current_rate = 0;
+  double average_rate = 0;
+  // Estimated time left, or -1 if there isn't enough data yet
+  int64_t eta_ms = -1;
+  // A target has stopped responding
+  bool stalled = false;
+};
+
+// Turns successive polls of a WriteProgress into throughput and ETA.
+// Not thread-safe; poll it from one thread.
+class ProgressMeter {
+ public:
+  explicit ProgressMeter(const WriteProgress* progress);
+
+  // Read the progress at time |now_ms| (any monotonic clock)
+  ProgressSample sample(int64_t now_ms);
+
+ private:
+  const WriteProgress* progress_;
+  bool started_ = false;
+  int64_t start_ms_ = 0;
+  uint64_t start_done_ = 0;
+  int64_t last_ms_ = 0;
+  uint64_t last_done_ = 0;
+  double current_rate_ = 0;
+};
+
+}  // namespace gondar
+
+#endif  // SRC_WRITE_PROGRESS_H_
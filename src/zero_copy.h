@@ -0,0 +1,46 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_ZERO_COPY_H_
+#define SRC_ZERO_COPY_H_
+
+#include <cstdint>
+
+#include "block_device.h"
+#include "write_engine.h"
+
+namespace gondar {
+
+// Copy the start of |source| to the start of |target| inside the
+// kernel, with copy_file_range() or failing that splice() through a
+// pipe, so that the data never passes through a user-space buffer.
+// Only whole sectors are copied, up to |image_size|. Sets |*copied| to
+// how far the target holds the image, which falls short if the kernel
+// or filesystem refuses the transfer or a call fails; the caller then
+// writes the rest the usual way. The progress, cancel and
+// stall_timeout_ms options apply as they do to writeImage(), and
+// |stats| gets the method used. Returns false if the write has to stop
+// there: cancelled, stalled (with |stats| saying so) or a failed
+// flush. Always leaves |*copied| at 0 on platforms other than Linux.
+bool copyInKernel(ImageSource* source,
+                  BlockDevice* target,
+                  uint64_t image_size,
+                  const WriteOptions& options,
+                  uint64_t* copied,
+                  WriteStats* stats);
+
+}  // namespace gondar
+
+#endif  // SRC_ZERO_COPY_H_
@@ -0,0 +1,290 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "zero_copy.h"
+
+#include <QElapsedTimer>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "cancel_token.h"
+#include "log.h"
+#include "stall_watchdog.h"
+#include "write_progress.h"
+
+namespace gondar {
+
+namespace {
+
+// Most one call covers, so that progress, cancellation and the stall
+// watchdog keep working
+constexpr uint64_t kSliceSize = 16 * 1024 * 1024;
+
+// Pipe capacity asked for when splicing. The default of 64 KiB would
+// take two system calls for every 64 KiB.
+constexpr int kPipeSize = 1024 * 1024;
+
+// Whether a failure with |error| means this kind of transfer isn't
+// possible between the two files, rather than an I/O error
+bool isUnsupported(const int error) {
+  return error == EINVAL || error == EXDEV || error == ENOSYS ||
+         error == EOPNOTSUPP || error == EBADF;
+}
+
+// Move |length| bytes at |in_base| + |offset| of |in_fd| to |offset|
+// of |out_fd| with copy_file_range(), which is done through a raw
+// system call as glibc only wraps it from 2.27 on. Sets |*moved| to how
+// many bytes made it, also on failure, which leaves the reason in
+// errno.
+bool copyFileRange(const int in_fd,
+                   const uint64_t in_base,
+                   const int out_fd,
+                   const uint64_t offset,
+                   const size_t length,
+                   size_t* moved) {
+  *moved = 0;
+#if defined(__NR_copy_file_range)
+  while (*moved < length) {
+    loff_t in_offset = in_base + offset + *moved;
+    loff_t out_offset = offset + *moved;
+    const ssize_t rc = syscall(__NR_copy_file_range, in_fd, &in_offset,
+                               out_fd, &out_offset, length - *moved, 0);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      // Some filesystems report that they can't copy by copying nothing
+      if (rc == 0) {
+        errno = EOPNOTSUPP;
+      }
+      return false;
+    }
+    *moved += rc;
+  }
+  return true;
+#else
+  (void)in_fd;
+  (void)in_base;
+  (void)out_fd;
+  (void)offset;
+  (void)length;
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+// splice() needs a pipe in between the two files. Once a transfer has
+// failed the pipe may still hold data, so it must not be used again.
+class Splicer {
+  Splicer& operator=(Splicer&) = delete;
+  Splicer(Splicer&) = delete;
+
+ public:
+  Splicer() {
+    if (pipe2(fds_, O_CLOEXEC) != 0) {
+      fds_[0] = fds_[1] = -1;
+      return;
+    }
+    // Best effort; a small pipe only means more calls
+    fcntl(fds_[1], F_SETPIPE_SZ, kPipeSize);
+  }
+
+  ~Splicer() {
+    if (valid()) {
+      close(fds_[0]);
+      close(fds_[1]);
+    }
+  }
+
+  bool valid() const { return fds_[0] >= 0; }
+
+  // Same contract as copyFileRange()
+  bool transfer(const int in_fd,
+                const uint64_t in_base,
+                const int out_fd,
+                const uint64_t offset,
+                const size_t length,
+                size_t* moved) {
+    *moved = 0;
+    while (*moved < length) {
+      loff_t in_offset = in_base + offset + *moved;
+      const ssize_t filled =
+          splice(in_fd, &in_offset, fds_[1], nullptr, length - *moved,
+                 SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (filled < 0 && errno == EINTR) {
+        continue;
+      }
+      if (filled <= 0) {
+        if (filled == 0) {
+          errno = EOPNOTSUPP;
+        }
+        return false;
+      }
+      for (ssize_t drained = 0; drained < filled;) {
+        loff_t out_offset = offset + *moved;
+        const ssize_t rc =
+            splice(fds_[0], nullptr, out_fd, &out_offset, filled - drained,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (rc < 0 && errno == EINTR) {
+          continue;
+        }
+        if (rc <= 0) {
+          if (rc == 0) {
+            errno = EIO;
+          }
+          return false;
+        }
+        drained += rc;
+        *moved += rc;
+      }
+    }
+    return true;
+  }
+
+ private:
+  int fds_[2];
+};
+
+}  // namespace
+
+bool copyInKernel(ImageSource* source,
+                  BlockDevice* target,
+                  const uint64_t image_size,
+                  const WriteOptions& options,
+                  uint64_t* copied,
+                  WriteStats* stats) {
+  *copied = 0;
+  const int in_fd = source->fd();
+  const uint64_t in_base = source->fdOffset();
+  const int out_fd = target->fd();
+  if (in_fd < 0 || out_fd < 0) {
+    LOG_INFO << "no file descriptors to copy to " << target->path()
+             << " with";
+    return true;
+  }
+  // Unbuffered targets only take whole sectors; the caller pads the
+  // tail
+  const uint64_t sector_size = std::max<uint64_t>(target->sectorSize(), 512);
+  const uint64_t length =
+      std::min<uint64_t>(image_size, std::max<int64_t>(source->size(), 0)) /
+      sector_size * sector_size;
+  if (length == 0) {
+    return true;
+  }
+
+  WriteProgress* progress = options.progress;
+  if (progress) {
+    progress->start(image_size);
+  }
+  std::unique_ptr<StallWatchdog> watchdog;
+  if (options.stall_timeout_ms > 0) {
+    watchdog.reset(new StallWatchdog(target->path(), options.stall_timeout_ms,
+                                     progress));
+    watchdog->start();
+  }
+
+  std::unique_ptr<Splicer> splicer;
+  QElapsedTimer clock;
+  uint64_t done = 0;
+  // Bytes reported to |progress|, which only counts whole sectors, as
+  // that is where the ring picks up if the copy stops
+  uint64_t counted = 0;
+  while (done < length) {
+    if (options.cancel && options.cancel->cancelled()) {
+      LOG_INFO << "write to " << target->path() << " cancelled";
+      stats->cancelled = true;
+      return false;
+    }
+    if (watchdog && watchdog->stalled()) {
+      stats->stalled = true;
+      return false;
+    }
+    const size_t slice = std::min(kSliceSize, length - done);
+    size_t moved = 0;
+    bool success = false;
+    {
+      StallWatchdog::Busy busy(watchdog.get());
+      clock.start();
+      success = splicer ? splicer->transfer(in_fd, in_base, out_fd, done,
+                                            slice, &moved)
+                        : copyFileRange(in_fd, in_base, out_fd, done, slice,
+                                        &moved);
+    }
+    const int error = errno;
+    if (moved > 0) {
+      done += moved;
+      if (watchdog) {
+        watchdog->touch();
+      }
+      const uint64_t aligned = done / sector_size * sector_size;
+      if (progress) {
+        progress->add(aligned - counted);
+      }
+      counted = aligned;
+      if (options.record_latency) {
+        stats->chunk_latency_ns.push_back(clock.nsecsElapsed());
+      }
+    }
+    if (success) {
+      continue;
+    }
+    if (!splicer && done == 0 && isUnsupported(error)) {
+      LOG_INFO << "copy_file_range to " << target->path()
+               << " refused (" << strerror(error) << "), trying splice";
+      splicer.reset(new Splicer());
+      if (!splicer->valid()) {
+        LOG_ERROR << "could not create a pipe: " << strerror(errno);
+        break;
+      }
+      continue;
+    }
+    LOG_INFO << (splicer ? "splice" : "copy_file_range") << " to "
+             << target->path() << " stopped at " << done << ": "
+             << strerror(error);
+    break;
+  }
+  // Whatever was moved of a partial sector is written again later
+  done = counted;
+  if (done == 0) {
+    return true;
+  }
+
+  {
+    StallWatchdog::Busy busy(watchdog.get());
+    if (!target->flush()) {
+      return false;
+    }
+  }
+  if (watchdog && watchdog->stalled()) {
+    stats->stalled = true;
+    return false;
+  }
+  stats->engine = splicer ? "splice" : "copy_file_range";
+  stats->queue_depth = 1;
+  stats->chunk_size = kSliceSize;
+  *copied = done;
+  LOG_INFO << "copied " << done << " bytes to " << target->path()
+           << " with " << stats->engine;
+  return true;
+}
+
+}  // namespace gondar
@@ -0,0 +1,120 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "zero_detect.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GONDAR_ZERO_DETECT_X86
+#endif
+
+namespace gondar {
+
+namespace {
+
+// Handles whatever the vector loops leave over, and is the whole
+// implementation on other architectures
+bool isAllZeroScalar(const uint8_t* data, size_t length) {
+  uint64_t acc = 0;
+  for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    acc |= word;
+    data += sizeof(word);
+  }
+  while (length-- > 0) {
+    acc |= *data++;
+  }
+  return acc == 0;
+}
+
+#ifdef GONDAR_ZERO_DETECT_X86
+
+// Vector loops OR a few registers together and only test once per
+// iteration, bailing out at the first block containing data. Image
+// data is rarely zero for long, so that exit is usually taken early.
+
+__attribute__((target("sse2"))) bool isAllZeroSse2(const uint8_t* data,
+                                                   size_t length) {
+  constexpr size_t kStep = 4 * sizeof(__m128i);
+  for (; length >= kStep; length -= kStep, data += kStep) {
+    const __m128i* p = reinterpret_cast<const __m128i*>(data);
+    const __m128i acc = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+        _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+        0xffff) {
+      return false;
+    }
+  }
+  return isAllZeroScalar(data, length);
+}
+
+__attribute__((target("avx2"))) bool isAllZeroAvx2(const uint8_t* data,
+                                                   size_t length) {
+  constexpr size_t kStep = 4 * sizeof(__m256i);
+  for (; length >= kStep; length -= kStep, data += kStep) {
+    const __m256i* p = reinterpret_cast<const __m256i*>(data);
+    const __m256i acc = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+        _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+    if (!_mm256_testz_si256(acc, acc)) {
+      return false;
+    }
+  }
+  return isAllZeroScalar(data, length);
+}
+
+#endif  // GONDAR_ZERO_DETECT_X86
+
+using ZeroCheck = bool (*)(const uint8_t*, size_t);
+
+struct Implementation {
+  ZeroCheck check;
+  const char* name;
+};
+
+Implementation pickImplementation() {
+#ifdef GONDAR_ZERO_DETECT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {isAllZeroAvx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {isAllZeroSse2, "sse2"};
+  }
+#endif
+  return {isAllZeroScalar, "scalar"};
+}
+
+const Implementation& implementation() {
+  // Thread-safe in C++11, and cheap after the first call
+  static const Implementation impl = pickImplementation();
+  return impl;
+}
+
+}  // namespace
+
+bool isAllZero(const uint8_t* data, const size_t length) {
+  return implementation().check(data, length);
+}
+
+const char* zeroDetectImplementation() {
+  return implementation().name;
+}
+
+}  // namespace gondar
@@ -0,0 +1,33 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_ZERO_DETECT_H_
+#define SRC_ZERO_DETECT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace gondar {
+
+// True if all |length| bytes at |data| are zero. Uses AVX2 or SSE2
+// when the CPU has them, and a word-at-a-time loop otherwise.
+bool isAllZero(const uint8_t* data, size_t length);
+
+// Name of the implementation isAllZero() picked, for logging
+const char* zeroDetectImplementation();
+
+}  // namespace gondar
+
+#endif  // SRC_ZERO_DETECT_H_
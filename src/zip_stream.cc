@@ -0,0 +1,304 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "zip_stream.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include "byte_queue.h"
+#include "log.h"
+
+namespace gondar {
+
+namespace {
+
+// Compressed input is taken from the queue this much at a time
+constexpr size_t kInputBufferSize = 256 * 1024;
+
+constexpr uint32_t kLocalHeaderSignature = 0x04034b50;
+constexpr uint32_t kDescriptorSignature = 0x08074b50;
+constexpr size_t kLocalHeaderSize = 30;
+constexpr uint16_t kZip64ExtraId = 0x0001;
+constexpr uint32_t kZip64Marker = 0xffffffff;
+
+constexpr uint16_t kFlagEncrypted = 1 << 0;
+constexpr uint16_t kFlagDescriptor = 1 << 3;
+constexpr uint16_t kMethodStored = 0;
+constexpr uint16_t kMethodDeflated = 8;
+
+uint64_t getLe(const uint8_t* src, const int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | src[i];
+  }
+  return value;
+}
+
+}  // namespace
+
+ZipStreamSource::ZipStreamSource(ByteQueue* input)
+    : input_(input), input_buffer_(kInputBufferSize) {
+  memset(&zstream_, 0, sizeof(zstream_));
+}
+
+ZipStreamSource::~ZipStreamSource() {
+  if (inflating_) {
+    inflateEnd(&zstream_);
+  }
+}
+
+bool ZipStreamSource::start() {
+  uint8_t header[kLocalHeaderSize];
+  if (!readInput(header, sizeof(header))) {
+    return false;
+  }
+  if (getLe(header, 4) != kLocalHeaderSignature) {
+    fail("not a zip file");
+    return false;
+  }
+  const uint16_t flags = getLe(header + 6, 2);
+  const uint16_t method = getLe(header + 8, 2);
+  expected_crc_ = getLe(header + 14, 4);
+  uint64_t compressed_size = getLe(header + 18, 4);
+  uint64_t size = getLe(header + 22, 4);
+  const size_t name_length = getLe(header + 26, 2);
+  size_t extra_length = getLe(header + 28, 2);
+
+  std::vector<uint8_t> name(name_length);
+  if (!readInput(name.data(), name.size())) {
+    return false;
+  }
+  name_.assign(name.begin(), name.end());
+
+  // Only the zip64 sizes are of interest among the extra fields
+  std::vector<uint8_t> extra(extra_length);
+  if (!readInput(extra.data(), extra.size())) {
+    return false;
+  }
+  for (size_t pos = 0; pos + 4 <= extra.size();) {
+    const uint16_t id = getLe(&extra[pos], 2);
+    const size_t length = getLe(&extra[pos + 2], 2);
+    const uint8_t* field = &extra[pos + 4];
+    pos += 4 + length;
+    if (id != kZip64ExtraId || pos > extra.size()) {
+      continue;
+    }
+    zip64_ = true;
+    size_t used = 0;
+    if (size == kZip64Marker && used + 8 <= length) {
+      size = getLe(field + used, 8);
+      used += 8;
+    }
+    if (compressed_size == kZip64Marker && used + 8 <= length) {
+      compressed_size = getLe(field + used, 8);
+    }
+  }
+
+  if (flags & kFlagEncrypted) {
+    fail(name_ + " is encrypted");
+    return false;
+  }
+  descriptor_ = (flags & kFlagDescriptor) != 0;
+  if (method == kMethodDeflated) {
+    deflated_ = true;
+    // Raw deflate data, without a zlib header
+    if (inflateInit2(&zstream_, -MAX_WBITS) != Z_OK) {
+      fail("inflateInit2 failed");
+      return false;
+    }
+    inflating_ = true;
+  } else if (method != kMethodStored || descriptor_) {
+    // A stored entry only says where it ends in its header
+    fail(name_ + " uses unsupported compression method " +
+         std::to_string(method));
+    return false;
+  }
+  if (!descriptor_) {
+    size_.store(static_cast<int64_t>(size));
+  } else if (size != 0) {
+    header_size_ = static_cast<int64_t>(size);
+  }
+  crc_ = crc32(0, Z_NULL, 0);
+  LOG_INFO << "streaming " << name_ << ", "
+           << (descriptor_ ? std::string("size not known yet")
+                           : std::to_string(size) + " bytes from " +
+                                 std::to_string(compressed_size));
+  return true;
+}
+
+int64_t ZipStreamSource::read(const uint64_t offset,
+                              uint8_t* buffer,
+                              const size_t length) {
+  if (failed()) {
+    return -1;
+  }
+  if (offset < position_) {
+    LOG_ERROR << "can't go back to " << offset << " in a streamed zip, "
+              << "already at " << position_;
+    return -1;
+  }
+  // Skipping still means inflating
+  while (position_ < offset) {
+    const int64_t count = produce(
+        buffer, std::min<uint64_t>(length, offset - position_));
+    if (count <= 0) {
+      return count;
+    }
+  }
+  return produce(buffer, length);
+}
+
+bool ZipStreamSource::fill() {
+  if (zstream_.avail_in > 0) {
+    return true;
+  }
+  const int64_t count = input_->pop(input_buffer_.data(), input_buffer_.size());
+  if (count < 0) {
+    fail("input failed");
+    return false;
+  }
+  if (count == 0) {
+    fail("zip ends early");
+    return false;
+  }
+  zstream_.next_in = input_buffer_.data();
+  zstream_.avail_in = static_cast<uInt>(count);
+  return true;
+}
+
+bool ZipStreamSource::readInput(uint8_t* dst, size_t length) {
+  while (length > 0) {
+    if (!fill()) {
+      return false;
+    }
+    const size_t count = std::min<size_t>(length, zstream_.avail_in);
+    memcpy(dst, zstream_.next_in, count);
+    zstream_.next_in += count;
+    zstream_.avail_in -= count;
+    dst += count;
+    length -= count;
+  }
+  return true;
+}
+
+int64_t ZipStreamSource::produce(uint8_t* buffer, size_t length) {
+  if (ended_ || length == 0) {
+    return 0;
+  }
+  length = std::min<size_t>(length, UINT_MAX);
+  size_t count = 0;
+  bool end_of_entry = false;
+  if (!deflated_) {
+    const uint64_t remaining = size() - position_;
+    if (remaining > 0) {
+      if (!fill()) {
+        return -1;
+      }
+      count = std::min<uint64_t>(std::min<uint64_t>(length, remaining),
+                                 zstream_.avail_in);
+      memcpy(buffer, zstream_.next_in, count);
+      zstream_.next_in += count;
+      zstream_.avail_in -= count;
+    }
+    end_of_entry = count == remaining;
+  } else {
+    zstream_.next_out = buffer;
+    zstream_.avail_out = static_cast<uInt>(length);
+    while (zstream_.avail_out == length) {
+      if (!fill()) {
+        return -1;
+      }
+      const int rc = inflate(&zstream_, Z_NO_FLUSH);
+      if (rc == Z_STREAM_END) {
+        end_of_entry = true;
+        break;
+      }
+      if (rc != Z_OK) {
+        fail(std::string("inflate failed: ") +
+             (zstream_.msg ? zstream_.msg : std::to_string(rc)));
+        return -1;
+      }
+    }
+    count = length - zstream_.avail_out;
+  }
+  crc_ = crc32(crc_, buffer, static_cast<uInt>(count));
+  position_ += count;
+  // A reader that knows the size stops there, so that is where the
+  // entry has to be checked, once the deflate stream says it has ended
+  if (deflated_ && !end_of_entry &&
+      static_cast<int64_t>(position_) == size()) {
+    uint8_t extra = 0;
+    while (!end_of_entry) {
+      zstream_.next_out = &extra;
+      zstream_.avail_out = 1;
+      if (!fill()) {
+        return -1;
+      }
+      const int rc = inflate(&zstream_, Z_NO_FLUSH);
+      if (zstream_.avail_out == 0 || (rc != Z_OK && rc != Z_STREAM_END)) {
+        fail(name_ + " doesn't end where its header says");
+        return -1;
+      }
+      end_of_entry = rc == Z_STREAM_END;
+    }
+  }
+  if (end_of_entry) {
+    if (!finishEntry()) {
+      return -1;
+    }
+    ended_ = true;
+  }
+  return count;
+}
+
+bool ZipStreamSource::finishEntry() {
+  uint64_t expected_size = size();
+  if (descriptor_) {
+    // The signature is optional
+    uint8_t descriptor[24];
+    if (!readInput(descriptor, 4)) {
+      return false;
+    }
+    const bool signed_descriptor = getLe(descriptor, 4) == kDescriptorSignature;
+    const size_t size_bytes = zip64_ ? 8 : 4;
+    const size_t rest = (signed_descriptor ? 4 : 0) + 2 * size_bytes;
+    if (!readInput(descriptor + 4, rest)) {
+      return false;
+    }
+    const uint8_t* fields = signed_descriptor ? descriptor + 4 : descriptor;
+    expected_crc_ = getLe(fields, 4);
+    expected_size = getLe(fields + 4 + size_bytes, size_bytes);
+  }
+  if (crc_ != expected_crc_ || expected_size != position_) {
+    fail(name_ + " is corrupt: " + std::to_string(position_) +
+         " bytes with CRC " + std::to_string(crc_) + ", expected " +
+         std::to_string(expected_size) + " with CRC " +
+         std::to_string(expected_crc_));
+    return false;
+  }
+  size_.store(static_cast<int64_t>(position_));
+  LOG_INFO << "streamed all " << position_ << " bytes of " << name_;
+  return true;
+}
+
+void ZipStreamSource::fail(const std::string& why) {
+  if (!failed_.exchange(true)) {
+    LOG_ERROR << "streamed zip: " << why;
+  }
+}
+
+}  // namespace gondar
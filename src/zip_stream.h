@@ -0,0 +1,113 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SRC_ZIP_STREAM_H_
+#define SRC_ZIP_STREAM_H_
+
+#include <zlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "block_device.h"
+
+namespace gondar {
+
+class ByteQueue;
+
+// The first entry of a zip, inflated as the zip arrives through a
+// ByteQueue, so that an image can be written while it is still
+// downloading. Nothing is kept once it has been read, so reads can
+// skip ahead but never go back. Only stored and deflated entries are
+// supported; zip64 is.
+class ZipStreamSource : public ImageSource {
+  ZipStreamSource& operator=(ZipStreamSource&) = delete;
+  ZipStreamSource(ZipStreamSource&) = delete;
+
+ public:
+  // |input| must outlive the source
+  explicit ZipStreamSource(ByteQueue* input);
+  ~ZipStreamSource() override;
+
+  // Wait for the entry's local header and get ready to read the entry.
+  // Call before anything else, on the thread that reads. Returns false
+  // if the input isn't a zip, the entry can't be read as a stream or
+  // the input fails first.
+  bool start();
+
+  const std::string& entryName() const { return name_; }
+
+  // The entry's uncompressed size. A zip written as a stream only
+  // records it in a data descriptor after the entry's data, so this
+  // may be -1 until the end of the entry has been read.
+  int64_t size() const override { return size_.load(); }
+  // The size as far as it is known before the entry has been read:
+  // size() if that is set, or else whatever the local header gives
+  // if the tool that wrote the zip filled it in despite using a
+  // descriptor. -1 if neither says. Call after start().
+  int64_t expectedSize() const {
+    const int64_t size = size_.load();
+    return size >= 0 ? size : header_size_;
+  }
+
+  // The CRC-32 and size are checked once the end of the entry is
+  // reached; if they don't match, the read that got there fails.
+  int64_t read(uint64_t offset, uint8_t* buffer, size_t length) override;
+  bool forwardOnly() const override { return true; }
+
+  // Set once the input has failed or the zip turned out to be bad, as
+  // opposed to the reader giving up
+  bool failed() const { return failed_.load(); }
+
+ private:
+  // Make sure there is input to consume. False if the input ended or
+  // failed, which fails the source.
+  bool fill();
+  bool readInput(uint8_t* dst, size_t length);
+  // Produce up to |length| bytes of the entry. Same return value as
+  // read().
+  int64_t produce(uint8_t* buffer, size_t length);
+  // Check the entry once its data has all been read
+  bool finishEntry();
+  void fail(const std::string& why);
+
+  ByteQueue* input_;
+  std::vector<uint8_t> input_buffer_;
+  z_stream zstream_;
+  bool inflating_ = false;
+
+  std::string name_;
+  bool deflated_ = false;
+  // Sizes and CRC come after the data, in a descriptor
+  bool descriptor_ = false;
+  // The descriptor, if any, has 64-bit sizes
+  bool zip64_ = false;
+  uint32_t expected_crc_ = 0;
+  std::atomic<int64_t> size_{-1};
+  // The local header's size if the entry has a descriptor and the
+  // header gives one anyway, otherwise -1
+  int64_t header_size_ = -1;
+
+  uint64_t position_ = 0;
+  uint32_t crc_ = 0;
+  bool ended_ = false;
+  std::atomic<bool> failed_{false};
+};
+
+}  // namespace gondar
+
+#endif  // SRC_ZIP_STREAM_H_
@@ -0,0 +1,184 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Shared by the zlib and zlib-ng inflaters. zlib-ng's native header
+// can't be included alongside zlib.h, so each backend lives in its own
+// file and includes its zlib before this, which relies on the Z_ status
+// codes both define the same way.
+
+#ifndef SRC_ZLIB_STYLE_INFLATER_H_
+#define SRC_ZLIB_STYLE_INFLATER_H_
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#include "inflater.h"
+#include "log.h"
+
+namespace gondar {
+
+// |Stream| is z_stream or zng_stream and |Api| supplies the matching
+// functions, which otherwise differ only by prefix
+template <typename Stream, typename Api>
+class ZlibStyleInflater : public Inflater {
+ public:
+  explicit ZlibStyleInflater(const char* name) : name_(name) {}
+
+  ~ZlibStyleInflater() override {
+    if (initialized_) {
+      Api::end(&stream_);
+    }
+  }
+
+  // Raw deflate, with the largest window
+  bool init() {
+    stream_ = Stream();
+    const int rc = Api::init(&stream_, -15);
+    if (rc != Z_OK) {
+      LOG_ERROR << name_ << " inflateInit2 failed: " << rc;
+      return false;
+    }
+    initialized_ = true;
+    return true;
+  }
+
+  const char* name() const override { return name_; }
+
+  bool reset() override {
+    const int rc = Api::reset(&stream_);
+    if (rc != Z_OK) {
+      LOG_ERROR << name_ << " inflateReset failed: " << rc;
+      return false;
+    }
+    return true;
+  }
+
+  Status inflate(const uint8_t** input,
+                 size_t* input_left,
+                 uint8_t** output,
+                 size_t* output_left) override {
+    return run(input, input_left, output, output_left, Z_NO_FLUSH);
+  }
+
+  Status inflateToBlock(const uint8_t** input,
+                        size_t* input_left,
+                        uint8_t** output,
+                        size_t* output_left,
+                        int* boundary_bits) override {
+    const Status status =
+        run(input, input_left, output, output_left, Z_BLOCK);
+    // Bit 128 is set just after an end-of-block code and bit 64 while
+    // in the last block; the low bits count what is left of the byte
+    const int type = stream_.data_type;
+    *boundary_bits = status == Status::kOk && (type & 128) && !(type & 64)
+                         ? type & 7
+                         : -1;
+    return status;
+  }
+
+  bool resume(const int bits,
+              const uint8_t byte,
+              const uint8_t* window,
+              const size_t window_size) override {
+    if (!reset()) {
+      return false;
+    }
+    if (bits > 0) {
+      const int rc = Api::prime(&stream_, bits, byte >> (8 - bits));
+      if (rc != Z_OK) {
+        LOG_ERROR << name_ << " inflatePrime failed: " << rc;
+        return false;
+      }
+    }
+    if (window_size > 0) {
+      const int rc =
+          Api::setDictionary(&stream_, window, clamp(window_size));
+      if (rc != Z_OK) {
+        LOG_ERROR << name_ << " inflateSetDictionary failed: " << rc;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint32_t crc32(uint32_t crc,
+                 const uint8_t* data,
+                 size_t length) const override {
+    while (length > 0) {
+      const uint32_t step = clamp(length);
+      crc = Api::crc32(crc, data, step);
+      data += step;
+      length -= step;
+    }
+    return crc;
+  }
+
+ private:
+  Status run(const uint8_t** input,
+             size_t* input_left,
+             uint8_t** output,
+             size_t* output_left,
+             const int flush) {
+    stream_.next_in = const_cast<decltype(stream_.next_in)>(*input);
+    stream_.avail_in = clamp(*input_left);
+    stream_.next_out = *output;
+    stream_.avail_out = clamp(*output_left);
+    const int rc = Api::inflate(&stream_, flush);
+    const size_t used = stream_.next_in - *input;
+    const size_t produced = stream_.next_out - *output;
+    *input += used;
+    *input_left -= used;
+    *output += produced;
+    *output_left -= produced;
+    switch (rc) {
+      case Z_STREAM_END:
+        return Status::kEnd;
+      case Z_OK:
+      case Z_BUF_ERROR:
+        // Z_BUF_ERROR only means no progress could be made with what
+        // was given, which the caller sees from the counts
+        return Status::kOk;
+      default:
+        LOG_ERROR << name_ << " inflate failed: " << rc << " ("
+                  << (stream_.msg ? stream_.msg : "no message") << ")";
+        return Status::kError;
+    }
+  }
+
+  // Both zlibs count in 32 bits, so longer buffers go through in pieces
+  static uint32_t clamp(const size_t length) {
+    return static_cast<uint32_t>(std::min<size_t>(
+        length, std::numeric_limits<uint32_t>::max()));
+  }
+
+  const char* const name_;
+  Stream stream_;
+  bool initialized_ = false;
+};
+
+template <typename Stream, typename Api>
+std::unique_ptr<Inflater> createZlibStyleInflater(const char* name) {
+  std::unique_ptr<ZlibStyleInflater<Stream, Api>> inflater(
+      new ZlibStyleInflater<Stream, Api>(name));
+  if (!inflater->init()) {
+    return nullptr;
+  }
+  return std::unique_ptr<Inflater>(inflater.release());
+}
+
+}  // namespace gondar
+
+#endif  // SRC_ZLIB_STYLE_INFLATER_H_
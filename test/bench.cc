@@ -0,0 +1,585 @@
+// Copyright 2018 Neverware
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Write engine benchmark. Generates deterministic synthetic images and
+// writes each of them to each target with every combination of buffer
+// size, queue depth and transfer mode asked for, then prints the
+// results as JSON so that builds can be compared on the same hardware.
+// CPU time is reported per GB as well as throughput, since stations
+// running several flashes at once run out of CPU first.
+//
+// A target is either a directory, in which a scratch file is written
+// (point it at tmpfs to take the device out of the picture), or a
+// block device such as a loop device, which is overwritten.
+//
+// With --unzip, each image is zipped into each target directory
+// instead and extracted next to itself with every inflate backend in
+// the build, the way a downloaded image is, and throughput is counted
+// in uncompressed bytes. --inflate-threads above 1 extracts with an
+// inflate index, built by an untimed extraction first.
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <zlib.h>
+
+#include "zip.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/block_device.h"
+#include "src/inflater.h"
+#include "src/neverware_unzipper.h"
+#include "src/write_engine.h"
+
+namespace {
+
+// Images are made of blocks of this size, each either all zeros or
+// all noise
+constexpr int kPatternBlockSize = 64 * 1024;
+
+struct Pattern {
+  const char* name;
+  // Share of blocks that are zero, out of 100
+  int zero_percent;
+};
+
+const Pattern kPatterns[] = {
+    {"random", 0},
+    {"zero", 90},
+    {"mixed", 50},
+};
+
+// xorshift64*: fast, and the same on every platform, so that every
+// build writes the same images
+class Prng {
+ public:
+  explicit Prng(uint64_t seed) : state_(seed) {}
+
+  uint64_t next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 0x2545f4914f6cdd1dULL;
+  }
+
+ private:
+  uint64_t state_;
+};
+
+bool generateImage(const QString& path,
+                   const Pattern& pattern,
+                   const qint64 size) {
+  QFile file(path);
+  if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+    return false;
+  }
+  Prng prng(0x9e3779b97f4a7c15ULL + pattern.zero_percent);
+  QByteArray block(kPatternBlockSize, 0);
+  for (qint64 done = 0; done < size; done += block.size()) {
+    const bool zero =
+        static_cast<int>(prng.next() % 100) < pattern.zero_percent;
+    if (zero) {
+      block.fill(0);
+    } else {
+      for (int i = 0; i + 8 <= block.size(); i += 8) {
+        const uint64_t value = prng.next();
+        memcpy(block.data() + i, &value, sizeof(value));
+      }
+    }
+    const qint64 length = std::min<qint64>(block.size(), size - done);
+    if (file.write(block.constData(), length) != length) {
+      return false;
+    }
+  }
+  return file.flush();
+}
+
+// CPU time used by the whole process so far, on every thread
+double cpuSeconds() {
+#if defined(Q_OS_WIN)
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel,
+                       &user)) {
+    return 0;
+  }
+  const auto seconds = [](const FILETIME& time) {
+    const uint64_t ticks =
+        (static_cast<uint64_t>(time.dwHighDateTime) << 32) |
+        time.dwLowDateTime;
+    return ticks / 1e7;
+  };
+  return seconds(kernel) + seconds(user);
+#else
+  rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  const auto seconds = [](const timeval& time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+  };
+  return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#endif
+}
+
+// Nearest-rank percentile of |sorted|, in milliseconds
+double percentileMs(const std::vector<int64_t>& sorted, const double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const size_t index = std::min<size_t>(
+      sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()));
+  return sorted[index] / 1e6;
+}
+
+QList<int> parseIntList(const QString& value, bool* ok) {
+  QList<int> list;
+  *ok = true;
+  for (const auto& item : value.split(',', QString::SkipEmptyParts)) {
+    const int number = item.toInt(ok);
+    if (!*ok || number <= 0) {
+      *ok = false;
+      return list;
+    }
+    list.append(number);
+  }
+  *ok = !list.isEmpty();
+  return list;
+}
+
+struct Target {
+  QString name;
+  // "file" for a scratch file, "device" for a block device
+  QString kind;
+  QString path;
+};
+
+// Zip |image_path| into |zip_path| as its only file, deflated at the
+// default level, in zip64 form so that images over 4 GiB fit
+bool zipImage(const QString& image_path,
+              const QString& zip_path,
+              const char* entry_name) {
+  QFile image(image_path);
+  if (!image.open(QFile::ReadOnly)) {
+    return false;
+  }
+  zipFile zip =
+      zipOpen64(zip_path.toStdString().c_str(), APPEND_STATUS_CREATE);
+  if (!zip) {
+    return false;
+  }
+  bool ok = zipOpenNewFileInZip64(zip, entry_name, nullptr, nullptr, 0,
+                                  nullptr, 0, nullptr, Z_DEFLATED,
+                                  Z_DEFAULT_COMPRESSION, 1) == ZIP_OK;
+  while (ok && !image.atEnd()) {
+    const QByteArray block = image.read(1024 * 1024);
+    ok = !block.isEmpty() &&
+         zipWriteInFileInZip(zip, block.constData(), block.size()) == ZIP_OK;
+  }
+  ok = zipCloseFileInZip(zip) == ZIP_OK && ok;
+  return zipClose(zip, nullptr) == ZIP_OK && ok;
+}
+
+// Zip |image_path| next to |target|'s scratch file and extract it
+// |repeat| times with each of |backends| and |thread_counts|, adding a
+// result for each run
+bool benchUnzip(const QString& image_path,
+                const Pattern& pattern,
+                const qint64 image_size,
+                const Target& target,
+                const std::vector<std::string>& backends,
+                const QList<int>& thread_counts,
+                const int repeat,
+                QJsonArray* results,
+                QTextStream* err) {
+  const QString zip_path =
+      QFileInfo(target.path).dir().filePath(QString(pattern.name) + ".zip");
+  *err << "zipping " << pattern.name << " image into " << target.name << "\n";
+  err->flush();
+  if (!zipImage(image_path, zip_path, "unzipped.bin")) {
+    *err << "could not write " << zip_path << "\n";
+    return false;
+  }
+  const qint64 zip_size = QFileInfo(zip_path).size();
+  const QString index_path = zip_path + ".index";
+
+  for (const auto& backend : backends) {
+    for (const int threads : thread_counts) {
+      NeverwareUnzipOptions options;
+      options.inflate_backend = backend;
+      options.threads = threads;
+      if (threads > 1) {
+        options.index_path = index_path.toStdString();
+        if (!QFile::exists(index_path)) {
+          try {
+            QFile::remove(
+                neverware_unzip(QFileInfo(zip_path), nullptr, options)
+                    .absoluteFilePath());
+          } catch (const std::exception& exc) {
+            *err << "indexing " << zip_path << " failed: " << exc.what()
+                 << "\n";
+            return false;
+          }
+        }
+      }
+      for (int run = 0; run < repeat; run++) {
+        QFileInfo output;
+        QElapsedTimer clock;
+        const double cpu_start = cpuSeconds();
+        clock.start();
+        try {
+          output = neverware_unzip(QFileInfo(zip_path), nullptr, options);
+        } catch (const std::exception& exc) {
+          *err << "unzip with " << QString::fromStdString(backend)
+               << " failed: " << exc.what() << "\n";
+          return false;
+        }
+        const double seconds = clock.nsecsElapsed() / 1e9;
+        const double cpu = cpuSeconds() - cpu_start;
+        const qint64 output_size = output.size();
+        QFile::remove(output.absoluteFilePath());
+        if (output_size != image_size) {
+          *err << "unzip with " << QString::fromStdString(backend)
+               << " produced " << output_size << " bytes\n";
+          return false;
+        }
+
+        const double mb_per_s = image_size / 1e6 / seconds;
+        QJsonObject result;
+        result["target"] = target.name;
+        result["target_kind"] = target.kind;
+        result["pattern"] = pattern.name;
+        result["image_bytes"] = image_size;
+        result["zip_bytes"] = zip_size;
+        result["inflate_backend"] = QString::fromStdString(backend);
+        result["inflate_threads"] = threads;
+        result["run"] = run;
+        result["seconds"] = seconds;
+        result["mb_per_s"] = mb_per_s;
+        result["cpu_seconds"] = cpu;
+        result["cpu_seconds_per_gb"] = cpu / (image_size / 1e9);
+        results->append(result);
+
+        *err << pattern.name << " zip -> " << target.name << ", "
+             << QString::fromStdString(backend) << " x" << threads << ": "
+             << mb_per_s << " MB/s, " << cpu / (image_size / 1e9)
+             << " CPU s/GB\n";
+        err->flush();
+      }
+    }
+  }
+  QFile::remove(index_path);
+  QFile::remove(zip_path);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("bench");
+  QTextStream err(stderr);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Benchmark the write engine, or unzipping, on synthetic images.");
+  parser.addHelpOption();
+  const QCommandLineOption size_option(
+      "size", "Image size in MiB (default: 256).", "MiB", "256");
+  const QCommandLineOption patterns_option(
+      "patterns", "Images to write: random, zero and/or mixed.", "list",
+      "random,zero,mixed");
+  const QCommandLineOption buffer_sizes_option(
+      "buffer-sizes", "Buffer sizes to try, in KiB.", "list", "256,1024,4096");
+  const QCommandLineOption queue_depths_option(
+      "queue-depths",
+      "Queue depths to try; 1 is the synchronous engine, more uses "
+      "io_uring where available.",
+      "list", "1,4");
+  const QCommandLineOption transfers_option(
+      "transfers",
+      "Transfer modes to try: ring (through user-space buffers) and/or "
+      "zero-copy (in the kernel, where supported).",
+      "list", "ring,zero-copy");
+  const QCommandLineOption repeat_option(
+      "repeat", "Runs of each combination (default: 3).", "count", "3");
+  const QCommandLineOption verify_option("verify",
+                                         "Read back and verify every write.");
+  const QCommandLineOption skip_zeros_option(
+      "skip-zeros",
+      "Have the target zero empty blocks rather than writing them.");
+  const QCommandLineOption unzip_option(
+      "unzip",
+      "Benchmark extracting a zip of each image instead of writing it; "
+      "buffer sizes, queue depths and transfers are then ignored.");
+  const QCommandLineOption backends_option(
+      "inflate-backends",
+      "Inflate backends to try with --unzip (default: all in this build).",
+      "list");
+  const QCommandLineOption inflate_threads_option(
+      "inflate-threads",
+      "Inflate threads to try with --unzip; above 1 needs an inflate index.",
+      "list", "1");
+  const QCommandLineOption output_option(
+      {"o", "output"}, "Where to write the JSON (default: stdout).", "path");
+  parser.addOption(size_option);
+  parser.addOption(patterns_option);
+  parser.addOption(buffer_sizes_option);
+  parser.addOption(queue_depths_option);
+  parser.addOption(transfers_option);
+  parser.addOption(repeat_option);
+  parser.addOption(verify_option);
+  parser.addOption(skip_zeros_option);
+  parser.addOption(unzip_option);
+  parser.addOption(backends_option);
+  parser.addOption(inflate_threads_option);
+  parser.addOption(output_option);
+  parser.addPositionalArgument(
+      "targets",
+      "Directories to write a scratch file in, or block devices to "
+      "overwrite (default: the temporary directory).",
+      "[target...]");
+  parser.process(app);
+
+  bool ok = false;
+  const qint64 image_size =
+      parser.value(size_option).toLongLong(&ok) * 1024 * 1024;
+  if (!ok || image_size <= 0) {
+    err << "invalid size\n";
+    return 1;
+  }
+  const QList<int> buffer_sizes_kib =
+      parseIntList(parser.value(buffer_sizes_option), &ok);
+  if (!ok) {
+    err << "invalid buffer sizes\n";
+    return 1;
+  }
+  const QList<int> queue_depths =
+      parseIntList(parser.value(queue_depths_option), &ok);
+  if (!ok) {
+    err << "invalid queue depths\n";
+    return 1;
+  }
+  std::vector<bool> zero_copy_modes;
+  for (const auto& name : parser.value(transfers_option).split(',')) {
+    if (name != "ring" && name != "zero-copy") {
+      err << "unknown transfer mode " << name << "\n";
+      return 1;
+    }
+    zero_copy_modes.push_back(name == "zero-copy");
+  }
+  const int repeat = parser.value(repeat_option).toInt(&ok);
+  if (!ok || repeat <= 0) {
+    err << "invalid repeat count\n";
+    return 1;
+  }
+  std::vector<Pattern> patterns;
+  for (const auto& name : parser.value(patterns_option).split(',')) {
+    const auto pattern =
+        std::find_if(std::begin(kPatterns), std::end(kPatterns),
+                     [&name](const Pattern& p) { return name == p.name; });
+    if (pattern == std::end(kPatterns)) {
+      err << "unknown pattern " << name << "\n";
+      return 1;
+    }
+    patterns.push_back(*pattern);
+  }
+  const bool unzip = parser.isSet(unzip_option);
+  const std::vector<std::string> available = gondar::inflaterBackends();
+  std::vector<std::string> backends = available;
+  if (parser.isSet(backends_option)) {
+    backends.clear();
+    for (const auto& name : parser.value(backends_option).split(',')) {
+      if (std::find(available.begin(), available.end(),
+                    name.toStdString()) == available.end()) {
+        err << "no inflate backend " << name << " in this build\n";
+        return 1;
+      }
+      backends.push_back(name.toStdString());
+    }
+  }
+
+  const QList<int> inflate_threads =
+      parseIntList(parser.value(inflate_threads_option), &ok);
+  if (!ok) {
+    err << "invalid inflate thread counts\n";
+    return 1;
+  }
+
+  // Images go in a directory of their own, away from the targets
+  QTemporaryDir image_dir;
+  if (!image_dir.isValid()) {
+    err << "could not create a temporary directory\n";
+    return 1;
+  }
+  std::vector<std::unique_ptr<QTemporaryDir>> scratch_dirs;
+  std::vector<Target> targets;
+  QStringList target_args = parser.positionalArguments();
+  if (target_args.isEmpty()) {
+    target_args.append(QDir::tempPath());
+  }
+  for (const auto& arg : target_args) {
+    const QFileInfo info(arg);
+    if (info.isDir()) {
+      scratch_dirs.emplace_back(
+          new QTemporaryDir(QDir(arg).filePath("bench-XXXXXX")));
+      if (!scratch_dirs.back()->isValid()) {
+        err << "could not create a scratch directory in " << arg << "\n";
+        return 1;
+      }
+      targets.push_back(
+          {arg, "file", scratch_dirs.back()->filePath("target.bin")});
+    } else if (unzip) {
+      err << arg << " is not a directory\n";
+      return 1;
+    } else if (info.exists()) {
+      targets.push_back({arg, "device", arg});
+    } else {
+      err << arg << " does not exist\n";
+      return 1;
+    }
+  }
+
+  QJsonArray results;
+  for (const auto& pattern : patterns) {
+    const QString image_path =
+        image_dir.filePath(QString(pattern.name) + ".img");
+    err << "generating " << pattern.name << " image\n";
+    err.flush();
+    if (!generateImage(image_path, pattern, image_size)) {
+      err << "could not write " << image_path << "\n";
+      return 1;
+    }
+
+    if (unzip) {
+      for (const auto& target : targets) {
+        if (!benchUnzip(image_path, pattern, image_size, target, backends,
+                        inflate_threads, repeat, &results, &err)) {
+          return 1;
+        }
+      }
+      continue;
+    }
+    for (const auto& target : targets) {
+      if (target.kind == "file") {
+        QFile file(target.path);
+        if (!file.open(QFile::ReadWrite) || !file.resize(image_size)) {
+          err << "could not create " << target.path << "\n";
+          return 1;
+        }
+      }
+      for (const int buffer_size_kib : buffer_sizes_kib) {
+        for (const int queue_depth : queue_depths) {
+          for (const bool zero_copy : zero_copy_modes) {
+            for (int run = 0; run < repeat; run++) {
+              auto source = gondar::openImageSource(image_path.toStdString());
+              auto device = gondar::openBlockDevice(target.path.toStdString());
+              if (!source || !device) {
+                err << "could not open " << target.path << "\n";
+                return 1;
+              }
+              gondar::WriteOptions options;
+              options.buffer_size = buffer_size_kib * 1024;
+              options.queue_depth = queue_depth;
+              options.verify = parser.isSet(verify_option);
+              options.skip_zero_blocks = parser.isSet(skip_zeros_option);
+              options.zero_copy = zero_copy;
+              options.record_latency = true;
+              gondar::WriteStats stats;
+
+              QElapsedTimer clock;
+              const double cpu_start = cpuSeconds();
+              clock.start();
+              const bool success = gondar::writeImage(
+                  source.get(), device.get(), image_size, options, &stats);
+              const double seconds = clock.nsecsElapsed() / 1e9;
+              const double cpu = cpuSeconds() - cpu_start;
+              if (!success) {
+                err << "write to " << target.path << " failed\n";
+                return 1;
+              }
+
+              std::vector<int64_t> latencies = stats.chunk_latency_ns;
+              std::sort(latencies.begin(), latencies.end());
+              const double mb_per_s = image_size / 1e6 / seconds;
+              QJsonObject result;
+              result["target"] = target.name;
+              result["target_kind"] = target.kind;
+              result["pattern"] = pattern.name;
+              result["image_bytes"] = image_size;
+              result["buffer_size"] = buffer_size_kib * 1024;
+              result["queue_depth"] = stats.queue_depth;
+              result["transfer"] = zero_copy ? "zero-copy" : "ring";
+              result["engine"] = QString::fromStdString(stats.engine);
+              result["verify"] = options.verify;
+              result["run"] = run;
+              result["seconds"] = seconds;
+              result["mb_per_s"] = mb_per_s;
+              result["cpu_seconds"] = cpu;
+              result["cpu_seconds_per_gb"] = cpu / (image_size / 1e9);
+              result["chunks_written"] = static_cast<int>(latencies.size());
+              result["latency_p50_ms"] = percentileMs(latencies, 50);
+              result["latency_p99_ms"] = percentileMs(latencies, 99);
+              result["zero_bytes_skipped"] =
+                  static_cast<qint64>(stats.zero_bytes_skipped);
+              results.append(result);
+
+              err << pattern.name << " -> " << target.name << ", "
+                  << buffer_size_kib << " KiB x" << stats.queue_depth << " "
+                  << QString::fromStdString(stats.engine) << ": " << mb_per_s
+                  << " MB/s, " << cpu / (image_size / 1e9)
+                  << " CPU s/GB\n";
+              err.flush();
+            }
+          }
+        }
+      }
+    }
+  }
+  QJsonObject report;
+  report["qt_version"] = qVersion();
+  report["results"] = results;
+  const QByteArray json = QJsonDocument(report).toJson();
+  if (parser.isSet(output_option)) {
+    QFile output(parser.value(output_option));
+    if (!output.open(QFile::WriteOnly | QFile::Truncate) ||
+        output.write(json) != json.size()) {
+      err << "could not write " << output.fileName() << "\n";
+      return 1;
+    }
+  } else {
+    QTextStream(stdout) << json;
+  }
+  return 0;
+}
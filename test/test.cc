@@ -20,11 +20,41 @@
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QNetworkRequest>
+#include <QSemaphore>
+#include <QTemporaryDir>
+#include <QThread>
 #include <QUrl>
+#include <QtEndian>
 
+#include <zlib.h>
+
+#include "zip.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "src/block_device.h"
+#include "src/block_map.h"
+#include "src/byte_queue.h"
+#include "src/cancel_token.h"
+#include "src/chunk_tuner.h"
 #include "src/device_picker.h"
+#include "src/erase.h"
+#include "src/fat32.h"
+#include "src/inflate_index.h"
+#include "src/inflater.h"
 #include "src/log.h"
 #include "src/meepo.h"
+#include "src/neverware_unzipper.h"
+#include "src/partition_table.h"
+#include "src/speed_probe.h"
+#include "src/write_engine.h"
+#include "src/write_journal.h"
+#include "src/write_progress.h"
+#include "src/zero_detect.h"
+#include "src/zip_stream.h"
 
 #if defined(Q_OS_WIN)
 Q_IMPORT_PLUGIN(QWindowsIntegrationPlugin);
@@ -39,6 +69,370 @@ QAbstractButton* getDevicePickerButton(DevicePicker* picker, const int index) {
   return dynamic_cast<QAbstractButton*>(widget);
 }
 
+// Write |data| to a new file at |path|. Returns true on success.
+bool writeFile(const QString& path, const QByteArray& data) {
+  QFile file(path);
+  return file.open(QFile::WriteOnly) && file.write(data) == data.size();
+}
+
+QByteArray readFile(const QString& path) {
+  QFile file(path);
+  if (!file.open(QFile::ReadOnly)) {
+    return QByteArray();
+  }
+  return file.readAll();
+}
+
+// Deterministic pseudo-random test data
+QByteArray makeTestImage(const int size) {
+  QByteArray data(size, 0);
+  uint32_t state = 12345;
+  for (int i = 0; i < size; i++) {
+    state = state * 1103515245 + 12345;
+    data[i] = static_cast<char>(state >> 16);
+  }
+  return data;
+}
+
+void putLe32(QByteArray* data, const int offset, const uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    (*data)[offset + i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+void putLe64(QByteArray* data, const int offset, const uint64_t value) {
+  putLe32(data, offset, static_cast<uint32_t>(value));
+  putLe32(data, offset + 4, static_cast<uint32_t>(value >> 32));
+}
+
+uint32_t crc(const QByteArray& data, const int length) {
+  return crc32(0, reinterpret_cast<const Bytef*>(data.constData()), length);
+}
+
+// A 512-byte-sector GPT disk image of |sectors| sectors with 128
+// entries. Each partition (inclusive first and last LBA) is filled with
+// 'a', 'b', ...; the protective MBR with 'm' and all other space with
+// 's'.
+QByteArray makeGptImage(const int sectors,
+                        const std::vector<std::pair<int, int>>& partitions) {
+  const int kSector = 512;
+  const int kEntries = 128;
+  const int kEntrySize = 128;
+  const int entries_sectors = kEntries * kEntrySize / kSector;
+  QByteArray image(sectors * kSector, 's');
+  image.replace(0, kSector, QByteArray(kSector, 'm'));
+
+  QByteArray entries(kEntries * kEntrySize, 0);
+  for (size_t i = 0; i < partitions.size(); i++) {
+    const int first = partitions[i].first;
+    const int last = partitions[i].second;
+    entries[static_cast<int>(i) * kEntrySize] = 1;  // any non-zero type
+    putLe64(&entries, i * kEntrySize + 32, first);
+    putLe64(&entries, i * kEntrySize + 40, last);
+    image.replace(first * kSector, (last - first + 1) * kSector,
+                  QByteArray((last - first + 1) * kSector, 'a' + i));
+  }
+
+  auto makeHeader = [&](const int lba, const int alternate,
+                        const int entries_lba) {
+    QByteArray header(kSector, 0);
+    header.replace(0, 8, "EFI PART");
+    putLe32(&header, 8, 0x10000);
+    putLe32(&header, 12, 92);
+    putLe64(&header, 24, lba);
+    putLe64(&header, 32, alternate);
+    putLe64(&header, 40, 2 + entries_sectors);
+    putLe64(&header, 48, sectors - 2 - entries_sectors);
+    putLe64(&header, 72, entries_lba);
+    putLe32(&header, 80, kEntries);
+    putLe32(&header, 84, kEntrySize);
+    putLe32(&header, 88, crc(entries, entries.size()));
+    putLe32(&header, 16, crc(header, 92));
+    return header;
+  };
+  const int backup_entries_lba = sectors - 1 - entries_sectors;
+  image.replace(kSector, kSector, makeHeader(1, sectors - 1, 2));
+  image.replace(2 * kSector, entries.size(), entries);
+  image.replace(backup_entries_lba * kSector, entries.size(), entries);
+  image.replace((sectors - 1) * kSector, kSector,
+                makeHeader(sectors - 1, 1, backup_entries_lba));
+  return image;
+}
+
+// Passes reads through to |source| but says it only goes forward, and
+// notes how far into the image it was read
+class ForwardOnlySource : public ImageSource {
+ public:
+  explicit ForwardOnlySource(std::unique_ptr<ImageSource> source)
+      : source_(std::move(source)) {}
+
+  int64_t size() const override { return source_->size(); }
+  int64_t read(const uint64_t offset,
+               uint8_t* buffer,
+               const size_t length) override {
+    const int64_t count = source_->read(offset, buffer, length);
+    if (count > 0) {
+      furthest_ = std::max<uint64_t>(furthest_, offset + count);
+    }
+    return count;
+  }
+  bool forwardOnly() const override { return true; }
+
+  uint64_t furthest() const { return furthest_; }
+
+ private:
+  std::unique_ptr<ImageSource> source_;
+  uint64_t furthest_ = 0;
+};
+
+// Passes everything through to |device|, except that reads covering
+// |corrupt_offset| come back with that byte flipped
+class CorruptingDevice : public BlockDevice {
+ public:
+  CorruptingDevice(std::unique_ptr<BlockDevice> device,
+                   const uint64_t corrupt_offset)
+      : device_(std::move(device)), corrupt_offset_(corrupt_offset) {}
+
+  const std::string& path() const override { return device_->path(); }
+  uint64_t sectorSize() const override { return device_->sectorSize(); }
+  uint64_t size() const override { return device_->size(); }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    if (!device_->read(offset, buffer, length)) {
+      return false;
+    }
+    if (corrupt_offset_ >= offset && corrupt_offset_ < offset + length) {
+      buffer[corrupt_offset_ - offset] ^= 1;
+    }
+    return true;
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    return device_->write(offset, buffer, length);
+  }
+
+  bool flush() override { return device_->flush(); }
+
+  bool dropCache(uint64_t offset, uint64_t length) override {
+    return device_->dropCache(offset, length);
+  }
+
+ private:
+  std::unique_ptr<BlockDevice> device_;
+  const uint64_t corrupt_offset_;
+};
+
+// Wraps a device so that every write reaching past |fail_offset| fails
+// and counts the writes it gets
+class FailingDevice : public BlockDevice {
+ public:
+  FailingDevice(std::unique_ptr<BlockDevice> device,
+                const uint64_t fail_offset)
+      : device_(std::move(device)), fail_offset_(fail_offset) {}
+
+  const std::string& path() const override { return device_->path(); }
+  uint64_t sectorSize() const override { return device_->sectorSize(); }
+  uint64_t size() const override { return device_->size(); }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    return device_->read(offset, buffer, length);
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    writes_++;
+    if (offset + length > fail_offset_) {
+      return false;
+    }
+    return device_->write(offset, buffer, length);
+  }
+
+  bool flush() override { return device_->flush(); }
+
+  int writes() const { return writes_; }
+
+ private:
+  std::unique_ptr<BlockDevice> device_;
+  const uint64_t fail_offset_;
+  int writes_ = 0;
+};
+
+// Wraps a device so that the first |failures| writes covering
+// |flaky_offset| fail, like a stick that recovers after a while
+class FlakyDevice : public BlockDevice {
+ public:
+  FlakyDevice(std::unique_ptr<BlockDevice> device,
+              const uint64_t flaky_offset,
+              const int failures)
+      : device_(std::move(device)),
+        flaky_offset_(flaky_offset),
+        failures_(failures) {}
+
+  const std::string& path() const override { return device_->path(); }
+  uint64_t sectorSize() const override { return device_->sectorSize(); }
+  uint64_t size() const override { return device_->size(); }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    return device_->read(offset, buffer, length);
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    if (flaky_offset_ >= offset && flaky_offset_ < offset + length &&
+        failures_ > 0) {
+      failures_--;
+      return false;
+    }
+    return device_->write(offset, buffer, length);
+  }
+
+  bool flush() override { return device_->flush(); }
+
+ private:
+  std::unique_ptr<BlockDevice> device_;
+  const uint64_t flaky_offset_;
+  int failures_;
+};
+
+// Hangs for |delay_ms| on the first write that reaches past
+// |slow_offset|, like a stick that has stopped responding
+class SlowDevice : public BlockDevice {
+ public:
+  SlowDevice(std::unique_ptr<BlockDevice> device,
+             const uint64_t slow_offset,
+             const unsigned long delay_ms)  // NOLINT(runtime/int)
+      : device_(std::move(device)),
+        slow_offset_(slow_offset),
+        delay_ms_(delay_ms) {}
+
+  const std::string& path() const override { return device_->path(); }
+  uint64_t sectorSize() const override { return device_->sectorSize(); }
+  uint64_t size() const override { return device_->size(); }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    return device_->read(offset, buffer, length);
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    if (offset + length > slow_offset_ && !delayed_) {
+      delayed_ = true;
+      QThread::msleep(delay_ms_);
+    }
+    return device_->write(offset, buffer, length);
+  }
+
+  bool flush() override { return device_->flush(); }
+
+ private:
+  std::unique_ptr<BlockDevice> device_;
+  const uint64_t slow_offset_;
+  const unsigned long delay_ms_;  // NOLINT(runtime/int)
+  bool delayed_ = false;
+};
+
+// Cancels |token| as soon as anything reaches |cancel_offset|, as if
+// the user had hit cancel just then
+class CancellingDevice : public BlockDevice {
+ public:
+  CancellingDevice(std::unique_ptr<BlockDevice> device,
+                   const uint64_t cancel_offset,
+                   CancelToken* token)
+      : device_(std::move(device)),
+        cancel_offset_(cancel_offset),
+        token_(token) {}
+
+  const std::string& path() const override { return device_->path(); }
+  uint64_t sectorSize() const override { return device_->sectorSize(); }
+  uint64_t size() const override { return device_->size(); }
+
+  bool read(uint64_t offset, uint8_t* buffer, size_t length) override {
+    return device_->read(offset, buffer, length);
+  }
+
+  bool write(uint64_t offset, const uint8_t* buffer, size_t length) override {
+    if (offset + length > cancel_offset_) {
+      token_->cancel();
+    }
+    return device_->write(offset, buffer, length);
+  }
+
+  bool flush() override { return device_->flush(); }
+
+ private:
+  std::unique_ptr<BlockDevice> device_;
+  const uint64_t cancel_offset_;
+  CancelToken* token_;
+};
+
+// A zip holding just |data|, deflated, as written by a tool that fills
+// in the local header (or, with |descriptor|, one that can't seek back
+// to and puts the sizes and CRC after the data instead). Streaming
+// never gets as far as the central directory, so there is none.
+QByteArray makeZip(const QByteArray& data, const bool descriptor) {
+  QByteArray deflated(compressBound(data.size()), 0);
+  z_stream stream = {};
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+               Z_DEFAULT_STRATEGY);
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(deflated.data());
+  stream.avail_out = deflated.size();
+  deflate(&stream, Z_FINISH);
+  deflated.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  const QByteArray name("image.bin");
+  QByteArray zip(30, 0);
+  putLe32(&zip, 0, 0x04034b50);
+  zip[4] = 20;  // version needed
+  zip[6] = descriptor ? 0x08 : 0;
+  zip[8] = 8;  // deflated
+  if (!descriptor) {
+    putLe32(&zip, 14, crc(data, data.size()));
+    putLe32(&zip, 18, deflated.size());
+    putLe32(&zip, 22, data.size());
+  }
+  zip[26] = static_cast<char>(name.size());
+  zip += name + deflated;
+  if (descriptor) {
+    QByteArray fields(16, 0);
+    putLe32(&fields, 0, 0x08074b50);
+    putLe32(&fields, 4, crc(data, data.size()));
+    putLe32(&fields, 8, deflated.size());
+    putLe32(&fields, 12, data.size());
+    zip += fields;
+  }
+  return zip;
+}
+
+// Pushes |data| into |queue| from a thread of its own, a piece at a
+// time and waiting for room, the way the downloader does
+class QueueFeeder : public QThread {
+ public:
+  QueueFeeder(ByteQueue* queue, const QByteArray& data)
+      : queue_(queue), data_(data) {
+    queue_->setSpaceCallback([this]() { space_.release(); });
+  }
+
+ protected:
+  void run() override {
+    int pos = 0;
+    while (pos < data_.size() && !queue_->failed()) {
+      const int piece = std::min(7777, data_.size() - pos);
+      const int taken = queue_->push(data_.constData() + pos, piece);
+      pos += taken;
+      if (taken < piece) {
+        space_.tryAcquire(1, 100);
+      }
+    }
+    queue_->finish(true);
+  }
+
+ private:
+  ByteQueue* queue_;
+  const QByteArray data_;
+  QSemaphore space_;
+};
+
 }  // namespace
 
 uint64_t getValidDiskSize() {
@@ -105,6 +499,1253 @@ void Test::testMeepoGetMetricRequest() {
   QCOMPARE(actual_request.url(), expected_url);
 }
 
+void Test::testWriteImage() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+
+  // Deliberately not a multiple of the sector size
+  const QByteArray image = makeTestImage(3 * 65536 + 1000);
+  QVERIFY(writeFile(image_path, image));
+  // Once with plain synchronous writes, once with several queued
+  // writes (io_uring if the kernel supports it)
+  for (const int queue_depth : {1, 4}) {
+    QVERIFY(writeFile(device_path, QByteArray(4 * 65536, 'x')));
+    WriteStats stats;
+    {
+      auto source = openImageSource(image_path.toStdString());
+      auto target = openBlockDevice(device_path.toStdString());
+      QVERIFY(source && target);
+      // Small buffers so the image spans several trips around the ring
+      WriteOptions options;
+      options.buffer_size = 65536;
+      options.ring_depth = 3;
+      options.queue_depth = queue_depth;
+      QVERIFY(writeImage(source.get(), target.get(), image.size(), options,
+                         &stats));
+    }
+    if (queue_depth == 1) {
+      QCOMPARE(stats.engine, std::string("sync"));
+    }
+    QVERIFY(stats.queue_depth >= 1 && stats.queue_depth <= queue_depth);
+
+    const QByteArray written = readFile(device_path);
+    QCOMPARE(written.size(), 4 * 65536);
+    QCOMPARE(written.left(image.size()), image);
+    // The final partial sector is zero padded, the rest is untouched
+    const int padded_size = roundUp(image.size(), 512);
+    QCOMPARE(written.mid(image.size(), padded_size - image.size()),
+             QByteArray(padded_size - image.size(), 0));
+    QCOMPARE(written.at(padded_size), 'x');
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testIsAllZero() {
+  // Lengths and offsets that exercise the vector loops and the tail
+  QByteArray data(1024 + 7, 0);
+  const uint8_t* base = reinterpret_cast<const uint8_t*>(data.constData());
+  for (const int offset : {0, 1, 7}) {
+    for (const int length : {0, 1, 31, 64, 127, 128, 1000}) {
+      QVERIFY(isAllZero(base + offset, length));
+      if (length == 0) {
+        continue;
+      }
+      for (const int pos : {0, length / 2, length - 1}) {
+        data[offset + pos] = 1;
+        QVERIFY(!isAllZero(base + offset, length));
+        data[offset + pos] = 0;
+      }
+    }
+  }
+}
+
+void Test::testWriteImageSkipsZeros() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+
+  // Data, then several buffers of zeros, then a partial buffer of data
+  const int zero_size = 4 * 65536;
+  QByteArray image = makeTestImage(65536);
+  image.append(QByteArray(zero_size, 0));
+  image.append(makeTestImage(1000));
+  QVERIFY(writeFile(image_path, image));
+  QVERIFY(writeFile(device_path, QByteArray(8 * 65536, 'x')));
+
+  WriteStats stats;
+  {
+    auto source = openImageSource(image_path.toStdString());
+    auto target = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && target);
+    WriteOptions options;
+    options.buffer_size = 65536;
+    options.skip_zero_blocks = true;
+    QVERIFY(writeImage(source.get(), target.get(), image.size(), options,
+                       &stats));
+  }
+  // Whether the filesystem could zero the range itself varies, but the
+  // zeros must land either way
+  QVERIFY(stats.zero_bytes_skipped == 0 ||
+          stats.zero_bytes_skipped == static_cast<uint64_t>(zero_size));
+  QVERIFY(stats.zero_runs <= 1);
+
+  const QByteArray written = readFile(device_path);
+  QCOMPARE(written.left(image.size()), image);
+  QCOMPARE(written.at(roundUp(image.size(), 512)), 'x');
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testBlockMap() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+
+  // Blocks 0-1 data, 2-5 zero, 6 data, then a partial block of data
+  const int block = kDefaultBmapBlockSize;
+  QByteArray image = makeTestImage(2 * block);
+  image.append(QByteArray(4 * block, 0));
+  image.append(makeTestImage(block + 100));
+  QVERIFY(writeFile(image_path, image));
+
+  BlockMap map;
+  QVERIFY(generateBlockMap(image_path.toStdString(), block, true, &map));
+  QCOMPARE(map.image_size, static_cast<uint64_t>(image.size()));
+  QCOMPARE(map.blocks_count, static_cast<uint64_t>(8));
+  QCOMPARE(map.ranges.size(), static_cast<size_t>(2));
+  QCOMPARE(map.ranges[0].first, static_cast<uint64_t>(0));
+  QCOMPARE(map.ranges[0].last, static_cast<uint64_t>(1));
+  QCOMPARE(map.ranges[1].first, static_cast<uint64_t>(6));
+  QCOMPARE(map.ranges[1].last, static_cast<uint64_t>(7));
+  QCOMPARE(map.rangeLength(map.ranges[1]),
+           static_cast<uint64_t>(block + 100));
+
+  // Survives a round trip, and tampering is caught by the file checksum
+  const QByteArray xml = serializeBlockMap(map);
+  BlockMap parsed;
+  QVERIFY(parseBlockMap(xml, &parsed));
+  QCOMPARE(parsed.mappedBlocks(), map.mappedBlocks());
+  QCOMPARE(parsed.ranges[1].sha256, map.ranges[1].sha256);
+  QByteArray tampered = xml;
+  tampered.replace("6-7", "5-7");
+  QVERIFY(!parseBlockMap(tampered, &parsed));
+
+  // Only mapped blocks are written
+  QVERIFY(writeFile(device_path, QByteArray(16 * block, 'x')));
+  {
+    auto source = openImageSource(image_path.toStdString());
+    auto target = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && target);
+    WriteOptions options;
+    options.block_map = &map;
+    QVERIFY(writeImage(source.get(), target.get(), image.size(), options));
+  }
+  const QByteArray written = readFile(device_path);
+  QCOMPARE(written.left(2 * block), image.left(2 * block));
+  QCOMPARE(written.mid(2 * block, 4 * block), QByteArray(4 * block, 'x'));
+  QCOMPARE(written.mid(6 * block, block + 100), image.mid(6 * block));
+
+  // A map that doesn't match the image fails the write
+  map.ranges[0].sha256 = map.ranges[1].sha256;
+  {
+    auto source = openImageSource(image_path.toStdString());
+    auto target = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && target);
+    WriteOptions options;
+    options.block_map = &map;
+    QVERIFY(!writeImage(source.get(), target.get(), image.size(), options));
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteGptPartitionsOnly() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+
+  // Partitions deliberately out of LBA order in the table
+  const int sectors = 2048;
+  const QByteArray image = makeGptImage(sectors, {{1000, 1199}, {100, 299}});
+  QVERIFY(writeFile(image_path, image));
+  QVERIFY(writeFile(device_path, QByteArray(2 * image.size(), 'x')));
+
+  GptLayout gpt;
+  {
+    auto source = openImageSource(image_path.toStdString());
+    QVERIFY(source);
+    QVERIFY(readGptLayout(source.get(), image.size(), &gpt));
+  }
+  QCOMPARE(gpt.sector_size, static_cast<uint64_t>(512));
+  QCOMPARE(gpt.partitions.size(), static_cast<size_t>(2));
+  QCOMPARE(gpt.partitions[0].first_lba, static_cast<uint64_t>(100));
+  QVERIFY(gpt.has_backup);
+
+  // A source that only goes forward gets the same layout from the
+  // primary table alone
+  {
+    ForwardOnlySource source(openImageSource(image_path.toStdString()));
+    GptLayout primary;
+    QVERIFY(readGptLayout(&source, image.size(), &primary));
+    QVERIFY(primary.has_backup);
+    QCOMPARE(primary.backup_header_lba, gpt.backup_header_lba);
+    QCOMPARE(primary.backup_entries_lba, gpt.backup_entries_lba);
+    QCOMPARE(primary.partitions.size(), gpt.partitions.size());
+    QVERIFY(source.furthest() <= (gpt.entries_lba + gpt.entries_sectors) *
+                                     gpt.sector_size);
+  }
+
+  WriteStats stats;
+  {
+    auto source = openImageSource(image_path.toStdString());
+    auto target = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && target);
+    WriteOptions options;
+    options.partitions_only = true;
+    QVERIFY(writeImage(source.get(), target.get(), image.size(), options,
+                       &stats));
+  }
+  QVERIFY(stats.unmapped_bytes_skipped > 0);
+
+  // Tables and partitions are copied, unallocated space is untouched
+  const QByteArray written = readFile(device_path);
+  for (int lba = 0; lba < sectors; lba++) {
+    const QByteArray expected = image.mid(lba * 512, 512);
+    const QByteArray actual = written.mid(lba * 512, 512);
+    if (expected == QByteArray(512, 's')) {
+      QCOMPARE(actual, QByteArray(512, 'x'));
+    } else {
+      QCOMPARE(actual, expected);
+    }
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteImageVerify() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+
+  // Data with a zero run in the middle, so both kinds of region are
+  // read back
+  QByteArray image = makeTestImage(4 * 65536);
+  image.append(QByteArray(4 * 65536, 0));
+  image.append(makeTestImage(65536 + 100));
+  QVERIFY(writeFile(image_path, image));
+
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.verify = true;
+  options.verify_distance = 2 * 65536;
+
+  // Clean write, then one where a data byte and then a zero byte reads
+  // back wrong
+  for (const int64_t corrupt : {int64_t(-1), int64_t(3 * 65536 + 5),
+                                int64_t(6 * 65536 + 7)}) {
+    QVERIFY(writeFile(device_path, QByteArray(16 * 65536, 'x')));
+    auto source = openImageSource(image_path.toStdString());
+    auto device = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && device);
+    CorruptingDevice target(std::move(device), corrupt);
+    WriteStats stats;
+    const bool ok =
+        writeImage(source.get(), &target, image.size(), options, &stats);
+    if (corrupt < 0) {
+      QVERIFY(ok);
+      QVERIFY(!stats.verify_failed);
+      QCOMPARE(stats.verified_bytes, static_cast<uint64_t>(image.size()));
+    } else {
+      QVERIFY(!ok);
+      QVERIFY(stats.verify_failed);
+    }
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testChunkSizeTuner() {
+  const uint64_t kMiB = 1024 * 1024;
+  ChunkSizeTuner tuner(512, 8 * kMiB);
+  QVERIFY(!tuner.locked());
+  QCOMPARE(tuner.maxChunkSize(), static_cast<size_t>(4 * kMiB));
+
+  // Fake a device that writes 1 MiB chunks at 40 MB/s and everything
+  // else at 20 MB/s
+  Chunk chunk(512, 512);
+  int64_t now_ns = 0;
+  auto write = [&](const double seconds_per_mib) {
+    chunk.length = tuner.chunkSize();
+    const int64_t latency_ns =
+        static_cast<int64_t>(chunk.length * seconds_per_mib * 1e9 / kMiB);
+    now_ns += latency_ns;
+    tuner.onComplete(chunk, latency_ns, now_ns);
+  };
+  for (int i = 0; i < 1000 && !tuner.locked(); i++) {
+    write(tuner.chunkSize() == kMiB ? 1 / 40.0 : 1 / 20.0);
+  }
+  QVERIFY(tuner.locked());
+  QCOMPARE(tuner.chunkSize(), static_cast<size_t>(kMiB));
+
+  // A single slow write is tolerated, a run of them backs off
+  write(1);
+  write(1 / 40.0);
+  QCOMPARE(tuner.chunkSize(), static_cast<size_t>(kMiB));
+  write(1);
+  write(1);
+  write(1);
+  QCOMPARE(tuner.chunkSize(), static_cast<size_t>(kMiB / 2));
+}
+
+void Test::testWriteImageToMany() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  QByteArray image = makeTestImage(24 * 65536 + 100);
+  image.replace(8 * 65536, 4 * 65536, QByteArray(4 * 65536, 0));
+  QVERIFY(writeFile(image_path, image));
+
+  // Two good targets, one that fails partway through and one that is
+  // too small for the image
+  std::vector<QString> paths;
+  for (const char* name : {"a.bin", "b.bin", "c.bin", "d.bin"}) {
+    paths.push_back(dir.filePath(name));
+  }
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.fan_out_lag = 4 * 65536;
+  options.verify = true;
+  options.verify_distance = 65536;
+  for (const int queue_depth : {1, 4}) {
+    for (size_t i = 0; i < paths.size(); i++) {
+      const int size = i == 3 ? 65536 : 32 * 65536;
+      QVERIFY(writeFile(paths[i], QByteArray(size, 'x')));
+    }
+    auto source = openImageSource(image_path.toStdString());
+    auto good1 = openBlockDevice(paths[0].toStdString());
+    auto failing = openBlockDevice(paths[1].toStdString());
+    auto good2 = openBlockDevice(paths[2].toStdString());
+    auto small = openBlockDevice(paths[3].toStdString());
+    QVERIFY(source && good1 && failing && good2 && small);
+    FailingDevice failing_target(std::move(failing), 10 * 65536);
+
+    options.queue_depth = queue_depth;
+    std::vector<TargetResult> results;
+    QVERIFY(!writeImageToMany(source.get(),
+                              {good1.get(), &failing_target, good2.get(),
+                               small.get()},
+                              image.size(), options, &results));
+    QCOMPARE(results.size(), paths.size());
+    QVERIFY(results[0].success);
+    QVERIFY(!results[1].success);
+    QVERIFY(results[2].success);
+    QVERIFY(!results[3].success);
+    for (const int i : {0, 2}) {
+      QCOMPARE(readFile(paths[i]).left(image.size()), image);
+      QCOMPARE(results[i].stats.verified_bytes,
+               static_cast<uint64_t>(image.size()));
+    }
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteImageResume() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image = makeTestImage(40 * 65536 + 100);
+  QVERIFY(writeFile(image_path, image));
+
+  WriteJournal journal(dir.filePath("journal").toStdString(), "device",
+                       imageFingerprint(image_path.toStdString()));
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.journal = &journal;
+  options.journal_interval = 4 * 65536;
+  options.verify = true;
+
+  // The first attempt dies partway through, then the retry either
+  // picks up from the journal or, if the spot check finds the target
+  // was changed in between, starts over
+  for (const bool tamper : {false, true}) {
+    QVERIFY(writeFile(device_path, QByteArray(48 * 65536, 'x')));
+    {
+      auto source = openImageSource(image_path.toStdString());
+      auto device = openBlockDevice(device_path.toStdString());
+      QVERIFY(source && device);
+      FailingDevice target(std::move(device), 30 * 65536);
+      QVERIFY(!writeImage(source.get(), &target, image.size(), options));
+    }
+    const uint64_t committed = journal.load();
+    QVERIFY(committed > 0);
+    QVERIFY(committed <= 30 * 65536);
+    if (tamper) {
+      QFile file(device_path);
+      QVERIFY(file.open(QFile::ReadWrite));
+      QVERIFY(file.seek(5));
+      QVERIFY(file.putChar(~image[5]));
+    }
+
+    auto source = openImageSource(image_path.toStdString());
+    // Which of the two it will be can be found out beforehand, without
+    // writing anything
+    {
+      auto reader = openBlockDeviceForReading(device_path.toStdString());
+      QVERIFY(reader);
+      QCOMPARE(canResume(source.get(), reader.get(), image.size(), options),
+               !tamper);
+    }
+    auto device = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && device);
+    WriteStats stats;
+    QVERIFY(writeImage(source.get(), device.get(), image.size(), options,
+                       &stats));
+    QCOMPARE(stats.resumed_from, tamper ? 0 : committed);
+    QCOMPARE(readFile(device_path).left(image.size()), image);
+    // Done, so there is nothing left to resume
+    QCOMPARE(journal.load(), static_cast<uint64_t>(0));
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteImageDifferential() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+  QByteArray image = makeTestImage(16 * 65536 + 100);
+  image.replace(8 * 65536, 4 * 65536, QByteArray(4 * 65536, 0));
+  QVERIFY(writeFile(image_path, image));
+
+  // The stick holds an older build that differs in one data chunk and
+  // one zero chunk
+  QByteArray old_image = image + QByteArray(65536 - 100, 'x');
+  old_image[3 * 65536 + 7] = ~old_image[3 * 65536 + 7];
+  old_image[9 * 65536 + 1] = 1;
+  QVERIFY(writeFile(device_path, old_image));
+
+  auto source = openImageSource(image_path.toStdString());
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(source && device);
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.differential = true;
+  WriteStats stats;
+  QVERIFY(
+      writeImage(source.get(), device.get(), image.size(), options, &stats));
+  QCOMPARE(readFile(device_path).left(image.size()), image);
+  QCOMPARE(stats.unchanged_bytes_skipped,
+           static_cast<uint64_t>(image.size() - 2 * 65536));
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteProgress() {
+  WriteProgress progress;
+  ProgressMeter meter(&progress);
+  QCOMPARE(meter.sample(0).total, static_cast<uint64_t>(0));
+
+  // Resumed at 100 bytes, then 100 bytes per second for two seconds
+  // and 300 for the next
+  progress.start(1000, 100);
+  QCOMPARE(meter.sample(0).eta_ms, static_cast<int64_t>(-1));
+  progress.add(200);
+  ProgressSample sample = meter.sample(2000);
+  QCOMPARE(sample.done, static_cast<uint64_t>(300));
+  QCOMPARE(sample.current_rate, 100.0);
+  QCOMPARE(sample.eta_ms, static_cast<int64_t>(7000));
+  progress.add(300);
+  sample = meter.sample(3000);
+  QCOMPARE(sample.average_rate, 500 / 3.0);
+  QVERIFY(sample.current_rate > 100 && sample.current_rate < 300);
+  QVERIFY(sample.eta_ms > 0 && sample.eta_ms < 4000);
+
+#if defined(Q_OS_LINUX)
+  // The engine accounts for every byte, written or zeroed
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+  QByteArray image = makeTestImage(8 * 65536 + 100);
+  image.replace(65536, 2 * 65536, QByteArray(2 * 65536, 0));
+  QVERIFY(writeFile(image_path, image));
+  QVERIFY(writeFile(device_path, QByteArray(16 * 65536, 'x')));
+  auto source = openImageSource(image_path.toStdString());
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(source && device);
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.progress = &progress;
+  QVERIFY(writeImage(source.get(), device.get(), image.size(), options));
+  QCOMPARE(progress.total(), static_cast<uint64_t>(image.size()));
+  QCOMPARE(progress.done(), static_cast<uint64_t>(image.size()));
+#endif
+}
+
+void Test::testWriteImageCancel() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image = makeTestImage(32 * 65536);
+  QVERIFY(writeFile(image_path, image));
+  const QByteArray old_contents(32 * 65536, 'x');
+
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.verify = true;
+
+  // Cancelled before it starts, nothing is written
+  {
+    CancelToken token;
+    token.cancel();
+    options.cancel = &token;
+    QVERIFY(writeFile(device_path, old_contents));
+    auto source = openImageSource(image_path.toStdString());
+    auto device = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && device);
+    WriteStats stats;
+    QVERIFY(!writeImage(source.get(), device.get(), image.size(), options,
+                        &stats));
+    QVERIFY(stats.cancelled);
+    QCOMPARE(readFile(device_path), old_contents);
+  }
+
+  // Cancelled partway, the write stops at the next chunk
+  {
+    CancelToken token;
+    options.cancel = &token;
+    QVERIFY(writeFile(device_path, old_contents));
+    auto source = openImageSource(image_path.toStdString());
+    auto device = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && device);
+    CancellingDevice target(std::move(device), 8 * 65536, &token);
+    WriteStats stats;
+    QVERIFY(!writeImage(source.get(), &target, image.size(), options, &stats));
+    QVERIFY(stats.cancelled);
+    QVERIFY(!stats.verify_failed);
+    const QByteArray contents = readFile(device_path);
+    QCOMPARE(contents.left(9 * 65536), image.left(9 * 65536));
+    QCOMPARE(contents.mid(9 * 65536), old_contents.mid(9 * 65536));
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteImageBadRegion() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image = makeTestImage(16 * 65536);
+  QVERIFY(writeFile(image_path, image));
+  QVERIFY(writeFile(device_path, QByteArray(16 * 65536, 'x')));
+
+  // Everything from a few sectors into the sixth chunk is bad. The
+  // failing chunk is narrowed down to exactly that, and the good part
+  // of it still gets written.
+  auto source = openImageSource(image_path.toStdString());
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(source && device);
+  const uint64_t sector_size = device->sectorSize();
+  const uint64_t bad_offset = 5 * 65536 + 3 * sector_size;
+  FailingDevice target(std::move(device), bad_offset);
+  WriteOptions options;
+  options.buffer_size = 65536;
+  WriteStats stats;
+  QVERIFY(!writeImage(source.get(), &target, image.size(), options, &stats));
+  QCOMPARE(stats.bad_regions.size(), static_cast<size_t>(1));
+  QCOMPARE(stats.bad_regions[0].offset, bad_offset);
+  QCOMPARE(stats.bad_regions[0].length, 6 * 65536 - bad_offset);
+  QCOMPARE(readFile(device_path).left(bad_offset), image.left(bad_offset));
+
+  // A chunk that only fails until its retries run out is written in
+  // full when split up, so it has no bad region and the write succeeds
+  {
+    QVERIFY(writeFile(device_path, QByteArray(16 * 65536, 'x')));
+    auto source = openImageSource(image_path.toStdString());
+    auto device = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && device);
+    FlakyDevice target(std::move(device), bad_offset, 5);
+    WriteStats stats;
+    QVERIFY(writeImage(source.get(), &target, image.size(), options, &stats));
+    QVERIFY(stats.bad_regions.empty());
+    QCOMPARE(readFile(device_path), image);
+  }
+
+  // In a large chunk the search gives up after a run of bad sectors
+  // and marks the rest bad, rather than trying every sector of it
+  {
+    QVERIFY(writeFile(device_path, QByteArray(16 * 65536, 'x')));
+    auto source = openImageSource(image_path.toStdString());
+    auto device = openBlockDevice(device_path.toStdString());
+    QVERIFY(source && device);
+    const uint64_t chunk_end = 16 * 65536;
+    const uint64_t bad_offset = 3 * sector_size;
+    FailingDevice target(std::move(device), bad_offset);
+    WriteOptions options;
+    options.buffer_size = chunk_end;
+    WriteStats stats;
+    QVERIFY(!writeImage(source.get(), &target, image.size(), options, &stats));
+    QCOMPARE(stats.bad_regions.size(), static_cast<size_t>(1));
+    QCOMPARE(stats.bad_regions[0].offset, bad_offset);
+    QCOMPARE(stats.bad_regions[0].length, chunk_end - bad_offset);
+    QVERIFY(static_cast<uint64_t>(target.writes()) <
+            (chunk_end - bad_offset) / sector_size);
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteImageStall() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image = makeTestImage(16 * 65536);
+  QVERIFY(writeFile(image_path, image));
+  QVERIFY(writeFile(device_path, QByteArray(16 * 65536, 'x')));
+
+  auto source = openImageSource(image_path.toStdString());
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(source && device);
+  SlowDevice target(std::move(device), 4 * 65536, 1000);
+  WriteProgress progress;
+  WriteOptions options;
+  options.buffer_size = 65536;
+  options.stall_timeout_ms = 100;
+  options.progress = &progress;
+  WriteStats stats;
+  QVERIFY(!writeImage(source.get(), &target, image.size(), options, &stats));
+  QVERIFY(stats.stalled);
+  QVERIFY(progress.stalled());
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testSpeedProbe() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray contents = makeTestImage(4 * 1024 * 1024);
+  QVERIFY(writeFile(device_path, contents));
+
+  auto device = openBlockDeviceForReading(device_path.toStdString());
+  QVERIFY(device);
+  SpeedProbeResult result;
+  QVERIFY(probeSpeed(device.get(), &result));
+  QVERIFY(result.sequential_rate > 0);
+  QVERIFY(result.random_iops > 0);
+  // The probe must never write
+  QCOMPARE(readFile(device_path), contents);
+
+  CancelToken cancel;
+  cancel.cancel();
+  QVERIFY(!probeSpeed(device.get(), &result, &cancel));
+#endif
+
+  SpeedProbeResult slow;
+  slow.sequential_rate = 10e6;
+  slow.random_iops = 100;
+  SpeedProbeResult fast = slow;
+  fast.sequential_rate *= 4;
+  fast.random_iops *= 4;
+  const uint64_t size = 4ULL * 1024 * 1024 * 1024;
+  QVERIFY(estimateFlashSeconds(slow, size) > 0);
+  QVERIFY(estimateFlashSeconds(fast, size) < estimateFlashSeconds(slow, size));
+  QVERIFY(estimateFlashSeconds(slow, 2 * size) >
+          estimateFlashSeconds(slow, size));
+  QCOMPARE(estimateFlashSeconds(SpeedProbeResult(), size), -1.0);
+}
+
+void Test::testEraseRange() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString device_path = dir.filePath("device.bin");
+  const int size = 16 * 65536;
+  QVERIFY(writeFile(device_path, QByteArray(size, 'x')));
+
+  // The device zeroes the range itself; the length rounds up to a
+  // sector
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(device);
+  WriteProgress progress;
+  WriteOptions options;
+  options.progress = &progress;
+  EraseStats stats;
+  QVERIFY(eraseRange(device.get(), 65536, 3 * 65536 + 100, options, &stats));
+  QCOMPARE(stats.written_bytes, uint64_t(0));
+  QCOMPARE(stats.zeroed_bytes, uint64_t(3 * 65536 + 512));
+  QCOMPARE(progress.done(), progress.total());
+  QByteArray expected(size, 'x');
+  expected.replace(65536, 3 * 65536 + 512, QByteArray(3 * 65536 + 512, 0));
+  QCOMPARE(readFile(device_path), expected);
+
+  // A device that can't zero ranges gets zeros written, in chunks
+  QVERIFY(writeFile(device_path, QByteArray(size, 'x')));
+  FailingDevice writes_only(openBlockDevice(device_path.toStdString()),
+                            std::numeric_limits<uint64_t>::max());
+  options.buffer_size = 65536;
+  QVERIFY(eraseRange(&writes_only, 0, size, options, &stats));
+  QCOMPARE(stats.zeroed_bytes, uint64_t(0));
+  QCOMPARE(stats.written_bytes, uint64_t(size));
+  QCOMPARE(readFile(device_path), QByteArray(size, 0));
+
+  // Zeroing through writeImage() takes the same path
+  QVERIFY(writeFile(device_path, QByteArray(size, 'x')));
+  device = openBlockDevice(device_path.toStdString());
+  WriteStats write_stats;
+  WriteOptions skip_zeros;
+  skip_zeros.skip_zero_blocks = true;
+  QVERIFY(writeImage(nullptr, device.get(), size, skip_zeros, &write_stats));
+  QCOMPARE(write_stats.engine, std::string("erase"));
+  QCOMPARE(readFile(device_path), QByteArray(size, 0));
+
+  CancelToken cancel;
+  cancel.cancel();
+  options.cancel = &cancel;
+  QVERIFY(!eraseRange(device.get(), 0, size, options, &stats));
+  QVERIFY(stats.cancelled);
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testFormatFat32() {
+  // Cluster sizes follow the volume size, and the data region lands on
+  // a 1 MiB boundary of the disk
+  Fat32Layout layout;
+  QVERIFY(layoutFat32(8ULL * 1024 * 1024 * 2, 512, 2048, &layout));
+  QCOMPARE(layout.sectors_per_cluster, uint32_t(8));
+  QCOMPARE((2048 + layout.reserved_sectors + 2 * layout.fat_sectors) % 2048,
+           uint32_t(0));
+  QVERIFY(layout.fat_sectors * 512 / 4 >= layout.clusters + 2);
+  QVERIFY(layoutFat32(64ULL * 1024 * 1024 * 2, 512, 0, &layout));
+  QCOMPARE(layout.sectors_per_cluster, uint32_t(64));
+  // Too few clusters to be FAT32
+  QVERIFY(!layoutFat32(40000, 512, 0, &layout));
+
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString device_path = dir.filePath("device.bin");
+  const int size = 64 * 1024 * 1024;
+  QVERIFY(writeFile(device_path, QByteArray(size, 'x')));
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(device);
+  Fat32Options options;
+  options.hidden_sectors = 2048;
+  options.label = "cloudready";
+  options.volume_id = 0x12345678;
+  QVERIFY(formatFat32(device.get(), 2048, size / 512 - 2048, options));
+  QVERIFY(layoutFat32(size / 512 - 2048, 512, 2048, &layout));
+
+  const QByteArray disk = readFile(device_path);
+  const QByteArray boot = disk.mid(1024 * 1024, 512);
+  const auto le16 = [&boot](const int offset) {
+    return qFromLittleEndian<quint16>(
+        reinterpret_cast<const uchar*>(boot.constData() + offset));
+  };
+  const auto le32 = [](const QByteArray& data, const int offset) {
+    return qFromLittleEndian<quint32>(
+        reinterpret_cast<const uchar*>(data.constData() + offset));
+  };
+  QCOMPARE(le16(11), quint16(512));
+  QCOMPARE(static_cast<uint8_t>(boot[13]), uint8_t(1));
+  QCOMPARE(le16(14), quint16(layout.reserved_sectors));
+  QCOMPARE(le32(boot, 28), quint32(2048));
+  QCOMPARE(le32(boot, 32), quint32(size / 512 - 2048));
+  QCOMPARE(le32(boot, 36), quint32(layout.fat_sectors));
+  QCOMPARE(le32(boot, 67), quint32(0x12345678));
+  QCOMPARE(boot.mid(71, 11), QByteArray("CLOUDREADY "));
+  QCOMPARE(boot.mid(82, 8), QByteArray("FAT32   "));
+  QCOMPARE(boot.mid(510, 2), QByteArray("\x55\xaa"));
+  // FSInfo, and backups of both
+  const QByteArray fs_info = disk.mid(1024 * 1024 + 512, 512);
+  QCOMPARE(le32(fs_info, 0), quint32(0x41615252));
+  QCOMPARE(le32(fs_info, 488), quint32(layout.clusters - 1));
+  QCOMPARE(disk.mid(1024 * 1024 + 6 * 512, 1024), disk.mid(1024 * 1024, 1024));
+
+  // Both FATs start with the reserved entries and the root directory's
+  // end of chain, and are otherwise empty
+  const int fat_bytes = layout.fat_sectors * 512;
+  for (int i = 0; i < 2; i++) {
+    const QByteArray fat = disk.mid(
+        1024 * 1024 + layout.reserved_sectors * 512 + i * fat_bytes, fat_bytes);
+    QCOMPARE(le32(fat, 0), quint32(0x0ffffff8));
+    QCOMPARE(le32(fat, 4), quint32(0x0fffffff));
+    QCOMPARE(le32(fat, 8), quint32(0x0fffffff));
+    QCOMPARE(fat.mid(12), QByteArray(fat_bytes - 12, 0));
+  }
+  const int root = 1024 * 1024 + layout.reserved_sectors * 512 + 2 * fat_bytes;
+  QCOMPARE(disk.mid(root, 12), QByteArray("CLOUDREADY \x08"));
+  // Nothing outside the metadata is touched
+  QCOMPARE(disk.left(1024 * 1024), QByteArray(1024 * 1024, 'x'));
+  QCOMPARE(disk.mid(root + 512, 512), QByteArray(512, 'x'));
+#endif
+}
+
+void Test::testWipePartitionTables() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString device_path = dir.filePath("device.bin");
+  const int sectors = 16384;
+  const QByteArray old_disk =
+      makeGptImage(sectors, {{2048, 4095}, {8000, 9000}});
+  QVERIFY(writeFile(device_path, old_disk));
+
+  // With a data partition covering the device after the first MiB
+  auto device = openBlockDevice(device_path.toStdString());
+  QVERIFY(device);
+  GptLayout::Partition partition;
+  QVERIFY(wipePartitionTables(device.get(), &partition));
+  QCOMPARE(partition.first_lba, uint64_t(2048));
+  QCOMPARE(partition.last_lba, uint64_t(sectors - 34));
+
+  QByteArray disk = readFile(device_path);
+  QCOMPARE(static_cast<uint8_t>(disk[446 + 4]), uint8_t(0xee));
+  QCOMPARE(disk.mid(510, 2), QByteArray("\x55\xaa"));
+  auto source = openImageSource(device_path.toStdString());
+  GptLayout gpt;
+  QVERIFY(readGptLayout(source.get(), disk.size(), &gpt));
+  QVERIFY(gpt.has_backup);
+  QCOMPARE(gpt.backup_header_lba, uint64_t(sectors - 1));
+  QCOMPARE(gpt.partitions.size(), size_t(1));
+  QCOMPARE(gpt.partitions[0].first_lba, partition.first_lba);
+  QCOMPARE(gpt.partitions[0].last_lba, partition.last_lba);
+  // Only the tables themselves are rewritten
+  QCOMPARE(disk.mid(34 * 512, (sectors - 67) * 512),
+           old_disk.mid(34 * 512, (sectors - 67) * 512));
+
+  // Empty
+  QVERIFY(wipePartitionTables(device.get()));
+  disk = readFile(device_path);
+  source = openImageSource(device_path.toStdString());
+  QVERIFY(readGptLayout(source.get(), disk.size(), &gpt));
+  QVERIFY(gpt.has_backup);
+  QVERIFY(gpt.partitions.empty());
+
+  // Too small to hold both tables
+  const QString small_path = dir.filePath("small.bin");
+  QVERIFY(writeFile(small_path, QByteArray(64 * 512, 0)));
+  auto small = openBlockDevice(small_path.toStdString());
+  QVERIFY(small);
+  QVERIFY(!wipePartitionTables(small.get()));
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteImageZeroCopy() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString image_path = dir.filePath("image.bin");
+  const QString device_path = dir.filePath("device.bin");
+
+  // A whole number of sectors is copied entirely by the kernel; with
+  // a partial sector at the end, the ring writes the tail. A target
+  // without a file descriptor can't be copied to at all.
+  for (const int image_size : {3 * 65536, 3 * 65536 + 1000}) {
+    for (const bool wrapped : {false, true}) {
+      const QByteArray image = makeTestImage(image_size);
+      QVERIFY(writeFile(image_path, image));
+      QVERIFY(writeFile(device_path, QByteArray(4 * 65536, 'x')));
+      WriteProgress progress;
+      WriteStats stats;
+      {
+        auto source = openImageSource(image_path.toStdString());
+        std::unique_ptr<BlockDevice> target =
+            openBlockDevice(device_path.toStdString());
+        QVERIFY(source && target);
+        if (wrapped) {
+          target.reset(new SlowDevice(std::move(target),
+                                      std::numeric_limits<uint64_t>::max(), 0));
+        }
+        WriteOptions options;
+        options.buffer_size = 65536;
+        options.queue_depth = 1;
+        options.zero_copy = true;
+        options.progress = &progress;
+        QVERIFY(writeImage(source.get(), target.get(), image.size(), options,
+                           &stats));
+      }
+      if (wrapped || image_size % 512 != 0) {
+        QCOMPARE(stats.engine, std::string("sync"));
+      } else {
+        QVERIFY(stats.engine == "copy_file_range" ||
+                stats.engine == "splice");
+      }
+      QCOMPARE(progress.done(), uint64_t(image.size()));
+
+      const QByteArray written = readFile(device_path);
+      QCOMPARE(written.left(image.size()), image);
+      const int padded_size = roundUp(image.size(), 512);
+      QCOMPARE(written.mid(image.size(), padded_size - image.size()),
+               QByteArray(padded_size - image.size(), 0));
+      QCOMPARE(written.at(padded_size), 'x');
+    }
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testZipStreamSource() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image =
+      makeTestImage(3 * 65536 + 1000) + QByteArray(65536, 0);
+
+  // Without a descriptor the size is known up front; with one, the
+  // write is open-ended and the end of the entry says where it stops.
+  // Damaged data must fail the write either way.
+  for (const bool descriptor : {false, true}) {
+    for (const bool corrupt : {false, true}) {
+      QByteArray zip = makeZip(image, descriptor);
+      if (corrupt) {
+        zip[zip.size() / 2] = ~zip[zip.size() / 2];
+      }
+      QVERIFY(writeFile(device_path, QByteArray(8 * 65536, 'x')));
+      ByteQueue queue(65536);
+      QueueFeeder feeder(&queue, zip);
+      ZipStreamSource source(&queue);
+      feeder.start();
+      bool ok = source.start();
+      QVERIFY(ok);
+      QCOMPARE(source.entryName(), std::string("image.bin"));
+      QCOMPARE(source.size() < 0, descriptor);
+      QCOMPARE(source.expectedSize(), source.size());
+      {
+        auto target = openBlockDevice(device_path.toStdString());
+        QVERIFY(target);
+        WriteOptions options;
+        options.buffer_size = 65536;
+        options.verify = true;
+        options.open_ended = descriptor;
+        ok = writeImage(&source, target.get(),
+                        descriptor ? target->size() : image.size(), options);
+      }
+      if (!ok) {
+        queue.abort();
+      }
+      feeder.wait();
+      QCOMPARE(ok, !corrupt);
+      QCOMPARE(source.failed(), corrupt);
+      if (corrupt) {
+        continue;
+      }
+      QCOMPARE(source.size(), int64_t(image.size()));
+      const QByteArray written = readFile(device_path);
+      QCOMPARE(written.left(image.size()), image);
+      const int padded_size = roundUp(image.size(), 512);
+      QCOMPARE(written.mid(image.size(), padded_size - image.size()),
+               QByteArray(padded_size - image.size(), 0));
+      QCOMPARE(written.at(padded_size), 'x');
+    }
+  }
+
+  // Some tools fill in the local header's sizes as well as writing a
+  // descriptor. The write is still open-ended, but progress can be
+  // counted against that size instead of the whole drive.
+  {
+    QByteArray zip = makeZip(image, true);
+    putLe32(&zip, 22, image.size());
+    QVERIFY(writeFile(device_path, QByteArray(8 * 65536, 'x')));
+    ByteQueue queue(65536);
+    QueueFeeder feeder(&queue, zip);
+    ZipStreamSource source(&queue);
+    feeder.start();
+    QVERIFY(source.start());
+    QCOMPARE(source.size(), int64_t(-1));
+    QCOMPARE(source.expectedSize(), int64_t(image.size()));
+    auto target = openBlockDevice(device_path.toStdString());
+    QVERIFY(target);
+    WriteProgress progress;
+    WriteOptions options;
+    options.buffer_size = 65536;
+    options.open_ended = true;
+    options.progress = &progress;
+    const bool ok = writeImage(&source, target.get(), source.expectedSize(),
+                               options);
+    if (!ok) {
+      queue.abort();
+    }
+    feeder.wait();
+    QVERIFY(ok);
+    QCOMPARE(progress.total(), uint64_t(image.size()));
+    QCOMPARE(progress.done(), progress.total());
+    QCOMPARE(readFile(device_path).left(image.size()), image);
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testWriteZipEntry() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString zip_path = dir.filePath("image.zip");
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image =
+      makeTestImage(3 * 65536 + 1000) + QByteArray(65536, 0);
+
+  for (const int method : {Z_DEFLATED, 0}) {
+    zipFile zip = zipOpen64(zip_path.toStdString().c_str(),
+                            APPEND_STATUS_CREATE);
+    QVERIFY(zip);
+    QCOMPARE(zipOpenNewFileInZip(zip, "dir/image.bin", nullptr, nullptr, 0,
+                                 nullptr, 0, nullptr, method,
+                                 Z_DEFAULT_COMPRESSION),
+             ZIP_OK);
+    QCOMPARE(zipWriteInFileInZip(zip, image.constData(), image.size()),
+             ZIP_OK);
+    QCOMPARE(zipCloseFileInZip(zip), ZIP_OK);
+    QCOMPARE(zipClose(zip, nullptr), ZIP_OK);
+
+    const NeverwareZipEntry entry = neverware_first_entry(QFileInfo(zip_path));
+    QCOMPARE(entry.name, QString("dir/image.bin"));
+    QCOMPARE(entry.size, int64_t(image.size()));
+    // A stored file is read in place
+    QCOMPARE(entry.data_offset >= 0, method == 0);
+    if (method == 0) {
+      QCOMPARE(readFile(zip_path).mid(entry.data_offset, image.size()),
+               image);
+    }
+    QVERIFY(!neverware_open_entry(QFileInfo(zip_path), "image.bin"));
+
+    // Looking for a GPT first means going back to the start once it
+    // turns out there is none
+    QVERIFY(writeFile(device_path, QByteArray(8 * 65536, 'x')));
+    {
+      auto source = neverware_open_entry(QFileInfo(zip_path), entry.name);
+      auto target = openBlockDevice(device_path.toStdString());
+      QVERIFY(source && target);
+      QCOMPARE(source->size(), int64_t(image.size()));
+      WriteOptions options;
+      options.buffer_size = 65536;
+      options.partitions_only = true;
+      options.verify = true;
+      QVERIFY(writeImage(source.get(), target.get(), image.size(), options));
+    }
+    const QByteArray written = readFile(device_path);
+    QCOMPARE(written.left(image.size()), image);
+    QCOMPARE(written.at(roundUp(image.size(), 512)), 'x');
+
+    // minizip doesn't read a stored file, so nothing else checks its
+    // CRC; a damaged one has to fail the write all the same
+    if (method == 0) {
+      QByteArray zip_data = readFile(zip_path);
+      zip_data[static_cast<int>(entry.data_offset) + 1000] ^= 1;
+      QVERIFY(writeFile(zip_path, zip_data));
+      auto source = neverware_open_entry(QFileInfo(zip_path), entry.name);
+      auto target = openBlockDevice(device_path.toStdString());
+      QVERIFY(source && target);
+      WriteOptions options;
+      options.buffer_size = 65536;
+      QVERIFY(!writeImage(source.get(), target.get(), image.size(), options));
+    }
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testSliceImageSource() {
+#if defined(Q_OS_LINUX)
+  QTemporaryDir dir;
+  const QString file_path = dir.filePath("image.zip");
+  const QString device_path = dir.filePath("device.bin");
+  const QByteArray image = makeTestImage(3 * 65536);
+  // Unbuffered targets can only be copied to in the kernel from
+  // sector-aligned offsets
+  const QByteArray prefix(1024, 'p');
+  QVERIFY(writeFile(file_path, prefix + image + QByteArray(100, 's')));
+
+  QVERIFY(!sliceImageSource(openImageSource(file_path.toStdString()),
+                            prefix.size() + 101, image.size()));
+
+  // Both through the ring and copied in the kernel, which has to start
+  // as far into the file as the slice does
+  for (const bool zero_copy : {false, true}) {
+    QVERIFY(writeFile(device_path, QByteArray(4 * 65536, 'x')));
+    WriteStats stats;
+    {
+      auto source = sliceImageSource(
+          openImageSource(file_path.toStdString()), prefix.size(),
+          image.size());
+      auto target = openBlockDevice(device_path.toStdString());
+      QVERIFY(source && target);
+      QCOMPARE(source->size(), int64_t(image.size()));
+      QCOMPARE(source->fdOffset(), uint64_t(prefix.size()));
+      WriteOptions options;
+      options.buffer_size = 65536;
+      options.zero_copy = zero_copy;
+      QVERIFY(writeImage(source.get(), target.get(), image.size(), options,
+                         &stats));
+    }
+    if (zero_copy) {
+      QVERIFY(stats.engine == "copy_file_range" || stats.engine == "splice");
+    }
+    const QByteArray written = readFile(device_path);
+    QCOMPARE(written.left(image.size()), image);
+    QCOMPARE(written.at(image.size()), 'x');
+  }
+#else
+  QSKIP("block device backend is Linux only");
+#endif
+}
+
+void Test::testUnzipBackends() {
+  QTemporaryDir dir;
+  const QString zip_path = dir.filePath("image.zip");
+  const QString output_path = dir.filePath("image.bin");
+  const QByteArray image =
+      makeTestImage(5 * 65536 + 123) + QByteArray(3 * 65536, 0);
+
+  zipFile zip = zipOpen64(zip_path.toStdString().c_str(),
+                          APPEND_STATUS_CREATE);
+  QVERIFY(zip);
+  QCOMPARE(zipOpenNewFileInZip(zip, "dir/image.bin", nullptr, nullptr, 0,
+                               nullptr, 0, nullptr, Z_DEFLATED,
+                               Z_DEFAULT_COMPRESSION),
+           ZIP_OK);
+  QCOMPARE(zipWriteInFileInZip(zip, image.constData(), image.size()), ZIP_OK);
+  QCOMPARE(zipCloseFileInZip(zip), ZIP_OK);
+  QCOMPARE(zipClose(zip, nullptr), ZIP_OK);
+  const QByteArray good_zip = readFile(zip_path);
+
+  const auto backends = inflaterBackends();
+  QVERIFY(!backends.empty());
+  QCOMPARE(backends.back(), std::string("zlib"));
+  for (const auto& backend : backends) {
+    NeverwareUnzipOptions options;
+    options.inflate_backend = backend;
+    auto inflater = createInflater(backend);
+    QVERIFY(inflater);
+    QCOMPARE(std::string(inflater->name()), backend);
+    QCOMPARE(inflater->crc32(0, reinterpret_cast<const uint8_t*>(
+                                    image.constData()),
+                             image.size()),
+             crc(image, image.size()));
+
+    QCOMPARE(neverware_unzip(QFileInfo(zip_path), nullptr, options)
+                 .absoluteFilePath(),
+             QFileInfo(output_path).absoluteFilePath());
+    QCOMPARE(readFile(output_path), image);
+    QVERIFY(QFile::remove(output_path));
+
+    // Damage the compressed data; whether that breaks the stream or
+    // only changes what it inflates to, nothing is left behind
+    QByteArray bad_zip = good_zip;
+    const int middle = bad_zip.size() / 2;
+    bad_zip[middle] = static_cast<char>(bad_zip[middle] ^ 0x55);
+    QVERIFY(writeFile(zip_path, bad_zip));
+    QVERIFY_EXCEPTION_THROWN(
+        neverware_unzip(QFileInfo(zip_path), nullptr, options),
+        std::exception);
+    QVERIFY(!QFile::exists(output_path));
+    QVERIFY(writeFile(zip_path, good_zip));
+  }
+
+  QVERIFY(!createInflater("no-such-backend"));
+  NeverwareUnzipOptions missing;
+  missing.inflate_backend = "no-such-backend";
+  QVERIFY_EXCEPTION_THROWN(
+      neverware_unzip(QFileInfo(zip_path), nullptr, missing),
+      std::exception);
+}
+
+void Test::testInflateIndex() {
+  QTemporaryDir dir;
+  const QString zip_path = dir.filePath("image.zip");
+  const QString output_path = dir.filePath("image.bin");
+  // Long enough for a couple of spans, with stored and compressed
+  // blocks on both sides of the boundary
+  const QByteArray image = makeTestImage(7 * 1024 * 1024) +
+                           QByteArray(3 * 1024 * 1024, 0) +
+                           makeTestImage(2 * 1024 * 1024 + 123);
+  auto zipImage = [&zip_path](const QByteArray& data) {
+    zipFile zip = zipOpen64(zip_path.toStdString().c_str(),
+                            APPEND_STATUS_CREATE);
+    return zip &&
+           zipOpenNewFileInZip(zip, "image.bin", nullptr, nullptr, 0,
+                               nullptr, 0, nullptr, Z_DEFLATED,
+                               Z_DEFAULT_COMPRESSION) == ZIP_OK &&
+           zipWriteInFileInZip(zip, data.constData(), data.size()) ==
+               ZIP_OK &&
+           zipCloseFileInZip(zip) == ZIP_OK &&
+           zipClose(zip, nullptr) == ZIP_OK;
+  };
+  QVERIFY(zipImage(image));
+
+  NeverwareUnzipOptions options;
+  options.index_path = dir.filePath("image.index").toStdString();
+  options.threads = 4;
+
+  // The first unzip builds the index as it goes
+  QVERIFY(!QFile::exists(QString::fromStdString(options.index_path)));
+  neverware_unzip(QFileInfo(zip_path), nullptr, options);
+  QCOMPARE(readFile(output_path), image);
+  InflateIndex index;
+  QVERIFY(loadInflateIndex(options.index_path, &index));
+  QCOMPARE(index.entry_name, std::string("image.bin"));
+  QCOMPARE(index.size, uint64_t(image.size()));
+  QCOMPARE(index.crc, crc(image, image.size()));
+  QVERIFY(index.checkpoints.size() >= 2);
+  QCOMPARE(index.spanAt(0), size_t(0));
+  QCOMPARE(index.spanAt(index.size - 1), index.checkpoints.size() - 1);
+
+  // and later ones inflate its spans on several threads
+  QVERIFY(QFile::remove(output_path));
+  neverware_unzip(QFileInfo(zip_path), nullptr, options);
+  QCOMPARE(readFile(output_path), image);
+  QVERIFY(QFile::remove(output_path));
+
+  {
+    auto source =
+        neverware_open_entry(QFileInfo(zip_path), "image.bin", options);
+    QVERIFY(source);
+    QCOMPARE(source->size(), int64_t(image.size()));
+    QByteArray read(image.size(), 0);
+    QVERIFY(readFully(source.get(), 0, reinterpret_cast<uint8_t*>(read.data()),
+                      read.size()));
+    QCOMPARE(read, image);
+    // Going back only costs the spans from there
+    QVERIFY(readFully(source.get(), 1000,
+                      reinterpret_cast<uint8_t*>(read.data()), 65536));
+    QCOMPARE(read.left(65536), image.mid(1000, 65536));
+  }
+
+  // An index for another zip is ignored, and replaced
+  const QByteArray other = image.mid(1) + image.left(1);
+  QVERIFY(QFile::remove(zip_path));
+  QVERIFY(zipImage(other));
+  neverware_unzip(QFileInfo(zip_path), nullptr, options);
+  QCOMPARE(readFile(output_path), other);
+  QVERIFY(loadInflateIndex(options.index_path, &index));
+  QCOMPARE(index.crc, crc(other, other.size()));
+}
+
 }  // namespace gondar
 
 QTEST_MAIN(gondar::Test)
@@ -28,6 +28,30 @@ class Test : public QObject {
   void testDevicePicker();
   void testMeepoGetMetricJson();
   void testMeepoGetMetricRequest();
+  void testWriteImage();
+  void testIsAllZero();
+  void testWriteImageSkipsZeros();
+  void testBlockMap();
+  void testWriteGptPartitionsOnly();
+  void testWriteImageVerify();
+  void testChunkSizeTuner();
+  void testWriteImageToMany();
+  void testWriteImageResume();
+  void testWriteImageDifferential();
+  void testWriteProgress();
+  void testWriteImageCancel();
+  void testWriteImageBadRegion();
+  void testWriteImageStall();
+  void testSpeedProbe();
+  void testEraseRange();
+  void testFormatFat32();
+  void testWipePartitionTables();
+  void testWriteImageZeroCopy();
+  void testZipStreamSource();
+  void testWriteZipEntry();
+  void testSliceImageSource();
+  void testUnzipBackends();
+  void testInflateIndex();
 };
 }  // namespace gondar
 